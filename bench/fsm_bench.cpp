@@ -0,0 +1,307 @@
+/*
+ * FSM engine micro-benchmarks
+ *
+ * Drives fsm_send()/fsm_handle_event() on synthetic machines of growing
+ * size and on mirrors of the four real machines, once through the linear
+ * transition search and once through the dense dispatch table. For every
+ * case it reports the mean cost of an event (send plus handle), the
+ * 99th percentile and worst single fsm_handle_event() call, and the RAM a
+ * machine of that shape needs. fsm_footprint.sh reports the code size.
+ *
+ *   pio run -e bench && .pio/build/bench/program [-c]
+ *
+ *   -c  print CSV, to keep a record of the numbers across changes
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "fsm.h"
+#include "fsm_table.h"
+#include "dht_capture.h"
+#include "dht_fsm.h"
+#include "mqtt_fsm.h"
+#include "prox_fsm.h"
+#include "wifi_fsm.h"
+
+#define BENCH_WALK_LENGTH 4096
+#define BENCH_RUNS 5
+#define BENCH_MIN_EVENTS 200000
+
+typedef std::chrono::steady_clock bench_clock;
+
+typedef struct bench_machine {
+  const char *name;
+  uint8_t num_states;
+  uint16_t num_events;
+  std::vector<fsm_static_transition_t> transitions;
+} bench_machine_t;
+
+typedef struct bench_result {
+  double ns_per_event;
+  double p99_ns;
+  double max_ns;
+  size_t ram_bytes;
+} bench_result_t;
+
+static volatile uint32_t work = 0;
+
+/******** PRIVATE FUNCTIONS ********/
+static fsm_err_t nop_fn(void) {
+  work = work + 1;
+  return FSM_ERR_OK;
+}
+
+// Mirrors of the tables in src/*_fsm.cpp, state IDs in the same order
+static bench_machine_t dht_machine(void) {
+  enum { UNKNOWN, ACTIVE, INACTIVE, COUNT };
+  return {"dht", COUNT, DHT_EVENT_COUNT,
+      {{UNKNOWN, DHT_EVENT_START, ACTIVE, nullptr},
+          {UNKNOWN, DHT_EVENT_STOP, INACTIVE, nullptr},
+          {ACTIVE, DHT_EVENT_STOP, INACTIVE, nullptr},
+          {ACTIVE, FSM_PERIODIC_EVENT_5S, ACTIVE, nop_fn},
+          {ACTIVE, DHT_EVENT_SAMPLE, ACTIVE, nop_fn},
+          {ACTIVE, DHT_EVENT_REFERENCE, ACTIVE, nop_fn},
+          {ACTIVE, DHT_EVENT_SETTINGS, ACTIVE, nop_fn},
+#if DHT_ASYNC
+          {ACTIVE, DHT_EVENT_RELEASE, ACTIVE, nop_fn},
+          {ACTIVE, DHT_EVENT_CAPTURED, ACTIVE, nop_fn},
+#endif
+          {INACTIVE, DHT_EVENT_START, ACTIVE, nullptr}}};
+}
+
+static bench_machine_t prox_machine(void) {
+  enum { UNKNOWN, ACTIVE, INACTIVE, COUNT };
+  return {"prox", COUNT, PROX_EVENT_COUNT,
+      {{UNKNOWN, PROX_EVENT_START, ACTIVE, nullptr},
+          {UNKNOWN, PROX_EVENT_STOP, INACTIVE, nullptr},
+          {ACTIVE, PROX_EVENT_STOP, INACTIVE, nullptr},
+          {ACTIVE, FSM_PERIODIC_EVENT_5S, ACTIVE, nop_fn},
+          {ACTIVE, PROX_EVENT_MOTION, ACTIVE, nop_fn},
+          {ACTIVE, PROX_EVENT_VACANCY_CHECK, ACTIVE, nop_fn},
+          {INACTIVE, PROX_EVENT_START, ACTIVE, nullptr}}};
+}
+
+static bench_machine_t wifi_machine(void) {
+  enum { UNKNOWN, ACTIVE, INACTIVE, CONNECTING, BACKOFF, COUNT };
+  return {"wifi", COUNT, WIFI_EVENT_COUNT,
+      {{UNKNOWN, WIFI_EVENT_START, CONNECTING, nullptr},
+          {UNKNOWN, WIFI_EVENT_STOP, INACTIVE, nullptr},
+          {CONNECTING, WIFI_EVENT_CONNECTED, ACTIVE, nullptr},
+          {CONNECTING, WIFI_EVENT_DISCONNECTED, BACKOFF, nullptr},
+          {CONNECTING, WIFI_EVENT_STOP, INACTIVE, nullptr},
+          {CONNECTING, FSM_PERIODIC_EVENT_500MS, CONNECTING, nop_fn},
+          {BACKOFF, WIFI_EVENT_RETRY, CONNECTING, nullptr},
+          {BACKOFF, WIFI_EVENT_STOP, INACTIVE, nullptr},
+          {BACKOFF, FSM_PERIODIC_EVENT_500MS, BACKOFF, nop_fn},
+          {ACTIVE, WIFI_EVENT_DISCONNECTED, BACKOFF, nullptr},
+          {ACTIVE, WIFI_EVENT_STOP, INACTIVE, nullptr},
+          {ACTIVE, FSM_PERIODIC_EVENT_1S, ACTIVE, nop_fn},
+          {INACTIVE, WIFI_EVENT_START, CONNECTING, nullptr}}};
+}
+
+static bench_machine_t mqtt_machine(void) {
+  enum { UNKNOWN, ACTIVE, INACTIVE, CONNECTING, CONNACK_WAIT, COUNT };
+  return {"mqtt", COUNT, MQTT_EVENT_COUNT,
+      {{UNKNOWN, MQTT_EVENT_START, CONNECTING, nullptr},
+          {UNKNOWN, MQTT_EVENT_STOP, INACTIVE, nullptr},
+          {CONNECTING, MQTT_EVENT_OPEN, CONNACK_WAIT, nullptr},
+          {CONNECTING, MQTT_EVENT_LOST, INACTIVE, nullptr},
+          {CONNECTING, MQTT_EVENT_STOP, INACTIVE, nullptr},
+          {CONNECTING, MQTT_EVENT_POLL, CONNECTING, nop_fn},
+          {CONNECTING, FSM_PERIODIC_EVENT_500MS, CONNECTING, nop_fn},
+          {CONNECTING, FSM_PERIODIC_EVENT_5S, CONNECTING, nop_fn},
+          {CONNACK_WAIT, MQTT_EVENT_CONNACK, ACTIVE, nullptr},
+          {CONNACK_WAIT, MQTT_EVENT_LOST, INACTIVE, nullptr},
+          {CONNACK_WAIT, MQTT_EVENT_STOP, INACTIVE, nullptr},
+          {CONNACK_WAIT, MQTT_EVENT_POLL, CONNACK_WAIT, nop_fn},
+          {CONNACK_WAIT, FSM_PERIODIC_EVENT_500MS, CONNACK_WAIT, nop_fn},
+          {CONNACK_WAIT, FSM_PERIODIC_EVENT_5S, CONNACK_WAIT, nop_fn},
+          {ACTIVE, MQTT_EVENT_STOP, INACTIVE, nullptr},
+          {ACTIVE, MQTT_EVENT_LOST, INACTIVE, nullptr},
+          {ACTIVE, FSM_PERIODIC_EVENT_5S, ACTIVE, nop_fn},
+          {ACTIVE, FSM_PERIODIC_EVENT_1S, ACTIVE, nop_fn},
+          {ACTIVE, MQTT_EVENT_OCCUPANCY, ACTIVE, nop_fn},
+          {ACTIVE, FSM_PERIODIC_EVENT_500MS, ACTIVE, nop_fn},
+          {ACTIVE, MQTT_EVENT_COMMAND, ACTIVE, nop_fn},
+          {INACTIVE, MQTT_EVENT_START, CONNECTING, nullptr},
+          {INACTIVE, MQTT_EVENT_RETRY, CONNECTING, nullptr},
+          {INACTIVE, FSM_PERIODIC_EVENT_1S, INACTIVE, nop_fn},
+          {INACTIVE, FSM_PERIODIC_EVENT_5S, INACTIVE, nop_fn}}};
+}
+
+// Every state handles every event, half of them as self-transitions
+static bench_machine_t synthetic_machine(
+    const char *name, uint8_t num_states, uint16_t num_events) {
+  bench_machine_t machine = {name, num_states, num_events, {}};
+  for (uint8_t state = 0; state < num_states; state++) {
+    for (uint16_t event = 0; event < num_events; event++) {
+      fsm_state_ID destination =
+          (event & 1) ? state : (state + event / 2 + 1) % num_states;
+      machine.transitions.push_back({state, event, destination, nop_fn});
+    }
+  }
+  return machine;
+}
+
+// A deterministic walk that only sends events the current state handles
+static std::vector<fsm_event> make_walk(const bench_machine_t &machine) {
+  std::vector<fsm_event> walk;
+  fsm_state_ID state = 0;
+  uint32_t seed = 12345;
+  while (walk.size() < BENCH_WALK_LENGTH) {
+    std::vector<const fsm_static_transition_t *> candidates;
+    for (const fsm_static_transition_t &t : machine.transitions) {
+      if (t.source_state_ID == state) {
+        candidates.push_back(&t);
+      }
+    }
+    if (candidates.empty()) {
+      break;
+    }
+    seed = seed * 1103515245 + 12345;
+    const fsm_static_transition_t *t =
+        candidates[(seed >> 16) % candidates.size()];
+    walk.push_back(t->event);
+    state = t->destination_state_ID;
+  }
+  return walk;
+}
+
+static double elapsed_ns(bench_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(bench_clock::now() - start)
+      .count();
+}
+
+// Cost of reading the clock twice, taken off every latency sample
+static double timer_overhead_ns(void) {
+  double overhead = 1e12;
+  for (int i = 0; i < 10000; i++) {
+    overhead = std::min(overhead, elapsed_ns(bench_clock::now()));
+  }
+  return overhead;
+}
+
+static bench_result_t run(const bench_machine_t &machine, bool use_table,
+    uint16_t depth, double overhead_ns) {
+  std::vector<fsm_state_t> states(machine.num_states);
+  std::vector<std::vector<fsm_transition_t>> arrays(machine.num_states);
+  std::vector<fsm_dispatch_t> table(
+      machine.num_states * machine.num_events, {FSM_NO_TRANSITION, nullptr});
+  for (const fsm_static_transition_t &t : machine.transitions) {
+    arrays[t.source_state_ID].push_back(
+        {t.destination_state_ID, t.event, t.transition_fn});
+    table[t.source_state_ID * machine.num_events + t.event] = {
+        t.destination_state_ID, t.transition_fn};
+  }
+  size_t num_transitions = 0;
+  for (uint8_t state = 0; state < machine.num_states; state++) {
+    states[state] = {.ID = state,
+        .entry_fn = nop_fn,
+        .exit_fn = nop_fn,
+        .transition_array = use_table ? nullptr : arrays[state].data(),
+        .num_transitions = use_table ? 0 : arrays[state].size()};
+    num_transitions += arrays[state].size();
+  }
+
+  fsm_handle_t state_machine;
+  const fsm_queue_config_t queue = {.buffer = NULL,
+      .capacity = depth,
+      .overflow_policy = FSM_OVERFLOW_DROP_NEWEST};
+  fsm_init_with_dispatch(&state_machine, states.data(), machine.num_states,
+      use_table ? table.data() : NULL, use_table ? machine.num_events : 0,
+      &queue);
+
+  std::vector<fsm_event> walk = make_walk(machine);
+  size_t rounds = BENCH_MIN_EVENTS / walk.size() + 1;
+  bench_result_t result = {};
+  result.ns_per_event = 1e12;
+
+  // Throughput: fill the queue to the requested depth, then drain it
+  for (int r = 0; r < BENCH_RUNS; r++) {
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+      for (size_t i = 0; i < walk.size(); i += depth) {
+        size_t end = std::min(walk.size(), i + depth);
+        for (size_t j = i; j < end; j++) {
+          fsm_send(&state_machine, walk[j]);
+        }
+        while (FSM_ERR_OK == fsm_handle_event(&state_machine)) {
+        }
+      }
+    }
+    double ns = elapsed_ns(start) / (rounds * walk.size());
+    result.ns_per_event = std::min(result.ns_per_event, ns);
+  }
+
+  // Latency: time each fsm_handle_event() call on its own
+  std::vector<double> samples;
+  samples.reserve(walk.size() * BENCH_RUNS);
+  for (int r = 0; r < BENCH_RUNS; r++) {
+    for (fsm_event event : walk) {
+      fsm_send(&state_machine, event);
+      bench_clock::time_point start = bench_clock::now();
+      fsm_handle_event(&state_machine);
+      samples.push_back(std::max(0.0, elapsed_ns(start) - overhead_ns));
+    }
+  }
+  std::sort(samples.begin(), samples.end());
+  result.p99_ns = samples[samples.size() * 99 / 100];
+  result.max_ns = samples.back();
+
+  result.ram_bytes = sizeof(fsm_handle_t) +
+                     machine.num_states * sizeof(fsm_state_t) +
+                     (use_table ? table.size() * sizeof(fsm_dispatch_t)
+                                : num_transitions * sizeof(fsm_transition_t));
+  return result;
+}
+
+static void report(bool csv, const bench_machine_t &machine, uint16_t depth,
+    double overhead_ns) {
+  for (int use_table = 0; use_table <= 1; use_table++) {
+    bench_result_t result = run(machine, use_table, depth, overhead_ns);
+    const char *format =
+        csv ? "%s,%u,%zu,%u,%s,%.1f,%.0f,%.0f,%zu\n"
+            : "%-14s %4u %6zu %5u  %-6s %9.1f %8.0f %8.0f %8zu\n";
+    printf(format, machine.name, machine.num_states,
+        machine.transitions.size(), depth, use_table ? "table" : "linear",
+        result.ns_per_event, result.p99_ns, result.max_ns, result.ram_bytes);
+  }
+}
+
+/******** PUBLIC FUNCTIONS ********/
+int main(int argc, char **argv) {
+  bool csv = (2 == argc && 0 == strcmp(argv[1], "-c"));
+  double overhead_ns = timer_overhead_ns();
+  if (csv) {
+    printf("machine,states,transitions,depth,dispatch,ns_per_event,p99_ns,"
+           "max_ns,ram_bytes\n");
+  } else {
+    printf("%-14s %4s %6s %5s  %-6s %9s %8s %8s %8s\n", "machine", "st",
+        "trans", "depth", "path", "ns/event", "p99 ns", "max ns", "RAM");
+  }
+
+  const bench_machine_t fixtures[] = {
+      dht_machine(), prox_machine(), wifi_machine(), mqtt_machine()};
+  for (const bench_machine_t &machine : fixtures) {
+    report(csv, machine, 8, overhead_ns);
+  }
+
+  const uint8_t sizes[] = {2, 8, 32};
+  const uint16_t depths[] = {1, 8, MAX_PENDING_EVENTS};
+  char names[9][16];
+  int n = 0;
+  for (uint8_t num_states : sizes) {
+    for (uint8_t num_events : sizes) {
+      snprintf(names[n], sizeof(names[n]), "synth-%ux%u", num_states,
+          num_events);
+      bench_machine_t machine =
+          synthetic_machine(names[n++], num_states, num_events);
+      for (uint16_t depth : depths) {
+        report(csv, machine, depth, overhead_ns);
+      }
+    }
+  }
+  return 0;
+}
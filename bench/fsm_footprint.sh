@@ -0,0 +1,12 @@
+#!/bin/sh
+# Code and static RAM of the FSM engine in every environment built so far.
+# Set SIZE to the toolchain's size, e.g. for the ESP32 builds:
+#   SIZE=~/.platformio/packages/toolchain-xtensa-esp32/bin/xtensa-esp32-elf-size
+cd "$(dirname "$0")/.." || exit 1
+SIZE=${SIZE:-size}
+for object in .pio/build/*/src/fsm.cpp.o; do
+  [ -f "$object" ] || continue
+  env=$(basename "$(dirname "$(dirname "$object")")")
+  $SIZE "$object" | awk -v env="$env" \
+      'NR == 2 {printf "%-14s text %6d  data %5d  bss %5d\n", env, $1, $2, $3}'
+done
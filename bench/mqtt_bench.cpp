@@ -0,0 +1,166 @@
+/*
+ * QoS 1 publish throughput
+ *
+ * Runs the firmware's MQTT client against the native broker over the lwIP
+ * sockets stand-in, in virtual time. For every window size and broker
+ * round trip it connects, publishes a fixed number of QoS 1 messages as
+ * fast as the window lets it, polling the client every millisecond, and
+ * reports acknowledged messages per second, the mean time from publish to
+ * PUBACK and how many publishes had to be sent again.
+ *
+ *   pio run -e mqtt_bench && .pio/build/mqtt_bench/program [-n messages]
+ *       [-l n] [-c]
+ *
+ *   -n  messages per case (default 2000)
+ *   -l  lose every n-th PUBACK, to exercise the retransmit timer
+ *   -c  print CSV, to keep a record of the numbers across changes
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "WiFi.h"
+#include "mqtt_client.h"
+#include "native_hal.h"
+
+#define BENCH_BROKER "192.168.4.1"
+#define BENCH_PORT 1883
+#define BENCH_PAYLOAD_LEN 32  // about a JSON state message
+#define BENCH_POLL_US 1000
+#define BENCH_RETRY_MS 200
+#define BENCH_TIMEOUT_MS (120 * 1000)
+
+static const uint8_t windows[] = {1, 4, 16};
+static const uint32_t round_trips_ms[] = {1, 5, 20};
+
+typedef struct bench_result {
+  uint32_t acked;
+  uint32_t elapsed_ms;
+  uint32_t retransmits;
+  uint64_t latency_sum_ms;
+} bench_result_t;
+
+static mqtt_client_t client;
+static bench_result_t result;
+static uint32_t sent_ms[UINT16_MAX + 1];
+
+/******** PRIVATE FUNCTIONS ********/
+static void on_ack(uint16_t tag) {
+  result.acked++;
+  result.latency_sum_ms += millis() - sent_ms[tag];
+}
+
+static void advance(void) { native_hal_advance_us(BENCH_POLL_US); }
+
+static bool connect(void) {
+  uint32_t start_ms = millis();
+  if (!mqtt_client_open(&client, BENCH_BROKER, BENCH_PORT, millis())) {
+    return false;
+  }
+  while (millis() - start_ms < BENCH_TIMEOUT_MS) {
+    mqtt_client_event_t event = mqtt_client_poll(&client, millis());
+    if (MQTT_CLIENT_EVENT_OPEN == event) {
+      mqtt_client_connect(&client, 60, true);
+    } else if (MQTT_CLIENT_EVENT_CONNACK == event) {
+      return true;
+    } else if (MQTT_CLIENT_EVENT_NONE != event) {
+      return false;
+    }
+    advance();
+  }
+  return false;
+}
+
+static bool run_case(uint8_t window, uint32_t messages) {
+  uint8_t payload[BENCH_PAYLOAD_LEN];
+  memset(payload, 'x', sizeof(payload));
+  result = {};
+  mqtt_client_init(&client, tcp_transport(), "bench", NULL);
+  mqtt_client_set_window(&client, window, BENCH_RETRY_MS, on_ack);
+  if (!connect()) {
+    return false;
+  }
+  uint32_t start_ms = millis();
+  uint32_t published = 0;
+  while (result.acked < messages && millis() - start_ms < BENCH_TIMEOUT_MS) {
+    if (MQTT_CLIENT_EVENT_NONE != mqtt_client_poll(&client, millis())) {
+      return false;
+    }
+    while (published < messages) {
+      uint16_t tag = published & UINT16_MAX;
+      sent_ms[tag] = millis();
+      if (!mqtt_client_publish_qos1(
+              &client, "bench/state", payload, sizeof(payload), tag)) {
+        break;
+      }
+      published++;
+    }
+    advance();
+  }
+  result.elapsed_ms = millis() - start_ms;
+  result.retransmits = client.stats.retransmits;
+  mqtt_client_close(&client);
+  return result.acked == messages;
+}
+
+/******** PUBLIC FUNCTIONS ********/
+int main(int argc, char **argv) {
+  uint32_t messages = 2000;
+  bool csv = false;
+  int opt;
+  while (-1 != (opt = getopt(argc, argv, "n:l:c"))) {
+    switch (opt) {
+      case 'n':
+        messages = strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        native_broker_set_puback_loss(strtoul(optarg, NULL, 10));
+        break;
+      case 'c':
+        csv = true;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n messages] [-l n] [-c]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  native_hal_set_quiet(true);
+  WiFi.mode(WIFI_STA);
+  WiFi.begin("bench", "bench");
+  while (WL_CONNECTED != WiFi.status() && millis() < BENCH_TIMEOUT_MS) {
+    advance();
+  }
+
+  if (csv) {
+    printf("rtt_ms,window,msgs_per_s,ack_latency_ms,retransmits\n");
+  } else {
+    printf("%u QoS 1 messages of %u bytes per case\n\n", messages,
+        BENCH_PAYLOAD_LEN);
+    printf("%-8s %-8s %12s %16s %12s\n", "rtt ms", "window", "msgs/s",
+        "ack latency ms", "retransmits");
+  }
+  for (uint32_t rtt_ms : round_trips_ms) {
+    native_broker_set_latency_ms(rtt_ms);
+    for (uint8_t window : windows) {
+      if (!run_case(window, messages)) {
+        fprintf(stderr, "rtt %u ms, window %u: only %u of %u acked\n",
+            rtt_ms, window, result.acked, messages);
+        return 1;
+      }
+      double rate = 1000.0 * result.acked / result.elapsed_ms;
+      double latency = (double)result.latency_sum_ms / result.acked;
+      if (csv) {
+        printf("%u,%u,%.0f,%.2f,%u\n", rtt_ms, window, rate, latency,
+            result.retransmits);
+      } else {
+        printf("%-8u %-8u %12.0f %16.2f %12u\n", rtt_ms, window, rate,
+            latency, result.retransmits);
+      }
+    }
+  }
+  return 0;
+}
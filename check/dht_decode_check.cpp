@@ -0,0 +1,129 @@
+/*
+ * Host check of the DHT22 frame decoder
+ *
+ * Feeds falling edge timestamps, as the edge ISR in dht_capture.cpp records
+ * them, into dht_decode(): a captured frame, frames built from known bytes
+ * with the bit periods pushed to the 0/1 threshold and the timing limits,
+ * and broken ones with a bad checksum, too few or too many edges.
+ *
+ *   pio run -e dht_check && .pio/build/dht_check/program
+ *
+ * Exits with 1 if any frame decoded differently than expected.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dht_capture.h"
+
+#define CHECK_PREAMBLE_US 160  // 80 us low + 80 us high before the first bit
+#define CHECK_ZERO_US 78
+#define CHECK_ONE_US 120
+
+// 65.2 %, 23.1 C; preamble edge first, bit periods 75-81 and 117-123 us
+static const uint32_t captured[] = {
+    1843207, 1843368, 1843445, 1843521, 1843599, 1843679,
+    1843754, 1843829, 1843952, 1844031, 1844148, 1844225,
+    1844304, 1844379, 1844500, 1844618, 1844693, 1844768,
+    1844846, 1844924, 1844999, 1845075, 1845150, 1845229,
+    1845307, 1845382, 1845505, 1845626, 1845743, 1845819,
+    1845899, 1846021, 1846142, 1846259, 1846338, 1846459,
+    1846579, 1846696, 1846772, 1846889, 1846968, 1847091,
+};
+
+static uint32_t failures = 0;
+
+/******** PRIVATE FUNCTIONS ********/
+/**
+ * @brief Build a train of 42 edges, preamble included
+ *
+ * @param bytes the frame, the checksum is taken as given
+ * @param zero_us period of a 0 bit
+ * @param one_us period of a 1 bit
+ * @param start_us timestamp of the preamble edge
+ * @return uint8_t number of edges
+ */
+static uint8_t build(uint32_t *edges, const uint8_t bytes[5], uint32_t zero_us,
+    uint32_t one_us, uint32_t start_us) {
+  uint8_t n = 0;
+  uint32_t at_us = start_us;
+  edges[n++] = at_us;
+  at_us += CHECK_PREAMBLE_US;
+  edges[n++] = at_us;
+  for (uint8_t bit = 0; bit < DHT_FRAME_BITS; bit++) {
+    bool one = bytes[bit / 8] & (0x80 >> (bit % 8));
+    at_us += one ? one_us : zero_us;
+    edges[n++] = at_us;
+  }
+  return n;
+}
+
+static void with_checksum(uint8_t bytes[5]) {
+  bytes[4] = (uint8_t)(bytes[0] + bytes[1] + bytes[2] + bytes[3]);
+}
+
+static void expect(const char *name, const uint32_t *edges, uint8_t num_edges,
+    dht_decode_err_t expected, int16_t temperature_x10,
+    uint16_t humidity_x10) {
+  dht_frame_t frame = {};
+  dht_decode_err_t err = dht_decode(edges, num_edges, &frame);
+  bool ok = expected == err &&
+            (DHT_DECODE_OK != err || (temperature_x10 == frame.temperature_x10 &&
+                                         humidity_x10 == frame.humidity_x10));
+  printf("  %-26s %-10s %s\n", name, dht_decode_err_name(err),
+      ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+    if (DHT_DECODE_OK == err) {
+      fprintf(stderr, "%s: decoded %d/%u, expected %d/%u\n", name,
+          frame.temperature_x10, frame.humidity_x10, temperature_x10,
+          humidity_x10);
+    }
+  }
+}
+
+/******** PUBLIC FUNCTIONS ********/
+int main(void) {
+  uint32_t edges[DHT_CAPTURE_MAX_EDGES + 1];
+  uint8_t n = sizeof(captured) / sizeof(captured[0]);
+
+  expect("captured", captured, n, DHT_DECODE_OK, 231, 652);
+  expect("captured, no preamble", &captured[1], n - 1, DHT_DECODE_OK, 231,
+      652);
+  expect("truncated", captured, 30, DHT_DECODE_SHORT, 0, 0);
+  expect("no answer", captured, 0, DHT_DECODE_SHORT, 0, 0);
+
+  // Last bit of the checksum 0x75 read as a 0
+  memcpy(edges, captured, sizeof(captured));
+  edges[n - 1] = edges[n - 2] + CHECK_ZERO_US;
+  expect("bad checksum", edges, n, DHT_DECODE_CHECKSUM, 0, 0);
+
+  // Sign and magnitude: -10.1 C
+  uint8_t cold[5] = {0x01, 0x5E, 0x80, 0x65};
+  with_checksum(cold);
+  n = build(edges, cold, CHECK_ZERO_US, CHECK_ONE_US, 1000);
+  expect("negative temperature", edges, n, DHT_DECODE_OK, -101, 350);
+
+  uint8_t bytes[5] = {0x02, 0x8C, 0x00, 0xE7};
+  with_checksum(bytes);
+  n = build(edges, bytes, DHT_BIT_ONE_US - 1, DHT_BIT_ONE_US, 1000);
+  expect("jitter at the threshold", edges, n, DHT_DECODE_OK, 231, 652);
+  n = build(edges, bytes, DHT_BIT_MIN_US, DHT_BIT_MAX_US, 1000);
+  expect("jitter at the limits", edges, n, DHT_DECODE_OK, 231, 652);
+  n = build(edges, bytes, DHT_BIT_MIN_US - 1, CHECK_ONE_US, 1000);
+  expect("0 too short", edges, n, DHT_DECODE_TIMING, 0, 0);
+  n = build(edges, bytes, CHECK_ZERO_US, DHT_BIT_MAX_US + 1, 1000);
+  expect("1 too long", edges, n, DHT_DECODE_TIMING, 0, 0);
+  n = build(edges, bytes, CHECK_ZERO_US, CHECK_ONE_US, UINT32_MAX - 2000);
+  expect("micros() wrapping", edges, n, DHT_DECODE_OK, 231, 652);
+
+  // A glitching line, more edges than the capture buffer keeps
+  n = build(edges, bytes, CHECK_ZERO_US, CHECK_ONE_US, 1000);
+  for (; n <= DHT_CAPTURE_MAX_EDGES; n++) {
+    edges[n] = edges[n - 1] + CHECK_ZERO_US;
+  }
+  expect("noise", edges, n, DHT_DECODE_NOISE, 0, 0);
+
+  printf("checks: %u failed\n", (unsigned)failures);
+  return (0 == failures) ? 0 : 1;
+}
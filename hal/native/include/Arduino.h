@@ -0,0 +1,113 @@
+#pragma once
+
+/*
+ * Host stand-in for the Arduino-ESP32 core, just enough for src/ to build
+ * and run under the native environment. Time is virtual: delay() advances
+ * the clock instantly, so the firmware runs much faster than real time.
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "native_hal.h"
+
+#define IRAM_ATTR
+
+#ifndef F_CPU
+#define F_CPU 240000000L
+#endif
+
+#define LOW 0x0
+#define HIGH 0x1
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t pin);
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+
+class String {
+ public:
+  String(const char *str = "") : str_(str ? str : "") {}
+  explicit String(int value) : str_(std::to_string(value)) {}
+  explicit String(unsigned value) : str_(std::to_string(value)) {}
+  const char *c_str() const { return str_.c_str(); }
+  size_t length() const { return str_.size(); }
+  String &operator=(const char *str) {
+    str_ = str;
+    return *this;
+  }
+  String operator+(const String &rhs) const {
+    return String((str_ + rhs.str_).c_str());
+  }
+  friend String operator+(const char *lhs, const String &rhs) {
+    return String((std::string(lhs) + rhs.str_).c_str());
+  }
+
+ private:
+  std::string str_;
+};
+
+class IPAddress;
+
+class HardwareSerial {
+ public:
+  void begin(unsigned long baud) { (void)baud; }
+  void flush(void) { fflush(stdout); }
+  int available(void);
+  int availableForWrite(void);
+  int read(void);
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buffer, size_t size);
+  size_t print(const char *str);
+  size_t print(const String &str) { return print(str.c_str()); }
+  size_t print(char c);
+  size_t print(int value);
+  size_t print(unsigned value);
+  size_t print(long value);
+  size_t print(unsigned long value);
+  size_t print(double value);
+  size_t print(const IPAddress &ip);
+  size_t println(void) { return print("\n"); }
+  template <typename T>
+  size_t println(const T &value) {
+    size_t n = print(value);
+    return n + print("\n");
+  }
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+ public:
+  uint32_t getFreeHeap(void);
+  uint32_t getMinFreeHeap(void);
+  uint32_t getMaxAllocHeap(void);
+  uint32_t getCycleCount(void);
+  void restart(void);
+};
+
+extern EspClass ESP;
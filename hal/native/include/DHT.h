@@ -0,0 +1,16 @@
+#pragma once
+
+#include "Arduino.h"
+
+#define DHT22 22
+
+class DHT {
+ public:
+  DHT(uint8_t pin, uint8_t type) {
+    (void)pin;
+    (void)type;
+  }
+  void begin(void) {}
+  float readTemperature(bool fahrenheit = false);
+  float readHumidity(void);
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+/*
+ * In-memory NVS: keys live for the lifetime of the process.
+ */
+class Preferences {
+ public:
+  bool begin(const char *name, bool readOnly = false);
+  void end(void);
+  bool clear(void);
+  bool remove(const char *key);
+  bool isKey(const char *key);
+  size_t putBytes(const char *key, const void *value, size_t len);
+  size_t getBytes(const char *key, void *buf, size_t maxLen);
+  size_t getBytesLength(const char *key);
+  size_t putUInt(const char *key, uint32_t value);
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0);
+  size_t putFloat(const char *key, float value);
+  float getFloat(const char *key, float defaultValue = NAN);
+
+ private:
+  std::string name_;
+  bool read_only_ = true;
+};
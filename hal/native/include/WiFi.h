@@ -0,0 +1,71 @@
+#pragma once
+
+#include "Arduino.h"
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_DISCONNECTED = 6,
+} wl_status_t;
+
+typedef enum { WIFI_OFF, WIFI_STA } wifi_mode_t;
+
+typedef enum {
+  ARDUINO_EVENT_WIFI_STA_CONNECTED,
+  ARDUINO_EVENT_WIFI_STA_DISCONNECTED,
+  ARDUINO_EVENT_WIFI_STA_GOT_IP,
+  ARDUINO_EVENT_WIFI_STA_LOST_IP,
+  ARDUINO_EVENT_MAX,
+} arduino_event_id_t;
+
+#define WIFI_REASON_ASSOC_LEAVE 8
+#define WIFI_REASON_BEACON_TIMEOUT 200
+#define WIFI_REASON_NO_AP_FOUND 201
+
+typedef union {
+  struct {
+    uint8_t reason;
+  } wifi_sta_disconnected;
+} arduino_event_info_t;
+
+typedef arduino_event_id_t WiFiEvent_t;
+typedef arduino_event_info_t WiFiEventInfo_t;
+typedef void (*WiFiEventFuncCb)(WiFiEvent_t event, WiFiEventInfo_t info);
+
+class IPAddress {
+ public:
+  IPAddress() : address_(0) {}
+  IPAddress(uint32_t address) : address_(address) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : address_(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  operator uint32_t() const { return address_; }
+  uint8_t operator[](int index) const { return address_ >> (8 * index); }
+
+ private:
+  uint32_t address_;
+};
+
+class WiFiClass {
+ public:
+  bool mode(wifi_mode_t mode);
+  bool setAutoReconnect(bool autoReconnect);
+  bool setSleep(bool enabled);
+  int onEvent(WiFiEventFuncCb cb);
+  wl_status_t begin(const char *ssid, const char *passphrase = NULL,
+      int32_t channel = 0, const uint8_t *bssid = NULL, bool connect = true);
+  bool config(IPAddress local_ip, IPAddress gateway, IPAddress subnet,
+      IPAddress dns1 = IPAddress());
+  bool disconnect(bool wifioff = false);
+  wl_status_t status(void);
+  IPAddress localIP(void);
+  IPAddress gatewayIP(void);
+  IPAddress subnetMask(void);
+  IPAddress dnsIP(void);
+  uint8_t *BSSID(void);
+  int32_t channel(void);
+  int hostByName(const char *host, IPAddress &result);
+};
+
+extern WiFiClass WiFi;
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "esp_sleep.h"
+
+esp_err_t rtc_gpio_deinit(gpio_num_t gpio_num);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The one data partition the firmware looks up, "outbox" from
+ * partitions.csv, held in RAM with NOR flash semantics: erasing sets bits,
+ * writing can only clear them.
+ */
+
+typedef int esp_err_t;
+
+#ifndef ESP_OK
+#define ESP_OK 0
+#define ESP_FAIL -1
+#endif
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_SIZE 0x104
+
+typedef enum {
+  ESP_PARTITION_TYPE_APP = 0x00,
+  ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef enum {
+  ESP_PARTITION_SUBTYPE_DATA_UNDEFINED = 0x06,
+  ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct esp_partition {
+  esp_partition_type_t type;
+  esp_partition_subtype_t subtype;
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+    esp_partition_subtype_t subtype, const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+    size_t src_offset, void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *partition,
+    size_t dst_offset, const void *src, size_t size);
+esp_err_t esp_partition_erase_range(
+    const esp_partition_t *partition, size_t offset, size_t size);
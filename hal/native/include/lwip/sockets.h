@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+ * Host stand-in for lwIP's socket API. The constants and types come from
+ * the host's headers; the sockets are in-process connections to the broker
+ * in native_broker.cpp, only TCP to it is supported.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+int lwip_socket(int domain, int type, int protocol);
+int lwip_connect(int s, const struct sockaddr *name, socklen_t namelen);
+int lwip_fcntl(int s, int cmd, int val);
+int lwip_setsockopt(
+    int s, int level, int optname, const void *optval, socklen_t optlen);
+int lwip_getsockopt(
+    int s, int level, int optname, void *optval, socklen_t *optlen);
+int lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset,
+    fd_set *exceptset, struct timeval *timeout);
+ssize_t lwip_send(int s, const void *dataptr, size_t size, int flags);
+ssize_t lwip_recv(int s, void *mem, size_t len, int flags);
+int lwip_close(int s);
@@ -0,0 +1,142 @@
+#pragma once
+
+/*
+ * Control surface of the native HAL
+ *
+ * Scenarios and tools drive the simulated hardware through these calls:
+ * virtual time, the PIR pin, scripted DHT readings, Wi-Fi availability,
+ * NVS and flash, and the in-process MQTT broker.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+
+/**
+ * @brief Run fn once the virtual clock reaches at_us
+ *
+ * Timed callbacks model interrupts and driver events; they run from inside
+ * delay() and friends, like an ISR preempting the loop.
+ */
+void native_hal_at(uint64_t at_us, std::function<void(void)> fn);
+
+/**
+ * @brief Advance the virtual clock, firing every timed callback on the way
+ */
+void native_hal_advance_us(uint64_t us);
+
+uint64_t native_hal_now_us(void);
+
+/**
+ * @brief Time of the next timed callback, UINT64_MAX if none
+ */
+uint64_t native_hal_next_event_us(void);
+
+/**
+ * @brief Suppress Serial output, for long soak runs
+ */
+void native_hal_set_quiet(bool quiet);
+
+/******** PIR ********/
+/**
+ * @brief Raise the PIR output at at_ms for one second, like the HC-SR501
+ */
+void native_pir_trigger_at(uint8_t pin, uint32_t at_ms);
+/**
+ * @brief Rising edges native_pir_trigger_at() raised so far
+ */
+uint32_t native_pir_edges(void);
+
+/******** DHT ********/
+void native_dht_set(float temperature_c, float humidity);
+/**
+ * @brief Make every n-th read fail, 0 to disable
+ */
+void native_dht_set_failure_period(uint32_t n);
+/**
+ * @brief Replace the constant reading with a function of time
+ */
+void native_dht_set_source(
+    std::function<void(uint32_t now_ms, float *temperature_c, float *humidity)>
+        source);
+
+/******** WiFi ********/
+void native_wifi_set_available(bool available);
+void native_wifi_set_available_at(bool available, uint32_t at_ms);
+
+/******** NVS ********/
+/**
+ * @brief Load Preferences from a file, so consecutive runs share NVS
+ *
+ * @return false if the file doesn't exist or is malformed
+ */
+bool native_nvs_load(const char *path);
+bool native_nvs_save(const char *path);
+
+/******** Flash ********/
+typedef struct native_flash_stats {
+  uint32_t bytes_written;
+  uint32_t sectors_erased;
+} native_flash_stats_t;
+
+/**
+ * @brief Load the outbox partition from a file, so a run can pick up where
+ * an earlier one was cut off
+ *
+ * @return false if the file doesn't exist or has the wrong size
+ */
+bool native_flash_load(const char *path);
+bool native_flash_save(const char *path);
+void native_flash_get_stats(native_flash_stats_t *stats);
+
+/******** MQTT broker ********/
+/*
+ * The broker speaks MQTT 3.1.1 over the lwIP socket stand-in in
+ * lwip/sockets.h, so the firmware's own client runs unmodified against it.
+ */
+typedef struct native_broker_stats {
+  uint32_t connects;
+  uint32_t refused;  // connections and CONNECTs
+  uint32_t messages;
+  uint32_t duplicates;  // PUBLISHes flagged DUP, counted in messages too
+  uint32_t bytes;
+  uint32_t pings;
+  uint32_t keepalive_expired;  // clients dropped for going quiet
+  uint32_t qos1_delivered;     // PUBLISHes to clients at QoS 1
+  uint32_t qos1_acked;         // PUBACKs clients sent for those
+} native_broker_stats_t;
+
+typedef enum {
+  NATIVE_BROKER_UP,
+  NATIVE_BROKER_DOWN,      // drops every client and refuses connections
+  NATIVE_BROKER_REFUSING,  // accepts TCP, answers CONNECT with code 3
+  NATIVE_BROKER_STALLED,   // stops answering, dropping everyone once over
+} native_broker_mode_t;
+
+void native_broker_set_mode(native_broker_mode_t mode);
+void native_broker_set_mode_at(native_broker_mode_t mode, uint32_t at_ms);
+/**
+ * @brief Delay of the TCP handshake and of every reply, 5 ms by default
+ */
+void native_broker_set_latency_ms(uint32_t ms);
+/**
+ * @brief Lose every n-th PUBACK, 0 to disable
+ */
+void native_broker_set_puback_loss(uint32_t n);
+void native_broker_get_stats(native_broker_stats_t *stats);
+/**
+ * @brief Called for every message the broker accepts
+ */
+void native_broker_on_message(
+    std::function<void(const char *topic, const uint8_t *payload, size_t len)>
+        fn);
+/**
+ * @brief Publish to the firmware at at_ms
+ *
+ * Delivered if the client subscribed to the topic, or to a filter ending
+ * in "#", by then. A stored session that subscribed at QoS 1 keeps it until
+ * the client resumes the session.
+ */
+void native_broker_publish_at(
+    const char *topic, const char *payload, uint32_t at_ms);
@@ -0,0 +1,598 @@
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "WiFi.h"
+#include "lwip/sockets.h"
+#include "native_hal.h"
+
+#define NATIVE_BROKER_PORT 1883
+#define NATIVE_BROKER_LATENCY_MS 5  // LAN round trip, connect and replies
+#define NATIVE_SOCKET_FD_BASE 64
+// lwIP's TCP_SND_BUF on the ESP32, only fills up while the broker stalls
+#define NATIVE_SOCKET_SEND_BUFFER 5744
+
+typedef struct native_subscription {
+  std::string filter;
+  uint8_t qos;
+} native_subscription_t;
+
+typedef struct native_session {
+  std::vector<native_subscription_t> subscriptions;
+  // QoS 1 messages that arrived while the client was away
+  std::deque<std::pair<std::string, std::string>> pending;
+} native_session_t;
+
+typedef enum {
+  NATIVE_SOCKET_CREATED,
+  NATIVE_SOCKET_CONNECTING,
+  NATIVE_SOCKET_OPEN,
+  NATIVE_SOCKET_FAILED,  // connect failed, see error
+  NATIVE_SOCKET_CLOSED,  // by the broker, recv() drains then returns 0
+  NATIVE_SOCKET_RESET,
+} native_socket_state_t;
+
+typedef struct native_socket {
+  native_socket_state_t state;
+  int error;
+  uint32_t generation;  // timed callbacks for an older socket are ignored
+  std::string to_client;
+  std::string from_client;
+  bool mqtt_connected;
+  std::string client_id;
+  bool persistent;  // session kept in stored_sessions
+  native_session_t session;  // clean sessions only
+  uint32_t keepalive_s;
+  uint64_t last_rx_us;
+  uint16_t next_packet_id;
+} native_socket_t;
+
+static native_broker_mode_t mode = NATIVE_BROKER_UP;
+static uint32_t latency_ms = NATIVE_BROKER_LATENCY_MS;
+static uint32_t puback_loss_period = 0;
+static uint32_t pubacks = 0;
+static uint32_t next_generation = 1;
+static native_broker_stats_t stats = {};
+static std::function<void(const char *, const uint8_t *, size_t)> on_message_s;
+static std::map<int, native_socket_t> sockets;
+static std::map<std::string, native_session_t> stored_sessions;
+
+/******** PRIVATE FUNCTIONS ********/
+static bool topic_matches(const std::string &filter, const std::string &topic) {
+  if (!filter.empty() && '#' == filter.back()) {
+    return 0 == topic.compare(0, filter.size() - 1, filter, 0,
+                    filter.size() - 1);
+  }
+  return filter == topic;
+}
+
+static bool link_up(void) { return WL_CONNECTED == WiFi.status(); }
+
+static native_socket_t *find_socket(int fd) {
+  std::map<int, native_socket_t>::iterator it = sockets.find(fd);
+  return (sockets.end() == it) ? NULL : &it->second;
+}
+
+static native_session_t *session_of(native_socket_t *sock) {
+  return sock->persistent ? &stored_sessions[sock->client_id]
+                          : &sock->session;
+}
+
+// Runs fn after the round trip, unless the socket was closed or replaced
+static void after_latency(int fd, std::function<void(native_socket_t *)> fn) {
+  uint32_t generation = sockets[fd].generation;
+  native_hal_at(native_hal_now_us() + (uint64_t)latency_ms * 1000,
+      [fd, generation, fn]() {
+        native_socket_t *sock = find_socket(fd);
+        if (sock && generation == sock->generation) {
+          fn(sock);
+        }
+      });
+}
+
+static void reset_socket(native_socket_t *sock) {
+  if (NATIVE_SOCKET_OPEN == sock->state ||
+      NATIVE_SOCKET_CONNECTING == sock->state) {
+    sock->state = NATIVE_SOCKET_RESET;
+    sock->mqtt_connected = false;
+  }
+}
+
+static void reset_all(void) {
+  for (std::pair<const int, native_socket_t> &entry : sockets) {
+    reset_socket(&entry.second);
+  }
+}
+
+// Sockets see the link go down straight away, lwIP aborts them
+static bool check_link(native_socket_t *sock) {
+  if (!link_up()) {
+    reset_socket(sock);
+  }
+  return NATIVE_SOCKET_OPEN == sock->state;
+}
+
+static std::string encode_u16(uint16_t value) {
+  return std::string(1, (char)(value >> 8)) + (char)(value & 0xFF);
+}
+
+static std::string encode_packet(uint8_t header, const std::string &body) {
+  std::string packet(1, (char)header);
+  size_t remaining = body.size();
+  do {
+    uint8_t byte = remaining & 0x7F;
+    remaining >>= 7;
+    packet += (char)(byte | (remaining ? 0x80 : 0));
+  } while (remaining);
+  return packet + body;
+}
+
+static std::string encode_publish(native_socket_t *sock,
+    const std::string &topic, const std::string &payload, uint8_t qos) {
+  std::string body = encode_u16(topic.size()) + topic;
+  if (qos > 0) {
+    if (0 == ++sock->next_packet_id) {
+      sock->next_packet_id = 1;
+    }
+    body += encode_u16(sock->next_packet_id);
+    stats.qos1_delivered++;
+  }
+  return encode_packet(0x30 | (qos << 1), body + payload);
+}
+
+static void reply(int fd, const std::string &packet) {
+  after_latency(fd, [packet](native_socket_t *sock) {
+    if (NATIVE_SOCKET_OPEN == sock->state && NATIVE_BROKER_STALLED != mode) {
+      sock->to_client += packet;
+    }
+  });
+}
+
+static void check_keepalive(int fd) {
+  native_socket_t *sock = find_socket(fd);
+  uint64_t grace_us = (uint64_t)sock->keepalive_s * 1500000;
+  uint32_t generation = sock->generation;
+  native_hal_at(sock->last_rx_us + grace_us, [fd, generation, grace_us]() {
+    native_socket_t *sock = find_socket(fd);
+    if (!sock || generation != sock->generation ||
+        NATIVE_SOCKET_OPEN != sock->state) {
+      return;
+    }
+    if (native_hal_now_us() - sock->last_rx_us >= grace_us) {
+      stats.keepalive_expired++;
+      sock->state = NATIVE_SOCKET_CLOSED;
+      sock->mqtt_connected = false;
+    } else {
+      check_keepalive(fd);
+    }
+  });
+}
+
+// Sequential reader over a packet body, reads past the end give zeros
+typedef struct body_reader {
+  const std::string *body;
+  size_t pos;
+  bool overrun;
+} body_reader_t;
+
+static uint8_t read_u8(body_reader_t *reader) {
+  if (reader->pos + 1 > reader->body->size()) {
+    reader->overrun = true;
+    return 0;
+  }
+  return (uint8_t)(*reader->body)[reader->pos++];
+}
+
+static uint16_t read_u16(body_reader_t *reader) {
+  uint16_t high = read_u8(reader);
+  return (high << 8) | read_u8(reader);
+}
+
+static std::string read_string(body_reader_t *reader) {
+  uint16_t len = read_u16(reader);
+  if (reader->pos + len > reader->body->size()) {
+    reader->overrun = true;
+    return std::string();
+  }
+  std::string str = reader->body->substr(reader->pos, len);
+  reader->pos += len;
+  return str;
+}
+
+static void handle_connect(int fd, native_socket_t *sock, body_reader_t *in) {
+  read_string(in);  // protocol name
+  read_u8(in);      // protocol level
+  uint8_t flags = read_u8(in);
+  sock->keepalive_s = read_u16(in);
+  sock->client_id = read_string(in);
+  if (in->overrun) {
+    sock->state = NATIVE_SOCKET_CLOSED;
+    return;
+  }
+  if (NATIVE_BROKER_REFUSING == mode) {
+    stats.refused++;
+    after_latency(fd, [](native_socket_t *sock) {
+      sock->to_client += encode_packet(0x20, std::string("\x00\x03", 2));
+      sock->state = NATIVE_SOCKET_CLOSED;
+    });
+    return;
+  }
+
+  // A second connection with the same client ID takes over the session
+  for (std::pair<const int, native_socket_t> &entry : sockets) {
+    if (entry.first != fd && entry.second.mqtt_connected &&
+        entry.second.client_id == sock->client_id) {
+      reset_socket(&entry.second);
+    }
+  }
+  bool clean = (0 != (flags & 0x02));
+  bool present = !clean && stored_sessions.count(sock->client_id);
+  if (clean) {
+    stored_sessions.erase(sock->client_id);
+  }
+  sock->persistent = !clean;
+  sock->mqtt_connected = true;
+  stats.connects++;
+  if (sock->keepalive_s) {
+    check_keepalive(fd);
+  }
+  after_latency(fd, [present](native_socket_t *sock) {
+    if (NATIVE_SOCKET_OPEN != sock->state) {
+      return;
+    }
+    sock->to_client += encode_packet(0x20, std::string(1, present ? 1 : 0) +
+                                               std::string(1, 0));
+    native_session_t *session = session_of(sock);
+    while (!session->pending.empty()) {
+      sock->to_client += encode_publish(sock, session->pending.front().first,
+          session->pending.front().second, 1);
+      session->pending.pop_front();
+    }
+  });
+}
+
+static void handle_publish(
+    int fd, native_socket_t *sock, uint8_t flags, body_reader_t *in) {
+  uint8_t qos = (flags >> 1) & 0x03;
+  std::string topic = read_string(in);
+  uint16_t packet_id = (qos > 0) ? read_u16(in) : 0;
+  if (in->overrun) {
+    sock->state = NATIVE_SOCKET_CLOSED;
+    return;
+  }
+  std::string payload = in->body->substr(in->pos);
+  stats.messages++;
+  stats.duplicates += (flags & 0x08) ? 1 : 0;
+  stats.bytes += payload.size();
+  if (on_message_s) {
+    on_message_s(topic.c_str(), (const uint8_t *)payload.data(),
+        payload.size());
+  }
+  if (1 == qos && (0 == puback_loss_period ||
+                      0 != ++pubacks % puback_loss_period)) {
+    reply(fd, encode_packet(0x40, encode_u16(packet_id)));
+  }
+}
+
+static void handle_subscribe(int fd, native_socket_t *sock, body_reader_t *in) {
+  uint16_t packet_id = read_u16(in);
+  std::string granted;
+  native_session_t *session = session_of(sock);
+  while (!in->overrun && in->pos < in->body->size()) {
+    std::string filter = read_string(in);
+    uint8_t qos = read_u8(in);
+    qos = (qos > 1) ? 1 : qos;
+    bool replaced = false;
+    for (native_subscription_t &subscription : session->subscriptions) {
+      if (subscription.filter == filter) {
+        subscription.qos = qos;
+        replaced = true;
+      }
+    }
+    if (!replaced) {
+      session->subscriptions.push_back({filter, qos});
+    }
+    granted += (char)qos;
+  }
+  reply(fd, encode_packet(0x90, encode_u16(packet_id) + granted));
+}
+
+static void handle_packet(
+    int fd, native_socket_t *sock, uint8_t header, const std::string &body) {
+  body_reader_t in = {&body, 0, false};
+  sock->last_rx_us = native_hal_now_us();
+  if (!sock->mqtt_connected && 0x10 != (header & 0xF0)) {
+    sock->state = NATIVE_SOCKET_CLOSED;  // protocol violation
+    return;
+  }
+  switch (header & 0xF0) {
+    case 0x10:
+      handle_connect(fd, sock, &in);
+      break;
+    case 0x30:
+      handle_publish(fd, sock, header & 0x0F, &in);
+      break;
+    case 0x80:
+      handle_subscribe(fd, sock, &in);
+      break;
+    case 0xC0:
+      stats.pings++;
+      reply(fd, encode_packet(0xD0, std::string()));
+      break;
+    case 0xE0:
+      sock->mqtt_connected = false;
+      sock->state = NATIVE_SOCKET_CLOSED;
+      break;
+    case 0x40:  // PUBACK for what we delivered at QoS 1
+      stats.qos1_acked++;
+      break;
+    default:
+      break;
+  }
+}
+
+// Handles every complete packet the client sent so far
+static void serve(int fd, native_socket_t *sock) {
+  while (NATIVE_SOCKET_OPEN == sock->state && NATIVE_BROKER_STALLED != mode) {
+    const std::string &data = sock->from_client;
+    size_t remaining = 0;
+    size_t pos = 1;
+    bool complete = false;
+    for (; pos < data.size() && pos <= 4; pos++) {
+      remaining |= (size_t)(data[pos] & 0x7F) << (7 * (pos - 1));
+      if (0 == (data[pos] & 0x80)) {
+        complete = true;
+        pos++;
+        break;
+      }
+    }
+    if (!complete || data.size() < pos + remaining) {
+      return;
+    }
+    uint8_t header = (uint8_t)data[0];
+    std::string body = data.substr(pos, remaining);
+    sock->from_client.erase(0, pos + remaining);
+    handle_packet(fd, sock, header, body);
+  }
+}
+
+static void deliver(const std::string &topic, const std::string &payload) {
+  for (std::pair<const int, native_socket_t> &entry : sockets) {
+    native_socket_t *sock = &entry.second;
+    if (!sock->mqtt_connected || NATIVE_SOCKET_OPEN != sock->state) {
+      continue;
+    }
+    for (const native_subscription_t &subscription :
+        session_of(sock)->subscriptions) {
+      if (topic_matches(subscription.filter, topic)) {
+        sock->to_client +=
+            encode_publish(sock, topic, payload, subscription.qos);
+        break;
+      }
+    }
+  }
+  // Stored sessions of clients that are away keep what they'd get at QoS 1
+  for (std::pair<const std::string, native_session_t> &entry :
+      stored_sessions) {
+    bool online = false;
+    for (std::pair<const int, native_socket_t> &socket_entry : sockets) {
+      online = online || (socket_entry.second.mqtt_connected &&
+                             socket_entry.second.client_id == entry.first);
+    }
+    for (const native_subscription_t &subscription :
+        entry.second.subscriptions) {
+      if (!online && 1 == subscription.qos &&
+          topic_matches(subscription.filter, topic)) {
+        entry.second.pending.emplace_back(topic, payload);
+        break;
+      }
+    }
+  }
+}
+
+/******** HAL CONTROL ********/
+void native_broker_set_mode(native_broker_mode_t new_mode) {
+  // Going down drops every client; a stalled broker is restarted after
+  if (NATIVE_BROKER_DOWN == new_mode ||
+      (NATIVE_BROKER_STALLED == mode && NATIVE_BROKER_STALLED != new_mode)) {
+    reset_all();
+  }
+  mode = new_mode;
+}
+
+void native_broker_set_mode_at(native_broker_mode_t new_mode, uint32_t at_ms) {
+  native_hal_at((uint64_t)at_ms * 1000,
+      [new_mode]() { native_broker_set_mode(new_mode); });
+}
+
+void native_broker_set_latency_ms(uint32_t ms) { latency_ms = ms; }
+
+void native_broker_set_puback_loss(uint32_t n) { puback_loss_period = n; }
+
+void native_broker_get_stats(native_broker_stats_t *stats_out) {
+  *stats_out = stats;
+}
+
+void native_broker_on_message(
+    std::function<void(const char *topic, const uint8_t *payload, size_t len)>
+        fn) {
+  on_message_s = fn;
+}
+
+void native_broker_publish_at(
+    const char *topic, const char *payload, uint32_t at_ms) {
+  std::string topic_s = topic;
+  std::string payload_s = payload;
+  native_hal_at((uint64_t)at_ms * 1000, [topic_s, payload_s]() {
+    if (NATIVE_BROKER_UP == mode) {
+      deliver(topic_s, payload_s);
+    }
+  });
+}
+
+/******** lwIP sockets ********/
+int lwip_socket(int domain, int type, int protocol) {
+  (void)protocol;
+  if (AF_INET != domain || SOCK_STREAM != type) {
+    errno = EAFNOSUPPORT;
+    return -1;
+  }
+  int fd = NATIVE_SOCKET_FD_BASE;
+  while (sockets.count(fd)) {
+    fd++;
+  }
+  native_socket_t sock = {};
+  sock.generation = next_generation++;
+  sockets[fd] = sock;
+  return fd;
+}
+
+int lwip_connect(int s, const struct sockaddr *name, socklen_t namelen) {
+  native_socket_t *sock = find_socket(s);
+  if (!sock || NATIVE_SOCKET_CREATED != sock->state ||
+      namelen < sizeof(struct sockaddr_in)) {
+    errno = EBADF;
+    return -1;
+  }
+  if (!link_up()) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  uint16_t port = ntohs(((const struct sockaddr_in *)name)->sin_port);
+  sock->state = NATIVE_SOCKET_CONNECTING;
+  after_latency(s, [port](native_socket_t *sock) {
+    if (NATIVE_SOCKET_CONNECTING != sock->state ||
+        NATIVE_BROKER_STALLED == mode) {
+      return;  // a stalled broker never answers the SYN
+    }
+    if (NATIVE_BROKER_DOWN == mode || NATIVE_BROKER_PORT != port) {
+      stats.refused++;
+      sock->state = NATIVE_SOCKET_FAILED;
+      sock->error = ECONNREFUSED;
+      return;
+    }
+    sock->state = NATIVE_SOCKET_OPEN;
+  });
+  errno = EINPROGRESS;
+  return -1;
+}
+
+int lwip_fcntl(int s, int cmd, int val) {
+  (void)cmd;
+  (void)val;
+  return find_socket(s) ? 0 : -1;
+}
+
+int lwip_setsockopt(
+    int s, int level, int optname, const void *optval, socklen_t optlen) {
+  (void)level;
+  (void)optname;
+  (void)optval;
+  (void)optlen;
+  return find_socket(s) ? 0 : -1;
+}
+
+int lwip_getsockopt(
+    int s, int level, int optname, void *optval, socklen_t *optlen) {
+  native_socket_t *sock = find_socket(s);
+  if (!sock || SOL_SOCKET != level || SO_ERROR != optname ||
+      *optlen < sizeof(int)) {
+    errno = EINVAL;
+    return -1;
+  }
+  int error = 0;
+  if (NATIVE_SOCKET_FAILED == sock->state) {
+    error = sock->error;
+  } else if (NATIVE_SOCKET_RESET == sock->state) {
+    error = ECONNRESET;
+  }
+  *(int *)optval = error;
+  *optlen = sizeof(int);
+  return 0;
+}
+
+int lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset,
+    fd_set *exceptset, struct timeval *timeout) {
+  (void)exceptset;
+  (void)timeout;  // never waits, the firmware only polls
+  int ready = 0;
+  for (int fd = 0; fd < maxfdp1; fd++) {
+    native_socket_t *sock = find_socket(fd);
+    if (sock) {
+      check_link(sock);
+    }
+    if (readset && FD_ISSET(fd, readset)) {
+      bool ended = sock && (NATIVE_SOCKET_CLOSED == sock->state ||
+                               NATIVE_SOCKET_RESET == sock->state ||
+                               NATIVE_SOCKET_FAILED == sock->state);
+      if (ended || (sock && !sock->to_client.empty())) {
+        ready++;
+      } else {
+        FD_CLR(fd, readset);
+      }
+    }
+    if (writeset && FD_ISSET(fd, writeset)) {
+      if (sock && NATIVE_SOCKET_CONNECTING != sock->state &&
+          NATIVE_SOCKET_CREATED != sock->state) {
+        ready++;
+      } else {
+        FD_CLR(fd, writeset);
+      }
+    }
+  }
+  return ready;
+}
+
+ssize_t lwip_send(int s, const void *dataptr, size_t size, int flags) {
+  (void)flags;
+  native_socket_t *sock = find_socket(s);
+  if (!sock || !check_link(sock)) {
+    errno = (sock && NATIVE_SOCKET_CONNECTING == sock->state) ? ENOTCONN
+                                                              : ECONNRESET;
+    return -1;
+  }
+  size_t space = NATIVE_SOCKET_SEND_BUFFER - sock->from_client.size();
+  size_t len = (size < space) ? size : space;
+  if (0 == len) {
+    errno = EAGAIN;
+    return -1;
+  }
+  sock->from_client.append((const char *)dataptr, len);
+  serve(s, sock);
+  return len;
+}
+
+ssize_t lwip_recv(int s, void *mem, size_t len, int flags) {
+  (void)flags;
+  native_socket_t *sock = find_socket(s);
+  if (!sock) {
+    errno = EBADF;
+    return -1;
+  }
+  check_link(sock);
+  if (NATIVE_SOCKET_RESET == sock->state) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  if (sock->to_client.empty()) {
+    if (NATIVE_SOCKET_CLOSED == sock->state) {
+      return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+  size_t n = (len < sock->to_client.size()) ? len : sock->to_client.size();
+  memcpy(mem, sock->to_client.data(), n);
+  sock->to_client.erase(0, n);
+  return n;
+}
+
+int lwip_close(int s) {
+  if (0 == sockets.erase(s)) {
+    errno = EBADF;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+#include <math.h>
+
+#include "DHT.h"
+#include "native_hal.h"
+#include "native_internal.h"
+
+// Same as DHT_INPUT in dht_fsm.cpp
+#define NATIVE_DHT_PIN 4
+// DHT22 answer timing, see dht_capture.h
+#define NATIVE_DHT_ANSWER_DELAY_US 30
+#define NATIVE_DHT_PREAMBLE_US 80
+#define NATIVE_DHT_BIT_LOW_US 50
+#define NATIVE_DHT_ZERO_HIGH_US 27
+#define NATIVE_DHT_ONE_HIGH_US 70
+
+static float temperature_s = 21.5f;
+static float humidity_s = 40.0f;
+static uint32_t failure_period = 0;
+static uint32_t reads = 0;
+static std::function<void(uint32_t, float *, float *)> source_s;
+
+/******** PRIVATE FUNCTIONS ********/
+static bool read_sensor(float *temperature_c, float *humidity) {
+  reads++;
+  if (0 != failure_period && 0 == reads % failure_period) {
+    return false;
+  }
+  *temperature_c = temperature_s;
+  *humidity = humidity_s;
+  if (source_s) {
+    source_s(millis(), temperature_c, humidity);
+  }
+  return true;
+}
+
+static void edge_at(uint64_t at_us, uint8_t level) {
+  native_hal_at(at_us, [level]() { native_gpio_set(NATIVE_DHT_PIN, level); });
+}
+
+/******** HAL CONTROL ********/
+void native_dht_set(float temperature_c, float humidity) {
+  temperature_s = temperature_c;
+  humidity_s = humidity;
+}
+
+void native_dht_set_failure_period(uint32_t n) { failure_period = n; }
+
+void native_dht_set_source(
+    std::function<void(uint32_t now_ms, float *temperature_c, float *humidity)>
+        source) {
+  source_s = source;
+}
+
+void native_dht_released(uint8_t pin, uint64_t held_low_us) {
+  float temperature_c = 0;
+  float humidity = 0;
+  // The sensor only answers a start signal of at least 1 ms
+  if (NATIVE_DHT_PIN != pin || held_low_us < 1000 ||
+      !read_sensor(&temperature_c, &humidity)) {
+    return;
+  }
+  uint16_t humidity_x10 = (uint16_t)lroundf(humidity * 10);
+  long temperature_x10 = lroundf(temperature_c * 10);
+  uint16_t temperature_bits = (uint16_t)(temperature_x10 < 0
+                                             ? 0x8000 | -temperature_x10
+                                             : temperature_x10);
+  uint8_t bytes[5] = {(uint8_t)(humidity_x10 >> 8), (uint8_t)humidity_x10,
+      (uint8_t)(temperature_bits >> 8), (uint8_t)temperature_bits, 0};
+  bytes[4] = bytes[0] + bytes[1] + bytes[2] + bytes[3];
+
+  uint64_t at_us = native_hal_now_us() + NATIVE_DHT_ANSWER_DELAY_US;
+  edge_at(at_us, LOW);
+  at_us += NATIVE_DHT_PREAMBLE_US;
+  edge_at(at_us, HIGH);
+  at_us += NATIVE_DHT_PREAMBLE_US;
+  for (uint8_t bit = 0; bit < 40; bit++) {
+    edge_at(at_us, LOW);
+    at_us += NATIVE_DHT_BIT_LOW_US;
+    edge_at(at_us, HIGH);
+    bool one = bytes[bit / 8] & (0x80 >> (bit % 8));
+    at_us += one ? NATIVE_DHT_ONE_HIGH_US : NATIVE_DHT_ZERO_HIGH_US;
+  }
+  edge_at(at_us, LOW);
+  edge_at(at_us + NATIVE_DHT_BIT_LOW_US, HIGH);
+}
+
+/******** DHT ********/
+float DHT::readTemperature(bool fahrenheit) {
+  float temperature_c = 0;
+  float humidity = 0;
+  if (!read_sensor(&temperature_c, &humidity)) {
+    return NAN;
+  }
+  return fahrenheit ? temperature_c * 1.8f + 32 : temperature_c;
+}
+
+float DHT::readHumidity(void) {
+  float temperature_c = 0;
+  float humidity = 0;
+  if (!read_sensor(&temperature_c, &humidity)) {
+    return NAN;
+  }
+  return humidity;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "esp_partition.h"
+#include "native_hal.h"
+
+// Matches the outbox entry in partitions.csv
+#define NATIVE_OUTBOX_ADDRESS 0x3E0000
+#define NATIVE_OUTBOX_SIZE 0x10000
+#define NATIVE_FLASH_SECTOR 4096
+
+static const esp_partition_t outbox = {.type = ESP_PARTITION_TYPE_DATA,
+    .subtype = ESP_PARTITION_SUBTYPE_DATA_UNDEFINED,
+    .address = NATIVE_OUTBOX_ADDRESS,
+    .size = NATIVE_OUTBOX_SIZE,
+    .label = "outbox"};
+
+static std::vector<uint8_t> contents(NATIVE_OUTBOX_SIZE, 0xFF);
+static native_flash_stats_t stats = {};
+
+/******** PRIVATE FUNCTIONS ********/
+static bool in_range(
+    const esp_partition_t *partition, size_t offset, size_t size) {
+  return &outbox == partition && offset <= outbox.size &&
+         size <= outbox.size - offset;
+}
+
+/******** HAL CONTROL ********/
+bool native_flash_load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  std::vector<uint8_t> loaded(NATIVE_OUTBOX_SIZE);
+  bool ok = loaded.size() == fread(loaded.data(), 1, loaded.size(), file);
+  fclose(file);
+  if (ok) {
+    contents = loaded;
+  }
+  return ok;
+}
+
+bool native_flash_save(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok =
+      contents.size() == fwrite(contents.data(), 1, contents.size(), file);
+  return 0 == fclose(file) && ok;
+}
+
+void native_flash_get_stats(native_flash_stats_t *stats_out) {
+  *stats_out = stats;
+}
+
+/******** esp_partition ********/
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+    esp_partition_subtype_t subtype, const char *label) {
+  if (ESP_PARTITION_TYPE_DATA != type ||
+      (ESP_PARTITION_SUBTYPE_ANY != subtype && outbox.subtype != subtype) ||
+      (label && 0 != strcmp(label, outbox.label))) {
+    return NULL;
+  }
+  return &outbox;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+    size_t src_offset, void *dst, size_t size) {
+  if (!in_range(partition, src_offset, size)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(dst, &contents[src_offset], size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition,
+    size_t dst_offset, const void *src, size_t size) {
+  if (!in_range(partition, dst_offset, size)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  const uint8_t *bytes = (const uint8_t *)src;
+  for (size_t i = 0; i < size; i++) {
+    contents[dst_offset + i] &= bytes[i];
+  }
+  stats.bytes_written += size;
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(
+    const esp_partition_t *partition, size_t offset, size_t size) {
+  if (!in_range(partition, offset, size) || offset % NATIVE_FLASH_SECTOR ||
+      size % NATIVE_FLASH_SECTOR) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  memset(&contents[offset], 0xFF, size);
+  stats.sectors_erased += size / NATIVE_FLASH_SECTOR;
+  return ESP_OK;
+}
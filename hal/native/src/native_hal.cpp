@@ -0,0 +1,301 @@
+#include <malloc.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+
+#include "Arduino.h"
+#include "ArduinoOTA.h"
+#include "driver/rtc_io.h"
+#include "esp_sleep.h"
+#include "native_hal.h"
+#include "native_internal.h"
+
+// Same as the usable DRAM heap of an ESP32 running the Arduino core
+#define NATIVE_HEAP_SIZE (320 * 1024)
+#define NATIVE_NUM_PINS 40
+#define NATIVE_PIR_HIGH_MS 1000
+#define NATIVE_HEAP_SAMPLE_INTERVAL_US 1000000
+
+HardwareSerial Serial;
+EspClass ESP;
+ArduinoOTAClass ArduinoOTA;
+
+static uint64_t now_us = 0;
+static std::multimap<uint64_t, std::function<void(void)>> timed_events;
+static bool quiet = false;
+
+static uint8_t pin_levels[NATIVE_NUM_PINS] = {};
+static void (*pin_isrs[NATIVE_NUM_PINS])(void) = {};
+static int pin_isr_modes[NATIVE_NUM_PINS] = {};
+static uint8_t pin_modes[NATIVE_NUM_PINS] = {};
+static uint64_t pin_low_since_us[NATIVE_NUM_PINS] = {};
+static uint32_t pir_edges = 0;
+
+static bool sleeping = false;
+static bool woken_by_pin = false;
+static int ext0_pin = -1;
+static int ext0_level = HIGH;
+static uint64_t timer_wakeup_us = 0;
+static esp_sleep_wakeup_cause_t wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+
+static size_t heap_baseline = 0;
+static uint32_t min_free_heap = NATIVE_HEAP_SIZE;
+
+/******** PRIVATE FUNCTIONS ********/
+static void run_until(uint64_t target_us, const bool *stop) {
+  while (!timed_events.empty() && timed_events.begin()->first <= target_us) {
+    auto next = timed_events.begin();
+    std::function<void(void)> fn = next->second;
+    if (next->first > now_us) {
+      now_us = next->first;
+    }
+    timed_events.erase(next);
+    fn();
+    if (stop && *stop) {
+      return;
+    }
+  }
+  if (target_us > now_us) {
+    now_us = target_us;
+  }
+}
+
+/******** HAL CONTROL ********/
+void native_hal_at(uint64_t at_us, std::function<void(void)> fn) {
+  timed_events.emplace(at_us, fn);
+}
+
+void native_hal_advance_us(uint64_t us) {
+  run_until(now_us + us, NULL);
+  native_heap_sample();
+}
+
+uint64_t native_hal_now_us(void) { return now_us; }
+
+uint64_t native_hal_next_event_us(void) {
+  return timed_events.empty() ? UINT64_MAX : timed_events.begin()->first;
+}
+
+void native_hal_set_quiet(bool quiet_in) { quiet = quiet_in; }
+
+void native_pir_trigger_at(uint8_t pin, uint32_t at_ms) {
+  uint64_t at_us = (uint64_t)at_ms * 1000;
+  native_hal_at(at_us, [pin]() {
+    // A trigger while the output is still high isn't an edge
+    if (pin < NATIVE_NUM_PINS && LOW == pin_levels[pin]) {
+      pir_edges++;
+    }
+    native_gpio_set(pin, HIGH);
+  });
+  native_hal_at(at_us + (uint64_t)NATIVE_PIR_HIGH_MS * 1000,
+      [pin]() { native_gpio_set(pin, LOW); });
+}
+
+uint32_t native_pir_edges(void) { return pir_edges; }
+
+void native_gpio_set(uint8_t pin, uint8_t level) {
+  if (pin >= NATIVE_NUM_PINS || pin_levels[pin] == level) {
+    return;
+  }
+  pin_levels[pin] = level;
+  if (sleeping) {
+    if (pin == ext0_pin && level == ext0_level) {
+      woken_by_pin = true;
+    }
+    return;
+  }
+  int mode = pin_isr_modes[pin];
+  bool edge = (CHANGE == mode) || (RISING == mode && HIGH == level) ||
+              (FALLING == mode && LOW == level);
+  if (pin_isrs[pin] && edge) {
+    pin_isrs[pin]();
+  }
+}
+
+void native_heap_sample(void) {
+  // mallinfo2() is slow enough to dominate runs that idle in short slices
+  static uint64_t last_sample_us = 0;
+  if (0 != last_sample_us &&
+      now_us - last_sample_us < NATIVE_HEAP_SAMPLE_INTERVAL_US) {
+    return;
+  }
+  last_sample_us = now_us;
+  uint32_t free_heap = ESP.getFreeHeap();
+  if (free_heap < min_free_heap) {
+    min_free_heap = free_heap;
+  }
+}
+
+/******** ARDUINO CORE ********/
+unsigned long millis(void) { return (unsigned long)(uint32_t)(now_us / 1000); }
+
+unsigned long micros(void) { return (unsigned long)(uint32_t)now_us; }
+
+void delay(uint32_t ms) { native_hal_advance_us((uint64_t)ms * 1000); }
+
+void delayMicroseconds(uint32_t us) { native_hal_advance_us(us); }
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin >= NATIVE_NUM_PINS) {
+    return;
+  }
+  bool released = (OUTPUT == pin_modes[pin] && LOW == pin_levels[pin] &&
+                   OUTPUT != mode);
+  if (OUTPUT == mode && OUTPUT != pin_modes[pin]) {
+    pin_low_since_us[pin] = now_us;
+  }
+  pin_modes[pin] = mode;
+  if (INPUT_PULLUP == mode) {
+    pin_levels[pin] = HIGH;
+  }
+  if (released) {
+    native_dht_released(pin, now_us - pin_low_since_us[pin]);
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  if (pin < NATIVE_NUM_PINS) {
+    if (!val && pin_levels[pin]) {
+      pin_low_since_us[pin] = now_us;
+    }
+    pin_levels[pin] = val ? HIGH : LOW;
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return (pin < NATIVE_NUM_PINS) ? pin_levels[pin] : LOW;
+}
+
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode) {
+  if (pin < NATIVE_NUM_PINS) {
+    pin_isrs[pin] = isr;
+    pin_isr_modes[pin] = mode;
+  }
+}
+
+void detachInterrupt(uint8_t pin) {
+  if (pin < NATIVE_NUM_PINS) {
+    pin_isrs[pin] = NULL;
+  }
+}
+
+long random(long howbig) { return (howbig <= 0) ? 0 : rand() % howbig; }
+
+long random(long howsmall, long howbig) {
+  return (howsmall >= howbig) ? howsmall : howsmall + random(howbig - howsmall);
+}
+
+/******** SERIAL ********/
+int HardwareSerial::available(void) { return 0; }
+
+int HardwareSerial::read(void) { return -1; }
+
+int HardwareSerial::availableForWrite(void) { return 4096; }
+
+size_t HardwareSerial::write(uint8_t c) { return write(&c, 1); }
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  return quiet ? size : fwrite(buffer, 1, size, stdout);
+}
+
+size_t HardwareSerial::print(const char *str) {
+  return write((const uint8_t *)str, strlen(str));
+}
+
+size_t HardwareSerial::print(char c) { return write((uint8_t)c); }
+
+size_t HardwareSerial::print(int value) { return printf("%d", value); }
+
+size_t HardwareSerial::print(unsigned value) { return printf("%u", value); }
+
+size_t HardwareSerial::print(long value) { return printf("%ld", value); }
+
+size_t HardwareSerial::print(unsigned long value) {
+  return printf("%lu", value);
+}
+
+size_t HardwareSerial::print(double value) { return printf("%.2f", value); }
+
+size_t HardwareSerial::printf(const char *format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (len < 0) {
+    return 0;
+  }
+  return write((const uint8_t *)buffer,
+      ((size_t)len < sizeof(buffer)) ? (size_t)len : sizeof(buffer) - 1);
+}
+
+/******** ESP ********/
+uint32_t EspClass::getFreeHeap(void) {
+  size_t used = mallinfo2().uordblks;
+  if (0 == heap_baseline) {
+    heap_baseline = used;
+  }
+  size_t grown = (used > heap_baseline) ? used - heap_baseline : 0;
+  return (grown < NATIVE_HEAP_SIZE) ? NATIVE_HEAP_SIZE - grown : 0;
+}
+
+uint32_t EspClass::getMinFreeHeap(void) {
+  native_heap_sample();
+  return min_free_heap;
+}
+
+uint32_t EspClass::getMaxAllocHeap(void) { return getFreeHeap(); }
+
+uint32_t EspClass::getCycleCount(void) {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+  return (uint32_t)((uint64_t)ns * (F_CPU / 1000000) / 1000);
+}
+
+void EspClass::restart(void) {
+  fflush(stdout);
+  exit(0);
+}
+
+/******** SLEEP ********/
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us) {
+  timer_wakeup_us = time_in_us;
+  return 0;
+}
+
+esp_err_t esp_sleep_enable_ext0_wakeup(gpio_num_t gpio_num, int level) {
+  ext0_pin = gpio_num;
+  ext0_level = level;
+  return 0;
+}
+
+esp_err_t esp_sleep_disable_wakeup_source(esp_sleep_source_t source) {
+  if (ESP_SLEEP_WAKEUP_EXT0 == source || ESP_SLEEP_WAKEUP_ALL == source) {
+    ext0_pin = -1;
+  }
+  if (ESP_SLEEP_WAKEUP_TIMER == source || ESP_SLEEP_WAKEUP_ALL == source) {
+    timer_wakeup_us = 0;
+  }
+  return 0;
+}
+
+esp_err_t esp_light_sleep_start(void) {
+  sleeping = true;
+  woken_by_pin = false;
+  run_until(now_us + timer_wakeup_us, &woken_by_pin);
+  sleeping = false;
+  wakeup_cause = woken_by_pin ? ESP_SLEEP_WAKEUP_EXT0 : ESP_SLEEP_WAKEUP_TIMER;
+  native_heap_sample();
+  return 0;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause(void) {
+  return wakeup_cause;
+}
+
+esp_err_t rtc_gpio_deinit(gpio_num_t gpio_num) {
+  (void)gpio_num;
+  return 0;
+}
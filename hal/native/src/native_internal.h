@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+ * Shared between the native HAL translation units, not for firmware code.
+ */
+
+#include <stdint.h>
+
+/**
+ * @brief Drive an input pin from the simulated outside world
+ *
+ * Runs the attached interrupt handler on a matching edge, or ends a light
+ * sleep when the pin is armed as the ext0 wake source.
+ */
+void native_gpio_set(uint8_t pin, uint8_t level);
+
+/**
+ * @brief Sample the heap watermark, called as virtual time passes
+ */
+void native_heap_sample(void);
+
+/**
+ * @brief A pin driven low for held_low_us was released
+ *
+ * Answers with a DHT22 frame on the sensor's pin, see dht_capture.h.
+ */
+void native_dht_released(uint8_t pin, uint64_t held_low_us);
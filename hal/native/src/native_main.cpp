@@ -0,0 +1,488 @@
+/*
+ * Entry point of the native environment: runs the unmodified setup() and
+ * loop() from src/main.cpp against the simulated hardware, in virtual time.
+ *
+ *   .pio/build/native/program [-t seconds] [-m motion_period_s]
+ *       [-w start_s:length_s] [-b start_s:length_s] [-R start_s:length_s]
+ *       [-s start_s:length_s] [-D ms] [-L n] [-f n] [-r at_s:temp_f]
+ *       [-c at_s:command] [-n nvs_file] [-F flash_file] [-T trace_file]
+ *       [-p] [-q] [-h]
+ *
+ *   -t  how long to run, in simulated seconds (default one hour)
+ *   -m  PIR trigger period, 0 for an empty room (default 120)
+ *   -w  Wi-Fi outage window
+ *   -b  broker outage window, clients are dropped and refused
+ *   -R  window in which the broker refuses CONNECT
+ *   -s  window in which the broker stops answering, e.g. a half-open link
+ *   -D  broker round trip in ms (default 5)
+ *   -L  lose every n-th PUBACK
+ *   -f  fail every n-th DHT read
+ *   -r  publish a reference temperature for the calibration, repeatable
+ *   -c  publish a command on <host>/cmd, e.g. 600:vacant_ms=60000,
+ *       repeatable
+ *   -n  keep NVS in a file across runs, e.g. to exercise the fast boot path
+ *   -F  keep the outbox partition in a file across runs, e.g. to reboot in
+ *       the middle of an outage
+ *   -T  write the FSM trace ring at the end, for tools/trace_replay.cpp
+ *   -p  print every message the broker receives
+ *   -q  silence the firmware's Serial output
+ *   -h  print the usage
+ *
+ * Exits with status 1 if a PIR edge was lost or handled late, e.g. while
+ * -s or -D hold up a publish, or if a sample queued during a -w or -b
+ * outage didn't reach <host>/batch afterwards and wasn't counted as dropped,
+ * or if the heap low-water mark is more than 32 KB below the start or, in a
+ * run of 2 h or more, still fell in the second half.
+ */
+
+#include <getopt.h>
+
+#include <algorithm>
+
+#include "Arduino.h"
+#include "device_config.h"
+#include "dht_fsm.h"
+#include "mqtt_fsm.h"
+#include "native_hal.h"
+#include "power.h"
+#include "prox_fsm.h"
+#include "trace.h"
+#include "wifi_fsm.h"
+
+// Provisioned on the first run, and kept with -n
+#define NATIVE_HOST "native"
+// Handlers take no virtual time, so a PIR edge handled this late waited for
+// something like a slow publish
+#define NATIVE_PIR_LATE_US (100 * 1000)
+#define NATIVE_MAX_OUTAGES 8
+// A week of 5 s samples; static, so the heap figures only see the firmware
+#define NATIVE_MAX_BATCHED (7 * 24 * 720)
+// The heap must settle within the first half of a run this long or longer,
+// and stay within the bound
+#define NATIVE_HEAP_SOAK_S (2 * 3600)
+#define NATIVE_HEAP_MAX_USED (32 * 1024)
+
+typedef struct native_outage {
+  uint32_t start_ms;
+  uint32_t end_ms;
+  sample_queue_stats_t before;
+  sample_queue_stats_t after;
+} native_outage_t;
+
+static native_outage_t outages[NATIVE_MAX_OUTAGES];
+static uint8_t num_outages = 0;
+static bool print_messages = false;
+// Sample timestamps seen on <host>/batch, retransmitted ones included
+static uint32_t batched[NATIVE_MAX_BATCHED];
+static uint32_t num_batched = 0;
+static uint32_t batches = 0;
+static uint32_t bad_batches = 0;  // empty, oversized or unparsable
+static uint32_t heap_at_start = 0;
+static uint32_t heap_at_half = 0;  // low-water marks, free bytes
+
+void setup(void);
+void loop(void);
+
+/******** PRIVATE FUNCTIONS ********/
+static bool parse_window(const char *arg, uint32_t *start_s, uint32_t *len_s) {
+  return 2 == sscanf(arg, "%u:%u", start_s, len_s);
+}
+
+// Snapshots the sample queue around a -w or -b window
+static bool add_outage(uint32_t start_s, uint32_t len_s) {
+  if (num_outages >= NATIVE_MAX_OUTAGES) {
+    return false;
+  }
+  native_outage_t *outage = &outages[num_outages++];
+  outage->start_ms = start_s * 1000;
+  outage->end_ms = (start_s + len_s) * 1000;
+  native_hal_at((uint64_t)outage->start_ms * 1000,
+      [outage]() { mqtt_fsm_get_sample_stats(&outage->before); });
+  native_hal_at((uint64_t)outage->end_ms * 1000,
+      [outage]() { mqtt_fsm_get_sample_stats(&outage->after); });
+  return true;
+}
+
+// Each line is "<age ms>,<temperature>,<humidity>,<occupied>"
+static void record_batch(const uint8_t *payload, size_t len) {
+  std::string text((const char *)payload, len);
+  uint32_t now_ms = millis();
+  uint32_t lines = 0;
+  bool parsed = true;
+  for (size_t pos = 0; pos < text.size();) {
+    unsigned age_ms = 0;
+    int temperature = 0;
+    int humidity = 0;
+    unsigned occupied = 0;
+    size_t end = text.find('\n', pos);
+    if (std::string::npos == end || 4 != sscanf(&text[pos], "%u,%d,%d,%u",
+                                             &age_ms, &temperature,
+                                             &humidity, &occupied)) {
+      parsed = false;
+      break;
+    }
+    if (num_batched < NATIVE_MAX_BATCHED) {
+      batched[num_batched++] = now_ms - age_ms;
+    }
+    lines++;
+    pos = end + 1;
+  }
+  batches++;
+  if (!parsed || 0 == lines || lines > MQTT_BATCH_SIZE) {
+    bad_batches++;
+  }
+}
+
+static void on_message(const char *topic, const uint8_t *payload, size_t len) {
+  if (print_messages) {
+    fprintf(stderr, "[%8lu] %s ", millis(), topic);
+    fwrite(payload, 1, len, stderr);
+    fputc('\n', stderr);
+  }
+  char batch_topic[64];
+  snprintf(batch_topic, sizeof(batch_topic), "%s/batch",
+      device_config_get()->host_name);
+  if (0 == strcmp(topic, batch_topic)) {
+    record_batch(payload, len);
+  }
+}
+
+static void print_queue_stats(
+    const char *name, fsm_err_t (*get)(fsm_queue_stats_t *)) {
+  fsm_queue_stats_t stats = {};
+  get(&stats);
+  printf("  %-5s queue: hwm %u, dropped %u, coalesced %u\n", name,
+      stats.high_water_mark, stats.dropped, stats.coalesced);
+}
+
+static void print_summary(void) {
+  native_broker_stats_t broker = {};
+  native_broker_get_stats(&broker);
+  sample_queue_stats_t samples = {};
+  mqtt_fsm_get_sample_stats(&samples);
+  power_stats_t power = {};
+  power_get_stats(&power);
+  native_flash_stats_t flash = {};
+  native_flash_get_stats(&flash);
+
+  printf("\n--- native run: %lu s simulated ---\n", millis() / 1000);
+  printf("  broker: %u connects, %u refused, %u messages, %u bytes\n",
+      broker.connects, broker.refused, broker.messages, broker.bytes);
+  printf("  delivery: %u duplicates\n", broker.duplicates);
+  printf("  inbound: %u at QoS 1, %u acknowledged\n", broker.qos1_delivered,
+      broker.qos1_acked);
+  printf("  keepalive: %u pings, %u clients expired\n", broker.pings,
+      broker.keepalive_expired);
+  printf("  samples: %u queued, hwm %u, dropped %u, %u batches\n",
+      samples.queued, samples.high_water_mark, samples.dropped, batches);
+  printf("  flash: %u bytes written, %u sectors erased\n",
+      flash.bytes_written, flash.sectors_erased);
+  printf("  power: active %u ms, idle %u ms, sleep %u ms, %u pin wakeups\n",
+      power.active_ms, power.idle_ms, power.sleep_ms, power.pin_wakeups);
+  print_queue_stats("wifi", wifi_fsm_get_queue_stats);
+  print_queue_stats("mqtt", mqtt_fsm_get_queue_stats);
+  print_queue_stats("prox", prox_fsm_get_queue_stats);
+  print_queue_stats("dht", dht_fsm_get_queue_stats);
+}
+
+// Drops until the next outage still come out of this one's backlog, the
+// queue keeps filling until the reconnect
+static uint32_t drops_after(
+    const native_outage_t *outage, const sample_queue_stats_t *last) {
+  uint32_t dropped = last->dropped;
+  for (uint8_t i = 0; i < num_outages; i++) {
+    if (outages[i].start_ms >= outage->end_ms &&
+        outages[i].before.dropped < dropped) {
+      dropped = outages[i].before.dropped;
+    }
+  }
+  return dropped - outage->before.dropped;
+}
+
+/**
+ * @brief Every sample queued during an outage must reach <host>/batch once
+ * the connection is back, unless the full queue dropped it
+ *
+ * Reconnecting drains the backlog as batches as soon as two samples wait,
+ * so a single one may go out live and isn't looked for.
+ */
+static bool check_outages(void) {
+  sample_queue_stats_t samples = {};
+  mqtt_fsm_get_sample_stats(&samples);
+  bool ok = true;
+  uint32_t *end = batched + num_batched;
+  std::sort(batched, end);
+  end = std::unique(batched, end);
+  if (0 != bad_batches) {
+    fprintf(stderr, "%u of %u batches were empty, longer than %u samples "
+        "or malformed\n", bad_batches, batches, MQTT_BATCH_SIZE);
+    ok = false;
+  }
+  for (uint8_t i = 0; i < num_outages; i++) {
+    const native_outage_t *outage = &outages[i];
+    uint32_t queued = outage->after.queued - outage->before.queued;
+    uint32_t dropped = drops_after(outage, &samples);
+    uint32_t delivered =
+        std::lower_bound(batched, end, outage->end_ms) -
+        std::lower_bound(batched, end, outage->start_ms);
+    // The queue holds an hour of samples, a longer outage has to drop some
+    uint32_t excess = (queued > MQTT_SAMPLE_QUEUE_SIZE)
+                          ? queued - MQTT_SAMPLE_QUEUE_SIZE
+                          : 0;
+    uint32_t peak = (queued < MQTT_SAMPLE_QUEUE_SIZE) ? queued
+                                                      : MQTT_SAMPLE_QUEUE_SIZE;
+    printf("  outage %u-%u s: %u samples queued, %u batched, %u dropped\n",
+        outage->start_ms / 1000, outage->end_ms / 1000, queued, delivered,
+        dropped);
+    if (queued < 2) {
+      continue;
+    }
+    if (delivered + dropped < queued) {
+      fprintf(stderr, "%u samples queued during the outage at %u s never "
+          "reached the broker\n", queued - delivered - dropped,
+          outage->start_ms / 1000);
+      ok = false;
+    }
+    if (dropped < excess) {
+      fprintf(stderr, "%u samples queued during the outage at %u s, only %u "
+          "dropped with room for %u\n", queued, outage->start_ms / 1000,
+          dropped, MQTT_SAMPLE_QUEUE_SIZE);
+      ok = false;
+    }
+    if (samples.high_water_mark < peak) {
+      fprintf(stderr, "sample queue high watermark %u, the outage at %u s "
+          "queued %u\n", samples.high_water_mark, outage->start_ms / 1000,
+          peak);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+/**
+ * @brief The heap has to level off: in the second half of a soak run its
+ * low-water mark may not fall any further, and it never gets more than
+ * NATIVE_HEAP_MAX_USED below where it started
+ *
+ * Outages and reconnects can take a little more the first time around, so
+ * a soak run should leave its second half to repeat what the first did.
+ */
+static bool check_heap(void) {
+  uint32_t min_free = ESP.getMinFreeHeap();
+  uint32_t used = heap_at_start - min_free;
+  bool ok = true;
+  if (0 == heap_at_half) {
+    printf("  heap: min free %u bytes, %u used\n", min_free, used);
+  } else {
+    printf("  heap: min free %u bytes, %u used, %u half way\n", min_free,
+        used, heap_at_half);
+    if (min_free < heap_at_half) {
+      fprintf(stderr, "the heap low-water mark fell by %u bytes in the "
+          "second half of the run\n", heap_at_half - min_free);
+      ok = false;
+    }
+  }
+  if (used > NATIVE_HEAP_MAX_USED) {
+    fprintf(stderr, "the heap low-water mark is %u bytes below the start, "
+        "more than %u\n", used, NATIVE_HEAP_MAX_USED);
+    ok = false;
+  }
+  return ok;
+}
+
+// Every PIR edge must reach the prox FSM in time, whatever the broker does
+static bool check_pir(void) {
+  prox_stats_t prox = {};
+  prox_fsm_get_stats(&prox);
+  uint32_t raised = native_pir_edges();
+  printf("  pir: %u edges raised, %u handled, latency max %u us\n", raised,
+      prox.edges, prox.latency_max_us);
+  if (raised != prox.edges) {
+    fprintf(stderr, "%u PIR edges lost\n", raised - prox.edges);
+    return false;
+  }
+  if (prox.latency_max_us > NATIVE_PIR_LATE_US) {
+    fprintf(stderr, "a PIR edge was handled %u us late\n",
+        prox.latency_max_us);
+    return false;
+  }
+  return true;
+}
+
+static void print_usage(FILE *out, const char *program) {
+  fprintf(out,
+      "usage: %s [-t s] [-m s] [-w start:len] [-b start:len] "
+      "[-R start:len] [-s start:len] [-D ms] [-L n] [-f n] "
+      "[-r at_s:temp_f] [-c at_s:command] [-n nvs_file] "
+      "[-F flash_file] [-T trace_file] [-p] [-q] [-h]\n",
+      program);
+}
+
+// What a new device gets over the serial console, see console.h
+static void provision(void) {
+  device_config_set("ssid", "native");
+  device_config_set("password", "native");
+  device_config_set("mqtt_server", "127.0.0.1");
+  device_config_set("host_name", NATIVE_HOST);
+  device_config_set("ota_password", "native");
+}
+
+static void write_trace(const uint8_t *data, size_t len, void *ctx) {
+  fwrite(data, 1, len, (FILE *)ctx);
+}
+
+static bool save_trace(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+  trace_dump(write_trace, file);
+  return 0 == fclose(file);
+}
+
+/******** PUBLIC FUNCTIONS ********/
+int main(int argc, char **argv) {
+  uint32_t duration_s = 3600;
+  uint32_t motion_period_s = 120;
+  uint32_t start_s = 0;
+  uint32_t len_s = 0;
+  const char *nvs_path = NULL;
+  const char *flash_path = NULL;
+  const char *trace_path = NULL;
+  int opt;
+
+  while (-1 != (opt = getopt(argc, argv, "t:m:w:b:R:s:D:L:f:r:c:n:F:T:pqh"))) {
+    switch (opt) {
+      case 't':
+        duration_s = strtoul(optarg, NULL, 10);
+        break;
+      case 'm':
+        motion_period_s = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+      case 'b':
+      case 'R':
+      case 's':
+        if (!parse_window(optarg, &start_s, &len_s)) {
+          fprintf(stderr, "-%c expects start_s:length_s\n", opt);
+          return 1;
+        }
+        if (('w' == opt || 'b' == opt) && !add_outage(start_s, len_s)) {
+          fprintf(stderr, "at most %u outages\n", NATIVE_MAX_OUTAGES);
+          return 1;
+        }
+        if ('w' == opt) {
+          native_wifi_set_available_at(false, start_s * 1000);
+          native_wifi_set_available_at(true, (start_s + len_s) * 1000);
+        } else {
+          native_broker_mode_t mode = NATIVE_BROKER_DOWN;
+          if ('R' == opt) {
+            mode = NATIVE_BROKER_REFUSING;
+          } else if ('s' == opt) {
+            mode = NATIVE_BROKER_STALLED;
+          }
+          native_broker_set_mode_at(mode, start_s * 1000);
+          native_broker_set_mode_at(NATIVE_BROKER_UP, (start_s + len_s) * 1000);
+        }
+        break;
+      case 'D':
+        native_broker_set_latency_ms(strtoul(optarg, NULL, 10));
+        break;
+      case 'L':
+        native_broker_set_puback_loss(strtoul(optarg, NULL, 10));
+        break;
+      case 'f':
+        native_dht_set_failure_period(strtoul(optarg, NULL, 10));
+        break;
+      case 'r': {
+        uint32_t at_s = 0;
+        float temp_f = 0;
+        char topic[64];
+        char payload[16];
+        if (2 != sscanf(optarg, "%u:%f", &at_s, &temp_f)) {
+          fprintf(stderr, "-r expects at_s:temp_f\n");
+          return 1;
+        }
+        snprintf(
+            topic, sizeof(topic), "%s/calibrate/reference", NATIVE_HOST);
+        snprintf(payload, sizeof(payload), "%.1f", temp_f);
+        native_broker_publish_at(topic, payload, at_s * 1000);
+        break;
+      }
+      case 'c': {
+        uint32_t at_s = 0;
+        int command_pos = 0;
+        char topic[64];
+        if (1 != sscanf(optarg, "%u:%n", &at_s, &command_pos) ||
+            0 == command_pos) {
+          fprintf(stderr, "-c expects at_s:command\n");
+          return 1;
+        }
+        snprintf(topic, sizeof(topic), "%s/cmd", NATIVE_HOST);
+        native_broker_publish_at(topic, &optarg[command_pos], at_s * 1000);
+        break;
+      }
+      case 'n':
+        nvs_path = optarg;
+        native_nvs_load(nvs_path);
+        break;
+      case 'F':
+        flash_path = optarg;
+        native_flash_load(flash_path);
+        break;
+      case 'T':
+        trace_path = optarg;
+        break;
+      case 'p':
+        print_messages = true;
+        break;
+      case 'q':
+        native_hal_set_quiet(true);
+        break;
+      case 'h':
+        print_usage(stdout, argv[0]);
+        return 0;
+      default:
+        print_usage(stderr, argv[0]);
+        return 1;
+    }
+  }
+
+  if (0 != motion_period_s) {
+    for (uint32_t t = motion_period_s; t < duration_s; t += motion_period_s) {
+      native_pir_trigger_at(PROX_INPUT, t * 1000);
+    }
+  }
+
+  // After -n, a stored configuration is kept as it is
+  if (!device_config_provisioned()) {
+    provision();
+  }
+  native_broker_on_message(on_message);
+  heap_at_start = ESP.getMinFreeHeap();
+  if (duration_s >= NATIVE_HEAP_SOAK_S) {
+    native_hal_at((uint64_t)duration_s / 2 * 1000000,
+        []() { heap_at_half = ESP.getMinFreeHeap(); });
+  }
+  setup();
+  while (native_hal_now_us() < (uint64_t)duration_s * 1000000) {
+    loop();
+  }
+  print_summary();
+  bool pir_ok = check_pir();
+  bool outages_ok = check_outages();
+  bool heap_ok = check_heap();
+  if (nvs_path && !native_nvs_save(nvs_path)) {
+    fprintf(stderr, "failed to save %s\n", nvs_path);
+    return 1;
+  }
+  if (flash_path && !native_flash_save(flash_path)) {
+    fprintf(stderr, "failed to save %s\n", flash_path);
+    return 1;
+  }
+  if (trace_path && !save_trace(trace_path)) {
+    fprintf(stderr, "failed to save %s\n", trace_path);
+    return 1;
+  }
+  return (pir_ok && outages_ok && heap_ok) ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+#include <map>
+#include <vector>
+
+#include "Arduino.h"
+#include "Preferences.h"
+#include "native_hal.h"
+
+static std::map<std::string, std::vector<uint8_t>> store;
+
+/******** PRIVATE FUNCTIONS ********/
+static std::string full_key(const std::string &name, const char *key) {
+  return name + "/" + key;
+}
+
+/******** HAL CONTROL ********/
+// One record per key: key length, key, value length, value
+bool native_nvs_load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  std::map<std::string, std::vector<uint8_t>> loaded;
+  uint32_t len = 0;
+  bool ok = true;
+  while (ok && 1 == fread(&len, sizeof(len), 1, file)) {
+    std::string key(len, '\0');
+    ok = len == fread(&key[0], 1, len, file) &&
+         1 == fread(&len, sizeof(len), 1, file);
+    if (ok) {
+      std::vector<uint8_t> value(len);
+      ok = len == fread(value.data(), 1, len, file);
+      loaded[key] = value;
+    }
+  }
+  fclose(file);
+  if (ok) {
+    store = loaded;
+  }
+  return ok;
+}
+
+bool native_nvs_save(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok = true;
+  for (const auto &entry : store) {
+    uint32_t key_len = entry.first.size();
+    uint32_t value_len = entry.second.size();
+    ok = ok && 1 == fwrite(&key_len, sizeof(key_len), 1, file) &&
+         key_len == fwrite(entry.first.data(), 1, key_len, file) &&
+         1 == fwrite(&value_len, sizeof(value_len), 1, file) &&
+         value_len == fwrite(entry.second.data(), 1, value_len, file);
+  }
+  return 0 == fclose(file) && ok;
+}
+
+/******** Preferences ********/
+bool Preferences::begin(const char *name, bool readOnly) {
+  name_ = name;
+  read_only_ = readOnly;
+  return true;
+}
+
+void Preferences::end(void) { name_.clear(); }
+
+bool Preferences::clear(void) {
+  if (read_only_ || name_.empty()) {
+    return false;
+  }
+  std::string prefix = name_ + "/";
+  for (auto it = store.begin(); it != store.end();) {
+    it = (0 == it->first.compare(0, prefix.size(), prefix)) ? store.erase(it)
+                                                             : ++it;
+  }
+  return true;
+}
+
+bool Preferences::remove(const char *key) {
+  if (read_only_ || name_.empty()) {
+    return false;
+  }
+  return 0 != store.erase(full_key(name_, key));
+}
+
+bool Preferences::isKey(const char *key) {
+  return !name_.empty() && store.count(full_key(name_, key));
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len) {
+  if (read_only_ || name_.empty() || !value) {
+    return 0;
+  }
+  const uint8_t *bytes = (const uint8_t *)value;
+  store[full_key(name_, key)] = std::vector<uint8_t>(bytes, bytes + len);
+  return len;
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen) {
+  size_t len = getBytesLength(key);
+  if (0 == len || !buf || len > maxLen) {
+    return 0;
+  }
+  memcpy(buf, store[full_key(name_, key)].data(), len);
+  return len;
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+  if (!isKey(key)) {
+    return 0;
+  }
+  return store[full_key(name_, key)].size();
+}
+
+size_t Preferences::putUInt(const char *key, uint32_t value) {
+  return putBytes(key, &value, sizeof(value));
+}
+
+uint32_t Preferences::getUInt(const char *key, uint32_t defaultValue) {
+  uint32_t value = defaultValue;
+  getBytes(key, &value, sizeof(value));
+  return value;
+}
+
+size_t Preferences::putFloat(const char *key, float value) {
+  return putBytes(key, &value, sizeof(value));
+}
+
+float Preferences::getFloat(const char *key, float defaultValue) {
+  float value = defaultValue;
+  getBytes(key, &value, sizeof(value));
+  return value;
+}
@@ -0,0 +1,176 @@
+#include <vector>
+
+#include "WiFi.h"
+#include "native_hal.h"
+
+// Rough association times seen on the bench: DHCP dominates a cold connect
+#define NATIVE_WIFI_SCAN_MS 1200
+#define NATIVE_WIFI_ASSOC_MS 300
+#define NATIVE_WIFI_DHCP_MS 1500
+#define NATIVE_WIFI_STATIC_IP_MS 50
+#define NATIVE_WIFI_NO_AP_MS 3000
+
+WiFiClass WiFi;
+
+static const uint8_t ap_bssid[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static const int32_t ap_channel = 6;
+static const IPAddress dhcp_ip(192, 168, 4, 100);
+static const IPAddress gateway_ip(192, 168, 4, 1);
+static const IPAddress subnet_mask(255, 255, 255, 0);
+
+static std::vector<WiFiEventFuncCb> callbacks;
+static bool ap_available = true;
+static wl_status_t status_s = WL_IDLE_STATUS;
+// Bumped on every begin/disconnect so stale association steps are ignored
+static uint32_t attempt = 0;
+static uint8_t bssid_s[6] = {};
+static int32_t channel_s = 0;
+static IPAddress static_ip;
+static IPAddress local_ip;
+
+/******** PRIVATE FUNCTIONS ********/
+static void fire(WiFiEvent_t event, uint8_t reason) {
+  WiFiEventInfo_t info = {};
+  info.wifi_sta_disconnected.reason = reason;
+  for (WiFiEventFuncCb cb : callbacks) {
+    cb(event, info);
+  }
+}
+
+static void drop_link(uint8_t reason) {
+  bool was_connected = (WL_CONNECTED == status_s);
+  status_s = WL_DISCONNECTED;
+  local_ip = IPAddress();
+  if (was_connected) {
+    fire(ARDUINO_EVENT_WIFI_STA_LOST_IP, 0);
+  }
+  fire(ARDUINO_EVENT_WIFI_STA_DISCONNECTED, reason);
+}
+
+static void schedule(uint32_t delay_ms, uint32_t expected_attempt,
+    std::function<void(void)> fn) {
+  native_hal_at(native_hal_now_us() + (uint64_t)delay_ms * 1000,
+      [expected_attempt, fn]() {
+        if (expected_attempt == attempt) {
+          fn();
+        }
+      });
+}
+
+/******** HAL CONTROL ********/
+void native_wifi_set_available(bool available) {
+  ap_available = available;
+  if (!available && WL_CONNECTED == status_s) {
+    attempt++;
+    drop_link(WIFI_REASON_BEACON_TIMEOUT);
+  }
+}
+
+void native_wifi_set_available_at(bool available, uint32_t at_ms) {
+  native_hal_at((uint64_t)at_ms * 1000,
+      [available]() { native_wifi_set_available(available); });
+}
+
+/******** WiFiClass ********/
+bool WiFiClass::mode(wifi_mode_t mode) {
+  (void)mode;
+  return true;
+}
+
+bool WiFiClass::setAutoReconnect(bool autoReconnect) {
+  (void)autoReconnect;
+  return true;
+}
+
+bool WiFiClass::setSleep(bool enabled) {
+  (void)enabled;
+  return true;
+}
+
+int WiFiClass::onEvent(WiFiEventFuncCb cb) {
+  callbacks.push_back(cb);
+  return (int)callbacks.size();
+}
+
+wl_status_t WiFiClass::begin(const char *ssid, const char *passphrase,
+    int32_t channel, const uint8_t *bssid, bool connect) {
+  (void)ssid;
+  (void)passphrase;
+  if (!connect) {
+    return status_s;
+  }
+  uint32_t this_attempt = ++attempt;
+  status_s = WL_DISCONNECTED;
+  if (!ap_available) {
+    schedule(NATIVE_WIFI_NO_AP_MS, this_attempt,
+        []() { drop_link(WIFI_REASON_NO_AP_FOUND); });
+    return status_s;
+  }
+
+  // A known BSSID and channel skip the scan, a static IP skips DHCP
+  bool direct = bssid && 0 == memcmp(bssid, ap_bssid, sizeof(ap_bssid)) &&
+                channel == ap_channel;
+  uint32_t assoc_ms =
+      (direct ? 0 : NATIVE_WIFI_SCAN_MS) + NATIVE_WIFI_ASSOC_MS;
+  uint32_t ip_ms = (0 != (uint32_t)static_ip) ? NATIVE_WIFI_STATIC_IP_MS
+                                              : NATIVE_WIFI_DHCP_MS;
+  schedule(assoc_ms, this_attempt, []() {
+    memcpy(bssid_s, ap_bssid, sizeof(bssid_s));
+    channel_s = ap_channel;
+    fire(ARDUINO_EVENT_WIFI_STA_CONNECTED, 0);
+  });
+  schedule(assoc_ms + ip_ms, this_attempt, []() {
+    status_s = WL_CONNECTED;
+    local_ip = (0 != (uint32_t)static_ip) ? static_ip : dhcp_ip;
+    fire(ARDUINO_EVENT_WIFI_STA_GOT_IP, 0);
+  });
+  return status_s;
+}
+
+bool WiFiClass::config(IPAddress local_ip_in, IPAddress gateway,
+    IPAddress subnet, IPAddress dns1) {
+  (void)gateway;
+  (void)subnet;
+  (void)dns1;
+  static_ip = local_ip_in;
+  return true;
+}
+
+bool WiFiClass::disconnect(bool wifioff) {
+  (void)wifioff;
+  attempt++;
+  if (WL_IDLE_STATUS != status_s) {
+    drop_link(WIFI_REASON_ASSOC_LEAVE);
+  }
+  return true;
+}
+
+wl_status_t WiFiClass::status(void) { return status_s; }
+
+IPAddress WiFiClass::localIP(void) { return local_ip; }
+
+IPAddress WiFiClass::gatewayIP(void) { return gateway_ip; }
+
+IPAddress WiFiClass::subnetMask(void) { return subnet_mask; }
+
+IPAddress WiFiClass::dnsIP(void) { return gateway_ip; }
+
+uint8_t *WiFiClass::BSSID(void) { return bssid_s; }
+
+int32_t WiFiClass::channel(void) { return channel_s; }
+
+// There is no DNS in the simulation, only addresses resolve
+int WiFiClass::hostByName(const char *host, IPAddress &result) {
+  unsigned a, b, c, d;
+  char end;
+  if (4 != sscanf(host, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end) || a > 255 ||
+      b > 255 || c > 255 || d > 255) {
+    return 0;
+  }
+  result = IPAddress(a, b, c, d);
+  return 1;
+}
+
+size_t HardwareSerial::print(const IPAddress &ip) {
+  return printf("%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifndef FAST_BOOT
+#define FAST_BOOT 0
+#endif
+
+/**
+ * @brief Log a boot phase with its absolute and relative time
+ *
+ * Ignored once boot_timing_finish() has been called, so milestones that
+ * repeat on reconnects are only reported for the first boot.
+ *
+ * @param phase name of the phase that just completed
+ */
+void boot_timing_mark(const char *phase);
+
+/**
+ * @brief Log the final boot phase and stop recording
+ *
+ * @param phase name of the phase that just completed
+ */
+void boot_timing_finish(const char *phase);
+
+/**
+ * @brief Time from start-up to boot_timing_finish()
+ *
+ * @return uint32_t milliseconds, 0 while still booting
+ */
+uint32_t boot_timing_total_ms(void);
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Self-heating model for the temperature reading
+ *
+ * The DHT22 sits next to the ESP32, so it reads high by an amount that
+ * depends on how hard the CPU and radio work and on how long the board has
+ * been powered. The offset subtracted from every reading is
+ *
+ *   offset = w0 + w1 * cpu + w2 * radio + w3 * warmup
+ *
+ * with cpu the active fraction of time and radio the MQTT transmit rate
+ * relative to CALIB_RADIO_FULL_BPS, both low-pass filtered with the board's
+ * thermal time constant, and warmup = 1 - exp(-uptime / time constant).
+ * Until a reference is received the model is just w0, the temp_offset
+ * setting (see settings.h).
+ * Every reference reading trains the weights with a normalized LMS step and
+ * the weights are kept in NVS.
+ */
+
+#define CALIB_TIME_CONSTANT_MS (15 * 60 * 1000)
+#define CALIB_RADIO_FULL_BPS 1000  // sustained MQTT bytes/s counted as 1.0
+#define CALIB_LEARNING_RATE 0.5f
+#define CALIB_MAX_OFFSET_F 30.0f
+// References this far from the prediction are typos, not self-heating
+#define CALIB_MAX_ERROR_F 20.0f
+#define CALIB_NUM_FEATURES 4
+
+typedef struct calibration_model {
+  float features[CALIB_NUM_FEATURES];  // 1, cpu, radio, warmup
+  float weights[CALIB_NUM_FEATURES];   // degrees Fahrenheit
+  uint32_t references;                 // reference readings trained on
+} calibration_model_t;
+
+/**
+ * @brief Load the weights from NVS, or start from the temp_offset setting
+ */
+void calibration_init(void);
+
+/**
+ * @brief Update the activity features, called before each reading
+ */
+void calibration_update(void);
+
+/**
+ * @brief Count bytes handed to the radio
+ *
+ * Safe to call from another task than the DHT state machine's.
+ *
+ * @param bytes payload size of a publish
+ */
+void calibration_note_tx(uint32_t bytes);
+
+/**
+ * @brief The current self-heating offset
+ *
+ * @return int32_t tenths of a degree Fahrenheit to subtract from a reading
+ */
+int32_t calibration_offset_x10(void);
+
+/**
+ * @brief Train the model against a trusted thermometer
+ *
+ * @param raw_x10 uncorrected reading, tenths of a degree Fahrenheit
+ * @param reference_x10 the true temperature, tenths of a degree Fahrenheit
+ * @return true if the reference was used, false if it was rejected
+ */
+bool calibration_train(int32_t raw_x10, int32_t reference_x10);
+
+/**
+ * @brief Restart the bias weight from a new offset and keep it in NVS
+ *
+ * The other weights stay, later references refine the bias again.
+ *
+ * @param offset_x10 tenths of a degree Fahrenheit
+ */
+void calibration_set_bias_x10(int32_t offset_x10);
+
+/**
+ * @brief Get the current features and weights
+ *
+ * @param model filled with a copy of the model
+ */
+void calibration_get_model(calibration_model_t *model);
@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+ * Line-based console on the serial port
+ *
+ * Provisions the device, see device_config.h:
+ *
+ *   config            list the stored configuration, passwords masked
+ *   <name>=<value>    set a field and store it in NVS
+ *   reboot            restart with the new configuration
+ *
+ * With FSM_TRACE, 'T' at the start of a line dumps the FSM trace to Serial
+ * and 'M' publishes it over MQTT.
+ */
+
+/**
+ * @brief Handle whatever arrived on the serial port, called from the loop
+ */
+void console_poll(void);
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Identity and credentials of the device, kept in NVS
+ *
+ * Every room runs the same image and is provisioned once over the serial
+ * port (see console.h), instead of building each room's image with its own
+ * Config.h and build flags. The configuration is loaded from NVS on first
+ * use and stored as a version byte followed by one tagged record per field
+ * that is set, so an image that adds fields still reads what older ones
+ * stored, and an older image skips the fields it doesn't know.
+ *
+ * The first device_config_get() has to come from setup(), before the FSM
+ * tasks start. It takes the copy the image runs with until the next boot:
+ * the console's changes only go to NVS, so the topics, the client ID and
+ * the credentials in use never change under a running connection.
+ */
+
+typedef struct device_config {
+  char ssid[33];
+  char password[65];
+  char mqtt_server[64];  // host name or IP address of the broker
+  char host_name[32];    // OTA host name, MQTT client ID and topic prefix
+  char ota_password[32];
+  // Topics of the one-topic-per-reading payload format, for existing
+  // dashboards, "<host>/humidity" and so on when not set
+  char topic_hum[64];
+  char topic_temp[64];
+  char topic_prox[64];
+  uint8_t sensor_power_pin;  // driven high to power the DHT22, 0 for none
+} device_config_t;
+
+typedef enum {
+  DEVICE_CONFIG_OK,
+  DEVICE_CONFIG_ERR_UNKNOWN,  // no field by that name
+  DEVICE_CONFIG_ERR_VALUE,    // too long, or not a valid number
+  DEVICE_CONFIG_ERR_STORE,    // NVS write failed
+} device_config_err_t;
+
+#define DEVICE_CONFIG_TEXT_LEN 96  // "<name>=<value>"
+
+/**
+ * @brief Get the configuration the image runs with
+ *
+ * Loaded from NVS on the first call and left as it is until a reboot.
+ *
+ * @return const device_config_t* never NULL, empty fields if unprovisioned
+ */
+const device_config_t *device_config_get(void);
+
+/**
+ * @brief Check whether the fields needed to go online are stored
+ *
+ * @return true if the SSID, broker and host name are set in NVS
+ */
+bool device_config_provisioned(void);
+
+/**
+ * @brief Set a field by name and store the configuration in NVS
+ *
+ * Takes effect after a reboot, device_config_get() doesn't see it.
+ *
+ * @param name e.g. "ssid"
+ * @param value text, an empty string clears the field
+ * @return device_config_err_t DEVICE_CONFIG_OK if stored
+ */
+device_config_err_t device_config_set(const char *name, const char *value);
+
+/**
+ * @brief Format a stored field as "<name>=<value>", passwords masked
+ *
+ * Shows what the next boot runs with, changes included.
+ *
+ * @param buf destination, DEVICE_CONFIG_TEXT_LEN bytes
+ * @param len size of buf
+ * @param index 0 up to device_config_field_count()
+ * @return size_t length of the text, 0 past the last field
+ */
+size_t device_config_format(char *buf, size_t len, uint8_t index);
+
+/**
+ * @brief Number of fields, for listing them with device_config_format()
+ */
+uint8_t device_config_field_count(void);
+
+/**
+ * @brief Short description of an error, for the console
+ *
+ * @param err the error
+ * @return const char* e.g. "unknown field"
+ */
+const char *device_config_err_name(device_config_err_t err);
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifndef DHT_ASYNC
+#define DHT_ASYNC 0
+#endif
+
+/*
+ * Background capture of a DHT22 frame
+ *
+ * The host holds the data line low for at least 1 ms and releases it. The
+ * sensor answers with an 80 us low / 80 us high preamble and 40 bits, each
+ * a 50 us low followed by a 26-28 us (0) or 70 us (1) high, then a final
+ * 50 us low. An edge interrupt timestamps every falling edge, so the period
+ * between two consecutive falling edges is ~78 us for a 0 and ~120 us for
+ * a 1, and the frame is decoded once the line has been quiet long enough.
+ *
+ *   dht_capture_begin()    drive the line low
+ *   dht_capture_release()  >= 1 ms later, release it and start timestamping
+ *   dht_capture_end()      >= 5 ms later, stop and hand over the edges
+ *   dht_decode()           turn the edges into a reading
+ *
+ * dht_decode() doesn't touch the hardware, so it can be fed recorded edges.
+ */
+
+#define DHT_FRAME_BITS 40
+#define DHT_CAPTURE_MAX_EDGES 48  // 42 expected, a few spare for glitches
+#define DHT_START_LOW_US 1100
+#define DHT_START_LOW_MS 2  // when to release, see dht_capture_release()
+#define DHT_FRAME_MS 8            // preamble + 40 bits take at most ~5.2 ms
+#define DHT_BIT_MIN_US 60
+#define DHT_BIT_ONE_US 100  // periods at least this long are a 1
+#define DHT_BIT_MAX_US 150
+
+typedef enum {
+  DHT_DECODE_OK,
+  DHT_DECODE_SHORT,     // too few edges, no answer or a truncated frame
+  DHT_DECODE_NOISE,     // more edges than a frame can have
+  DHT_DECODE_TIMING,    // a bit period outside DHT_BIT_MIN/MAX_US
+  DHT_DECODE_CHECKSUM,  // bits decoded but the checksum doesn't match
+} dht_decode_err_t;
+
+typedef struct dht_frame {
+  int16_t temperature_x10;  // tenths of a degree Celsius
+  uint16_t humidity_x10;    // tenths of a percent
+} dht_frame_t;
+
+/**
+ * @brief Decode a frame from falling edge timestamps
+ *
+ * Uses the last DHT_FRAME_BITS + 1 edges, so the preamble edge is optional.
+ *
+ * @param edges_us falling edge timestamps in microseconds, oldest first
+ * @param num_edges number of timestamps
+ * @param frame filled with the reading on success
+ * @return dht_decode_err_t DHT_DECODE_OK on success, relevant error otherwise
+ */
+dht_decode_err_t dht_decode(
+    const uint32_t *edges_us, uint8_t num_edges, dht_frame_t *frame);
+
+/**
+ * @brief Human readable name of a decode result, for logging
+ */
+const char *dht_decode_err_name(dht_decode_err_t err);
+
+/**
+ * @brief Start a read by driving the data line low
+ *
+ * @param pin the DHT22 data pin
+ */
+void dht_capture_begin(uint8_t pin);
+
+/**
+ * @brief Release the data line and timestamp the sensor's answer
+ */
+void dht_capture_release(void);
+
+/**
+ * @brief Stop timestamping and leave the line released
+ *
+ * Also aborts a read that hasn't been released yet.
+ *
+ * @param edges_us set to the captured timestamps, valid until the next read
+ * @return uint8_t number of timestamps
+ */
+uint8_t dht_capture_end(const uint32_t **edges_us);
+
+/**
+ * @brief Check whether a read is between dht_capture_begin() and
+ * dht_capture_end()
+ */
+bool dht_capture_busy(void);
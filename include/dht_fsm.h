@@ -1,11 +1,18 @@
 #pragma once
 
 #include "fsm.h"
+#include "scheduler.h"
 
 typedef enum {
   DHT_EVENT_START = FSM_GLOBAL_EVENT_COUNT,
   DHT_EVENT_STOP,
   DHT_EVENT_UNAVAILABLE,
+  DHT_EVENT_SAMPLE,
+  DHT_EVENT_RELEASE,    // DHT_ASYNC: start timestamping the answer
+  DHT_EVENT_CAPTURED,   // DHT_ASYNC: decode the captured frame
+  DHT_EVENT_REFERENCE,  // train the calibration on a submitted reference
+  DHT_EVENT_SETTINGS,   // settings.h values changed
+  DHT_EVENT_COUNT,
 } dht_event_t;
 
 /**
@@ -23,6 +30,14 @@ fsm_err_t dht_fsm_init(void);
  */
 fsm_err_t dht_fsm_send(fsm_event event);
 
+/**
+ * @brief Register the periodic events the DHT state machine handles
+ *
+ * @param scheduler the scheduler delivering periodic events
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t dht_fsm_schedule(scheduler_t *scheduler);
+
 /**
  * @brief Handle any pending events in the DHT state machine
  *
@@ -30,5 +45,69 @@ fsm_err_t dht_fsm_send(fsm_event event);
  */
 fsm_err_t dht_fsm_handle_event(void);
 
+/**
+ * @brief Get the event queue counters of the DHT state machine
+ *
+ * @param stats filled with the high-water mark and drop counters
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t dht_fsm_get_queue_stats(fsm_queue_stats_t *stats);
+
+/**
+ * @brief Check whether a recent valid reading is available
+ *
+ * Failed reads keep the last filtered values, which are only reported for
+ * up to a minute.
+ *
+ * @return true if a read succeeded within the last minute
+ */
+bool dht_has_reading(void);
+
+/**
+ * @brief Filtered readings rounded to whole degrees Fahrenheit and percent
+ */
 int get_temp(void);
-int get_hum(void);
\ No newline at end of file
+int get_hum(void);
+
+/**
+ * @brief Filtered readings in tenths of a degree Fahrenheit and percent
+ */
+int32_t get_temp_x10(void);
+int32_t get_hum_x10(void);
+
+/**
+ * @brief Filtered temperature before the self-heating correction
+ *
+ * @return int32_t tenths of a degree Fahrenheit
+ */
+int32_t get_raw_temp_x10(void);
+
+/**
+ * @brief Call on_reading from the loop after every read attempt
+ *
+ * Also called when the calibration changed the corrected temperature.
+ *
+ * @param on_reading e.g. a function handing the readings to the MQTT FSM
+ */
+void dht_fsm_on_reading(void (*on_reading)(void));
+
+/**
+ * @brief Train the calibration against a trusted thermometer
+ *
+ * The training runs in the DHT state machine, so this is safe to call from
+ * the network task. Only one task may submit references and settings.
+ *
+ * @param reference_x10 the true temperature, tenths of a degree Fahrenheit
+ * @return fsm_err_t FSM_ERR_OK on success, FSM_ERR_FULL if the lane is full
+ */
+fsm_err_t dht_fsm_submit_reference(int32_t reference_x10);
+
+/**
+ * @brief Tell the DHT state machine that settings changed
+ *
+ * A new temperature offset restarts the calibration's bias from it. Shares
+ * the lane of dht_fsm_submit_reference(), so only that task may call this.
+ *
+ * @return fsm_err_t FSM_ERR_OK on success, FSM_ERR_FULL if the lane is full
+ */
+fsm_err_t dht_fsm_notify_settings(void);
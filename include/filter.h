@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Streaming filters for sensor readings, all in integer arithmetic
+ *
+ * A reading goes through a median of the last FILTER_MEDIAN_SIZE values,
+ * which drops isolated spikes, and then an exponential moving average kept
+ * in FILTER_EMA_FRACTION_BITS fixed point. A dead band decides whether the
+ * filtered value moved far enough from the last reported one to be worth
+ * publishing.
+ */
+
+#define FILTER_MEDIAN_SIZE 5  // rejects up to 2 consecutive spikes
+#define FILTER_EMA_FRACTION_BITS 8
+
+typedef struct filter {
+  int32_t window[FILTER_MEDIAN_SIZE];
+  uint8_t count;  // values in the window, up to FILTER_MEDIAN_SIZE
+  uint8_t next;
+  uint8_t ema_shift;  // smoothing factor alpha = 1 / 2^ema_shift
+  int32_t ema;        // FILTER_EMA_FRACTION_BITS fixed point
+} filter_t;
+
+typedef struct deadband {
+  int32_t reported;
+  bool valid;
+} deadband_t;
+
+/**
+ * @brief Initialize a filter
+ *
+ * @param filter the filter
+ * @param ema_shift 0 disables smoothing, n averages over roughly 2^n values
+ */
+void filter_init(filter_t *filter, uint8_t ema_shift);
+
+/**
+ * @brief Feed a reading through the median and the moving average
+ *
+ * The first reading primes the average, so there is no ramp up from 0.
+ *
+ * @param filter the filter
+ * @param value the raw reading
+ * @return int32_t the filtered value, same scale as the input
+ */
+int32_t filter_push(filter_t *filter, int32_t value);
+
+/**
+ * @brief The last filtered value
+ *
+ * @param filter the filter
+ * @return int32_t the filtered value, meaningless before the first push
+ */
+int32_t filter_value(const filter_t *filter);
+
+/**
+ * @brief Check whether a value left the band around the last reported one
+ *
+ * @param band the dead band
+ * @param value the current value
+ * @param delta smallest change worth reporting
+ * @return true if nothing was reported yet or |value - reported| >= delta
+ */
+bool deadband_exceeded(const deadband_t *band, int32_t value, int32_t delta);
+
+/**
+ * @brief Record a value as reported, centering the band on it
+ *
+ * @param band the dead band
+ * @param value the reported value
+ */
+void deadband_commit(deadband_t *band, int32_t value);
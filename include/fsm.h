@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifndef FSM_REPLAY
+#define FSM_REPLAY 0
+#endif
+
 typedef enum {
   FSM_ERR_EVENT_HANDLED = 2,
   FSM_ERR_NO_EVENTS = 1,
@@ -21,6 +25,15 @@ enum {
 };
 
 #define MAX_PENDING_EVENTS 32
+#define FSM_ISR_QUEUE_SIZE 8  // must be a power of two
+#define FSM_MAX_MACHINES 8
+#define FSM_NO_ID 0
+
+typedef enum {
+  FSM_OVERFLOW_DROP_NEWEST,  // reject the incoming event with FSM_ERR_FULL
+  FSM_OVERFLOW_DROP_OLDEST,  // overwrite the oldest queued event
+  FSM_OVERFLOW_COALESCE,     // when full, merge a duplicate or drop the newest
+} fsm_overflow_policy_t;
 
 typedef uint16_t fsm_event;
 typedef uint16_t fsm_state_ID;
@@ -33,6 +46,13 @@ typedef struct fsm_transition {
   fsm_function transition_fn;
 } fsm_transition_t;
 
+#define FSM_NO_TRANSITION UINT16_MAX
+
+typedef struct fsm_dispatch {
+  fsm_state_ID destination_state_ID;  // FSM_NO_TRANSITION if unhandled
+  fsm_function transition_fn;
+} fsm_dispatch_t;
+
 typedef struct fsm_state {
   fsm_state_ID ID;
   fsm_function entry_fn;
@@ -41,12 +61,36 @@ typedef struct fsm_state {
   size_t num_transitions;
 } fsm_state_t;
 
+typedef struct fsm_queue_stats {
+  uint16_t high_water_mark;
+  uint32_t dropped;
+  uint32_t coalesced;
+} fsm_queue_stats_t;
+
+typedef struct fsm_queue_config {
+  fsm_event *buffer;  // NULL to use the handle's built-in storage
+  uint16_t capacity;
+  fsm_overflow_policy_t overflow_policy;
+} fsm_queue_config_t;
+
 typedef struct fsm_handle {
+  uint8_t id;  // FSM_NO_ID until named with fsm_set_name()
   fsm_state_t *state_array;
   uint8_t num_states;
   fsm_state_ID current_state_ID;
+  const fsm_dispatch_t *dispatch_table;  // NULL to search transition_array
+  uint16_t num_events;
+  fsm_event *queue;
+  uint16_t queue_capacity;
+  uint16_t queue_head;
+  uint16_t queue_count;
+  fsm_overflow_policy_t overflow_policy;
+  fsm_queue_stats_t queue_stats;
   fsm_event pending_events[MAX_PENDING_EVENTS];
-  uint8_t num_pending_events;
+  fsm_event isr_events[FSM_ISR_QUEUE_SIZE];
+  uint8_t isr_head;  // only written by the consumer (fsm_handle_event)
+  uint8_t isr_tail;  // only written by the producer (fsm_send_from_isr)
+  uint32_t isr_dropped;  // atomic, read while ISRs may still post
 } fsm_handle_t;
 
 /**
@@ -60,6 +104,85 @@ typedef struct fsm_handle {
 fsm_err_t fsm_init(
     fsm_handle_t *state_machine, fsm_state_t *states, uint8_t num_states);
 
+/**
+ * @brief Initialize a Finite State Machine with a custom event queue
+ *
+ * The queue is a ring buffer, so enqueue and dequeue are O(1). Only a full
+ * FSM_OVERFLOW_COALESCE queue scans the queued events for a duplicate.
+ *
+ * @param state_machine the handle for the state machine
+ * @param states an array of state definitions
+ * @param num_states the number of states
+ * @param queue storage, capacity and overflow policy of the event queue
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t fsm_init_with_queue(fsm_handle_t *state_machine, fsm_state_t *states,
+    uint8_t num_states, const fsm_queue_config_t *queue);
+
+/**
+ * @brief Initialize a Finite State Machine with a dense dispatch table
+ *
+ * The table holds num_states * num_events entries indexed by
+ * [state ID][event]; see fsm_table.h for building one at compile time.
+ *
+ * @param state_machine the handle for the state machine
+ * @param states an array of state definitions, indexed by state ID
+ * @param num_states the number of states
+ * @param table the dispatch table
+ * @param num_events the number of events covered by the table
+ * @param queue storage, capacity and overflow policy of the event queue
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t fsm_init_with_dispatch(fsm_handle_t *state_machine,
+    fsm_state_t *states, uint8_t num_states, const fsm_dispatch_t *table,
+    uint16_t num_events, const fsm_queue_config_t *queue);
+
+/**
+ * @brief Name a state machine for diagnostics
+ *
+ * Gives the machine a small ID that profiling and tracing records refer to.
+ * Call after initialization; naming the same machine again keeps its ID.
+ *
+ * @param state_machine the handle for the state machine
+ * @param name a string that outlives the state machine
+ * @return fsm_err_t FSM_ERR_OK on success, FSM_ERR_FULL if more than
+ * FSM_MAX_MACHINES machines are named
+ */
+fsm_err_t fsm_set_name(fsm_handle_t *state_machine, const char *name);
+
+/**
+ * @brief Get the name of a state machine by ID
+ *
+ * @param id the ID assigned by fsm_set_name()
+ * @return const char* the name, "fsm" for unknown IDs
+ */
+const char *fsm_get_name(uint8_t id);
+
+/**
+ * @brief Look up a named state machine
+ *
+ * @param name the name given to fsm_set_name()
+ * @return fsm_handle_t* the handle, NULL if no machine has that name
+ */
+fsm_handle_t *fsm_find(const char *name);
+
+/**
+ * @brief Number of named state machines, their IDs are 1 to this
+ */
+uint8_t fsm_num_machines(void);
+
+#if FSM_REPLAY
+/**
+ * @brief Gate every fsm_send() and fsm_send_from_isr()
+ *
+ * Replay builds dispatch recorded events only: while sends are blocked,
+ * events posted by handlers, timers and drivers are discarded.
+ *
+ * @param allowed false to discard events sent from now on
+ */
+void fsm_replay_allow_sends(bool allowed);
+#endif
+
 /**
  * @brief Send an event to a state machine's queue
  *
@@ -69,6 +192,20 @@ fsm_err_t fsm_init(
  */
 fsm_err_t fsm_send(fsm_handle_t *state_machine, fsm_event event);
 
+/**
+ * @brief Send an event to a state machine from interrupt context
+ *
+ * Lock-free single-producer/single-consumer path: at most one ISR (or task)
+ * may post to a given state machine through this function. Events are moved
+ * into the regular queue by fsm_handle_event().
+ *
+ * @param state_machine the handle for the state machine
+ * @param event a common or specific event for the state machine
+ * @return fsm_err_t FSM_ERR_OK on success, FSM_ERR_FULL if the ISR lane is full,
+ * FSM_ERR_EINVAL without a state machine
+ */
+fsm_err_t fsm_send_from_isr(fsm_handle_t *state_machine, fsm_event event);
+
 /**
  * @brief Handle any pending events in the state machine's queue
  *
@@ -76,3 +213,30 @@ fsm_err_t fsm_send(fsm_handle_t *state_machine, fsm_event event);
  * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
  */
 fsm_err_t fsm_handle_event(fsm_handle_t *state_machine);
+
+/**
+ * @brief Check whether any state of the state machine handles an event
+ *
+ * @param state_machine the handle for the state machine
+ * @param event a common or specific event for the state machine
+ * @return true if at least one state has a transition for the event
+ */
+bool fsm_handles_event(const fsm_handle_t *state_machine, fsm_event event);
+
+/**
+ * @brief Get the number of events waiting in the state machine's queue
+ *
+ * @param state_machine the handle for the state machine
+ * @return uint16_t number of pending events
+ */
+uint16_t fsm_pending_events(const fsm_handle_t *state_machine);
+
+/**
+ * @brief Get the high-water mark and drop counters of the event queue
+ *
+ * @param state_machine the handle for the state machine
+ * @param stats filled with the current counters
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t fsm_get_queue_stats(
+    const fsm_handle_t *state_machine, fsm_queue_stats_t *stats);
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "fsm.h"
+
+/*
+ * Compile-time transition tables
+ *
+ * A state machine lists its transitions once as a constexpr array and
+ * FSM_DEFINE_TABLE() expands it into a dense [state][event] dispatch table,
+ * rejecting out of range IDs, duplicate (state, event) pairs and states that
+ * can't be reached from the initial state at build time.
+ */
+
+typedef struct fsm_static_transition {
+  fsm_state_ID source_state_ID;
+  fsm_event event;
+  fsm_state_ID destination_state_ID;
+  fsm_function transition_fn;
+} fsm_static_transition_t;
+
+template <size_t NumStates, size_t NumEvents>
+struct fsm_table {
+  static constexpr size_t num_states = NumStates;
+  static constexpr size_t num_events = NumEvents;
+  fsm_dispatch_t entries[NumStates * NumEvents];
+};
+
+template <size_t NumStates, size_t NumEvents, size_t N>
+constexpr bool fsm_table_in_range(
+    const fsm_static_transition_t (&transitions)[N]) {
+  for (size_t i = 0; i < N; i++) {
+    if (transitions[i].source_state_ID >= NumStates ||
+        transitions[i].destination_state_ID >= NumStates ||
+        transitions[i].event >= NumEvents) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <size_t N>
+constexpr bool fsm_table_has_duplicates(
+    const fsm_static_transition_t (&transitions)[N]) {
+  for (size_t i = 0; i < N; i++) {
+    for (size_t j = i + 1; j < N; j++) {
+      if (transitions[i].source_state_ID == transitions[j].source_state_ID &&
+          transitions[i].event == transitions[j].event) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+template <size_t NumStates, size_t N>
+constexpr bool fsm_table_all_reachable(
+    const fsm_static_transition_t (&transitions)[N]) {
+  bool reached[NumStates] = {};
+  reached[0] = true;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < N; i++) {
+      if (reached[transitions[i].source_state_ID] &&
+          !reached[transitions[i].destination_state_ID]) {
+        reached[transitions[i].destination_state_ID] = true;
+        changed = true;
+      }
+    }
+  }
+  for (size_t i = 0; i < NumStates; i++) {
+    if (!reached[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <size_t NumStates, size_t NumEvents, size_t N>
+constexpr fsm_table<NumStates, NumEvents> fsm_make_table(
+    const fsm_static_transition_t (&transitions)[N]) {
+  fsm_table<NumStates, NumEvents> table = {};
+  for (size_t i = 0; i < NumStates * NumEvents; i++) {
+    table.entries[i].destination_state_ID = FSM_NO_TRANSITION;
+    table.entries[i].transition_fn = nullptr;
+  }
+  for (size_t i = 0; i < N; i++) {
+    fsm_dispatch_t &entry =
+        table.entries[transitions[i].source_state_ID * NumEvents +
+                      transitions[i].event];
+    entry.destination_state_ID = transitions[i].destination_state_ID;
+    entry.transition_fn = transitions[i].transition_fn;
+  }
+  return table;
+}
+
+#define FSM_DEFINE_TABLE(name, num_states, num_events, transitions)         \
+  static_assert(fsm_table_in_range<num_states, num_events>(transitions),   \
+      #transitions ": state or event out of range");                       \
+  static_assert(!fsm_table_has_duplicates(transitions),                    \
+      #transitions ": duplicate transition");                              \
+  static_assert(fsm_table_all_reachable<num_states>(transitions),          \
+      #transitions ": unreachable state");                                 \
+  static constexpr fsm_table<num_states, num_events> name =                \
+      fsm_make_table<num_states, num_events>(transitions)
+
+/**
+ * @brief Initialize a Finite State Machine from a compile-time table
+ *
+ * @param state_machine the handle for the state machine
+ * @param states an array of state definitions, indexed by state ID
+ * @param table the dispatch table produced by FSM_DEFINE_TABLE()
+ * @param queue storage, capacity and overflow policy of the event queue
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+template <size_t NumStates, size_t NumEvents>
+fsm_err_t fsm_init_table(fsm_handle_t *state_machine,
+    fsm_state_t (&states)[NumStates],
+    const fsm_table<NumStates, NumEvents> &table,
+    const fsm_queue_config_t *queue) {
+  return fsm_init_with_dispatch(
+      state_machine, states, NumStates, table.entries, NumEvents, queue);
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <type_traits>
+
+/*
+ * Deferred, rate-limited logging
+ *
+ * LOG_ERROR() .. LOG_DEBUG() only copy the format pointer and up to
+ * LOG_MAX_ARGS integer or string arguments into a lock-free ring; the text
+ * is formatted later by log_drain(), called from the loop when there is
+ * room in the UART buffer, so logging never waits on the serial port.
+ * Because formatting is deferred, string arguments must outlive the call,
+ * e.g. literals or configuration.
+ *
+ * Every call site logs at most LOG_SITE_BURST messages per
+ * LOG_SITE_INTERVAL_MS; the next message that gets through reports how
+ * many were suppressed. Levels above LOG_LEVEL are compiled out entirely.
+ */
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE 32  // must be a power of two
+#define LOG_MAX_ARGS 4
+#define LOG_LINE_LEN 128
+#define LOG_SITE_BURST 3
+#define LOG_SITE_INTERVAL_MS 10000
+
+typedef enum { LOG_ARG_INT, LOG_ARG_UINT, LOG_ARG_STR } log_arg_type_t;
+
+typedef struct log_arg {
+  log_arg_type_t type;
+  union {
+    int32_t i;
+    uint32_t u;
+    const char *s;
+  };
+} log_arg_t;
+
+typedef struct log_site {
+  uint32_t window_start_ms;
+  uint8_t in_window;
+  uint16_t suppressed;
+} log_site_t;
+
+typedef struct log_stats {
+  uint32_t written;
+  uint32_t dropped;     // ring full
+  uint32_t suppressed;  // rate limited
+} log_stats_t;
+
+/**
+ * @brief Check a call site's rate limit
+ *
+ * @param site the call site's state
+ * @param suppressed set to the number of messages suppressed since the
+ * last one allowed
+ * @return true if the message may be logged
+ */
+bool log_allow(log_site_t *site, uint16_t *suppressed);
+
+/**
+ * @brief Queue a message, dropping it if the ring is full
+ *
+ * Safe to call from any task or ISR.
+ */
+void log_push(uint8_t level, const char *format, const log_arg_t *args,
+    uint8_t num_args, uint16_t suppressed);
+
+/**
+ * @brief Format queued messages and write them to Serial
+ *
+ * Stops as soon as the next line doesn't fit in the UART transmit buffer.
+ */
+void log_drain(void);
+
+void log_get_stats(log_stats_t *stats);
+
+template <typename T>
+static inline log_arg_t log_arg(T value) {
+  static_assert(std::is_integral<T>::value,
+      "log arguments must be integers or strings");
+  log_arg_t arg;
+  if (std::is_signed<T>::value) {
+    arg.type = LOG_ARG_INT;
+    arg.i = (int32_t)value;
+  } else {
+    arg.type = LOG_ARG_UINT;
+    arg.u = (uint32_t)value;
+  }
+  return arg;
+}
+
+static inline log_arg_t log_arg(const char *value) {
+  log_arg_t arg;
+  arg.type = LOG_ARG_STR;
+  arg.s = value;
+  return arg;
+}
+
+static inline log_arg_t log_arg(char *value) {
+  return log_arg((const char *)value);
+}
+
+template <typename... Args>
+static inline void log_write(uint8_t level, log_site_t *site,
+    const char *format, Args... args) {
+  static_assert(sizeof...(args) <= LOG_MAX_ARGS, "too many log arguments");
+  uint16_t suppressed = 0;
+  if (!log_allow(site, &suppressed)) {
+    return;
+  }
+  const log_arg_t packed[sizeof...(args) + 1] = {log_arg(args)...};
+  log_push(level, format, packed, sizeof...(args), suppressed);
+}
+
+// Stripped levels still type-check their arguments, without evaluating them
+template <typename... Args>
+static inline int log_discard(const char *format, Args... args) {
+  return sizeof(format) + sizeof...(args);
+}
+
+#define LOG_STRIPPED(...)                   \
+  do {                                      \
+    (void)sizeof(log_discard(__VA_ARGS__)); \
+  } while (0)
+
+#define LOG_AT(level, ...)                       \
+  do {                                           \
+    static log_site_t log_site_;                 \
+    log_write((level), &log_site_, __VA_ARGS__); \
+  } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) LOG_STRIPPED(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) LOG_STRIPPED(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) LOG_STRIPPED(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_STRIPPED(__VA_ARGS__)
+#endif
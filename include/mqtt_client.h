@@ -0,0 +1,246 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt_transport.h"
+
+/*
+ * Non-blocking MQTT 3.1.1 client
+ *
+ * Nothing here waits on the network. The MQTT FSM opens the connection,
+ * sends CONNECT once the transport is up and then calls mqtt_client_poll()
+ * from its ticks, which reports how the handshake went, hands inbound
+ * messages to the callback and keeps the session alive with PINGREQs.
+ * Outbound packets are queued in a fixed buffer and written as the socket
+ * takes them, so a publish fails instead of stalling when it is full.
+ *
+ * QoS 1 publishes don't wait for each other's PUBACK: up to a window of
+ * them are outstanding at once. A copy of each is held until the broker
+ * acknowledges it and sent again, flagged DUP, if the PUBACK is late.
+ * Acknowledgements are reported in publish order. When the connection
+ * drops the held copies are discarded; the caller still has the data and
+ * publishes it again once reconnected.
+ */
+
+#define MQTT_CLIENT_TX_LEN 1024
+#define MQTT_CLIENT_RX_LEN 256  // larger inbound packets are skipped
+#define MQTT_CLIENT_TOPIC_LEN 96
+#define MQTT_CLIENT_WINDOW_MAX 16
+#define MQTT_CLIENT_HELD_LEN 4096  // unacknowledged QoS 1 packets
+
+typedef enum {
+  MQTT_CLIENT_EVENT_NONE,
+  MQTT_CLIENT_EVENT_OPEN,     // transport is up, send CONNECT
+  MQTT_CLIENT_EVENT_CONNACK,  // broker accepted the session
+  MQTT_CLIENT_EVENT_REFUSED,  // broker refused it, see return_code
+  MQTT_CLIENT_EVENT_LOST,     // connection failed, closed or went quiet
+} mqtt_client_event_t;
+
+typedef enum {
+  MQTT_CLIENT_CLOSED,
+  MQTT_CLIENT_OPENING,
+  MQTT_CLIENT_OPEN,  // CONNECT sent or about to be
+  MQTT_CLIENT_CONNECTED,
+} mqtt_client_state_t;
+
+typedef void (*mqtt_message_fn)(
+    const char *topic, const uint8_t *payload, size_t len);
+// Called with the tag given to mqtt_client_publish_qos1()
+typedef void (*mqtt_ack_fn)(uint16_t tag);
+
+typedef struct mqtt_client_stats {
+  uint32_t pings;
+  uint32_t ping_timeouts;
+  uint32_t skipped;  // inbound packets too large for the receive buffer
+                     // or with too long a topic, QoS 1 ones still PUBACKed
+  uint32_t acked;
+  uint32_t retransmits;
+} mqtt_client_stats_t;
+
+typedef struct mqtt_client_inflight {
+  uint16_t packet_id;
+  uint16_t len;  // of the PUBLISH in held[]
+  uint16_t tag;
+  bool acked;
+  uint32_t sent_ms;
+} mqtt_client_inflight_t;
+
+typedef struct mqtt_client {
+  const mqtt_transport_t *transport;
+  const char *client_id;
+  mqtt_message_fn on_message;
+  mqtt_ack_fn on_ack;
+  mqtt_client_state_t state;
+  uint32_t keepalive_ms;
+  uint32_t now_ms;  // as of the last poll
+  uint32_t last_tx_ms;
+  uint32_t last_rx_ms;
+  uint32_t ping_sent_ms;
+  bool ping_pending;
+  bool session_present;
+  uint8_t return_code;  // of the last CONNACK
+  uint16_t next_packet_id;
+  uint8_t tx[MQTT_CLIENT_TX_LEN];
+  uint16_t tx_len;
+  uint8_t rx[MQTT_CLIENT_RX_LEN];
+  uint16_t rx_len;
+  uint32_t rx_skip;  // bytes left of a packet being skipped
+  bool rx_skip_ack;  // it's a QoS 1 PUBLISH, acknowledged all the same
+  uint32_t rx_skip_id_at;  // bytes left before its packet ID
+  uint8_t window;
+  uint32_t retry_ms;
+  mqtt_client_inflight_t inflight[MQTT_CLIENT_WINDOW_MAX];  // oldest first
+  uint8_t inflight_count;
+  uint8_t held[MQTT_CLIENT_HELD_LEN];  // their packets, back to back
+  uint16_t held_len;
+  mqtt_client_stats_t stats;
+} mqtt_client_t;
+
+/**
+ * @brief Initialize a closed client
+ *
+ * @param client the client
+ * @param transport the byte stream to run over
+ * @param client_id identifies the session to the broker, must outlive it
+ * @param on_message called from mqtt_client_poll() for every inbound
+ * PUBLISH
+ */
+void mqtt_client_init(mqtt_client_t *client, const mqtt_transport_t *transport,
+    const char *client_id, mqtt_message_fn on_message);
+
+/**
+ * @brief Configure QoS 1 publishing
+ *
+ * @param client the client
+ * @param window most PUBLISHes awaiting a PUBACK, up to
+ * MQTT_CLIENT_WINDOW_MAX
+ * @param retry_ms how long to wait for a PUBACK before sending again
+ * @param on_ack called from mqtt_client_poll() as publishes are
+ * acknowledged, in publish order
+ */
+void mqtt_client_set_window(mqtt_client_t *client, uint8_t window,
+    uint32_t retry_ms, mqtt_ack_fn on_ack);
+
+/**
+ * @brief Start connecting to the broker, closing any previous connection
+ *
+ * mqtt_client_poll() reports MQTT_CLIENT_EVENT_OPEN once the transport is
+ * up.
+ *
+ * @param client the client
+ * @param host broker name or address
+ * @param port broker port
+ * @param now_ms current time
+ * @return true if connecting started, false if it failed straight away
+ */
+bool mqtt_client_open(
+    mqtt_client_t *client, const char *host, uint16_t port, uint32_t now_ms);
+
+/**
+ * @brief Send CONNECT on an open transport
+ *
+ * @param client the client
+ * @param keepalive_s longest silence the broker tolerates, 0 to disable
+ * @param clean_session false to resume the broker's stored session
+ * @return true if queued
+ */
+bool mqtt_client_connect(
+    mqtt_client_t *client, uint16_t keepalive_s, bool clean_session);
+
+/**
+ * @brief Send what is queued, read what arrived and service the keepalive
+ *
+ * Call at least twice per keepalive period. Returns at most one event; a
+ * CONNACK leaves anything after it for the next poll.
+ *
+ * @param client the client
+ * @param now_ms current time
+ * @return mqtt_client_event_t what happened to the connection, if anything
+ */
+mqtt_client_event_t mqtt_client_poll(mqtt_client_t *client, uint32_t now_ms);
+
+/**
+ * @brief Queue a QoS 0 PUBLISH
+ *
+ * @param client the client
+ * @param topic the topic
+ * @param payload the payload
+ * @param len bytes of payload
+ * @return true if queued, false if not connected or the buffer is full
+ */
+bool mqtt_client_publish(mqtt_client_t *client, const char *topic,
+    const uint8_t *payload, size_t len);
+
+/**
+ * @brief Queue a QoS 1 PUBLISH and hold a copy until it is acknowledged
+ *
+ * @param client the client
+ * @param topic the topic
+ * @param payload the payload
+ * @param len bytes of payload
+ * @param tag handed back to the on_ack callback
+ * @return true if queued, false if not connected or the window or a
+ * buffer is full
+ */
+bool mqtt_client_publish_qos1(mqtt_client_t *client, const char *topic,
+    const uint8_t *payload, size_t len, uint16_t tag);
+
+/**
+ * @brief Number of QoS 1 publishes that can be queued before the window
+ * is full
+ *
+ * @param client the client
+ * @return uint8_t free slots in the window
+ */
+uint8_t mqtt_client_window_free(const mqtt_client_t *client);
+
+/**
+ * @brief Encoded size of a QoS 1 PUBLISH
+ *
+ * @param topic the topic
+ * @param len bytes of payload
+ * @return uint32_t bytes it takes in the send and held buffers
+ */
+uint32_t mqtt_client_qos1_size(const char *topic, size_t len);
+
+/**
+ * @brief Check that a group of QoS 1 publishes would all be queued now
+ *
+ * For messages that only make sense together, so that none goes out if a
+ * later one wouldn't.
+ *
+ * @param client the client
+ * @param count number of publishes
+ * @param size their mqtt_client_qos1_size() added up
+ * @return true if connected and the window and both buffers have room
+ */
+bool mqtt_client_qos1_fits(
+    const mqtt_client_t *client, uint8_t count, uint32_t size);
+
+/**
+ * @brief Queue a SUBSCRIBE for one topic filter
+ *
+ * @param client the client
+ * @param topic the topic filter
+ * @param qos highest QoS to receive at, 0 or 1
+ * @return true if queued
+ */
+bool mqtt_client_subscribe(mqtt_client_t *client, const char *topic,
+    uint8_t qos);
+
+/**
+ * @brief Send DISCONNECT if connected and close the transport
+ *
+ * @param client the client
+ */
+void mqtt_client_close(mqtt_client_t *client);
+
+/**
+ * @brief Check whether the broker accepted the session
+ *
+ * @param client the client
+ * @return true between the CONNACK and the connection's loss
+ */
+bool mqtt_client_connected(const mqtt_client_t *client);
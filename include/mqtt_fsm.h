@@ -1,11 +1,25 @@
 #pragma once
 
 #include "fsm.h"
+#include "sample_queue.h"
+#include "scheduler.h"
+#include "sensor_link.h"
+
+#define MQTT_SAMPLE_QUEUE_SIZE 720  // one hour of 5 s samples
+#define MQTT_BATCH_SIZE 12          // samples per <host>/batch message
 
 typedef enum {
   MQTT_EVENT_START = FSM_GLOBAL_EVENT_COUNT,
   MQTT_EVENT_STOP,
   MQTT_EVENT_UNAVAILABLE,
+  MQTT_EVENT_OCCUPANCY,  // occupancy changed, publish the pushed reading now
+  MQTT_EVENT_OPEN,       // TCP connection is up, send CONNECT
+  MQTT_EVENT_CONNACK,    // broker accepted the session
+  MQTT_EVENT_LOST,       // connection failed, was refused or went quiet
+  MQTT_EVENT_RETRY,      // reconnect backoff expired
+  MQTT_EVENT_POLL,       // check on the handshake between ticks
+  MQTT_EVENT_COMMAND,    // a message arrived on <host>/cmd
+  MQTT_EVENT_COUNT,
 } mqtt_event_t;
 
 /**
@@ -23,6 +37,36 @@ fsm_err_t mqtt_fsm_init(void);
  */
 fsm_err_t mqtt_fsm_send(fsm_event event);
 
+/**
+ * @brief Send an event to the MQTT state machine from another task
+ *
+ * Lock-free lane of fsm_send_from_isr(), only one task (the sensor FSMs'
+ * one) may use it.
+ *
+ * @param event The specific event
+ * @return fsm_err_t FSM_ERR_OK on success, FSM_ERR_FULL if the lane is full
+ */
+fsm_err_t mqtt_fsm_send_from_isr(fsm_event event);
+
+/**
+ * @brief Hand a snapshot of the sensor readings to the MQTT state machine
+ *
+ * Called by the sensor FSMs' task only, see sensor_link.h. The MQTT state
+ * machine publishes the newest snapshot on its next tick.
+ *
+ * @param reading the readings to copy
+ * @return true if queued, false if the MQTT state machine fell behind
+ */
+bool mqtt_fsm_push_reading(const sensor_reading_t *reading);
+
+/**
+ * @brief Register the periodic events the MQTT state machine handles
+ *
+ * @param scheduler the scheduler delivering periodic events
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t mqtt_fsm_schedule(scheduler_t *scheduler);
+
 /**
  * @brief Handle any pending events in the MQTT state machine
  *
@@ -30,4 +74,20 @@ fsm_err_t mqtt_fsm_send(fsm_event event);
  */
 fsm_err_t mqtt_fsm_handle_event(void);
 
-/* fsm_err_t mqtt_fsm_queue_msg(const char topic[20], const char val[20]); */
\ No newline at end of file
+/**
+ * @brief Get the event queue counters of the MQTT state machine
+ *
+ * @param stats filled with the high-water mark and drop counters
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t mqtt_fsm_get_queue_stats(fsm_queue_stats_t *stats);
+
+/**
+ * @brief Get the high-water mark, drop and push counters of the sample queue
+ *
+ * Samples are queued while the broker is unreachable and drained in batches
+ * once it is back.
+ *
+ * @param stats filled with the current counters
+ */
+void mqtt_fsm_get_sample_stats(sample_queue_stats_t *stats);
\ No newline at end of file
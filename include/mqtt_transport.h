@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Byte stream under the MQTT client
+ *
+ * None of the calls may block: opening only starts the connection and the
+ * client polls for the outcome, and reads and writes move what fits right
+ * now. tcp_transport() is the one used on the device.
+ */
+
+typedef struct mqtt_transport {
+  /**
+   * @brief Start connecting
+   *
+   * @return false if it failed straight away
+   */
+  bool (*open)(void *ctx, const char *host, uint16_t port);
+  /**
+   * @brief Check on a connection started with open()
+   *
+   * @return int 1 once connected, 0 while connecting, -1 if it failed
+   */
+  int (*poll_open)(void *ctx);
+  /**
+   * @return int bytes taken, 0 if the send buffer is full, -1 if the
+   * connection is gone
+   */
+  int (*write)(void *ctx, const uint8_t *data, size_t len);
+  /**
+   * @return int bytes read, 0 if nothing arrived, -1 if the connection is
+   * gone
+   */
+  int (*read)(void *ctx, uint8_t *data, size_t len);
+  void (*close)(void *ctx);
+  void *ctx;
+} mqtt_transport_t;
+
+/**
+ * @brief Non-blocking TCP over the lwIP socket API
+ *
+ * There is a single socket. The broker's name is resolved on the first
+ * open() and cached, so only that one can block on DNS; an IP address
+ * never does.
+ *
+ * @return const mqtt_transport_t* the transport
+ */
+const mqtt_transport_t *tcp_transport(void);
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On-device occupancy statistics
+ *
+ * Folds the occupied/empty state into hour buckets: seconds occupied,
+ * visits started and a histogram of how long the visits that ended lasted.
+ * The last OCCUPANCY_HOURS closed hours are kept in a ring, so a summary
+ * covers a day even if a few were missed. There is no wall clock on the
+ * device, so hours count from boot and summaries list them newest first.
+ */
+
+#define OCCUPANCY_HOURS 24
+#define OCCUPANCY_HOUR_MS (60UL * 60 * 1000)
+#define OCCUPANCY_DWELL_BINS 8  // < 1, 5, 15, 30, 60 min, 2, 4 h, longer
+// {"occ":[24 x 3600],"visits":[24 x 65535],"dwell":[8 x 24 * 65535]} at
+// worst, room for a comma after every number and the terminator
+#define OCCUPANCY_SUMMARY_LEN                                  \
+  (sizeof("{\"occ\":[],\"visits\":[],\"dwell\":[]}") +          \
+      OCCUPANCY_HOURS * (4 + 1) + OCCUPANCY_HOURS * (5 + 1) + \
+      OCCUPANCY_DWELL_BINS * (7 + 1))
+
+typedef struct occupancy_hour {
+  uint16_t occupied_s;
+  uint16_t visits;
+  uint16_t dwell[OCCUPANCY_DWELL_BINS];
+} occupancy_hour_t;
+
+typedef struct occupancy {
+  occupancy_hour_t hours[OCCUPANCY_HOURS];  // ring of closed hours
+  uint8_t newest;     // index of the most recently closed hour
+  uint8_t num_hours;  // closed hours in the ring
+  occupancy_hour_t open;
+  uint32_t open_start_ms;
+  uint32_t open_occupied_ms;
+  uint32_t last_update_ms;
+  uint32_t visit_start_ms;
+  bool occupied;
+  bool report_pending;  // an hour closed since the last summary
+} occupancy_t;
+
+/**
+ * @brief Start accumulating, with the room empty
+ *
+ * @param occupancy the accumulator
+ * @param now_ms current time
+ */
+void occupancy_init(occupancy_t *occupancy, uint32_t now_ms);
+
+/**
+ * @brief Account for the time since the previous update
+ *
+ * Call whenever the state changes and at least every few seconds, so that
+ * hours close on time.
+ *
+ * @param occupancy the accumulator
+ * @param occupied whether the room is occupied from now on
+ * @param now_ms current time
+ */
+void occupancy_update(occupancy_t *occupancy, bool occupied, uint32_t now_ms);
+
+/**
+ * @brief Check for and clear a pending summary
+ *
+ * @param occupancy the accumulator
+ * @return true once after each hour that closed
+ */
+bool occupancy_take_report(occupancy_t *occupancy);
+
+/**
+ * @brief Format the closed hours as JSON, newest first
+ *
+ * {"occ":[<occupied s>,..],"visits":[<visits>,..],"dwell":[<bin>,..]}
+ * with dwell summed over all the hours in the ring.
+ *
+ * @param occupancy the accumulator
+ * @param buf destination, OCCUPANCY_SUMMARY_LEN bytes
+ * @param len size of buf
+ * @return size_t length of the text, 0 if buf is too small
+ */
+size_t occupancy_format_summary(
+    const occupancy_t *occupancy, char *buf, size_t len);
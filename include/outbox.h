@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sample_queue.h"
+
+/*
+ * Flash-backed copy of the samples waiting for the broker
+ *
+ * The MQTT FSM keeps its samples in a RAM queue until their PUBACK comes
+ * back. The outbox mirrors that queue as an append-only log in the
+ * "outbox" data partition (see partitions.csv), so a reboot in the middle
+ * of an outage doesn't lose the backlog. Every queued sample is appended
+ * as a 16 byte record and marked consumed in place once delivered, which
+ * only clears bits; a sector is erased when the log wraps around to it.
+ *
+ * There is no wall clock, so samples restored after a reboot keep their
+ * spacing but are dated as if the newest was taken at boot. Their ages
+ * leave out however long the device was down.
+ */
+
+typedef struct outbox_stats {
+  uint16_t restored;  // samples found in flash at boot
+  uint32_t erases;
+  uint32_t write_errors;
+} outbox_stats_t;
+
+typedef void (*outbox_restore_fn)(const sample_t *sample);
+
+/**
+ * @brief Find the partition and hand back the samples left in it
+ *
+ * @param capacity the RAM queue's capacity, older records are dropped
+ * like the queue drops them
+ * @param restore called for every pending sample, oldest first
+ * @return true if the outbox is usable, false if there is no partition or
+ * it is too small for capacity
+ */
+bool outbox_init(uint16_t capacity, outbox_restore_fn restore);
+
+/**
+ * @brief Append a sample just pushed onto the RAM queue
+ *
+ * @param sample the sample
+ */
+void outbox_append(const sample_t *sample);
+
+/**
+ * @brief Mark the n oldest samples delivered
+ *
+ * @param n number of samples popped from the RAM queue
+ */
+void outbox_consume(uint16_t n);
+
+/**
+ * @brief Get the outbox statistics
+ *
+ * @param stats where to copy them
+ */
+void outbox_get_stats(outbox_stats_t *stats);
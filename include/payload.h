@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sample_queue.h"
+
+#define PAYLOAD_INT_LEN 12  // "-2147483648" plus the terminator
+#define PAYLOAD_JSON_LEN 48  // {"t":-32768,"h":-32768,"o":1,"age":4294967295}
+#define PAYLOAD_BINARY_LEN 10
+#define PAYLOAD_BINARY_VERSION 1
+
+/*
+ * Allocation-free encoders for MQTT payloads
+ *
+ * Everything is written into caller provided buffers, so publishing never
+ * touches the heap. Every function returns the payload length excluding the
+ * terminator, or 0 if the buffer is too small.
+ */
+
+/**
+ * @brief Format a signed integer as decimal text
+ *
+ * @param buf destination, at least PAYLOAD_INT_LEN bytes for any value
+ * @param len size of buf
+ * @param value the value
+ * @return size_t length of the text
+ */
+size_t payload_format_int(char *buf, size_t len, int32_t value);
+
+/**
+ * @brief Format an unsigned integer as decimal text
+ *
+ * @param buf destination, at least PAYLOAD_INT_LEN bytes for any value
+ * @param len size of buf
+ * @param value the value
+ * @return size_t length of the text
+ */
+size_t payload_format_uint(char *buf, size_t len, uint32_t value);
+
+/**
+ * @brief Format a fixed-point value as decimal text
+ *
+ * @param buf destination
+ * @param len size of buf
+ * @param value the value scaled by 10^decimals, e.g. 725 for 72.5
+ * @param decimals number of fractional digits, 0 to 4
+ * @return size_t length of the text
+ */
+size_t payload_format_fixed(
+    char *buf, size_t len, int32_t value, uint8_t decimals);
+
+/**
+ * @brief A flat JSON object built in a caller provided buffer
+ *
+ * Room for the closing braces is kept back, so a field either fits whole
+ * or leaves the document as it was and returns false.
+ */
+typedef struct payload_json {
+  char *buf;
+  size_t len;
+  size_t pos;
+  uint8_t depth;  // objects still open
+  bool first;     // no field in the innermost object yet
+} payload_json_t;
+
+/**
+ * @brief Start a JSON document, the outermost object
+ *
+ * @param json the document
+ * @param buf destination
+ * @param len size of buf
+ */
+void payload_json_begin(payload_json_t *json, char *buf, size_t len);
+
+/**
+ * @brief Add "<key>":<value>
+ *
+ * @param json the document
+ * @param key the field name, not escaped
+ * @param value the value
+ * @return bool false if the field didn't fit
+ */
+bool payload_json_uint(payload_json_t *json, const char *key, uint32_t value);
+
+/**
+ * @brief Add "<key>":<value> with a fixed-point value, see
+ * payload_format_fixed()
+ *
+ * @return bool false if the field didn't fit
+ */
+bool payload_json_fixed(payload_json_t *json, const char *key, int32_t value,
+    uint8_t decimals);
+
+/**
+ * @brief Add "<key>":[<values>...]
+ *
+ * @return bool false if the field didn't fit
+ */
+bool payload_json_uints(payload_json_t *json, const char *key,
+    const uint32_t *values, size_t count);
+
+/**
+ * @brief Open "<key>":{, fields go into it until payload_json_close()
+ *
+ * @return bool false if the object didn't fit
+ */
+bool payload_json_open(payload_json_t *json, const char *key);
+
+/**
+ * @brief Close the innermost object opened by payload_json_open()
+ */
+void payload_json_close(payload_json_t *json);
+
+/**
+ * @brief Close every open object
+ *
+ * @param json the document
+ * @return size_t length of the JSON text, 0 if the buffer was too small for
+ * even an empty object
+ */
+size_t payload_json_end(payload_json_t *json);
+
+/**
+ * @brief Encode all readings of a sample as one compact JSON object
+ *
+ * {"t":<temperature>,"h":<humidity>,"o":<0|1>,"age":<ms>}
+ *
+ * @param buf destination, PAYLOAD_JSON_LEN bytes
+ * @param len size of buf
+ * @param sample the sample
+ * @param age_ms age of the sample at publish time
+ * @return size_t length of the JSON text
+ */
+size_t payload_encode_json(
+    char *buf, size_t len, const sample_t *sample, uint32_t age_ms);
+
+/**
+ * @brief Encode all readings of a sample as a little-endian binary record
+ *
+ * version:u8 flags:u8 (bit 0 occupied) temperature:i16 humidity:i16
+ * age_ms:u32
+ *
+ * @param buf destination, PAYLOAD_BINARY_LEN bytes
+ * @param len size of buf
+ * @param sample the sample
+ * @param age_ms age of the sample at publish time
+ * @return size_t PAYLOAD_BINARY_LEN
+ */
+size_t payload_encode_binary(
+    uint8_t *buf, size_t len, const sample_t *sample, uint32_t age_ms);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifndef POWER_LIGHT_SLEEP
+#define POWER_LIGHT_SLEEP 0
+#endif
+
+typedef struct power_stats {
+  uint32_t active_ms;  // running handlers
+  uint32_t idle_ms;    // waiting in delay()
+  uint32_t sleep_ms;   // in light sleep
+  uint32_t sleep_count;
+  uint32_t pin_wakeups;
+} power_stats_t;
+
+/**
+ * @brief Enable Wi-Fi modem sleep and configure the light-sleep wake pin
+ *
+ * Must be called after the Wi-Fi station has been started.
+ *
+ * @param wake_pin RTC capable GPIO that wakes the CPU when it goes high
+ * @param on_wake called from the loop after the wake pin ended a sleep
+ */
+void power_init(uint8_t wake_pin, void (*on_wake)(void));
+
+/**
+ * @brief Idle until the next deadline
+ *
+ * Enters light sleep when built with POWER_LIGHT_SLEEP and the wait is long
+ * enough to be worth it, otherwise falls back to delay(). With DUAL_CORE
+ * each FSM task blocks on its task notification instead and the counters
+ * are kept per core; POWER_LIGHT_SLEEP is ignored since the other core may
+ * still be busy.
+ *
+ * @param duration_ms time until the next scheduled work
+ */
+void power_idle(uint32_t duration_ms);
+
+/**
+ * @brief Make the current or next power_idle() return early
+ *
+ * Safe to call from an ISR that queued work for the loop. Light sleep is
+ * left by the wake pin instead. With DUAL_CORE every idling FSM task is
+ * woken, which also makes it usable for work handed to the other core.
+ */
+void power_wake(void);
+
+/**
+ * @brief Get the cumulative active/idle/sleep counters
+ *
+ * With DUAL_CORE these are summed over both cores.
+ *
+ * @param stats filled with the counters since boot
+ */
+void power_get_stats(power_stats_t *stats);
+
+/**
+ * @brief Active time as a percentage of the time since the previous call
+ *
+ * @return uint8_t duty cycle in percent
+ */
+uint8_t power_take_duty_cycle(void);
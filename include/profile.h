@@ -0,0 +1,114 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FSM_PROFILE
+#define FSM_PROFILE 0
+#endif
+
+/*
+ * Cycle-count profiling of FSM handlers and loop phases
+ *
+ * Built with FSM_PROFILE, fsm_handle_event() times every entry, exit and
+ * transition function and loop() times each of its phases. Each one gets a
+ * slot in a fixed table with count, min, max, total and a histogram of
+ * decades; the MQTT diagnostics take and publish the slots every minute.
+ * Without FSM_PROFILE none of this is compiled in.
+ */
+
+#define PROFILE_MAX_SLOTS 64
+#define PROFILE_NUM_BUCKETS 6  // <10us, <100us, <1ms, <10ms, <100ms, longer
+#define PROFILE_NAME_LEN 24    // "mqtt/s255/e8191"
+#define PROFILE_NUM_FIELDS (4 + PROFILE_NUM_BUCKETS)
+#define PROFILE_CYCLES_PER_US (F_CPU / 1000000)
+
+typedef enum {
+  PROFILE_KIND_ENTRY = 1,
+  PROFILE_KIND_EXIT,
+  PROFILE_KIND_TRANSITION,
+  PROFILE_KIND_LOOP,
+} profile_kind_t;
+
+typedef enum {
+  PROFILE_LOOP_OTA,
+  PROFILE_LOOP_SCHEDULER,
+  PROFILE_LOOP_EVENTS,
+  PROFILE_LOOP_BUSY,  // all of the above, the part of loop() that isn't idle
+} profile_loop_phase_t;
+
+typedef struct profile_entry {
+  uint32_t key;  // 0 for an unused slot
+  uint32_t count;
+  uint32_t min_cycles;
+  uint32_t max_cycles;
+  uint64_t total_cycles;
+  uint16_t buckets[PROFILE_NUM_BUCKETS];
+} profile_entry_t;
+
+#if FSM_PROFILE
+#define PROFILE_START(start) uint32_t start = ESP.getCycleCount()
+#define PROFILE_END(key, start) \
+  profile_record((key), ESP.getCycleCount() - (start))
+#else
+#define PROFILE_START(start)
+#define PROFILE_END(key, start)
+#endif
+
+#define PROFILE_LOOP_KEY(phase) profile_key(0, PROFILE_KIND_LOOP, (phase), 0)
+
+/**
+ * @brief Pack what was timed into a slot key
+ *
+ * @param fsm_id ID from fsm_set_name(), 0 for loop phases
+ * @param kind entry, exit, transition or loop phase
+ * @param state the state the handler belongs to, or the loop phase
+ * @param event the event being handled, only the low 13 bits are kept
+ * @return uint32_t non-zero key
+ */
+static inline uint32_t profile_key(
+    uint8_t fsm_id, profile_kind_t kind, uint16_t state, uint16_t event) {
+  return ((uint32_t)fsm_id << 24) | ((uint32_t)kind << 21) |
+         ((uint32_t)(state & 0xFF) << 13) | (event & 0x1FFF);
+}
+
+/**
+ * @brief Add one measurement to the key's slot
+ *
+ * @param key from profile_key()
+ * @param cycles CPU cycles spent
+ */
+void profile_record(uint32_t key, uint32_t cycles);
+
+/**
+ * @brief Copy a slot and reset its counters for the next period
+ *
+ * @param slot 0 to PROFILE_MAX_SLOTS - 1
+ * @param entry filled with the slot's counters
+ * @return true if the slot recorded anything since the last take
+ */
+bool profile_take(uint8_t slot, profile_entry_t *entry);
+
+/**
+ * @brief Number of measurements dropped because every slot was taken
+ */
+uint32_t profile_overflows(void);
+
+/**
+ * @brief Format a readable name for a key, e.g. "wifi/s3/e6" or "loop/ota"
+ *
+ * @param buf destination, PROFILE_NAME_LEN bytes
+ * @param len size of buf
+ * @param key the slot key
+ * @return size_t length of the name
+ */
+size_t profile_format_name(char *buf, size_t len, uint32_t key);
+
+/**
+ * @brief Flatten a slot to count, min, avg, max, <buckets...>, times in us
+ *
+ * @param fields destination, PROFILE_NUM_FIELDS values
+ * @param entry the slot
+ */
+void profile_entry_fields(uint32_t *fields, const profile_entry_t *entry);
@@ -1,11 +1,24 @@
 #pragma once
 
+#include <stddef.h>
+
 #include "fsm.h"
+#include "scheduler.h"
+
+#define PROX_INPUT 35
+
+typedef struct prox_stats {
+  uint32_t edges;           // PIR edges handled, debounced ones included
+  uint32_t latency_max_us;  // PIR edge to its handler, worst one
+} prox_stats_t;
 
 typedef enum {
   PROX_EVENT_START = FSM_GLOBAL_EVENT_COUNT,
   PROX_EVENT_STOP,
   PROX_EVENT_UNAVAILABLE,
+  PROX_EVENT_MOTION,
+  PROX_EVENT_VACANCY_CHECK,
+  PROX_EVENT_COUNT,
 } prox_event_t;
 
 /**
@@ -23,6 +36,14 @@ fsm_err_t prox_fsm_init(void);
  */
 fsm_err_t prox_fsm_send(fsm_event event);
 
+/**
+ * @brief Register the periodic events the Proximity state machine handles
+ *
+ * @param scheduler the scheduler delivering periodic events
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t prox_fsm_schedule(scheduler_t *scheduler);
+
 /**
  * @brief Handle any pending events in the Proximity state machine
  *
@@ -30,5 +51,54 @@ fsm_err_t prox_fsm_send(fsm_event event);
  */
 fsm_err_t prox_fsm_handle_event(void);
 
+/**
+ * @brief Get the event queue counters of the Proximity state machine
+ *
+ * @param stats filled with the high-water mark and drop counters
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t prox_fsm_get_queue_stats(fsm_queue_stats_t *stats);
+
+/**
+ * @brief Get the PIR edge counters of the Proximity state machine
+ *
+ * @param stats filled with the counters since boot
+ */
+void prox_fsm_get_stats(prox_stats_t *stats);
+
 void prox_set_IRQ(bool enable);
-bool get_prox(void);
\ No newline at end of file
+
+/**
+ * @brief Report motion that happened while the PIR interrupt couldn't run
+ *
+ * Used after the PIR pin woke the CPU from light sleep.
+ */
+void prox_notify_motion(void);
+
+bool get_prox(void);
+
+/**
+ * @brief Call on_change from the loop whenever get_prox() changes
+ *
+ * @param on_change e.g. a function waking the MQTT state machine
+ */
+void prox_fsm_on_change(void (*on_change)(void));
+
+/**
+ * @brief Time of the PIR edge that made the room occupied
+ *
+ * @return uint32_t micros() at the edge
+ */
+uint32_t prox_get_occupied_edge_us(void);
+
+/**
+ * @brief Get the occupancy summary once per closed hour
+ *
+ * See occupancy_format_summary() for the format. The summary is formatted
+ * on the prox FSM's 5 s tick, so this is safe to call from another task.
+ *
+ * @param buf destination, OCCUPANCY_SUMMARY_LEN bytes
+ * @param len size of buf
+ * @return size_t length of the summary, 0 if there is nothing new
+ */
+size_t prox_take_occupancy_summary(char *buf, size_t len);
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct sample {
+  uint32_t timestamp_ms;
+  int16_t temperature;
+  int16_t humidity;
+  bool occupied;
+} sample_t;
+
+typedef struct sample_queue_stats {
+  uint16_t high_water_mark;
+  uint32_t dropped;
+  uint32_t queued;  // every sample pushed, dropped ones included
+} sample_queue_stats_t;
+
+typedef struct sample_queue {
+  sample_t *buffer;
+  uint16_t capacity;
+  uint16_t head;
+  uint16_t count;
+  sample_queue_stats_t stats;
+} sample_queue_t;
+
+/**
+ * @brief Initialize a fixed-size sample queue over caller provided storage
+ *
+ * @param queue the queue
+ * @param buffer storage for capacity samples
+ * @param capacity number of samples the queue can hold
+ */
+void sample_queue_init(
+    sample_queue_t *queue, sample_t *buffer, uint16_t capacity);
+
+/**
+ * @brief Append a sample, overwriting the oldest one when full
+ *
+ * Keeping the newest data is what matters after a long outage.
+ *
+ * @param queue the queue
+ * @param sample the sample to copy in
+ * @return true if it fit, false if the oldest sample was dropped
+ */
+bool sample_queue_push(sample_queue_t *queue, const sample_t *sample);
+
+/**
+ * @brief Copy up to max of the oldest samples without removing them
+ *
+ * @param queue the queue
+ * @param samples destination array
+ * @param max size of the destination array
+ * @return uint16_t number of samples copied
+ */
+uint16_t sample_queue_peek(
+    const sample_queue_t *queue, sample_t *samples, uint16_t max);
+
+/**
+ * @brief Copy up to max samples, skipping the first oldest ones
+ *
+ * For reading past samples that are already on their way to the broker.
+ *
+ * @param queue the queue
+ * @param first number of oldest samples to skip
+ * @param samples destination array
+ * @param max size of the destination array
+ * @return uint16_t number of samples copied
+ */
+uint16_t sample_queue_peek_from(const sample_queue_t *queue, uint16_t first,
+    sample_t *samples, uint16_t max);
+
+/**
+ * @brief Remove the n oldest samples, after they have been delivered
+ *
+ * @param queue the queue
+ * @param n number of samples to remove
+ */
+void sample_queue_pop(sample_queue_t *queue, uint16_t n);
+
+/**
+ * @brief Number of samples in the queue
+ *
+ * @param queue the queue
+ * @return uint16_t number of samples
+ */
+uint16_t sample_queue_count(const sample_queue_t *queue);
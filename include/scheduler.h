@@ -0,0 +1,96 @@
+#pragma once
+
+#include "fsm.h"
+
+#define SCHEDULER_MAX_TIMERS 16
+
+typedef fsm_err_t (*scheduler_send_fn)(fsm_event event);
+
+typedef struct scheduler_timer {
+  uint32_t deadline_ms;
+  uint32_t period_ms;  // 0 for one-shot timers
+  fsm_event event;
+  scheduler_send_fn send;
+} scheduler_timer_t;
+
+typedef struct scheduler {
+  scheduler_timer_t heap[SCHEDULER_MAX_TIMERS];  // min-heap on deadline_ms
+  uint8_t num_timers;
+  uint32_t epoch_ms;
+  uint32_t last_dispatch_ms;  // one-shots are relative to this
+  uint32_t missed_periods;
+} scheduler_t;
+
+/**
+ * @brief Initialize a deadline scheduler
+ *
+ * @param scheduler the scheduler
+ * @param now_ms current time, used as the first deadline of every timer
+ */
+void scheduler_init(scheduler_t *scheduler, uint32_t now_ms);
+
+/**
+ * @brief Register a periodic event
+ *
+ * @param scheduler the scheduler
+ * @param event the event to send when the period expires
+ * @param period_ms period in milliseconds
+ * @param send function delivering the event to its state machine
+ * @return fsm_err_t FSM_ERR_OK on success, FSM_ERR_FULL if out of timers
+ */
+fsm_err_t scheduler_add(scheduler_t *scheduler, fsm_event event,
+    uint32_t period_ms, scheduler_send_fn send);
+
+/**
+ * @brief Register an event sent once
+ *
+ * The delay counts from the last scheduler_dispatch(), or from the epoch
+ * before the first one, so handlers woken by the scheduler can use it to
+ * arm a follow-up.
+ *
+ * @param scheduler the scheduler
+ * @param event the event to send when the delay expires
+ * @param delay_ms delay in milliseconds
+ * @param send function delivering the event to its state machine
+ * @return fsm_err_t FSM_ERR_OK on success, FSM_ERR_FULL if out of timers
+ */
+fsm_err_t scheduler_add_oneshot(scheduler_t *scheduler, fsm_event event,
+    uint32_t delay_ms, scheduler_send_fn send);
+
+/**
+ * @brief Register the global periodic events a state machine handles
+ *
+ * Only FSM_PERIODIC_EVENT_* events with at least one transition in the
+ * machine are registered, so machines don't wake up for ticks they ignore.
+ *
+ * @param scheduler the scheduler
+ * @param state_machine the handle for the state machine
+ * @param send function delivering the event to the state machine
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t scheduler_add_periodic(scheduler_t *scheduler,
+    const fsm_handle_t *state_machine, scheduler_send_fn send);
+
+/**
+ * @brief Send every event whose deadline has passed
+ *
+ * Deadlines advance by whole periods from the previous deadline, so a slow
+ * loop doesn't shift the cadence. Periods missed entirely are skipped and
+ * counted instead of being sent in a burst.
+ *
+ * @param scheduler the scheduler
+ * @param now_ms current time
+ * @return uint8_t number of events sent
+ */
+uint8_t scheduler_dispatch(scheduler_t *scheduler, uint32_t now_ms);
+
+/**
+ * @brief Time left until the next deadline
+ *
+ * @param scheduler the scheduler
+ * @param now_ms current time
+ * @return uint32_t milliseconds until the next deadline, 0 if already due,
+ * UINT32_MAX if no timers are registered
+ */
+uint32_t scheduler_time_until_next(
+    const scheduler_t *scheduler, uint32_t now_ms);
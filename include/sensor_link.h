@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sensor readings handed from the sensor FSMs to the MQTT FSM
+ *
+ * A lock-free single-producer/single-consumer ring: the DHT and PIR FSMs
+ * push a snapshot of their state whenever it changes and the MQTT FSM
+ * takes them in order. With DUAL_CORE the two ends run on different cores,
+ * so the MQTT FSM must not call the sensor getters directly.
+ */
+
+#define SENSOR_LINK_SIZE 16  // readings, must be a power of two
+
+typedef struct sensor_reading {
+  uint32_t timestamp_ms;
+  uint32_t occupied_edge_us;    // PIR edge that made the room occupied
+  int32_t temperature_x10;      // corrected, tenths of a degree Fahrenheit
+  int32_t raw_temperature_x10;  // before the self-heating correction
+  int32_t humidity_x10;         // tenths of a percent
+  bool climate_valid;           // see dht_has_reading()
+  bool occupied;
+} sensor_reading_t;
+
+typedef struct sensor_link {
+  sensor_reading_t readings[SENSOR_LINK_SIZE];
+  uint8_t head;  // only written by the consumer (sensor_link_take)
+  uint8_t tail;  // only written by the producer (sensor_link_push)
+  uint32_t dropped;
+} sensor_link_t;
+
+/**
+ * @brief Initialize an empty link, before either end uses it
+ *
+ * @param link the link
+ */
+void sensor_link_init(sensor_link_t *link);
+
+/**
+ * @brief Queue a reading, from the producer's task only
+ *
+ * The consumer owns the oldest entry, so a full link drops the new reading.
+ * Every reading is a full snapshot, so the next one makes up for it.
+ *
+ * @param link the link
+ * @param reading the reading to copy
+ * @return true if it was queued, false if the link was full
+ */
+bool sensor_link_push(sensor_link_t *link, const sensor_reading_t *reading);
+
+/**
+ * @brief Take the oldest reading, from the consumer's task only
+ *
+ * @param link the link
+ * @param reading filled with the reading
+ * @return true if there was one
+ */
+bool sensor_link_take(sensor_link_t *link, sensor_reading_t *reading);
+
+/**
+ * @brief Readings dropped because the link was full
+ *
+ * @param link the link
+ * @return uint32_t count since sensor_link_init()
+ */
+uint32_t sensor_link_dropped(const sensor_link_t *link);
+
+/**
+ * @brief Round a reading in tenths to a whole unit, halves away from zero
+ *
+ * @param value_x10 tenths of a degree or percent
+ * @return int whole degrees or percent
+ */
+int sensor_round_tenths(int32_t value_x10);
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Tuning knobs that can be changed at runtime
+ *
+ * Every setting starts from its compile-time default, which an env's
+ * build_flags can still override, and can be changed over MQTT, see
+ * <host>/cmd in mqtt_fsm.cpp. Only settings changed at runtime are kept in
+ * NVS, so they survive reboots and OTA updates while the others follow the
+ * defaults of whatever image is running.
+ *
+ * settings_get() is safe from either core. Settings are only changed from
+ * the network task.
+ */
+
+#define MQTT_PAYLOAD_TOPICS 0  // one topic per reading, for existing dashboards
+#define MQTT_PAYLOAD_JSON 1    // all readings as JSON on <host>/state
+#define MQTT_PAYLOAD_BINARY 2  // all readings as binary on <host>/state
+
+// New settings go at the end, stored ones keep their place in NVS
+typedef enum {
+  SETTING_SAMPLE_PERIOD_MS,  // DHT22 reads, rounded up to 5 s ticks
+  SETTING_DEBOUNCE_MS,       // PIR edges closer than this are one edge
+  SETTING_OCCUPIED_EDGES,    // edges within the window that mean occupied
+  SETTING_OCCUPIED_WINDOW_MS,
+  SETTING_VACANT_MS,       // no motion for this long means empty
+  SETTING_TEMP_DELTA_X10,  // dead band around the last published reading
+  SETTING_HUM_DELTA_X10,
+  SETTING_HEARTBEAT_MS,     // longest gap between published samples
+  SETTING_PAYLOAD_FORMAT,   // MQTT_PAYLOAD_*
+  SETTING_TEMP_OFFSET_X10,  // where the calibration's bias starts from
+  SETTING_COUNT,
+} setting_id_t;
+
+typedef enum {
+  SETTINGS_OK,
+  SETTINGS_ERR_UNKNOWN,  // no setting by that name
+  SETTINGS_ERR_VALUE,    // not a number
+  SETTINGS_ERR_RANGE,
+} settings_err_t;
+
+#define SETTINGS_TEXT_LEN 40  // "<name>=<value>"
+
+/**
+ * @brief Start from the defaults and apply the settings stored in NVS
+ */
+void settings_init(void);
+
+/**
+ * @brief Get the current value of a setting
+ *
+ * @param id the setting
+ * @return int32_t the value, tenths for the _X10 settings
+ */
+int32_t settings_get(setting_id_t id);
+
+/**
+ * @brief Change a setting by name and store it in NVS
+ *
+ * @param name e.g. "vacant_ms"
+ * @param value text, e.g. "90000", or "0.5" for the tenths settings
+ * @param id set to the setting's id if the name is known
+ * @return settings_err_t SETTINGS_OK if the value was changed
+ */
+settings_err_t settings_set(
+    const char *name, const char *value, setting_id_t *id);
+
+/**
+ * @brief Look a setting up by name
+ *
+ * @param name e.g. "vacant_ms"
+ * @param id set to the setting's id if found
+ * @return true if found
+ */
+bool settings_find(const char *name, setting_id_t *id);
+
+/**
+ * @brief Format a setting as "<name>=<value>"
+ *
+ * @param buf destination, SETTINGS_TEXT_LEN bytes
+ * @param len size of buf
+ * @param id the setting
+ * @return size_t length of the text
+ */
+size_t settings_format(char *buf, size_t len, setting_id_t id);
+
+/**
+ * @brief Return every setting to its default and forget the stored ones
+ */
+void settings_reset(void);
+
+/**
+ * @brief Short description of an error, for replies
+ *
+ * @param err the error
+ * @return const char* e.g. "out of range"
+ */
+const char *settings_err_name(settings_err_t err);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef DUAL_CORE
+#define DUAL_CORE 0
+#endif
+
+/*
+ * FSM tasks for DUAL_CORE builds
+ *
+ * The network FSMs (Wi-Fi, MQTT, OTA) run on the core the Wi-Fi stack uses
+ * and the sensor FSMs (DHT, PIR) on the other one, each group with its own
+ * scheduler, so a blocking connect or publish no longer delays a reading.
+ * The groups only exchange data through lock-free single-producer/
+ * single-consumer lanes: readings through sensor_link.h, events through
+ * fsm_send_from_isr(). Single-core builds run both groups from loop().
+ */
+
+#define TASKS_NETWORK_CORE 0  // PRO_CPU, where the Wi-Fi stack runs
+#define TASKS_SENSOR_CORE 1   // APP_CPU, where loop() runs
+#define TASKS_NETWORK_STACK_BYTES 8192
+#define TASKS_SENSOR_STACK_BYTES 4096
+#define TASKS_PRIORITY 1  // the same as loop()
+
+#if DUAL_CORE && FSM_PROFILE
+#error "FSM_PROFILE keeps one set of counters, it can't be used with DUAL_CORE"
+#endif
+
+// One pass over a group's timers and events, returns how long it may idle
+typedef uint32_t (*tasks_step_fn)(void);
+
+/**
+ * @brief Start the network and sensor tasks
+ *
+ * Each task calls its step function and then power_idle() for the time it
+ * returned, forever. Nothing is left running if either can't be created.
+ *
+ * @param network_step pass over the Wi-Fi and MQTT state machines
+ * @param sensor_step pass over the DHT and PIR state machines
+ * @return true if both tasks are running
+ */
+bool tasks_start(tasks_step_fn network_step, tasks_step_fn sensor_step);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FSM_TRACE
+#define FSM_TRACE 0
+#endif
+
+/*
+ * Binary trace of FSM dispatches
+ *
+ * Built with FSM_TRACE, fsm_handle_event() appends one 8-byte record per
+ * dispatched event to a RAM ring, overwriting the oldest. A dump is a
+ * header naming the machines followed by the records, oldest first:
+ *
+ *   "FTRC" | version u8 | machines u8 | records u16 |
+ *   machines x (length u8 | name) | records x trace_record_t
+ *
+ * all little-endian. tools/trace_replay.cpp decodes dumps and replays them
+ * through the native build.
+ */
+
+#define TRACE_SIZE 256  // records, must be a power of two
+#define TRACE_MAGIC "FTRC"
+#define TRACE_VERSION 1
+#define TRACE_SERIAL_PREFIX "trace: "
+
+typedef struct __attribute__((packed)) trace_record {
+  uint32_t timestamp_ms;
+  uint8_t fsm_id;  // see fsm_set_name()
+  uint8_t state;   // the state that handled the event
+  uint8_t event;
+  int8_t result;  // fsm_err_t returned by fsm_handle_event()
+} trace_record_t;
+
+typedef void (*trace_writer_t)(const uint8_t *data, size_t len, void *ctx);
+
+/**
+ * @brief Append a dispatch to the ring
+ */
+void trace_record(uint8_t fsm_id, uint8_t state, uint8_t event, int8_t result);
+
+/**
+ * @brief Number of records in the ring, at most TRACE_SIZE
+ */
+uint16_t trace_count(void);
+
+/**
+ * @brief Read a record
+ *
+ * @param index 0 for the oldest record in the ring
+ * @param record filled with the record
+ * @return true if the record exists
+ */
+bool trace_get(uint16_t index, trace_record_t *record);
+
+void trace_clear(void);
+
+/**
+ * @brief Serialize the ring in the dump format
+ *
+ * @param write called with consecutive pieces of the dump
+ * @param ctx passed through to write
+ */
+void trace_dump(trace_writer_t write, void *ctx);
+
+/**
+ * @brief Dump the ring to Serial as hex lines starting with
+ * TRACE_SERIAL_PREFIX
+ */
+void trace_dump_serial(void);
+
+/**
+ * @brief Ask for a dump over MQTT on the next diagnostics tick
+ */
+void trace_request_mqtt_dump(void);
+
+/**
+ * @brief Check and clear a pending MQTT dump request
+ */
+bool trace_take_mqtt_dump_request(void);
@@ -3,11 +3,16 @@
 #include <WiFi.h>
 
 #include "fsm.h"
+#include "scheduler.h"
 
 typedef enum {
   WIFI_EVENT_START = FSM_GLOBAL_EVENT_COUNT,
   WIFI_EVENT_STOP,
   WIFI_EVENT_UNAVAILABLE,
+  WIFI_EVENT_CONNECTED,
+  WIFI_EVENT_DISCONNECTED,
+  WIFI_EVENT_RETRY,
+  WIFI_EVENT_COUNT,
 } local_wifi_event_t;
 
 /**
@@ -25,6 +30,14 @@ fsm_err_t wifi_fsm_init(uint8_t led_pin);
  */
 fsm_err_t wifi_fsm_send(fsm_event event);
 
+/**
+ * @brief Register the periodic events the WiFi state machine handles
+ *
+ * @param scheduler the scheduler delivering periodic events
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t wifi_fsm_schedule(scheduler_t *scheduler);
+
 /**
  * @brief Handle any pending events in the WiFi state machine
  *
@@ -32,4 +45,17 @@ fsm_err_t wifi_fsm_send(fsm_event event);
  */
 fsm_err_t wifi_fsm_handle_event(void);
 
-WiFiClient *wifi_fsm_get_client(void);
\ No newline at end of file
+/**
+ * @brief Get the event queue counters of the WiFi state machine
+ *
+ * @param stats filled with the high-water mark and drop counters
+ * @return fsm_err_t FSM_ERR_OK on success, relevant error otherwise
+ */
+fsm_err_t wifi_fsm_get_queue_stats(fsm_queue_stats_t *stats);
+
+/**
+ * @brief Check whether the station is associated and has an IP address
+ *
+ * @return true when the WiFi state machine is active
+ */
+bool wifi_fsm_connected(void);
\ No newline at end of file
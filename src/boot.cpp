@@ -0,0 +1,31 @@
+#include "boot.h"
+
+#include <Arduino.h>
+
+#include "log.h"
+
+static bool boot_complete = false;
+static uint32_t last_mark_ms = 0;
+static uint32_t total_ms = 0;
+
+/******** PUBLIC FUNCTIONS ********/
+void boot_timing_mark(const char *phase) {
+  if (boot_complete) {
+    return;
+  }
+  uint32_t now_ms = millis();
+  LOG_INFO("boot: %-16s %6u ms (+%u ms)", phase, now_ms,
+      now_ms - last_mark_ms);
+  last_mark_ms = now_ms;
+}
+
+void boot_timing_finish(const char *phase) {
+  if (boot_complete) {
+    return;
+  }
+  boot_timing_mark(phase);
+  total_ms = last_mark_ms;
+  boot_complete = true;
+}
+
+uint32_t boot_timing_total_ms(void) { return total_ms; }
@@ -0,0 +1,142 @@
+#include "calibration.h"
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <math.h>
+#include <string.h>
+
+#include "log.h"
+#include "power.h"
+#include "settings.h"
+
+#define CALIB_NVS_NAMESPACE "calib"
+#define CALIB_NVS_MODEL_KEY "model"
+#define CALIB_NVS_VERSION 1
+
+enum { FEATURE_BIAS, FEATURE_CPU, FEATURE_RADIO, FEATURE_WARMUP };
+
+// Persisted as a blob in NVS, bump CALIB_NVS_VERSION when changing it
+typedef struct {
+  uint8_t version;
+  float weights[CALIB_NUM_FEATURES];
+  uint32_t references;
+} calibration_nvs_t;
+
+static calibration_model_t model = {};
+static uint32_t tx_bytes = 0;  // added to by the network task
+static uint32_t last_update_ms = 0;
+// Summed from millis() deltas, which stay right when millis() wraps
+static uint64_t uptime_ms = 0;
+static power_stats_t last_power = {};
+
+/******** PRIVATE FUNCTIONS ********/
+static float predict(void) {
+  float offset = 0;
+  for (uint8_t i = 0; i < CALIB_NUM_FEATURES; i++) {
+    offset += model.weights[i] * model.features[i];
+  }
+  return fmaxf(-CALIB_MAX_OFFSET_F, fminf(offset, CALIB_MAX_OFFSET_F));
+}
+
+static void save_model(void) {
+  calibration_nvs_t stored = {.version = CALIB_NVS_VERSION};
+  memcpy(stored.weights, model.weights, sizeof(stored.weights));
+  stored.references = model.references;
+  Preferences prefs;
+  prefs.begin(CALIB_NVS_NAMESPACE, false);
+  prefs.putBytes(CALIB_NVS_MODEL_KEY, &stored, sizeof(stored));
+  prefs.end();
+}
+
+/******** PUBLIC FUNCTIONS ********/
+void calibration_init(void) {
+  memset(&model, 0, sizeof(model));
+  model.features[FEATURE_BIAS] = 1;
+  model.weights[FEATURE_BIAS] = settings_get(SETTING_TEMP_OFFSET_X10) / 10.0f;
+
+  calibration_nvs_t stored = {};
+  Preferences prefs;
+  prefs.begin(CALIB_NVS_NAMESPACE, true);
+  if (sizeof(stored) ==
+          prefs.getBytes(CALIB_NVS_MODEL_KEY, &stored, sizeof(stored)) &&
+      CALIB_NVS_VERSION == stored.version) {
+    memcpy(model.weights, stored.weights, sizeof(model.weights));
+    model.references = stored.references;
+  }
+  prefs.end();
+
+  last_update_ms = millis();
+  uptime_ms = last_update_ms;
+  power_get_stats(&last_power);
+}
+
+void calibration_update(void) {
+  uint32_t now_ms = millis();
+  uint32_t elapsed_ms = now_ms - last_update_ms;
+  if (0 == elapsed_ms) {
+    return;
+  }
+  power_stats_t power;
+  power_get_stats(&power);
+  uint32_t active_ms = power.active_ms - last_power.active_ms;
+  uint32_t total_ms = active_ms + (power.idle_ms - last_power.idle_ms) +
+                      (power.sleep_ms - last_power.sleep_ms);
+  uint32_t bytes = __atomic_exchange_n(&tx_bytes, 0, __ATOMIC_RELAXED);
+  float radio = bytes * 1000.0f / elapsed_ms / CALIB_RADIO_FULL_BPS;
+
+  // First order low-pass with the board's thermal time constant
+  float alpha = (float)elapsed_ms / (CALIB_TIME_CONSTANT_MS + elapsed_ms);
+  if (total_ms > 0) {
+    float cpu = (float)active_ms / total_ms;
+    model.features[FEATURE_CPU] += alpha * (cpu - model.features[FEATURE_CPU]);
+  }
+  model.features[FEATURE_RADIO] +=
+      alpha * (fminf(radio, 1.0f) - model.features[FEATURE_RADIO]);
+  // After 49.7 days millis() starts over, the board stays warm
+  uptime_ms += elapsed_ms;
+  model.features[FEATURE_WARMUP] =
+      1 - expf(-(float)uptime_ms / CALIB_TIME_CONSTANT_MS);
+
+  last_update_ms = now_ms;
+  last_power = power;
+}
+
+void calibration_note_tx(uint32_t bytes) {
+  __atomic_fetch_add(&tx_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+int32_t calibration_offset_x10(void) { return lroundf(predict() * 10); }
+
+bool calibration_train(int32_t raw_x10, int32_t reference_x10) {
+  float target = (raw_x10 - reference_x10) / 10.0f;
+  float error = target - predict();
+  if (fabsf(error) > CALIB_MAX_ERROR_F) {
+    LOG_WARN("calib: reference %d rejected, %d off", (int)reference_x10,
+        (int)lroundf(error * 10));
+    return false;
+  }
+  float norm = 0;
+  for (uint8_t i = 0; i < CALIB_NUM_FEATURES; i++) {
+    norm += model.features[i] * model.features[i];
+  }
+  for (uint8_t i = 0; i < CALIB_NUM_FEATURES; i++) {
+    model.weights[i] +=
+        CALIB_LEARNING_RATE * error * model.features[i] / norm;
+  }
+  model.references++;
+  save_model();
+  LOG_INFO("calib: reference %d, offset now %d (x10)", (int)reference_x10,
+      (int)calibration_offset_x10());
+  return true;
+}
+
+void calibration_set_bias_x10(int32_t offset_x10) {
+  model.weights[FEATURE_BIAS] = offset_x10 / 10.0f;
+  save_model();
+  LOG_INFO("calib: bias set, offset now %d (x10)",
+      (int)calibration_offset_x10());
+}
+
+void calibration_get_model(calibration_model_t *model_out) {
+  *model_out = model;
+}
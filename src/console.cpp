@@ -0,0 +1,72 @@
+#include "console.h"
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "device_config.h"
+#include "trace.h"
+
+#define CONSOLE_LINE_LEN 128
+
+static char line[CONSOLE_LINE_LEN];
+static size_t line_len = 0;
+
+/******** PRIVATE FUNCTIONS ********/
+static void list_config(void) {
+  char text[DEVICE_CONFIG_TEXT_LEN];
+  for (uint8_t i = 0; i < device_config_field_count(); i++) {
+    if (device_config_format(text, sizeof(text), i)) {
+      Serial.printf("%s\n", text);
+    }
+  }
+  if (!device_config_provisioned()) {
+    Serial.printf("ssid, mqtt_server and host_name are needed to go online\n");
+  }
+}
+
+static void run_line(char *text) {
+  char *value = strchr(text, '=');
+  if (0 == strcmp(text, "config")) {
+    list_config();
+  } else if (0 == strcmp(text, "reboot")) {
+    Serial.printf("rebooting\n");
+    Serial.flush();
+    ESP.restart();
+  } else if (value) {
+    *value++ = '\0';
+    device_config_err_t err = device_config_set(text, value);
+    if (DEVICE_CONFIG_OK == err) {
+      Serial.printf("%s stored, reboot to apply\n", text);
+    } else {
+      Serial.printf("%s: %s\n", text, device_config_err_name(err));
+    }
+  } else {
+    Serial.printf("unknown command, try config, <name>=<value> or reboot\n");
+  }
+}
+
+/******** PUBLIC FUNCTIONS ********/
+void console_poll(void) {
+  while (Serial.available()) {
+    int c = Serial.read();
+#if FSM_TRACE
+    if (0 == line_len && 'T' == c) {
+      trace_dump_serial();
+      continue;
+    }
+    if (0 == line_len && 'M' == c) {
+      trace_request_mqtt_dump();
+      continue;
+    }
+#endif
+    if ('\r' == c || '\n' == c) {
+      line[line_len] = '\0';
+      if (line_len) {
+        run_line(line);
+      }
+      line_len = 0;
+    } else if (line_len < sizeof(line) - 1) {
+      line[line_len++] = (char)c;
+    }
+  }
+}
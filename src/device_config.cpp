@@ -0,0 +1,241 @@
+#include "device_config.h"
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define CONFIG_NVS_NAMESPACE "device"
+#define CONFIG_NVS_KEY "config"
+// Bump when a stored field changes meaning, new fields only need a new tag
+#define CONFIG_NVS_VERSION 1
+
+typedef enum { FIELD_TEXT, FIELD_SECRET, FIELD_UINT8 } field_type_t;
+
+typedef struct config_field {
+  uint8_t tag;  // stored with the value, never reuse one
+  const char *name;
+  field_type_t type;
+  size_t offset;
+  size_t size;
+} config_field_t;
+
+#define FIELD(tag, name, type, member)                 \
+  {tag, name, type, offsetof(device_config_t, member), \
+      sizeof(((device_config_t *)NULL)->member)}
+
+static const config_field_t fields[] = {
+    FIELD(1, "ssid", FIELD_TEXT, ssid),
+    FIELD(2, "password", FIELD_SECRET, password),
+    FIELD(3, "mqtt_server", FIELD_TEXT, mqtt_server),
+    FIELD(4, "host_name", FIELD_TEXT, host_name),
+    FIELD(5, "ota_password", FIELD_SECRET, ota_password),
+    FIELD(6, "topic_hum", FIELD_TEXT, topic_hum),
+    FIELD(7, "topic_temp", FIELD_TEXT, topic_temp),
+    FIELD(8, "topic_prox", FIELD_TEXT, topic_prox),
+    FIELD(9, "sensor_power_pin", FIELD_UINT8, sensor_power_pin),
+};
+
+#define CONFIG_FIELD_COUNT (sizeof(fields) / sizeof(fields[0]))
+// Version byte, then tag, length and value of every field that is set
+#define CONFIG_BLOB_LEN (1 + 2 * CONFIG_FIELD_COUNT + sizeof(device_config_t))
+
+// What NVS holds, and the copy the running image took at its first get
+static device_config_t stored;
+static bool loaded = false;
+static device_config_t config;
+static bool latched = false;
+
+/******** PRIVATE FUNCTIONS ********/
+static uint8_t *field_ptr(const config_field_t *field) {
+  return (uint8_t *)&stored + field->offset;
+}
+
+// Text fields are stored without their terminator
+static size_t max_len(const config_field_t *field) {
+  return (FIELD_UINT8 == field->type) ? field->size : field->size - 1;
+}
+
+// Unset fields, empty text or a zero, aren't stored at all
+static uint8_t field_len(const config_field_t *field) {
+  if (FIELD_UINT8 == field->type) {
+    return (0 != *field_ptr(field)) ? 1 : 0;
+  }
+  return strnlen((const char *)field_ptr(field), max_len(field));
+}
+
+static const config_field_t *find_tag(uint8_t tag) {
+  for (const config_field_t &field : fields) {
+    if (tag == field.tag) {
+      return &field;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Bring fields read from an older version up to CONFIG_NVS_VERSION
+ *
+ * Added fields only need a tag. When a field changes meaning, bump the
+ * version and add the previous one's case here, converting the value in
+ * stored. Cases fall through, so an old blob catches up one step at a time.
+ */
+static void upgrade(uint8_t version) {
+  static_assert(1 == CONFIG_NVS_VERSION, "add the previous version's case");
+  if (version > CONFIG_NVS_VERSION) {
+    LOG_WARN("config: stored by a newer image, unknown fields skipped");
+    return;
+  }
+  switch (version) {
+    case 1:  // current
+      break;
+    default:
+      LOG_WARN("config: version %u can't be upgraded, kept as it is",
+          version);
+      break;
+  }
+}
+
+static void decode(const uint8_t *blob, size_t len) {
+  size_t pos = 1;
+  while (pos + 2 <= len) {
+    uint8_t tag = blob[pos];
+    uint8_t value_len = blob[pos + 1];
+    pos += 2;
+    if (pos + value_len > len) {
+      LOG_WARN("config: record %u cut short", tag);
+      break;
+    }
+    const config_field_t *field = find_tag(tag);
+    if (field && value_len <= max_len(field)) {
+      memcpy(field_ptr(field), &blob[pos], value_len);
+    }
+    pos += value_len;
+  }
+  upgrade(blob[0]);
+}
+
+static void load(void) {
+  loaded = true;
+  memset(&stored, 0, sizeof(stored));
+  uint8_t blob[CONFIG_BLOB_LEN];
+  Preferences prefs;
+  prefs.begin(CONFIG_NVS_NAMESPACE, true);
+  size_t len = prefs.getBytesLength(CONFIG_NVS_KEY);
+  if (len > sizeof(blob)) {
+    len = 0;  // written by a newer image with more fields than fit
+  }
+  len = (len > 0) ? prefs.getBytes(CONFIG_NVS_KEY, blob, len) : 0;
+  prefs.end();
+  if (len > 0) {
+    decode(blob, len);
+  }
+}
+
+static bool save(void) {
+  uint8_t blob[CONFIG_BLOB_LEN];
+  size_t len = 0;
+  blob[len++] = CONFIG_NVS_VERSION;
+  for (const config_field_t &field : fields) {
+    uint8_t value_len = field_len(&field);
+    if (0 == value_len) {
+      continue;
+    }
+    blob[len++] = field.tag;
+    blob[len++] = value_len;
+    memcpy(&blob[len], field_ptr(&field), value_len);
+    len += value_len;
+  }
+  Preferences prefs;
+  prefs.begin(CONFIG_NVS_NAMESPACE, false);
+  bool retVal = len == prefs.putBytes(CONFIG_NVS_KEY, blob, len);
+  prefs.end();
+  return retVal;
+}
+
+static const device_config_t *get_stored(void) {
+  if (!loaded) {
+    load();
+  }
+  return &stored;
+}
+
+/******** PUBLIC FUNCTIONS ********/
+const device_config_t *device_config_get(void) {
+  if (!latched) {
+    config = *get_stored();
+    latched = true;
+  }
+  return &config;
+}
+
+bool device_config_provisioned(void) {
+  const device_config_t *current = get_stored();
+  return current->ssid[0] && current->mqtt_server[0] &&
+         current->host_name[0];
+}
+
+device_config_err_t device_config_set(const char *name, const char *value) {
+  get_stored();
+  const config_field_t *field = NULL;
+  for (const config_field_t &candidate : fields) {
+    if (0 == strcmp(name, candidate.name)) {
+      field = &candidate;
+    }
+  }
+  if (!field) {
+    return DEVICE_CONFIG_ERR_UNKNOWN;
+  }
+  if (FIELD_UINT8 == field->type) {
+    char *end = NULL;
+    unsigned long number = strtoul(value, &end, 10);
+    if (end == value || '\0' != *end || number > UINT8_MAX) {
+      return DEVICE_CONFIG_ERR_VALUE;
+    }
+    *field_ptr(field) = (uint8_t)number;
+  } else {
+    size_t len = strlen(value);
+    if (len > max_len(field)) {
+      return DEVICE_CONFIG_ERR_VALUE;
+    }
+    memset(field_ptr(field), 0, field->size);
+    memcpy(field_ptr(field), value, len);
+  }
+  return save() ? DEVICE_CONFIG_OK : DEVICE_CONFIG_ERR_STORE;
+}
+
+size_t device_config_format(char *buf, size_t len, uint8_t index) {
+  if (index >= CONFIG_FIELD_COUNT || 0 == len) {
+    return 0;
+  }
+  const config_field_t *field = &fields[index];
+  const char *text = (const char *)get_stored() + field->offset;
+  int written = 0;
+  if (FIELD_UINT8 == field->type) {
+    written = snprintf(buf, len, "%s=%u", field->name, (uint8_t)text[0]);
+  } else if (FIELD_SECRET == field->type && text[0]) {
+    written = snprintf(buf, len, "%s=(set)", field->name);
+  } else {
+    written = snprintf(buf, len, "%s=%s", field->name, text);
+  }
+  return (written < 0 || (size_t)written >= len) ? 0 : written;
+}
+
+uint8_t device_config_field_count(void) { return CONFIG_FIELD_COUNT; }
+
+const char *device_config_err_name(device_config_err_t err) {
+  switch (err) {
+    case DEVICE_CONFIG_OK:
+      return "ok";
+    case DEVICE_CONFIG_ERR_UNKNOWN:
+      return "unknown field";
+    case DEVICE_CONFIG_ERR_VALUE:
+      return "value too long or not a number";
+    case DEVICE_CONFIG_ERR_STORE:
+      return "NVS write failed";
+  }
+  return "?";
+}
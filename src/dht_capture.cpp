@@ -0,0 +1,97 @@
+#include "dht_capture.h"
+
+#include <Arduino.h>
+
+static uint8_t pin_s = 0;
+static bool busy = false;
+static uint32_t begin_us = 0;
+static volatile uint32_t edges[DHT_CAPTURE_MAX_EDGES];
+// Keeps counting past the buffer so dht_decode() can tell noise apart
+static volatile uint8_t num_edges = 0;
+
+static const char *const err_names[] = {
+    [DHT_DECODE_OK] = "ok",
+    [DHT_DECODE_SHORT] = "no answer",
+    [DHT_DECODE_NOISE] = "noise",
+    [DHT_DECODE_TIMING] = "bad timing",
+    [DHT_DECODE_CHECKSUM] = "checksum",
+};
+
+/******** PRIVATE FUNCTIONS ********/
+static void IRAM_ATTR falling_edge_isr() {
+  uint8_t count = num_edges;
+  if (count < DHT_CAPTURE_MAX_EDGES) {
+    edges[count] = micros();
+  }
+  if (count < UINT8_MAX) {
+    num_edges = count + 1;
+  }
+}
+
+/******** PUBLIC FUNCTIONS ********/
+dht_decode_err_t dht_decode(
+    const uint32_t *edges_us, uint8_t num_edges, dht_frame_t *frame) {
+  if (num_edges > DHT_CAPTURE_MAX_EDGES) {
+    return DHT_DECODE_NOISE;
+  }
+  if (num_edges < DHT_FRAME_BITS + 1) {
+    return DHT_DECODE_SHORT;
+  }
+  const uint32_t *bit_edges = edges_us + num_edges - (DHT_FRAME_BITS + 1);
+  uint8_t bytes[DHT_FRAME_BITS / 8] = {};
+  for (uint8_t bit = 0; bit < DHT_FRAME_BITS; bit++) {
+    uint32_t period_us = bit_edges[bit + 1] - bit_edges[bit];
+    if (period_us < DHT_BIT_MIN_US || period_us > DHT_BIT_MAX_US) {
+      return DHT_DECODE_TIMING;
+    }
+    bytes[bit / 8] <<= 1;
+    if (period_us >= DHT_BIT_ONE_US) {
+      bytes[bit / 8] |= 1;
+    }
+  }
+  if ((uint8_t)(bytes[0] + bytes[1] + bytes[2] + bytes[3]) != bytes[4]) {
+    return DHT_DECODE_CHECKSUM;
+  }
+  frame->humidity_x10 = (uint16_t)(bytes[0] << 8 | bytes[1]);
+  // Sign and magnitude, not two's complement
+  int16_t magnitude = (int16_t)((bytes[2] & 0x7F) << 8 | bytes[3]);
+  frame->temperature_x10 = (bytes[2] & 0x80) ? -magnitude : magnitude;
+  return DHT_DECODE_OK;
+}
+
+const char *dht_decode_err_name(dht_decode_err_t err) {
+  if ((unsigned)err >= sizeof(err_names) / sizeof(err_names[0])) {
+    return "?";
+  }
+  return err_names[err];
+}
+
+void dht_capture_begin(uint8_t pin) {
+  pin_s = pin;
+  busy = true;
+  begin_us = micros();
+  digitalWrite(pin_s, LOW);
+  pinMode(pin_s, OUTPUT);
+}
+
+void dht_capture_release(void) {
+  // The release is timed on the ms clock, top up a start signal it cut short
+  uint32_t held_us = micros() - begin_us;
+  if (held_us < DHT_START_LOW_US) {
+    delayMicroseconds(DHT_START_LOW_US - held_us);
+  }
+  num_edges = 0;
+  // Armed before letting go, the first answer edge follows within 40 us
+  attachInterrupt(pin_s, falling_edge_isr, FALLING);
+  pinMode(pin_s, INPUT_PULLUP);
+}
+
+uint8_t dht_capture_end(const uint32_t **edges_us) {
+  detachInterrupt(pin_s);
+  pinMode(pin_s, INPUT_PULLUP);
+  busy = false;
+  *edges_us = (const uint32_t *)edges;
+  return num_edges;
+}
+
+bool dht_capture_busy(void) { return busy; }
@@ -3,15 +3,53 @@
 #include <DHT.h>
 #include <stdio.h>
 
+#include "boot.h"
+#include "calibration.h"
+#include "device_config.h"
+#include "dht_capture.h"
+#include "filter.h"
+#include "fsm_table.h"
+#include "log.h"
+#include "sensor_link.h"
+#include "settings.h"
+
 #define DHTTYPE DHT22
 #define DHT_INPUT 4
+#if !DHT_ASYNC
 DHT dht(DHT_INPUT, DHTTYPE);
+#endif
+
+#define DHT_QUEUE_SIZE 8
+// The DHT22 ignores requests for the first second after power-up
+#define DHT_WARMUP_MS 1500
+// A capture whose follow-up events never arrived is abandoned after this
+#define DHT_CAPTURE_STALE_MS 1000
+// Readings older than this many sample periods, a dozen failed reads in a
+// row, aren't reported
+#define DHT_READING_MAX_AGE_READS 12
+// The sample period is a whole number of these ticks
+#define DHT_TICK_MS 5000  // FSM_PERIODIC_EVENT_5S
+// Averages over roughly 4 readings, on top of the median
+#define DHT_EMA_SHIFT 2
+#define DHT_NO_REFERENCE INT32_MIN
 
 static fsm_handle_t state_machine;
 
-enum { DHT_UNKNOWN, DHT_ACTIVE, DHT_INACTIVE };
-static int current_humidity = 1000;
-static int current_temp = 1000;
+enum { DHT_UNKNOWN, DHT_ACTIVE, DHT_INACTIVE, DHT_STATE_COUNT };
+static filter_t temp_filter;  // tenths of a degree Fahrenheit, uncorrected
+static filter_t hum_filter;   // tenths of a percent
+static bool has_reading = false;
+static unsigned long last_reading_ms = 0;
+static unsigned long power_on_ms = 0;
+static scheduler_t *scheduler_s = NULL;
+static void (*on_reading_s)(void) = NULL;
+// Written by dht_fsm_submit_reference() before it posts DHT_EVENT_REFERENCE
+static int32_t reference_x10 = DHT_NO_REFERENCE;
+static uint32_t sample_ticks = 0;
+static int32_t temp_offset_x10 = 0;  // as last handed to the calibration
+#if DHT_ASYNC
+static unsigned long capture_start_ms = 0;
+#endif
 
 /******** PRIVATE FUNCTIONS ********/
 static fsm_err_t unknown_entry_fn();
@@ -21,102 +59,304 @@ static fsm_err_t active_exit_fn();
 static fsm_err_t inactive_entry_fn();
 static fsm_err_t inactive_exit_fn();
 static fsm_err_t periodic_active_event_fn();
+static fsm_err_t sample_event_fn();
+static fsm_err_t reference_event_fn();
+static fsm_err_t settings_event_fn();
+#if DHT_ASYNC
+static fsm_err_t release_fn();
+static fsm_err_t captured_fn();
+#endif
 
 /******** TRANSITIONS ********/
-static fsm_transition_t unknown_transitions[] = {
-    {.destination_state_ID = DHT_ACTIVE, .event = DHT_EVENT_START},
-    {.destination_state_ID = DHT_INACTIVE, .event = DHT_EVENT_STOP},
-};
-
-static fsm_transition_t active_transitions[] = {
-    {.destination_state_ID = DHT_INACTIVE, .event = DHT_EVENT_STOP},
-    {.destination_state_ID = DHT_ACTIVE,
+static constexpr fsm_static_transition_t transitions[] = {
+    {.source_state_ID = DHT_UNKNOWN,
+        .event = DHT_EVENT_START,
+        .destination_state_ID = DHT_ACTIVE},
+    {.source_state_ID = DHT_UNKNOWN,
+        .event = DHT_EVENT_STOP,
+        .destination_state_ID = DHT_INACTIVE},
+    {.source_state_ID = DHT_ACTIVE,
+        .event = DHT_EVENT_STOP,
+        .destination_state_ID = DHT_INACTIVE},
+    {.source_state_ID = DHT_ACTIVE,
         .event = FSM_PERIODIC_EVENT_5S,
-        .transition_fn = periodic_active_event_fn}};
+        .destination_state_ID = DHT_ACTIVE,
+        .transition_fn = periodic_active_event_fn},
+    {.source_state_ID = DHT_ACTIVE,
+        .event = DHT_EVENT_SAMPLE,
+        .destination_state_ID = DHT_ACTIVE,
+        .transition_fn = sample_event_fn},
+    {.source_state_ID = DHT_ACTIVE,
+        .event = DHT_EVENT_REFERENCE,
+        .destination_state_ID = DHT_ACTIVE,
+        .transition_fn = reference_event_fn},
+    {.source_state_ID = DHT_ACTIVE,
+        .event = DHT_EVENT_SETTINGS,
+        .destination_state_ID = DHT_ACTIVE,
+        .transition_fn = settings_event_fn},
+#if DHT_ASYNC
+    {.source_state_ID = DHT_ACTIVE,
+        .event = DHT_EVENT_RELEASE,
+        .destination_state_ID = DHT_ACTIVE,
+        .transition_fn = release_fn},
+    {.source_state_ID = DHT_ACTIVE,
+        .event = DHT_EVENT_CAPTURED,
+        .destination_state_ID = DHT_ACTIVE,
+        .transition_fn = captured_fn},
+#endif
+    {.source_state_ID = DHT_INACTIVE,
+        .event = DHT_EVENT_START,
+        .destination_state_ID = DHT_ACTIVE},
+};
 
-static fsm_transition_t inactive_transitions[] = {
-    {.destination_state_ID = DHT_ACTIVE, .event = DHT_EVENT_START}};
+FSM_DEFINE_TABLE(
+    dispatch_table, DHT_STATE_COUNT, DHT_EVENT_COUNT, transitions);
 
 /******** STATES ********/
-static fsm_state_t unknown_state = {.ID = DHT_UNKNOWN,
-    .entry_fn = unknown_entry_fn,
-    .exit_fn = unknown_exit_fn,
-    .transition_array = unknown_transitions,
-    .num_transitions =
-        sizeof(unknown_transitions) / sizeof(unknown_transitions[0])};
-
-static fsm_state_t active_state = {.ID = DHT_ACTIVE,
-    .entry_fn = active_entry_fn,
-    .exit_fn = active_exit_fn,
-    .transition_array = active_transitions,
-    .num_transitions =
-        sizeof(active_transitions) / sizeof(active_transitions[0])};
-
-static fsm_state_t inactive_state = {.ID = DHT_INACTIVE,
-    .entry_fn = inactive_entry_fn,
-    .exit_fn = inactive_exit_fn,
-    .transition_array = inactive_transitions,
-    .num_transitions =
-        sizeof(inactive_transitions) / sizeof(inactive_transitions[0])};
-
-/******** STATE MACHINE ********/
 static fsm_state_t states[] = {
-    [DHT_UNKNOWN] = unknown_state,
-    [DHT_ACTIVE] = active_state,
-    [DHT_INACTIVE] = inactive_state,
+    [DHT_UNKNOWN] = {.ID = DHT_UNKNOWN,
+        .entry_fn = unknown_entry_fn,
+        .exit_fn = unknown_exit_fn},
+    [DHT_ACTIVE] = {.ID = DHT_ACTIVE,
+        .entry_fn = active_entry_fn,
+        .exit_fn = active_exit_fn},
+    [DHT_INACTIVE] = {.ID = DHT_INACTIVE,
+        .entry_fn = inactive_entry_fn,
+        .exit_fn = inactive_exit_fn},
 };
 
 /******** PUBLIC FUNCTIONS ********/
 fsm_err_t dht_fsm_init(void) {
-  return fsm_init(&state_machine, states, sizeof(states) / sizeof(states[0]));
+  calibration_init();
+  temp_offset_x10 = settings_get(SETTING_TEMP_OFFSET_X10);
+  filter_init(&temp_filter, DHT_EMA_SHIFT);
+  filter_init(&hum_filter, DHT_EMA_SHIFT);
+  const fsm_queue_config_t queue = {.buffer = NULL,
+      .capacity = DHT_QUEUE_SIZE,
+      .overflow_policy = FSM_OVERFLOW_COALESCE};
+  fsm_err_t retVal =
+      fsm_init_table(&state_machine, states, dispatch_table, &queue);
+  fsm_set_name(&state_machine, "dht");
+  return retVal;
 }
 
 fsm_err_t dht_fsm_send(fsm_event event) {
   return fsm_send(&state_machine, event);
 }
 
+fsm_err_t dht_fsm_schedule(scheduler_t *scheduler) {
+  scheduler_s = scheduler;
+  fsm_err_t retVal =
+      scheduler_add_periodic(scheduler, &state_machine, dht_fsm_send);
+  if (FSM_ERR_OK != retVal) {
+    return retVal;
+  }
+  // First reading as soon as the sensor is ready, not on the next 5 s tick
+  return scheduler_add_oneshot(
+      scheduler, DHT_EVENT_SAMPLE, DHT_WARMUP_MS, dht_fsm_send);
+}
+
 fsm_err_t dht_fsm_handle_event(void) {
   return fsm_handle_event(&state_machine);
 }
 
-int get_temp(void) { return current_temp; }
+fsm_err_t dht_fsm_get_queue_stats(fsm_queue_stats_t *stats) {
+  return fsm_get_queue_stats(&state_machine, stats);
+}
 
-int get_hum(void) { return current_humidity; }
+bool dht_has_reading(void) {
+  uint32_t max_age_ms =
+      DHT_READING_MAX_AGE_READS * settings_get(SETTING_SAMPLE_PERIOD_MS);
+  return has_reading && millis() - last_reading_ms < max_age_ms;
+}
+
+int get_temp(void) { return sensor_round_tenths(get_temp_x10()); }
+
+int get_hum(void) { return sensor_round_tenths(filter_value(&hum_filter)); }
+
+int32_t get_temp_x10(void) {
+  return filter_value(&temp_filter) - calibration_offset_x10();
+}
+
+int32_t get_raw_temp_x10(void) { return filter_value(&temp_filter); }
+
+int32_t get_hum_x10(void) { return filter_value(&hum_filter); }
+
+void dht_fsm_on_reading(void (*on_reading)(void)) { on_reading_s = on_reading; }
+
+fsm_err_t dht_fsm_submit_reference(int32_t reference) {
+  __atomic_store_n(&reference_x10, reference, __ATOMIC_RELAXED);
+  return fsm_send_from_isr(&state_machine, DHT_EVENT_REFERENCE);
+}
+
+fsm_err_t dht_fsm_notify_settings(void) {
+  return fsm_send_from_isr(&state_machine, DHT_EVENT_SETTINGS);
+}
 /******** PRIVATE FUNCTIONS ********/
+static void reading_done(void) {
+  if (on_reading_s) {
+    on_reading_s();
+  }
+}
+
+static void store_reading(int32_t hum_x10, int32_t temp_x10) {
+  calibration_update();
+  filter_push(&temp_filter, temp_x10);
+  filter_push(&hum_filter, hum_x10);
+  last_reading_ms = millis();
+  if (!has_reading) {
+    boot_timing_mark("first reading");
+  }
+  has_reading = true;
+  reading_done();
+}
+
+static fsm_err_t reference_event_fn() {
+  int32_t reference =
+      __atomic_exchange_n(&reference_x10, DHT_NO_REFERENCE, __ATOMIC_ACQUIRE);
+  if (DHT_NO_REFERENCE == reference) {
+    return FSM_ERR_OK;
+  }
+  if (!dht_has_reading()) {
+    LOG_WARN("calib: reference ignored, no reading to compare with");
+    return FSM_ERR_OK;
+  }
+  if (calibration_train(get_raw_temp_x10(), reference)) {
+    reading_done();
+  }
+  return FSM_ERR_OK;
+}
+
+// The sample period is read on every tick, only the offset needs applying
+static fsm_err_t settings_event_fn() {
+  int32_t offset_x10 = settings_get(SETTING_TEMP_OFFSET_X10);
+  if (offset_x10 == temp_offset_x10) {
+    return FSM_ERR_OK;
+  }
+  temp_offset_x10 = offset_x10;
+  calibration_set_bias_x10(offset_x10);
+  reading_done();
+  return FSM_ERR_OK;
+}
+
+#if DHT_ASYNC
+static void abort_capture(void) {
+  const uint32_t *edges_us;
+  dht_capture_end(&edges_us);
+}
+
+// The follow-up deadlines are shorter than POWER_MIN_LIGHT_SLEEP_MS, so the
+// loop waits them out awake and the edge interrupt keeps running
+static fsm_err_t start_capture(void) {
+  if (NULL == scheduler_s) {
+    return FSM_ERR_OK;
+  }
+  if (dht_capture_busy()) {
+    if (millis() - capture_start_ms < DHT_CAPTURE_STALE_MS) {
+      return FSM_ERR_OK;
+    }
+    abort_capture();
+  }
+  capture_start_ms = millis();
+  dht_capture_begin(DHT_INPUT);
+  if (FSM_ERR_OK != scheduler_add_oneshot(scheduler_s, DHT_EVENT_RELEASE,
+                        DHT_START_LOW_MS, dht_fsm_send)) {
+    abort_capture();
+    LOG_WARN("DHT22 read skipped: no free timer");
+  }
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t release_fn() {
+  if (!dht_capture_busy()) {
+    return FSM_ERR_OK;
+  }
+  dht_capture_release();
+  if (FSM_ERR_OK != scheduler_add_oneshot(scheduler_s, DHT_EVENT_CAPTURED,
+                        DHT_FRAME_MS, dht_fsm_send)) {
+    abort_capture();
+    LOG_WARN("DHT22 read skipped: no free timer");
+  }
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t captured_fn() {
+  if (!dht_capture_busy()) {
+    return FSM_ERR_OK;
+  }
+  const uint32_t *edges_us;
+  uint8_t num_edges = dht_capture_end(&edges_us);
+  dht_frame_t frame;
+  dht_decode_err_t err = dht_decode(edges_us, num_edges, &frame);
+  if (DHT_DECODE_OK != err) {
+    LOG_WARN("DHT22 read failed: %s (%u edges)", dht_decode_err_name(err),
+        num_edges);
+    reading_done();
+    return FSM_ERR_OK;
+  }
+  store_reading(
+      frame.humidity_x10, lroundf(frame.temperature_x10 * 1.8f) + 320);
+  return FSM_ERR_OK;
+}
+#endif
+
 static fsm_err_t unknown_entry_fn() {
+#if DHT_ASYNC
+  pinMode(DHT_INPUT, INPUT_PULLUP);
+#else
   dht.begin();
-  if (3 == DEVICE_LOC) {
-    // Living room hardware requires power workaround
-    pinMode(27, OUTPUT);
-    digitalWrite(27, HIGH);
+#endif
+  // Some boards, like the living room's, power the DHT22 from a GPIO
+  uint8_t power_pin = device_config_get()->sensor_power_pin;
+  if (power_pin) {
+    pinMode(power_pin, OUTPUT);
+    digitalWrite(power_pin, HIGH);
   }
+  power_on_ms = millis();
   dht_fsm_send(DHT_EVENT_START);
   return FSM_ERR_OK;
 }
 
   static fsm_err_t periodic_active_event_fn() {
-    float hum = dht.readHumidity();
-    float temp = dht.readTemperature(true);
-    if (isnan(hum)) {
-      Serial.println("Error reading hum");
-      current_humidity = 1000;
+    uint32_t period_ms = settings_get(SETTING_SAMPLE_PERIOD_MS);
+    if (++sample_ticks < (period_ms + DHT_TICK_MS - 1) / DHT_TICK_MS) {
+      return FSM_ERR_OK;
     }
-    if (isnan(temp)) {
-      Serial.println("Error reading temp");
-      current_temp = 1000;
+    sample_ticks = 0;
+    return sample_event_fn();
+  }
+
+  static fsm_err_t sample_event_fn() {
+    if (millis() - power_on_ms < DHT_WARMUP_MS) {
+      return FSM_ERR_OK;
     }
+#if DHT_ASYNC
+    return start_capture();
+#else
+    float hum = dht.readHumidity();
+    float temp = dht.readTemperature(true);
     if (isnan(hum) || isnan(temp)) {
-      Serial.println("Error reading DHT22");
+      LOG_WARN("DHT22 read failed:%s%s", isnan(hum) ? " humidity" : "",
+          isnan(temp) ? " temperature" : "");
+      reading_done();
     } else {
-      current_temp = temp - TEMPERATURE_OFFSET;
-      current_humidity = hum;
+      store_reading(lroundf(hum * 10), lroundf(temp * 10));
+    }
+    return FSM_ERR_OK;
+#endif
+  }
+
+  static fsm_err_t active_exit_fn() {
+#if DHT_ASYNC
+    if (dht_capture_busy()) {
+      abort_capture();
     }
+#endif
     return FSM_ERR_OK;
   }
 
   /******** NO OP FUNCTIONS ********/
   static fsm_err_t unknown_exit_fn() { return FSM_ERR_OK; }
   static fsm_err_t active_entry_fn() { return FSM_ERR_OK; }
-  static fsm_err_t active_exit_fn() { return FSM_ERR_OK; }
   static fsm_err_t inactive_entry_fn() { return FSM_ERR_OK; }
   static fsm_err_t inactive_exit_fn() { return FSM_ERR_OK; }
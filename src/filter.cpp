@@ -0,0 +1,63 @@
+#include "filter.h"
+
+#include <string.h>
+
+/************* Private Functions *************/
+static int32_t median(const filter_t *filter) {
+  int32_t sorted[FILTER_MEDIAN_SIZE];
+  memcpy(sorted, filter->window, filter->count * sizeof(sorted[0]));
+  // Insertion sort, the window is tiny
+  for (uint8_t i = 1; i < filter->count; i++) {
+    int32_t value = sorted[i];
+    uint8_t j = i;
+    while (j > 0 && sorted[j - 1] > value) {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = value;
+  }
+  return sorted[filter->count / 2];
+}
+
+/************* Public Functions *************/
+void filter_init(filter_t *filter, uint8_t ema_shift) {
+  memset(filter, 0, sizeof(*filter));
+  filter->ema_shift = ema_shift;
+}
+
+int32_t filter_push(filter_t *filter, int32_t value) {
+  filter->window[filter->next] = value;
+  filter->next = (filter->next + 1) % FILTER_MEDIAN_SIZE;
+  bool first = (0 == filter->count);
+  if (filter->count < FILTER_MEDIAN_SIZE) {
+    filter->count++;
+  }
+
+  int32_t target = median(filter) * (1 << FILTER_EMA_FRACTION_BITS);
+  if (first) {
+    filter->ema = target;
+  } else {
+    // Arithmetic shift of a signed difference rounds towards -infinity,
+    // which only costs a fraction of the last fixed-point bit
+    filter->ema += (target - filter->ema) >> filter->ema_shift;
+  }
+  return filter_value(filter);
+}
+
+int32_t filter_value(const filter_t *filter) {
+  const int32_t half = 1 << (FILTER_EMA_FRACTION_BITS - 1);
+  return (filter->ema + half) >> FILTER_EMA_FRACTION_BITS;
+}
+
+bool deadband_exceeded(const deadband_t *band, int32_t value, int32_t delta) {
+  if (!band->valid) {
+    return true;
+  }
+  int32_t diff = value - band->reported;
+  return diff >= delta || -diff >= delta;
+}
+
+void deadband_commit(deadband_t *band, int32_t value) {
+  band->reported = value;
+  band->valid = true;
+}
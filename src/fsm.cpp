@@ -1,35 +1,271 @@
 #include "fsm.h"
 
+#include <Arduino.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "HardwareSerial.h"
+#include "log.h"
+#include "profile.h"
+#include "trace.h"
+
+static const char *machine_names[FSM_MAX_MACHINES];
+static fsm_handle *machines[FSM_MAX_MACHINES];
+static uint8_t num_machines = 0;
+#if FSM_REPLAY
+static bool replay_sends_allowed = true;
+#endif
+
+/************* Private Functions *************/
+static bool queue_contains(const fsm_handle *state_machine, fsm_event event) {
+  uint16_t index = state_machine->queue_head;
+  for (uint16_t i = 0; i < state_machine->queue_count; i++) {
+    if (event == state_machine->queue[index]) {
+      return true;
+    }
+    index = (index + 1 == state_machine->queue_capacity) ? 0 : index + 1;
+  }
+  return false;
+}
+
+static fsm_event queue_pop(fsm_handle *state_machine) {
+  fsm_event event = state_machine->queue[state_machine->queue_head];
+  state_machine->queue_head =
+      (state_machine->queue_head + 1 == state_machine->queue_capacity)
+          ? 0
+          : state_machine->queue_head + 1;
+  state_machine->queue_count--;
+  return event;
+}
+
+static uint8_t isr_pending(const fsm_handle *state_machine) {
+  return (uint8_t)(__atomic_load_n(&state_machine->isr_tail, __ATOMIC_ACQUIRE) -
+                   state_machine->isr_head);
+}
+
+static void drain_isr_events(fsm_handle *state_machine) {
+  uint8_t head = state_machine->isr_head;
+  uint8_t pending = isr_pending(state_machine);
+  for (uint8_t i = 0; i < pending; i++, head++) {
+    fsm_send(state_machine,
+        state_machine->isr_events[head & (FSM_ISR_QUEUE_SIZE - 1)]);
+  }
+  __atomic_store_n(&state_machine->isr_head, head, __ATOMIC_RELEASE);
+}
+
+static fsm_err_t call_handler(const fsm_handle *state_machine,
+    fsm_function handler, profile_kind_t kind, fsm_state_ID state,
+    fsm_event event) {
+#if FSM_PROFILE
+  PROFILE_START(start);
+  fsm_err_t retVal = handler();
+  PROFILE_END(profile_key(state_machine->id, kind, state, event), start);
+  return retVal;
+#else
+  (void)state_machine;
+  (void)kind;
+  (void)state;
+  (void)event;
+  return handler();
+#endif
+}
+
+static fsm_err_t dispatch(fsm_handle *state_machine, fsm_event current_event) {
+  const fsm_state_t *current_state =
+      &state_machine->state_array[state_machine->current_state_ID];
+  fsm_state_ID destination_state_ID = FSM_NO_TRANSITION;
+  fsm_function transition_fn = NULL;
+
+  if (state_machine->dispatch_table) {
+    if (current_event < state_machine->num_events) {
+      const fsm_dispatch_t *dispatch =
+          &state_machine->dispatch_table[state_machine->current_state_ID *
+                                             state_machine->num_events +
+                                         current_event];
+      destination_state_ID = dispatch->destination_state_ID;
+      transition_fn = dispatch->transition_fn;
+    }
+  } else {
+    for (size_t i = 0; i < current_state->num_transitions; i++) {
+      if (current_event == current_state->transition_array[i].event) {
+        destination_state_ID =
+            current_state->transition_array[i].destination_state_ID;
+        transition_fn = current_state->transition_array[i].transition_fn;
+        break;
+      }
+    }
+  }
+  if (FSM_NO_TRANSITION == destination_state_ID) {
+    return FSM_ERR_OK;
+  }
+
+  const fsm_state_t *desired_state =
+      &state_machine->state_array[destination_state_ID];
+  if (state_machine->current_state_ID == destination_state_ID) {
+    if (transition_fn &&
+        0 != call_handler(state_machine, transition_fn,
+                 PROFILE_KIND_TRANSITION, current_state->ID, current_event)) {
+      return FSM_ERR_TRANS;
+    }
+  } else {
+    if (current_state->exit_fn &&
+        0 != call_handler(state_machine, current_state->exit_fn,
+                 PROFILE_KIND_EXIT, current_state->ID, current_event)) {
+      return FSM_ERR_TRANS;
+    }
+    if (desired_state->entry_fn &&
+        0 != call_handler(state_machine, desired_state->entry_fn,
+                 PROFILE_KIND_ENTRY, desired_state->ID, current_event)) {
+      return FSM_ERR_TRANS;
+    }
+  }
+  state_machine->current_state_ID = desired_state->ID;
+  return FSM_ERR_OK;
+}
 
 /************* Public Functions *************/
 fsm_err_t fsm_init(
     fsm_handle *state_machine, fsm_state_t *states, uint8_t num_states) {
-  if (!state_machine || !states || 0 == num_states) {
-    Serial.println("Bad Input");
+  const fsm_queue_config_t queue = {.buffer = NULL,
+      .capacity = MAX_PENDING_EVENTS,
+      .overflow_policy = FSM_OVERFLOW_DROP_NEWEST};
+  return fsm_init_with_queue(state_machine, states, num_states, &queue);
+}
+
+fsm_err_t fsm_init_with_queue(fsm_handle *state_machine, fsm_state_t *states,
+    uint8_t num_states, const fsm_queue_config_t *queue) {
+  return fsm_init_with_dispatch(
+      state_machine, states, num_states, NULL, 0, queue);
+}
+
+fsm_err_t fsm_init_with_dispatch(fsm_handle *state_machine,
+    fsm_state_t *states, uint8_t num_states, const fsm_dispatch_t *table,
+    uint16_t num_events, const fsm_queue_config_t *queue) {
+  if (!state_machine || !states || 0 == num_states || !queue ||
+      (table && 0 == num_events) ||
+      0 == queue->capacity ||
+      (!queue->buffer && MAX_PENDING_EVENTS < queue->capacity)) {
+    LOG_ERROR("fsm: bad input");
     return FSM_ERR_EINVAL;
   }
   state_machine->state_array = states;
   state_machine->num_states = num_states;
+  state_machine->dispatch_table = table;
+  state_machine->num_events = num_events;
   memset(
       state_machine->pending_events, 0, sizeof(state_machine->pending_events));
-  state_machine->num_pending_events = 0;
+  state_machine->queue =
+      queue->buffer ? queue->buffer : state_machine->pending_events;
+  state_machine->queue_capacity = queue->capacity;
+  state_machine->queue_head = 0;
+  state_machine->queue_count = 0;
+  state_machine->overflow_policy = queue->overflow_policy;
+  memset(&state_machine->queue_stats, 0, sizeof(state_machine->queue_stats));
+  state_machine->isr_head = 0;
+  state_machine->isr_tail = 0;
+  state_machine->isr_dropped = 0;
+  state_machine->id = FSM_NO_ID;
   state_machine->current_state_ID = 0;
   state_machine->state_array[state_machine->current_state_ID].entry_fn();
   return FSM_ERR_OK;
 }
 
+fsm_err_t fsm_set_name(fsm_handle *state_machine, const char *name) {
+  if (!state_machine || !name) {
+    return FSM_ERR_EINVAL;
+  }
+  for (uint8_t i = 0; i < num_machines; i++) {
+    if (0 == strcmp(machine_names[i], name)) {
+      machines[i] = state_machine;
+      state_machine->id = i + 1;
+      return FSM_ERR_OK;
+    }
+  }
+  if (FSM_MAX_MACHINES <= num_machines) {
+    return FSM_ERR_FULL;
+  }
+  machine_names[num_machines] = name;
+  machines[num_machines++] = state_machine;
+  state_machine->id = num_machines;
+  return FSM_ERR_OK;
+}
+
+const char *fsm_get_name(uint8_t id) {
+  if (FSM_NO_ID == id || id > num_machines) {
+    return "fsm";
+  }
+  return machine_names[id - 1];
+}
+
+fsm_handle *fsm_find(const char *name) {
+  for (uint8_t i = 0; name && i < num_machines; i++) {
+    if (0 == strcmp(machine_names[i], name)) {
+      return machines[i];
+    }
+  }
+  return NULL;
+}
+
+uint8_t fsm_num_machines(void) { return num_machines; }
+
+#if FSM_REPLAY
+void fsm_replay_allow_sends(bool allowed) { replay_sends_allowed = allowed; }
+#endif
+
 fsm_err_t fsm_send(fsm_handle *state_machine, fsm_event event) {
   if (!state_machine) {
     return FSM_ERR_EINVAL;
   }
-  if (MAX_PENDING_EVENTS <= state_machine->num_pending_events) {
+#if FSM_REPLAY
+  if (!replay_sends_allowed) {
+    return FSM_ERR_OK;
+  }
+#endif
+  if (state_machine->queue_capacity <= state_machine->queue_count) {
+    // Only a full queue merges, so order and repeats survive otherwise
+    if (FSM_OVERFLOW_COALESCE == state_machine->overflow_policy &&
+        queue_contains(state_machine, event)) {
+      state_machine->queue_stats.coalesced++;
+      return FSM_ERR_OK;
+    }
+    state_machine->queue_stats.dropped++;
+    if (FSM_OVERFLOW_DROP_OLDEST != state_machine->overflow_policy) {
+      return FSM_ERR_FULL;
+    }
+    queue_pop(state_machine);
+  }
+
+  uint16_t tail = state_machine->queue_head + state_machine->queue_count;
+  if (tail >= state_machine->queue_capacity) {
+    tail -= state_machine->queue_capacity;
+  }
+  state_machine->queue[tail] = event;
+  state_machine->queue_count++;
+  if (state_machine->queue_count > state_machine->queue_stats.high_water_mark) {
+    state_machine->queue_stats.high_water_mark = state_machine->queue_count;
+  }
+  return FSM_ERR_OK;
+}
+
+fsm_err_t IRAM_ATTR fsm_send_from_isr(
+    fsm_handle *state_machine, fsm_event event) {
+  if (!state_machine) {
+    return FSM_ERR_EINVAL;
+  }
+#if FSM_REPLAY
+  if (!replay_sends_allowed) {
+    return FSM_ERR_OK;
+  }
+#endif
+  uint8_t tail = state_machine->isr_tail;
+  uint8_t head = __atomic_load_n(&state_machine->isr_head, __ATOMIC_ACQUIRE);
+  if (FSM_ISR_QUEUE_SIZE <= (uint8_t)(tail - head)) {
+    __atomic_fetch_add(&state_machine->isr_dropped, 1, __ATOMIC_RELAXED);
     return FSM_ERR_FULL;
   }
-  state_machine->pending_events[state_machine->num_pending_events++] = event;
+  state_machine->isr_events[tail & (FSM_ISR_QUEUE_SIZE - 1)] = event;
+  __atomic_store_n(&state_machine->isr_tail, (uint8_t)(tail + 1),
+      __ATOMIC_RELEASE);
   return FSM_ERR_OK;
 }
 
@@ -37,44 +273,61 @@ fsm_err_t fsm_handle_event(fsm_handle *state_machine) {
   if (!state_machine) {
     return FSM_ERR_EINVAL;
   }
-  if (0 == state_machine->num_pending_events) {
+  drain_isr_events(state_machine);
+  if (0 == state_machine->queue_count) {
     return FSM_ERR_NO_EVENTS;
   }
 
-  fsm_state_t current_state =
-      state_machine->state_array[state_machine->current_state_ID];
-  fsm_event current_event = state_machine->pending_events[0];
-
-  for (size_t i = 0; i < state_machine->num_pending_events - 1; i++) {
-    state_machine->pending_events[i] = state_machine->pending_events[i + 1];
-  }
-
-  state_machine->num_pending_events--;
-  state_machine->pending_events[state_machine->num_pending_events] = 0;
-
-  for (size_t i = 0; i < current_state.num_transitions; i++) {
-    if (current_event == current_state.transition_array[i].event) {
-      fsm_state_t desired_state =
-          state_machine->state_array[current_state.transition_array[i]
-                                         .destination_state_ID];
-      if (state_machine->current_state_ID ==
-          current_state.transition_array[i].destination_state_ID) {
-        if (current_state.transition_array[i].transition_fn &&
-            0 != current_state.transition_array[i].transition_fn()) {
-          return FSM_ERR_TRANS;
-        }
-      } else {
-        if (current_state.exit_fn && 0 != current_state.exit_fn()) {
-          return FSM_ERR_TRANS;
-        }
-        if (desired_state.entry_fn && 0 != desired_state.entry_fn()) {
-          return FSM_ERR_TRANS;
-        }
+  fsm_state_ID state_ID = state_machine->current_state_ID;
+  fsm_event current_event = queue_pop(state_machine);
+  fsm_err_t retVal = dispatch(state_machine, current_event);
+#if FSM_TRACE
+  trace_record(state_machine->id, state_ID, current_event, retVal);
+#else
+  (void)state_ID;
+#endif
+  return retVal;
+}
+
+bool fsm_handles_event(const fsm_handle *state_machine, fsm_event event) {
+  if (!state_machine) {
+    return false;
+  }
+  for (uint8_t state = 0; state < state_machine->num_states; state++) {
+    if (state_machine->dispatch_table) {
+      if (event < state_machine->num_events &&
+          FSM_NO_TRANSITION !=
+              state_machine
+                  ->dispatch_table[state * state_machine->num_events + event]
+                  .destination_state_ID) {
+        return true;
+      }
+      continue;
+    }
+    const fsm_state_t *current_state = &state_machine->state_array[state];
+    for (size_t i = 0; i < current_state->num_transitions; i++) {
+      if (event == current_state->transition_array[i].event) {
+        return true;
       }
-      state_machine->current_state_ID = desired_state.ID;
-      break;
     }
   }
+  return false;
+}
 
+uint16_t fsm_pending_events(const fsm_handle *state_machine) {
+  if (!state_machine) {
+    return 0;
+  }
+  return state_machine->queue_count + isr_pending(state_machine);
+}
+
+fsm_err_t fsm_get_queue_stats(
+    const fsm_handle *state_machine, fsm_queue_stats_t *stats) {
+  if (!state_machine || !stats) {
+    return FSM_ERR_EINVAL;
+  }
+  *stats = state_machine->queue_stats;
+  stats->dropped +=
+      __atomic_load_n(&state_machine->isr_dropped, __ATOMIC_RELAXED);
   return FSM_ERR_OK;
 }
@@ -0,0 +1,221 @@
+#include "log.h"
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct log_record {
+  uint32_t sequence;  // slot ownership relative to its lap, see log_push()
+  uint32_t timestamp_ms;
+  const char *format;
+  log_arg_t args[LOG_MAX_ARGS];
+  uint8_t level;
+  uint8_t num_args;
+  uint16_t suppressed;
+} log_record_t;
+
+static log_record_t ring[LOG_RING_SIZE];
+static uint32_t write_pos = 0;
+static uint32_t read_pos = 0;
+static log_stats_t stats = {};
+static uint32_t reported_dropped = 0;
+
+// A formatted line that didn't fit in the UART buffer yet
+static char pending_line[LOG_LINE_LEN];
+static size_t pending_len = 0;
+
+static const char level_letters[] = "-EWID";
+
+/******** PRIVATE FUNCTIONS ********/
+static uint32_t lap(uint32_t pos) { return pos & ~(LOG_RING_SIZE - 1); }
+
+static size_t append(size_t used, int written) {
+  if (written < 0) {
+    return used;
+  }
+  return (used + written < LOG_LINE_LEN) ? used + written : LOG_LINE_LEN - 1;
+}
+
+// Formats one conversion at a time, so each argument gets its own type
+static size_t format_record(char *line, const log_record_t *record) {
+  size_t used = 0;
+  used = append(used,
+      snprintf(line, LOG_LINE_LEN, "%8u %c ", (unsigned)record->timestamp_ms,
+          level_letters[record->level < sizeof(level_letters) - 1
+                            ? record->level
+                            : 0]));
+
+  const char *format = record->format;
+  uint8_t arg = 0;
+  char spec[16];
+  while (*format && used < LOG_LINE_LEN - 1) {
+    const char *percent = strchr(format, '%');
+    size_t literal = percent ? (size_t)(percent - format) : strlen(format);
+    if (literal) {
+      size_t room = LOG_LINE_LEN - 1 - used;
+      size_t copy = (literal < room) ? literal : room;
+      memcpy(line + used, format, copy);
+      used += copy;
+      format += literal;
+      continue;
+    }
+    // Copy "%[flags][width]<conversion>" into spec, dropping any length
+    // modifier since every argument is stored as 32 bits
+    size_t spec_len = 0;
+    spec[spec_len++] = *format++;
+    while (*format && !strchr("diuxXcs%", *format)) {
+      if (!strchr("hlzjt", *format) && spec_len < sizeof(spec) - 2) {
+        spec[spec_len++] = *format;
+      }
+      format++;
+    }
+    if (!*format) {
+      break;
+    }
+    spec[spec_len++] = *format++;
+    spec[spec_len] = '\0';
+
+    char conversion = spec[spec_len - 1];
+    int written;
+    if ('%' == conversion) {
+      written = snprintf(line + used, LOG_LINE_LEN - used, "%%");
+    } else if (arg >= record->num_args) {
+      written = snprintf(line + used, LOG_LINE_LEN - used, "?");
+    } else if ('s' == conversion) {
+      const log_arg_t *value = &record->args[arg++];
+      written = snprintf(line + used, LOG_LINE_LEN - used, spec,
+          (LOG_ARG_STR == value->type && value->s) ? value->s : "?");
+    } else if (LOG_ARG_STR == record->args[arg].type) {
+      arg++;
+      written = snprintf(line + used, LOG_LINE_LEN - used, "?");
+    } else if (LOG_ARG_INT == record->args[arg].type) {
+      written = snprintf(
+          line + used, LOG_LINE_LEN - used, spec, record->args[arg++].i);
+    } else {
+      written = snprintf(
+          line + used, LOG_LINE_LEN - used, spec, record->args[arg++].u);
+    }
+    used = append(used, written);
+  }
+
+  if (record->suppressed) {
+    used = append(used,
+        snprintf(line + used, LOG_LINE_LEN - used, " (%u suppressed)",
+            (unsigned)record->suppressed));
+  }
+  if (used > LOG_LINE_LEN - 2) {
+    used = LOG_LINE_LEN - 2;
+  }
+  line[used++] = '\n';
+  line[used] = '\0';
+  return used;
+}
+
+static bool pop(log_record_t *record) {
+  log_record_t *slot = &ring[read_pos & (LOG_RING_SIZE - 1)];
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) !=
+      lap(read_pos) + 1) {
+    return false;
+  }
+  *record = *slot;
+  __atomic_store_n(
+      &slot->sequence, lap(read_pos) + LOG_RING_SIZE, __ATOMIC_RELEASE);
+  read_pos++;
+  return true;
+}
+
+static bool flush_pending(void) {
+  if (0 == pending_len) {
+    return true;
+  }
+  if ((size_t)Serial.availableForWrite() < pending_len) {
+    return false;
+  }
+  Serial.write((const uint8_t *)pending_line, pending_len);
+  pending_len = 0;
+  return true;
+}
+
+/******** PUBLIC FUNCTIONS ********/
+bool log_allow(log_site_t *site, uint16_t *suppressed) {
+  uint32_t now_ms = millis();
+  if (0 == site->in_window ||
+      now_ms - site->window_start_ms >= LOG_SITE_INTERVAL_MS) {
+    site->window_start_ms = now_ms;
+    site->in_window = 0;
+  }
+  if (site->in_window >= LOG_SITE_BURST) {
+    if (UINT16_MAX != site->suppressed) {
+      site->suppressed++;
+    }
+    __atomic_fetch_add(&stats.suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  site->in_window++;
+  *suppressed = site->suppressed;
+  site->suppressed = 0;
+  return true;
+}
+
+// Bounded MPMC ring (Vyukov), with sequences stored relative to the slot
+// index so the zeroed ring is valid: a slot is free for position p when its
+// sequence is lap(p), holds p's record at lap(p) + 1 and is free for the
+// next lap at lap(p) + LOG_RING_SIZE
+void log_push(uint8_t level, const char *format, const log_arg_t *args,
+    uint8_t num_args, uint16_t suppressed) {
+  uint32_t pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+  log_record_t *slot;
+  for (;;) {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    int32_t diff = (int32_t)(
+        __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - lap(pos));
+    if (0 == diff) {
+      if (__atomic_compare_exchange_n(&write_pos, &pos, pos + 1, true,
+              __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      __atomic_fetch_add(&stats.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+    }
+  }
+  slot->timestamp_ms = millis();
+  slot->format = format;
+  slot->level = level;
+  slot->num_args = num_args;
+  slot->suppressed = suppressed;
+  memcpy(slot->args, args, num_args * sizeof(log_arg_t));
+  __atomic_store_n(&slot->sequence, lap(pos) + 1, __ATOMIC_RELEASE);
+}
+
+void log_drain(void) {
+  if (!flush_pending()) {
+    return;
+  }
+  uint32_t dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+  if (dropped != reported_dropped) {
+    pending_len = snprintf(pending_line, sizeof(pending_line),
+        "%8u W log: %u messages dropped\n", (unsigned)millis(),
+        (unsigned)(dropped - reported_dropped));
+    reported_dropped = dropped;
+    if (!flush_pending()) {
+      return;
+    }
+  }
+  log_record_t record;
+  while (pop(&record)) {
+    pending_len = format_record(pending_line, &record);
+    stats.written++;
+    if (!flush_pending()) {
+      return;
+    }
+  }
+}
+
+void log_get_stats(log_stats_t *stats_out) {
+  stats_out->written = stats.written;
+  stats_out->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+  stats_out->suppressed = __atomic_load_n(&stats.suppressed, __ATOMIC_RELAXED);
+}
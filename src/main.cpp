@@ -1,70 +1,156 @@
 #include <Arduino.h>
-#include <Config.h>
 
+#include "boot.h"
+#include "console.h"
+#include "device_config.h"
 #include "dht_fsm.h"
+#include "log.h"
 #include "mqtt_fsm.h"
 #include "ota_handler.h"
+#include "power.h"
+#include "profile.h"
 #include "prox_fsm.h"
+#include "scheduler.h"
+#include "sensor_link.h"
+#include "settings.h"
+#include "tasks.h"
 #include "wifi_fsm.h"
 
 /***** DEFINES *****/
-#define MEASUREMENT_INTERVAL_MS (500)
+#define MAX_SLEEP_MS (500)
 #define ONBOARD_LED 2
 #define SERIAL_SPEED 115200
 
+// Each group of FSMs has its own timers, see tasks.h
+static scheduler_t network_scheduler;
+static scheduler_t sensor_scheduler;
+
+// Runs in the sensor FSMs, the MQTT FSM only sees these snapshots
+static void push_reading(void) {
+  uint32_t now_ms = millis();
+  sensor_reading_t reading = {.timestamp_ms = now_ms,
+      .occupied_edge_us = prox_get_occupied_edge_us(),
+      .temperature_x10 = get_temp_x10(),
+      .raw_temperature_x10 = get_raw_temp_x10(),
+      .humidity_x10 = get_hum_x10(),
+      .climate_valid = dht_has_reading(),
+      .occupied = get_prox()};
+  mqtt_fsm_push_reading(&reading);
+}
+
+static void on_occupancy_change(void) {
+  push_reading();
+  mqtt_fsm_send_from_isr(MQTT_EVENT_OCCUPANCY);
+  power_wake();
+}
+
 void setup() {
   Serial.begin(SERIAL_SPEED);
 
   pinMode(ONBOARD_LED, OUTPUT);
+#if !FAST_BOOT
   delay(3000);
+#endif
+  boot_timing_mark("serial");
+  // Takes the configuration before anything else, or any task, reads it
+  device_config_get();
+  if (!device_config_provisioned()) {
+    LOG_WARN("config: not provisioned, see the serial console");
+  }
+  settings_init();
 
+  // Start associating first so it overlaps with the sensor warm-up
+  wifi_fsm_init(ONBOARD_LED);
+  while (FSM_ERR_OK == wifi_fsm_handle_event()) {
+  }
+  boot_timing_mark("wifi started");
   dht_fsm_init();
   prox_fsm_init();
-  wifi_fsm_init(ONBOARD_LED);
+  dht_fsm_on_reading(push_reading);
+  prox_fsm_on_change(on_occupancy_change);
+  boot_timing_mark("sensors");
   mqtt_fsm_init();
   setup_ota();
-}
+  power_init(PROX_INPUT, prox_notify_motion);
 
-static void send_periodic_events(fsm_event event) {
-  dht_fsm_send(event);
-  prox_fsm_send(event);
-  wifi_fsm_send(event);
-  mqtt_fsm_send(event);
+  uint32_t now_ms = millis();
+  scheduler_init(&network_scheduler, now_ms);
+  scheduler_init(&sensor_scheduler, now_ms);
+  dht_fsm_schedule(&sensor_scheduler);
+  prox_fsm_schedule(&sensor_scheduler);
+  wifi_fsm_schedule(&network_scheduler);
+  mqtt_fsm_schedule(&network_scheduler);
+  boot_timing_mark("setup done");
 }
 
-void handle_events(void) {
+static void drain_events(fsm_err_t (*handle_event)(void)) {
   fsm_err_t retVal = FSM_ERR_OK;
   while (FSM_ERR_NO_EVENTS != retVal && FSM_ERR_OK == retVal) {
-    retVal = wifi_fsm_handle_event();
-  }
-  retVal = FSM_ERR_OK;
-  while (FSM_ERR_NO_EVENTS != retVal && FSM_ERR_OK == retVal) {
-    retVal = mqtt_fsm_handle_event();
-  }
-  retVal = FSM_ERR_OK;
-  while (FSM_ERR_NO_EVENTS != retVal && FSM_ERR_OK == retVal) {
-    retVal = prox_fsm_handle_event();
-  }
-  retVal = FSM_ERR_OK;
-  while (FSM_ERR_NO_EVENTS != retVal && FSM_ERR_OK == retVal) {
-    retVal = dht_fsm_handle_event();
+    retVal = handle_event();
   }
 }
 
-void loop() {
-  static uint16_t elapsed_time_ms = 0;
+static void handle_network_events(void) {
+  drain_events(wifi_fsm_handle_event);
+  drain_events(mqtt_fsm_handle_event);
+}
+
+static void handle_sensor_events(void) {
+  drain_events(prox_fsm_handle_event);
+  drain_events(dht_fsm_handle_event);
+}
+
+// Sleep until the next deadline, but keep OTA and motion events responsive
+static uint32_t idle_time(const scheduler_t *scheduler) {
+  uint32_t sleep_ms = scheduler_time_until_next(scheduler, millis());
+  return (sleep_ms < MAX_SLEEP_MS) ? sleep_ms : MAX_SLEEP_MS;
+}
+
+#if DUAL_CORE
+static uint32_t network_step(void) {
+  console_poll();
   ota_handler();
+  scheduler_dispatch(&network_scheduler, millis());
+  handle_network_events();
+  log_drain();
+  return idle_time(&network_scheduler);
+}
 
-  if (0 == elapsed_time_ms % MEASUREMENT_INTERVAL_MS) {
-    send_periodic_events(FSM_PERIODIC_EVENT_500MS);
-  }
-  if (0 == elapsed_time_ms % 1000) {
-    send_periodic_events(FSM_PERIODIC_EVENT_1S);
-  }
-  if (0 == elapsed_time_ms % 5000) {
-    send_periodic_events(FSM_PERIODIC_EVENT_5S);
+static uint32_t sensor_step(void) {
+  scheduler_dispatch(&sensor_scheduler, millis());
+  handle_sensor_events();
+  return idle_time(&sensor_scheduler);
+}
+#endif
+
+void loop() {
+#if DUAL_CORE
+  static bool tasks_tried = false;
+  if (!tasks_tried) {
+    tasks_tried = true;
+    if (tasks_start(network_step, sensor_step)) {
+      vTaskDelete(NULL);
+    }
   }
-  handle_events();
-  delay(MEASUREMENT_INTERVAL_MS);
-  elapsed_time_ms = (elapsed_time_ms + MEASUREMENT_INTERVAL_MS) % 5000;
+#endif
+  // Both groups in turn, also the fallback if the tasks couldn't be created
+  console_poll();
+  PROFILE_START(loop_start);
+  ota_handler();
+  PROFILE_END(PROFILE_LOOP_KEY(PROFILE_LOOP_OTA), loop_start);
+  PROFILE_START(scheduler_start);
+  scheduler_dispatch(&network_scheduler, millis());
+  scheduler_dispatch(&sensor_scheduler, millis());
+  PROFILE_END(PROFILE_LOOP_KEY(PROFILE_LOOP_SCHEDULER), scheduler_start);
+  PROFILE_START(events_start);
+  handle_network_events();
+  handle_sensor_events();
+  PROFILE_END(PROFILE_LOOP_KEY(PROFILE_LOOP_EVENTS), events_start);
+  PROFILE_END(PROFILE_LOOP_KEY(PROFILE_LOOP_BUSY), loop_start);
+  log_drain();
+
+  uint32_t network_sleep_ms = idle_time(&network_scheduler);
+  uint32_t sensor_sleep_ms = idle_time(&sensor_scheduler);
+  power_idle((network_sleep_ms < sensor_sleep_ms) ? network_sleep_ms
+                                                  : sensor_sleep_ms);
 }
@@ -0,0 +1,567 @@
+#include "mqtt_client.h"
+
+#include <string.h>
+
+// Fixed header first bytes, MQTT 3.1.1 section 2.2
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x82
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+#define MQTT_DISCONNECT 0xE0
+
+#define MQTT_QOS1 0x02
+#define MQTT_DUP 0x08
+
+#define MQTT_PROTOCOL_LEVEL 4
+#define MQTT_CLEAN_SESSION 0x02
+#define MQTT_MAX_HEADER_LEN 5  // type and up to four length bytes
+#define MQTT_RETRY_MS (10 * 1000)  // until mqtt_client_set_window()
+
+/************* Private Functions *************/
+static uint8_t varint_len(uint32_t value) {
+  uint8_t len = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    len++;
+  }
+  return len;
+}
+
+/**
+ * @brief Reserve room for a whole packet in the send buffer
+ *
+ * @return uint8_t* where the variable header goes, NULL if it doesn't fit
+ */
+static uint8_t *begin_packet(
+    mqtt_client_t *client, uint8_t header, uint32_t remaining) {
+  uint32_t total = 1 + varint_len(remaining) + remaining;
+  if (total > (uint32_t)(MQTT_CLIENT_TX_LEN - client->tx_len)) {
+    return NULL;
+  }
+  uint8_t *pos = &client->tx[client->tx_len];
+  *pos++ = header;
+  do {
+    uint8_t byte = remaining & 0x7F;
+    remaining >>= 7;
+    *pos++ = byte | (remaining ? 0x80 : 0);
+  } while (remaining);
+  client->tx_len += total;
+  client->last_tx_ms = client->now_ms;
+  return pos;
+}
+
+static uint8_t *put_u16(uint8_t *pos, uint16_t value) {
+  *pos++ = value >> 8;
+  *pos++ = value & 0xFF;
+  return pos;
+}
+
+static uint8_t *put_string(uint8_t *pos, const char *str, size_t len) {
+  pos = put_u16(pos, len);
+  memcpy(pos, str, len);
+  return pos + len;
+}
+
+static uint16_t get_u16(const uint8_t *pos) { return (pos[0] << 8) | pos[1]; }
+
+static bool packet_id_in_use(const mqtt_client_t *client, uint16_t id) {
+  for (uint8_t i = 0; i < client->inflight_count; i++) {
+    if (id == client->inflight[i].packet_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint16_t take_packet_id(mqtt_client_t *client) {
+  do {
+    if (0 == ++client->next_packet_id) {
+      client->next_packet_id = 1;
+    }
+  } while (packet_id_in_use(client, client->next_packet_id));
+  return client->next_packet_id;
+}
+
+// Writes as much of the send buffer as the transport takes
+static bool flush(mqtt_client_t *client) {
+  while (client->tx_len) {
+    int sent = client->transport->write(
+        client->transport->ctx, client->tx, client->tx_len);
+    if (sent < 0) {
+      return false;
+    }
+    if (0 == sent) {
+      break;
+    }
+    client->tx_len -= sent;
+    memmove(client->tx, &client->tx[sent], client->tx_len);
+  }
+  return true;
+}
+
+static mqtt_client_event_t drop(
+    mqtt_client_t *client, mqtt_client_event_t event) {
+  client->transport->close(client->transport->ctx);
+  client->state = MQTT_CLIENT_CLOSED;
+  client->tx_len = 0;
+  client->rx_len = 0;
+  client->rx_skip = 0;
+  client->rx_skip_ack = false;
+  client->ping_pending = false;
+  client->inflight_count = 0;
+  client->held_len = 0;
+  return event;
+}
+
+static void consume(mqtt_client_t *client, uint16_t len) {
+  client->rx_len -= len;
+  memmove(client->rx, &client->rx[len], client->rx_len);
+}
+
+/**
+ * @brief Decode the fixed header at the start of the receive buffer
+ *
+ * @return int 1 if decoded, 0 if more bytes are needed, -1 if malformed
+ */
+static int decode_header(
+    const mqtt_client_t *client, uint8_t *header_len, uint32_t *remaining) {
+  *remaining = 0;
+  for (uint8_t i = 1; i < MQTT_MAX_HEADER_LEN; i++) {
+    if (i >= client->rx_len) {
+      return 0;
+    }
+    *remaining |= (uint32_t)(client->rx[i] & 0x7F) << (7 * (i - 1));
+    if (0 == (client->rx[i] & 0x80)) {
+      *header_len = i + 1;
+      return 1;
+    }
+  }
+  return -1;
+}
+
+static void send_puback(mqtt_client_t *client, uint16_t packet_id) {
+  uint8_t *pos = begin_packet(client, MQTT_PUBACK, 2);
+  if (pos) {
+    put_u16(pos, packet_id);
+  }
+}
+
+static void handle_publish(
+    mqtt_client_t *client, uint8_t header, const uint8_t *body, uint32_t len) {
+  uint8_t qos = (header >> 1) & 0x03;
+  if (len < 2) {
+    return;
+  }
+  uint16_t topic_len = get_u16(body);
+  uint32_t payload_pos = 2 + topic_len + ((qos > 0) ? 2 : 0);
+  if (payload_pos > len) {
+    client->stats.skipped++;
+    return;
+  }
+  // A message that isn't acknowledged would be delivered again forever
+  if (1 == qos) {
+    send_puback(client, get_u16(&body[2 + topic_len]));
+  }
+  if (topic_len >= MQTT_CLIENT_TOPIC_LEN) {
+    client->stats.skipped++;
+    return;
+  }
+  char topic[MQTT_CLIENT_TOPIC_LEN];
+  memcpy(topic, &body[2], topic_len);
+  topic[topic_len] = '\0';
+  if (client->on_message) {
+    client->on_message(topic, &body[payload_pos], len - payload_pos);
+  }
+}
+
+// Retires acknowledged publishes from the front of the window, in order
+static void handle_puback(
+    mqtt_client_t *client, const uint8_t *body, uint32_t len) {
+  if (len < 2) {
+    return;
+  }
+  uint16_t packet_id = get_u16(body);
+  for (uint8_t i = 0; i < client->inflight_count; i++) {
+    if (packet_id == client->inflight[i].packet_id &&
+        !client->inflight[i].acked) {
+      client->inflight[i].acked = true;
+      client->stats.acked++;
+      break;
+    }
+  }
+  // Brokers acknowledge in order, so this is normally just the oldest
+  while (client->inflight_count && client->inflight[0].acked) {
+    uint16_t tag = client->inflight[0].tag;
+    client->held_len -= client->inflight[0].len;
+    memmove(client->held, &client->held[client->inflight[0].len],
+        client->held_len);
+    client->inflight_count--;
+    memmove(client->inflight, &client->inflight[1],
+        client->inflight_count * sizeof(client->inflight[0]));
+    if (client->on_ack) {
+      client->on_ack(tag);
+    }
+  }
+}
+
+static mqtt_client_event_t handle_packet(
+    mqtt_client_t *client, uint8_t header, const uint8_t *body, uint32_t len) {
+  client->last_rx_ms = client->now_ms;
+  switch (header & 0xF0) {
+    case MQTT_CONNACK:
+      if (len < 2 || MQTT_CLIENT_OPEN != client->state) {
+        return drop(client, MQTT_CLIENT_EVENT_LOST);
+      }
+      client->return_code = body[1];
+      if (0 != client->return_code) {
+        return drop(client, MQTT_CLIENT_EVENT_REFUSED);
+      }
+      client->state = MQTT_CLIENT_CONNECTED;
+      client->session_present = (0 != (body[0] & 0x01));
+      return MQTT_CLIENT_EVENT_CONNACK;
+    case MQTT_PUBLISH:
+      handle_publish(client, header, body, len);
+      return MQTT_CLIENT_EVENT_NONE;
+    case MQTT_PUBACK:
+      handle_puback(client, body, len);
+      return MQTT_CLIENT_EVENT_NONE;
+    case MQTT_PINGRESP:
+      client->ping_pending = false;
+      return MQTT_CLIENT_EVENT_NONE;
+    default:  // SUBACK
+      return MQTT_CLIENT_EVENT_NONE;
+  }
+}
+
+/**
+ * @brief Start skipping a packet too large for the receive buffer
+ *
+ * A QoS 1 PUBLISH is still acknowledged once its packet ID streams past.
+ *
+ * @return bool false if more bytes are needed to find the packet ID
+ */
+static bool skip_packet(
+    mqtt_client_t *client, uint8_t header_len, uint32_t remaining) {
+  bool qos1 = (MQTT_PUBLISH == (client->rx[0] & 0xF0)) &&
+              (1 == ((client->rx[0] >> 1) & 0x03));
+  uint32_t id_at = 0;
+  if (qos1) {
+    if (client->rx_len < header_len + 2) {
+      return false;
+    }
+    id_at = header_len + 2 + get_u16(&client->rx[header_len]);
+    qos1 = id_at + 2 <= header_len + remaining;
+  }
+  client->stats.skipped++;
+  client->rx_skip = header_len + remaining;
+  client->rx_skip_ack = qos1;
+  client->rx_skip_id_at = id_at;
+  return true;
+}
+
+// Handles the complete packets in the receive buffer, up to the first event
+static mqtt_client_event_t parse(mqtt_client_t *client) {
+  while (client->rx_len) {
+    if (client->rx_skip) {
+      if (client->rx_skip_ack && 0 == client->rx_skip_id_at) {
+        if (client->rx_len < 2) {
+          break;
+        }
+        send_puback(client, get_u16(client->rx));
+        client->rx_skip_ack = false;
+        consume(client, 2);
+        client->rx_skip -= 2;
+        continue;
+      }
+      uint32_t len = (client->rx_skip < client->rx_len) ? client->rx_skip
+                                                        : client->rx_len;
+      if (client->rx_skip_ack && len > client->rx_skip_id_at) {
+        len = client->rx_skip_id_at;
+      }
+      consume(client, len);
+      client->rx_skip -= len;
+      client->rx_skip_id_at -= client->rx_skip_ack ? len : 0;
+      continue;
+    }
+    uint8_t header_len = 0;
+    uint32_t remaining = 0;
+    int decoded = decode_header(client, &header_len, &remaining);
+    if (decoded < 0) {
+      return drop(client, MQTT_CLIENT_EVENT_LOST);
+    }
+    if (0 == decoded) {
+      break;
+    }
+    uint32_t total = header_len + remaining;
+    if (total > MQTT_CLIENT_RX_LEN) {
+      if (!skip_packet(client, header_len, remaining)) {
+        break;
+      }
+      continue;
+    }
+    if (total > client->rx_len) {
+      break;
+    }
+    mqtt_client_event_t event = handle_packet(
+        client, client->rx[0], &client->rx[header_len], remaining);
+    if (MQTT_CLIENT_CLOSED == client->state) {
+      return event;
+    }
+    consume(client, total);
+    if (MQTT_CLIENT_EVENT_NONE != event) {
+      return event;
+    }
+  }
+  return MQTT_CLIENT_EVENT_NONE;
+}
+
+static mqtt_client_event_t receive(mqtt_client_t *client) {
+  for (;;) {
+    mqtt_client_event_t event = parse(client);
+    if (MQTT_CLIENT_EVENT_NONE != event) {
+      return event;
+    }
+    int received = client->transport->read(client->transport->ctx,
+        &client->rx[client->rx_len], MQTT_CLIENT_RX_LEN - client->rx_len);
+    if (received < 0) {
+      return drop(client, MQTT_CLIENT_EVENT_LOST);
+    }
+    if (0 == received) {
+      return MQTT_CLIENT_EVENT_NONE;
+    }
+    client->rx_len += received;
+  }
+}
+
+// Sends held publishes again once their PUBACK is overdue
+static void resend_late(mqtt_client_t *client) {
+  uint16_t offset = 0;
+  for (uint8_t i = 0; i < client->inflight_count; i++) {
+    mqtt_client_inflight_t *entry = &client->inflight[i];
+    uint8_t *packet = &client->held[offset];
+    offset += entry->len;
+    if (entry->acked || client->now_ms - entry->sent_ms < client->retry_ms) {
+      continue;
+    }
+    if (entry->len > MQTT_CLIENT_TX_LEN - client->tx_len) {
+      return;  // the rest waits for the next poll
+    }
+    packet[0] |= MQTT_DUP;
+    memcpy(&client->tx[client->tx_len], packet, entry->len);
+    client->tx_len += entry->len;
+    client->last_tx_ms = client->now_ms;
+    entry->sent_ms = client->now_ms;
+    client->stats.retransmits++;
+  }
+}
+
+static mqtt_client_event_t keep_alive(mqtt_client_t *client) {
+  uint32_t now_ms = client->now_ms;
+  if (0 == client->keepalive_ms) {
+    return MQTT_CLIENT_EVENT_NONE;
+  }
+  if (client->ping_pending) {
+    // A half-open connection only shows up as a missing PINGRESP
+    if (now_ms - client->ping_sent_ms >= client->keepalive_ms) {
+      client->stats.ping_timeouts++;
+      return drop(client, MQTT_CLIENT_EVENT_LOST);
+    }
+    return MQTT_CLIENT_EVENT_NONE;
+  }
+  if (now_ms - client->last_tx_ms >= client->keepalive_ms ||
+      now_ms - client->last_rx_ms >= client->keepalive_ms) {
+    if (begin_packet(client, MQTT_PINGREQ, 0)) {
+      client->ping_pending = true;
+      client->ping_sent_ms = now_ms;
+      client->stats.pings++;
+    }
+  }
+  return flush(client) ? MQTT_CLIENT_EVENT_NONE
+                       : drop(client, MQTT_CLIENT_EVENT_LOST);
+}
+
+/************* Public Functions *************/
+void mqtt_client_init(mqtt_client_t *client, const mqtt_transport_t *transport,
+    const char *client_id, mqtt_message_fn on_message) {
+  memset(client, 0, sizeof(*client));
+  client->transport = transport;
+  client->client_id = client_id;
+  client->on_message = on_message;
+  client->state = MQTT_CLIENT_CLOSED;
+  client->window = 1;
+  client->retry_ms = MQTT_RETRY_MS;
+}
+
+void mqtt_client_set_window(mqtt_client_t *client, uint8_t window,
+    uint32_t retry_ms, mqtt_ack_fn on_ack) {
+  if (window > MQTT_CLIENT_WINDOW_MAX) {
+    window = MQTT_CLIENT_WINDOW_MAX;
+  }
+  client->window = window;
+  client->retry_ms = retry_ms;
+  client->on_ack = on_ack;
+}
+
+bool mqtt_client_open(
+    mqtt_client_t *client, const char *host, uint16_t port, uint32_t now_ms) {
+  mqtt_client_close(client);
+  client->now_ms = now_ms;
+  client->session_present = false;
+  if (!client->transport->open(client->transport->ctx, host, port)) {
+    return false;
+  }
+  client->state = MQTT_CLIENT_OPENING;
+  return true;
+}
+
+bool mqtt_client_connect(
+    mqtt_client_t *client, uint16_t keepalive_s, bool clean_session) {
+  if (MQTT_CLIENT_OPEN != client->state) {
+    return false;
+  }
+  size_t id_len = strlen(client->client_id);
+  uint8_t *pos = begin_packet(client, MQTT_CONNECT, 10 + 2 + id_len);
+  if (!pos) {
+    return false;
+  }
+  pos = put_string(pos, "MQTT", 4);
+  *pos++ = MQTT_PROTOCOL_LEVEL;
+  *pos++ = clean_session ? MQTT_CLEAN_SESSION : 0;
+  pos = put_u16(pos, keepalive_s);
+  put_string(pos, client->client_id, id_len);
+  client->keepalive_ms = keepalive_s * 1000UL;
+  // A write error shows up as MQTT_CLIENT_EVENT_LOST on the next poll
+  flush(client);
+  return true;
+}
+
+mqtt_client_event_t mqtt_client_poll(mqtt_client_t *client, uint32_t now_ms) {
+  client->now_ms = now_ms;
+  if (MQTT_CLIENT_CLOSED == client->state) {
+    return MQTT_CLIENT_EVENT_NONE;
+  }
+  if (MQTT_CLIENT_OPENING == client->state) {
+    int opened = client->transport->poll_open(client->transport->ctx);
+    if (opened < 0) {
+      return drop(client, MQTT_CLIENT_EVENT_LOST);
+    }
+    if (0 == opened) {
+      return MQTT_CLIENT_EVENT_NONE;
+    }
+    client->state = MQTT_CLIENT_OPEN;
+    client->last_tx_ms = now_ms;
+    client->last_rx_ms = now_ms;
+    return MQTT_CLIENT_EVENT_OPEN;
+  }
+
+  if (!flush(client)) {
+    return drop(client, MQTT_CLIENT_EVENT_LOST);
+  }
+  mqtt_client_event_t event = receive(client);
+  if (MQTT_CLIENT_EVENT_NONE != event ||
+      MQTT_CLIENT_CONNECTED != client->state) {
+    return event;
+  }
+  resend_late(client);
+  return keep_alive(client);
+}
+
+bool mqtt_client_publish(mqtt_client_t *client, const char *topic,
+    const uint8_t *payload, size_t len) {
+  if (MQTT_CLIENT_CONNECTED != client->state) {
+    return false;
+  }
+  size_t topic_len = strlen(topic);
+  uint8_t *pos = begin_packet(client, MQTT_PUBLISH, 2 + topic_len + len);
+  if (!pos) {
+    return false;
+  }
+  pos = put_string(pos, topic, topic_len);
+  memcpy(pos, payload, len);
+  return flush(client);
+}
+
+bool mqtt_client_publish_qos1(mqtt_client_t *client, const char *topic,
+    const uint8_t *payload, size_t len, uint16_t tag) {
+  if (MQTT_CLIENT_CONNECTED != client->state ||
+      0 == mqtt_client_window_free(client)) {
+    return false;
+  }
+  size_t topic_len = strlen(topic);
+  uint32_t remaining = 2 + topic_len + 2 + len;
+  uint32_t total = 1 + varint_len(remaining) + remaining;
+  if (total > (uint32_t)(MQTT_CLIENT_HELD_LEN - client->held_len)) {
+    return false;
+  }
+  uint8_t *pos = begin_packet(client, MQTT_PUBLISH | MQTT_QOS1, remaining);
+  if (!pos) {
+    return false;
+  }
+  uint16_t packet_id = take_packet_id(client);
+  pos = put_string(pos, topic, topic_len);
+  pos = put_u16(pos, packet_id);
+  memcpy(pos, payload, len);
+  memcpy(&client->held[client->held_len], &client->tx[client->tx_len - total],
+      total);
+  client->held_len += total;
+  mqtt_client_inflight_t *entry = &client->inflight[client->inflight_count++];
+  entry->packet_id = packet_id;
+  entry->len = total;
+  entry->tag = tag;
+  entry->acked = false;
+  entry->sent_ms = client->now_ms;
+  return flush(client);
+}
+
+uint8_t mqtt_client_window_free(const mqtt_client_t *client) {
+  return (client->window > client->inflight_count)
+             ? client->window - client->inflight_count
+             : 0;
+}
+
+uint32_t mqtt_client_qos1_size(const char *topic, size_t len) {
+  uint32_t remaining = 2 + strlen(topic) + 2 + len;
+  return 1 + varint_len(remaining) + remaining;
+}
+
+bool mqtt_client_qos1_fits(
+    const mqtt_client_t *client, uint8_t count, uint32_t size) {
+  return MQTT_CLIENT_CONNECTED == client->state &&
+         count <= mqtt_client_window_free(client) &&
+         size <= (uint32_t)(MQTT_CLIENT_TX_LEN - client->tx_len) &&
+         size <= (uint32_t)(MQTT_CLIENT_HELD_LEN - client->held_len);
+}
+
+bool mqtt_client_subscribe(
+    mqtt_client_t *client, const char *topic, uint8_t qos) {
+  if (MQTT_CLIENT_CONNECTED != client->state) {
+    return false;
+  }
+  size_t topic_len = strlen(topic);
+  uint8_t *pos = begin_packet(client, MQTT_SUBSCRIBE, 2 + 2 + topic_len + 1);
+  if (!pos) {
+    return false;
+  }
+  pos = put_u16(pos, take_packet_id(client));
+  pos = put_string(pos, topic, topic_len);
+  *pos = qos;
+  return flush(client);
+}
+
+void mqtt_client_close(mqtt_client_t *client) {
+  if (MQTT_CLIENT_CLOSED == client->state) {
+    return;
+  }
+  if (MQTT_CLIENT_CONNECTED == client->state &&
+      begin_packet(client, MQTT_DISCONNECT, 0)) {
+    flush(client);
+  }
+  drop(client, MQTT_CLIENT_EVENT_NONE);
+}
+
+bool mqtt_client_connected(const mqtt_client_t *client) {
+  return MQTT_CLIENT_CONNECTED == client->state;
+}
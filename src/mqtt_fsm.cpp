@@ -1,25 +1,117 @@
 #include "mqtt_fsm.h"
 
 #include <Arduino.h>
-#include <CircularBuffer.h>
-#include <PubSubClient.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include "Config.h"
+#include "boot.h"
+#include "calibration.h"
+#include "device_config.h"
 #include "dht_fsm.h"
+#include "filter.h"
+#include "fsm_table.h"
+#include "log.h"
+#include "mqtt_client.h"
+#include "occupancy.h"
+#include "outbox.h"
+#include "payload.h"
+#include "power.h"
+#include "profile.h"
 #include "prox_fsm.h"
+#include "sample_queue.h"
+#include "sensor_link.h"
+#include "settings.h"
+#include "trace.h"
 #include "wifi_fsm.h"
 
+#define MQTT_QUEUE_SIZE 8
+#define MQTT_TOPIC_LEN 64
+#define MQTT_DIAG_INTERVAL_TICKS 12  // 5 s ticks, once a minute
+#define MQTT_DIAG_LEN 896            // leaves room for the topic in a packet
+#define MQTT_TRACE_CHUNK_LEN 448    // leaves room for the topic in a packet
+#define MQTT_REFERENCE_LEN 16
+#define MQTT_COMMAND_LEN 48
+
+#define MQTT_PORT 1883
+#define MQTT_KEEPALIVE_S 15
+#define MQTT_CONNECT_TIMEOUT_MS (10 * 1000)  // TCP connect through CONNACK
+#define MQTT_HANDSHAKE_POLL_MS 10
+#define MQTT_BACKOFF_BASE_MS 1000
+#define MQTT_BACKOFF_MAX_MS (60 * 1000)
+// Resume the broker's stored session on reconnect, so subscriptions survive
+// and references and commands published while offline are delivered at QoS 1
+#ifndef MQTT_SESSION_RESUME
+#define MQTT_SESSION_RESUME 0
+#endif
+#define MQTT_SUBSCRIBE_QOS (MQTT_SESSION_RESUME ? 1 : 0)
+
+// Samples go out at QoS 1 and leave the queue once acknowledged. This many
+// publishes may await their PUBACK at once.
+#ifndef MQTT_PUBLISH_WINDOW
+#define MQTT_PUBLISH_WINDOW 8
+#endif
+#define MQTT_PUBLISH_RETRY_MS (5 * 1000)
+// Keep a copy of the queue in the outbox partition, see outbox.h
+#ifndef MQTT_OUTBOX_FLASH
+#define MQTT_OUTBOX_FLASH 0
+#endif
+
+#define MQTT_BATCH_LINE_LEN 28  // "<age ms>,<temp>,<hum>,<occupied>\n"
+// Batch draining starts at the high watermark (or on reconnect) and stops
+// once only the low watermark's worth of live samples is left
+#define MQTT_DRAIN_HIGH_WATERMARK 4
+#define MQTT_DRAIN_LOW_WATERMARK 1
+
 static fsm_handle_t state_machine;
 
-enum { MQTT_UNKNOWN, MQTT_ACTIVE, MQTT_INACTIVE };
+enum {
+  MQTT_UNKNOWN,
+  MQTT_ACTIVE,
+  MQTT_INACTIVE,
+  MQTT_CONNECTING,
+  MQTT_CONNACK_WAIT,
+  MQTT_STATE_COUNT
+};
+
+static mqtt_client_t client;
+static scheduler_t *scheduler_s = NULL;
+static uint8_t failed_attempts = 0;
+static uint32_t connect_start_ms = 0;
+static uint32_t connect_ms = 0;  // TCP connect through CONNACK, last one
+static uint32_t retry_at_ms = 0;
 
-static PubSubClient client(
-    device_config._mqtt_server, 1883, *wifi_fsm_get_client());
+static uint8_t diag_ticks = 0;
+static bool first_publish_done = false;
 
-static bool messages_available = true;
+static sample_t sample_buffer[MQTT_SAMPLE_QUEUE_SIZE];
+static sample_queue_t samples;
+static uint16_t samples_in_flight = 0;  // oldest queued, awaiting a PUBACK
+static bool draining = false;
+static char state_topic[MQTT_TOPIC_LEN];
+static char reference_topic[MQTT_TOPIC_LEN];
+static char command_topic[MQTT_TOPIC_LEN];
+static char hum_topic[MQTT_TOPIC_LEN];
+static char temp_topic[MQTT_TOPIC_LEN];
+static char prox_topic[MQTT_TOPIC_LEN];
+// Filled by on_message(), handled by command_event_fn() after the poll
+static char command[MQTT_COMMAND_LEN];
+static bool command_pending = false;
+static char occupancy_topic[MQTT_TOPIC_LEN];
+static char diag_topic[MQTT_TOPIC_LEN];
 
-// CircularBuffer<String, 32> topics;
-// CircularBuffer<String, 32> messages;
+static deadband_t temp_band;
+static deadband_t hum_band;
+static bool reported_occupied = false;
+static uint32_t last_report_ms = 0;
+static uint32_t samples_suppressed = 0;
+static uint32_t occupancy_latency_us = 0;  // PIR edge to publish, last one
+static uint32_t occupancy_latency_max_us = 0;
+
+// Filled by the sensor FSMs, see mqtt_fsm_push_reading()
+static sensor_link_t readings;
+static sensor_reading_t latest = {};
 
 /******** PRIVATE FUNCTIONS ********/
 static fsm_err_t unknown_entry_fn();
@@ -28,136 +120,843 @@ static fsm_err_t active_entry_fn();
 static fsm_err_t active_exit_fn();
 static fsm_err_t inactive_entry_fn();
 static fsm_err_t inactive_exit_fn();
+static fsm_err_t connecting_entry_fn();
+static fsm_err_t connecting_exit_fn();
+static fsm_err_t connack_wait_entry_fn();
+static fsm_err_t connack_wait_exit_fn();
 
 static fsm_err_t periodic_inactive_event_fn();
 static fsm_err_t periodic_active_event_fn();
+static fsm_err_t first_publish_event_fn();
+static fsm_err_t drain_event_fn();
+static fsm_err_t sample_event_fn();
+static fsm_err_t occupancy_event_fn();
+static fsm_err_t handshake_tick_event_fn();
+static fsm_err_t handshake_poll_event_fn();
+static fsm_err_t command_event_fn();
+static void on_message(const char *topic, const uint8_t *payload, size_t len);
+static void on_ack(uint16_t delivered);
+static void restore_sample(const sample_t *sample);
+static void legacy_topic(char *topic, const char *configured, const char *name);
 
 /******** TRANSITIONS ********/
-static fsm_transition_t unknown_transitions[] = {
-    {.destination_state_ID = MQTT_ACTIVE, .event = MQTT_EVENT_START},
-    {.destination_state_ID = MQTT_INACTIVE, .event = MQTT_EVENT_STOP},
-};
-
-static fsm_transition_t active_transitions[] = {
-    {.destination_state_ID = MQTT_INACTIVE, .event = MQTT_EVENT_STOP},
-    {.destination_state_ID = MQTT_ACTIVE,
+static constexpr fsm_static_transition_t transitions[] = {
+    {.source_state_ID = MQTT_UNKNOWN,
+        .event = MQTT_EVENT_START,
+        .destination_state_ID = MQTT_CONNECTING},
+    {.source_state_ID = MQTT_UNKNOWN,
+        .event = MQTT_EVENT_STOP,
+        .destination_state_ID = MQTT_INACTIVE},
+    {.source_state_ID = MQTT_CONNECTING,
+        .event = MQTT_EVENT_OPEN,
+        .destination_state_ID = MQTT_CONNACK_WAIT},
+    {.source_state_ID = MQTT_CONNECTING,
+        .event = MQTT_EVENT_LOST,
+        .destination_state_ID = MQTT_INACTIVE},
+    {.source_state_ID = MQTT_CONNECTING,
+        .event = MQTT_EVENT_STOP,
+        .destination_state_ID = MQTT_INACTIVE},
+    {.source_state_ID = MQTT_CONNECTING,
+        .event = MQTT_EVENT_POLL,
+        .destination_state_ID = MQTT_CONNECTING,
+        .transition_fn = handshake_poll_event_fn},
+    {.source_state_ID = MQTT_CONNECTING,
+        .event = FSM_PERIODIC_EVENT_500MS,
+        .destination_state_ID = MQTT_CONNECTING,
+        .transition_fn = handshake_tick_event_fn},
+    {.source_state_ID = MQTT_CONNECTING,
         .event = FSM_PERIODIC_EVENT_5S,
+        .destination_state_ID = MQTT_CONNECTING,
+        .transition_fn = sample_event_fn},
+    {.source_state_ID = MQTT_CONNACK_WAIT,
+        .event = MQTT_EVENT_CONNACK,
+        .destination_state_ID = MQTT_ACTIVE},
+    {.source_state_ID = MQTT_CONNACK_WAIT,
+        .event = MQTT_EVENT_LOST,
+        .destination_state_ID = MQTT_INACTIVE},
+    {.source_state_ID = MQTT_CONNACK_WAIT,
+        .event = MQTT_EVENT_STOP,
+        .destination_state_ID = MQTT_INACTIVE},
+    {.source_state_ID = MQTT_CONNACK_WAIT,
+        .event = MQTT_EVENT_POLL,
+        .destination_state_ID = MQTT_CONNACK_WAIT,
+        .transition_fn = handshake_poll_event_fn},
+    {.source_state_ID = MQTT_CONNACK_WAIT,
+        .event = FSM_PERIODIC_EVENT_500MS,
+        .destination_state_ID = MQTT_CONNACK_WAIT,
+        .transition_fn = handshake_tick_event_fn},
+    {.source_state_ID = MQTT_CONNACK_WAIT,
+        .event = FSM_PERIODIC_EVENT_5S,
+        .destination_state_ID = MQTT_CONNACK_WAIT,
+        .transition_fn = sample_event_fn},
+    {.source_state_ID = MQTT_ACTIVE,
+        .event = MQTT_EVENT_STOP,
+        .destination_state_ID = MQTT_INACTIVE},
+    {.source_state_ID = MQTT_ACTIVE,
+        .event = MQTT_EVENT_LOST,
+        .destination_state_ID = MQTT_INACTIVE},
+    {.source_state_ID = MQTT_ACTIVE,
+        .event = FSM_PERIODIC_EVENT_5S,
+        .destination_state_ID = MQTT_ACTIVE,
         .transition_fn = periodic_active_event_fn},
+    {.source_state_ID = MQTT_ACTIVE,
+        .event = FSM_PERIODIC_EVENT_1S,
+        .destination_state_ID = MQTT_ACTIVE,
+        .transition_fn = first_publish_event_fn},
+    {.source_state_ID = MQTT_ACTIVE,
+        .event = MQTT_EVENT_OCCUPANCY,
+        .destination_state_ID = MQTT_ACTIVE,
+        .transition_fn = occupancy_event_fn},
+    {.source_state_ID = MQTT_ACTIVE,
+        .event = FSM_PERIODIC_EVENT_500MS,
+        .destination_state_ID = MQTT_ACTIVE,
+        .transition_fn = drain_event_fn},
+    {.source_state_ID = MQTT_ACTIVE,
+        .event = MQTT_EVENT_COMMAND,
+        .destination_state_ID = MQTT_ACTIVE,
+        .transition_fn = command_event_fn},
+    {.source_state_ID = MQTT_INACTIVE,
+        .event = MQTT_EVENT_START,
+        .destination_state_ID = MQTT_CONNECTING},
+    {.source_state_ID = MQTT_INACTIVE,
+        .event = MQTT_EVENT_RETRY,
+        .destination_state_ID = MQTT_CONNECTING},
+    {.source_state_ID = MQTT_INACTIVE,
+        .event = FSM_PERIODIC_EVENT_1S,
+        .destination_state_ID = MQTT_INACTIVE,
+        .transition_fn = periodic_inactive_event_fn},
+    {.source_state_ID = MQTT_INACTIVE,
+        .event = FSM_PERIODIC_EVENT_5S,
+        .destination_state_ID = MQTT_INACTIVE,
+        .transition_fn = sample_event_fn},
 };
 
-static fsm_transition_t inactive_transitions[] = {
-    {.destination_state_ID = MQTT_ACTIVE, .event = MQTT_EVENT_START},
-    {.destination_state_ID = MQTT_INACTIVE,
-        .event = FSM_PERIODIC_EVENT_1S,
-        .transition_fn = periodic_inactive_event_fn}};
+FSM_DEFINE_TABLE(
+    dispatch_table, MQTT_STATE_COUNT, MQTT_EVENT_COUNT, transitions);
 
 /******** STATES ********/
-static fsm_state_t unknown_state = {.ID = MQTT_UNKNOWN,
-    .entry_fn = unknown_entry_fn,
-    .exit_fn = unknown_exit_fn,
-    .transition_array = unknown_transitions,
-    .num_transitions =
-        sizeof(unknown_transitions) / sizeof(unknown_transitions[0])};
-
-static fsm_state_t active_state = {.ID = MQTT_ACTIVE,
-    .entry_fn = active_entry_fn,
-    .exit_fn = active_exit_fn,
-    .transition_array = active_transitions,
-    .num_transitions =
-        sizeof(active_transitions) / sizeof(active_transitions[0])};
-
-static fsm_state_t inactive_state = {.ID = MQTT_INACTIVE,
-    .entry_fn = inactive_entry_fn,
-    .exit_fn = inactive_exit_fn,
-    .transition_array = inactive_transitions,
-    .num_transitions =
-        sizeof(inactive_transitions) / sizeof(inactive_transitions[0])};
-
-/******** STATE MACHINE ********/
 static fsm_state_t states[] = {
-    [MQTT_UNKNOWN] = unknown_state,
-    [MQTT_ACTIVE] = active_state,
-    [MQTT_INACTIVE] = inactive_state,
+    [MQTT_UNKNOWN] = {.ID = MQTT_UNKNOWN,
+        .entry_fn = unknown_entry_fn,
+        .exit_fn = unknown_exit_fn},
+    [MQTT_ACTIVE] = {.ID = MQTT_ACTIVE,
+        .entry_fn = active_entry_fn,
+        .exit_fn = active_exit_fn},
+    [MQTT_INACTIVE] = {.ID = MQTT_INACTIVE,
+        .entry_fn = inactive_entry_fn,
+        .exit_fn = inactive_exit_fn},
+    [MQTT_CONNECTING] = {.ID = MQTT_CONNECTING,
+        .entry_fn = connecting_entry_fn,
+        .exit_fn = connecting_exit_fn},
+    [MQTT_CONNACK_WAIT] = {.ID = MQTT_CONNACK_WAIT,
+        .entry_fn = connack_wait_entry_fn,
+        .exit_fn = connack_wait_exit_fn},
 };
 
 /******** PUBLIC FUNCTIONS ********/
 fsm_err_t mqtt_fsm_init(void) {
-  return fsm_init(&state_machine, states, sizeof(states) / sizeof(states[0]));
+  sample_queue_init(&samples, sample_buffer, MQTT_SAMPLE_QUEUE_SIZE);
+#if MQTT_OUTBOX_FLASH
+  outbox_init(MQTT_SAMPLE_QUEUE_SIZE, restore_sample);
+#endif
+  sensor_link_init(&readings);
+  const device_config_t *config = device_config_get();
+  mqtt_client_init(&client, tcp_transport(), config->host_name, on_message);
+  mqtt_client_set_window(
+      &client, MQTT_PUBLISH_WINDOW, MQTT_PUBLISH_RETRY_MS, on_ack);
+  snprintf(state_topic, sizeof(state_topic), "%s/state", config->host_name);
+  snprintf(occupancy_topic, sizeof(occupancy_topic), "%s/occupancy",
+      config->host_name);
+  snprintf(reference_topic, sizeof(reference_topic),
+      "%s/calibrate/reference", config->host_name);
+  snprintf(command_topic, sizeof(command_topic), "%s/cmd", config->host_name);
+  snprintf(diag_topic, sizeof(diag_topic), "%s/diag", config->host_name);
+  legacy_topic(hum_topic, config->topic_hum, "humidity");
+  legacy_topic(temp_topic, config->topic_temp, "temperature");
+  legacy_topic(prox_topic, config->topic_prox, "proximity");
+  const fsm_queue_config_t queue = {.buffer = NULL,
+      .capacity = MQTT_QUEUE_SIZE,
+      .overflow_policy = FSM_OVERFLOW_COALESCE};
+  fsm_err_t retVal =
+      fsm_init_table(&state_machine, states, dispatch_table, &queue);
+  fsm_set_name(&state_machine, "mqtt");
+  return retVal;
 }
 
 fsm_err_t mqtt_fsm_send(fsm_event event) {
   return fsm_send(&state_machine, event);
 }
 
+fsm_err_t mqtt_fsm_send_from_isr(fsm_event event) {
+  return fsm_send_from_isr(&state_machine, event);
+}
+
+bool mqtt_fsm_push_reading(const sensor_reading_t *reading) {
+  return sensor_link_push(&readings, reading);
+}
+
+fsm_err_t mqtt_fsm_schedule(scheduler_t *scheduler) {
+  scheduler_s = scheduler;
+  return scheduler_add_periodic(scheduler, &state_machine, mqtt_fsm_send);
+}
+
 fsm_err_t mqtt_fsm_handle_event(void) {
   return fsm_handle_event(&state_machine);
 }
 
-// fsm_err_t mqtt_fsm_queue_msg(const char topic[20], const char val[20]) {
-//   messages.push(val);
-//   topics.push(topic);
-//   messages_available = true;
-//   return FSM_ERR_OK;
-// }
+fsm_err_t mqtt_fsm_get_queue_stats(fsm_queue_stats_t *stats) {
+  return fsm_get_queue_stats(&state_machine, stats);
+}
+
+void mqtt_fsm_get_sample_stats(sample_queue_stats_t *stats) {
+  *stats = samples.stats;
+}
 
 /******** PRIVATE FUNCTIONS ********/
-static fsm_err_t unknown_entry_fn() {
-  if (client.connect(device_config._clientID)) {
-    Serial.println("Connected to MQTT Broker!");
-    mqtt_fsm_send(MQTT_EVENT_START);
+// Topics of MQTT_PAYLOAD_TOPICS, as configured or under the host name
+static void legacy_topic(
+    char *topic, const char *configured, const char *name) {
+  if (configured[0]) {
+    snprintf(topic, MQTT_TOPIC_LEN, "%s", configured);
   } else {
-    Serial.println("Connection to MQTT Broker failed...");
-    mqtt_fsm_send(MQTT_EVENT_STOP);
+    snprintf(topic, MQTT_TOPIC_LEN, "%s/%s", device_config_get()->host_name,
+        name);
+  }
+}
+
+static fsm_err_t unknown_entry_fn() {
+  mqtt_fsm_send(wifi_fsm_connected() ? MQTT_EVENT_START : MQTT_EVENT_STOP);
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t inactive_entry_fn() {
+  mqtt_client_close(&client);
+  // The client forgot what it held, those samples go out again
+  samples_in_flight = 0;
+  command_pending = false;
+  retry_at_ms = millis();
+  // Straight back after a dropped session, back off after failed attempts
+  if (0 == failed_attempts) {
+    return FSM_ERR_OK;
+  }
+  uint32_t backoff_ms = MQTT_BACKOFF_MAX_MS;
+  if (failed_attempts <= 16) {
+    backoff_ms = (uint32_t)MQTT_BACKOFF_BASE_MS << (failed_attempts - 1);
+  }
+  if (backoff_ms > MQTT_BACKOFF_MAX_MS) {
+    backoff_ms = MQTT_BACKOFF_MAX_MS;
   }
+  // Full jitter keeps the rooms from reconnecting in lockstep after a
+  // broker restart
+  backoff_ms = backoff_ms / 2 + random(backoff_ms / 2 + 1);
+  retry_at_ms += backoff_ms;
+  LOG_INFO("MQTT retry in %u ms", backoff_ms);
   return FSM_ERR_OK;
 }
 
 static fsm_err_t periodic_inactive_event_fn() {
-  if (client.connect(device_config._clientID)) {
-    Serial.println("Connected to MQTT Broker!");
-    mqtt_fsm_send(MQTT_EVENT_START);
-  } else {
-    Serial.println("Connection to MQTT Broker failed...");
+  if (wifi_fsm_connected() && (long)(millis() - retry_at_ms) >= 0) {
+    mqtt_fsm_send(MQTT_EVENT_RETRY);
   }
   return FSM_ERR_OK;
 }
 
-static fsm_err_t periodic_active_event_fn() {
-  if (!client.connected()) {
-    mqtt_fsm_send(MQTT_EVENT_STOP);
+// Turns what the client saw on the connection into events for this machine
+static mqtt_client_event_t poll_client() {
+  mqtt_client_event_t event = mqtt_client_poll(&client, millis());
+  switch (event) {
+    case MQTT_CLIENT_EVENT_OPEN:
+      mqtt_fsm_send(MQTT_EVENT_OPEN);
+      break;
+    case MQTT_CLIENT_EVENT_CONNACK:
+      mqtt_fsm_send(MQTT_EVENT_CONNACK);
+      break;
+    case MQTT_CLIENT_EVENT_REFUSED:
+      LOG_WARN("MQTT broker refused the connection, code %u",
+          client.return_code);
+      mqtt_fsm_send(MQTT_EVENT_LOST);
+      break;
+    case MQTT_CLIENT_EVENT_LOST:
+      LOG_WARN("MQTT connection lost");
+      mqtt_fsm_send(MQTT_EVENT_LOST);
+      break;
+    default:
+      break;
+  }
+  return event;
+}
+
+// Handshake steps are a LAN round trip, much shorter than the 500 ms tick
+static void arm_poll() {
+  if (scheduler_s) {
+    scheduler_add_oneshot(
+        scheduler_s, MQTT_EVENT_POLL, MQTT_HANDSHAKE_POLL_MS, mqtt_fsm_send);
+  }
+}
+
+// Returns true while the handshake is still going
+static bool poll_handshake() {
+  if (millis() - connect_start_ms > MQTT_CONNECT_TIMEOUT_MS) {
+    LOG_WARN("MQTT connection timed out");
+    mqtt_fsm_send(MQTT_EVENT_LOST);
+    return false;
+  }
+  mqtt_client_event_t event = poll_client();
+  return MQTT_CLIENT_EVENT_NONE == event || MQTT_CLIENT_EVENT_OPEN == event;
+}
+
+// Backstop for when no timer was free to arm the poll
+static fsm_err_t handshake_tick_event_fn() {
+  poll_handshake();
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t handshake_poll_event_fn() {
+  if (poll_handshake()) {
+    arm_poll();
+  }
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t connecting_entry_fn() {
+  failed_attempts += (failed_attempts < UINT8_MAX) ? 1 : 0;
+  connect_start_ms = millis();
+  if (!mqtt_client_open(&client, device_config_get()->mqtt_server, MQTT_PORT,
+          connect_start_ms)) {
+    LOG_WARN("Connection to MQTT Broker failed...");
+    mqtt_fsm_send(MQTT_EVENT_LOST);
     return FSM_ERR_OK;
   }
+  arm_poll();
+  return FSM_ERR_OK;
+}
+
+// The poll armed while connecting carries on here
+static fsm_err_t connack_wait_entry_fn() {
+  if (!mqtt_client_connect(&client, MQTT_KEEPALIVE_S, !MQTT_SESSION_RESUME)) {
+    mqtt_fsm_send(MQTT_EVENT_LOST);
+  }
+  return FSM_ERR_OK;
+}
+
+// Every publish goes through here so the calibration sees the radio load
+static bool publish(const char *topic, const uint8_t *payload, size_t len) {
+  if (!mqtt_client_publish(&client, topic, payload, len)) {
+    return false;
+  }
+  calibration_note_tx(strlen(topic) + len);
+  return true;
+}
+
+static bool publish(const char *topic, const char *payload) {
+  return publish(topic, (const uint8_t *)payload, strlen(payload));
+}
+
+/**
+ * @brief Publish samples at QoS 1, they stay queued until acknowledged
+ *
+ * @param delivered number of queued samples this publish completes,
+ * retired from the queue by on_ack()
+ */
+static bool publish_samples(const char *topic, const uint8_t *payload,
+    size_t len, uint16_t delivered) {
+  if (!mqtt_client_publish_qos1(&client, topic, payload, len, delivered)) {
+    return false;
+  }
+  calibration_note_tx(strlen(topic) + len);
+  samples_in_flight += delivered;
+  return true;
+}
+
+static bool publish_samples(
+    const char *topic, const char *payload, uint16_t delivered) {
+  return publish_samples(
+      topic, (const uint8_t *)payload, strlen(payload), delivered);
+}
 
-  bool reactivate_prox = false;
-  if (messages_available) {
-    reactivate_prox = true;
-    prox_fsm_send(PROX_EVENT_STOP);
-    fsm_err_t retVal = FSM_ERR_OK;
-    while (FSM_ERR_NO_EVENTS != retVal && FSM_ERR_OK == retVal) {
-      retVal = prox_fsm_handle_event();
+// Every queued sample also goes to the outbox, when there is one
+static void queue_sample(const sample_t *sample) {
+  if (!sample_queue_push(&samples, sample) && samples_in_flight) {
+    samples_in_flight--;  // the oldest was dropped on its way out
+  }
+#if MQTT_OUTBOX_FLASH
+  outbox_append(sample);
+#endif
+}
+
+static void restore_sample(const sample_t *sample) {
+  sample_queue_push(&samples, sample);
+}
+
+static void on_ack(uint16_t delivered) {
+  if (delivered > samples_in_flight) {
+    delivered = samples_in_flight;
+  }
+  samples_in_flight -= delivered;
+  sample_queue_pop(&samples, delivered);
+#if MQTT_OUTBOX_FLASH
+  outbox_consume(delivered);
+#endif
+}
+
+static uint16_t samples_unsent() {
+  return sample_queue_count(&samples) - samples_in_flight;
+}
+
+/**
+ * @brief Handle <host>/calibrate/reference, a trusted temperature reading
+ *
+ * The payload is degrees Fahrenheit as text, e.g. "71.3".
+ */
+static void on_reference(const uint8_t *payload, size_t len) {
+  char text[MQTT_REFERENCE_LEN];
+  char *end = text;
+  float reference = 0;
+  if (len > 0 && len < sizeof(text)) {
+    memcpy(text, payload, len);
+    text[len] = '\0';
+    reference = strtof(text, &end);
+  }
+  if (end == text) {
+    LOG_WARN("calib: reference of %u bytes ignored", (unsigned)len);
+    return;
+  }
+  if (FSM_ERR_OK != dht_fsm_submit_reference(lroundf(reference * 10))) {
+    LOG_WARN("calib: reference dropped, the previous one is pending");
+  }
+}
+
+// Replies are published once the poll that delivered the command returned
+static void on_command(const uint8_t *payload, size_t len) {
+  if (command_pending) {
+    LOG_WARN("cmd: dropped, the previous one is pending");
+    return;
+  }
+  // e.g. a trailing newline from a shell
+  while (len && isspace(payload[len - 1])) {
+    len--;
+  }
+  if (0 == len || len >= sizeof(command)) {
+    LOG_WARN("cmd: command of %u bytes ignored", (unsigned)len);
+    return;
+  }
+  memcpy(command, payload, len);
+  command[len] = '\0';
+  command_pending = true;
+  mqtt_fsm_send(MQTT_EVENT_COMMAND);
+}
+
+static void on_message(const char *topic, const uint8_t *payload, size_t len) {
+  if (0 == strcmp(topic, reference_topic)) {
+    on_reference(payload, len);
+  } else if (0 == strcmp(topic, command_topic)) {
+    on_command(payload, len);
+  }
+}
+
+#if FSM_PROFILE
+/**
+ * @brief Add the profile slots as "profile":{"<name>":[<fields>...]}
+ *
+ * Slots that don't fit go out in further documents on <host>/diag, each
+ * with a "profile" object of its own.
+ */
+static void add_profile(payload_json_t *json, char *buf, size_t len) {
+  char name[PROFILE_NAME_LEN];
+  uint32_t fields[PROFILE_NUM_FIELDS];
+  profile_entry_t entry;
+  payload_json_open(json, "profile");
+  for (uint8_t slot = 0; slot < PROFILE_MAX_SLOTS; slot++) {
+    if (!profile_take(slot, &entry)) {
+      continue;
+    }
+    profile_format_name(name, sizeof(name), entry.key);
+    profile_entry_fields(fields, &entry);
+    if (payload_json_uints(json, name, fields, PROFILE_NUM_FIELDS)) {
+      continue;
+    }
+    publish(diag_topic, (const uint8_t *)buf, payload_json_end(json));
+    payload_json_begin(json, buf, len);
+    payload_json_open(json, "profile");
+    payload_json_uints(json, name, fields, PROFILE_NUM_FIELDS);
+  }
+  payload_json_close(json);
+  payload_json_uint(json, "profile_overflows", profile_overflows());
+}
+#endif
+
+#if FSM_TRACE
+typedef struct trace_chunk {
+  uint8_t data[MQTT_TRACE_CHUNK_LEN];
+  size_t used;
+} trace_chunk_t;
+
+static void publish_trace_chunk(trace_chunk_t *chunk) {
+  char topic[MQTT_TOPIC_LEN];
+  snprintf(
+      topic, sizeof(topic), "%s/diag/trace", device_config_get()->host_name);
+  publish(topic, chunk->data, chunk->used);
+  chunk->used = 0;
+}
+
+static void write_trace(const uint8_t *data, size_t len, void *ctx) {
+  trace_chunk_t *chunk = (trace_chunk_t *)ctx;
+  while (len--) {
+    chunk->data[chunk->used++] = *data++;
+    if (MQTT_TRACE_CHUNK_LEN == chunk->used) {
+      publish_trace_chunk(chunk);
+    }
+  }
+}
+
+// Consecutive messages on <host>/diag/trace form one dump
+static void publish_trace() {
+  static trace_chunk_t chunk;
+  chunk.used = 0;
+  trace_dump(write_trace, &chunk);
+  if (chunk.used) {
+    publish_trace_chunk(&chunk);
+  }
+}
+#endif
+
+/**
+ * @brief Publish the counters as one JSON document on <host>/diag
+ *
+ * {"duty_cycle":12,"samples_dropped":0,...,"calib_offset":-4.2,...}
+ */
+static void publish_diagnostics() {
+  static char payload[MQTT_DIAG_LEN];
+  payload_json_t json;
+  payload_json_begin(&json, payload, sizeof(payload));
+  payload_json_uint(&json, "duty_cycle", power_take_duty_cycle());
+  payload_json_uint(&json, "samples_dropped", samples.stats.dropped);
+  payload_json_uint(&json, "samples_suppressed", samples_suppressed);
+  payload_json_uint(&json, "occupancy_latency_us", occupancy_latency_us);
+  payload_json_uint(
+      &json, "occupancy_latency_max_us", occupancy_latency_max_us);
+  payload_json_uint(
+      &json, "readings_dropped", sensor_link_dropped(&readings));
+  payload_json_uint(&json, "mqtt_connect_ms", connect_ms);
+  payload_json_uint(&json, "mqtt_ping_timeouts", client.stats.ping_timeouts);
+  payload_json_uint(&json, "mqtt_retransmits", client.stats.retransmits);
+  payload_json_fixed(&json, "calib_offset",
+      latest.raw_temperature_x10 - latest.temperature_x10, 1);
+  // A shrinking largest block with a steady minimum means fragmentation
+  payload_json_uint(&json, "heap_min", ESP.getMinFreeHeap());
+  payload_json_uint(&json, "heap_max_alloc", ESP.getMaxAllocHeap());
+#if FSM_PROFILE
+  add_profile(&json, payload, sizeof(payload));
+#endif
+  publish(diag_topic, (const uint8_t *)payload, payload_json_end(&json));
+}
+
+// Catch up with the sensor FSMs, the newest reading wins
+static void take_readings() {
+  while (sensor_link_take(&readings, &latest)) {
+  }
+}
+
+// Queues a sample if it is worth publishing, returns whether it did
+static bool take_sample() {
+  take_readings();
+  if (!latest.climate_valid) {
+    return false;
+  }
+  uint32_t now_ms = millis();
+  int32_t temp_x10 = latest.temperature_x10;
+  int32_t hum_x10 = latest.humidity_x10;
+  bool occupied = latest.occupied;
+  // Only when a reading left the dead band around the last published one,
+  // occupancy changed or the heartbeat expired
+  bool changed = deadband_exceeded(&temp_band, temp_x10,
+                     settings_get(SETTING_TEMP_DELTA_X10)) ||
+                 deadband_exceeded(&hum_band, hum_x10,
+                     settings_get(SETTING_HUM_DELTA_X10)) ||
+                 occupied != reported_occupied;
+  uint32_t heartbeat_ms = settings_get(SETTING_HEARTBEAT_MS);
+  if (!changed && now_ms - last_report_ms < heartbeat_ms) {
+    samples_suppressed++;
+    return false;
+  }
+  deadband_commit(&temp_band, temp_x10);
+  deadband_commit(&hum_band, hum_x10);
+  reported_occupied = occupied;
+  last_report_ms = now_ms;
+
+  sample_t sample = {.timestamp_ms = now_ms,
+      .temperature = (int16_t)sensor_round_tenths(temp_x10),
+      .humidity = (int16_t)sensor_round_tenths(hum_x10),
+      .occupied = occupied};
+  queue_sample(&sample);
+  return true;
+}
+
+/**
+ * @brief Publish a sample as MQTT_PAYLOAD_TOPICS, one message per reading
+ *
+ * The messages go out together or not at all, so a retry never repeats the
+ * ones that already made it. The sample counts as delivered with the PUBACK
+ * of the last one.
+ */
+static bool publish_topics(const sample_t *sample) {
+  char hum[PAYLOAD_INT_LEN];
+  char temp[PAYLOAD_INT_LEN];
+  const char *prox = (sample->occupied) ? "person" : "empty";
+  payload_format_int(hum, sizeof(hum), sample->humidity);
+  payload_format_int(temp, sizeof(temp), sample->temperature);
+  uint32_t size = mqtt_client_qos1_size(hum_topic, strlen(hum)) +
+                  mqtt_client_qos1_size(temp_topic, strlen(temp)) +
+                  mqtt_client_qos1_size(prox_topic, strlen(prox));
+  if (!mqtt_client_qos1_fits(&client, 3, size)) {
+    return false;
+  }
+  bool ok = publish_samples(hum_topic, hum, 0);
+  ok = ok && publish_samples(temp_topic, temp, 0);
+  return ok && publish_samples(prox_topic, prox, 1);
+}
+
+static bool publish_live(const sample_t *sample) {
+  int32_t format = settings_get(SETTING_PAYLOAD_FORMAT);
+  if (0 == mqtt_client_window_free(&client)) {
+    return false;
+  }
+  uint32_t age_ms = (uint32_t)millis() - sample->timestamp_ms;
+  bool ok = false;
+  if (MQTT_PAYLOAD_JSON == format) {
+    char payload[PAYLOAD_JSON_LEN];
+    payload_encode_json(payload, sizeof(payload), sample, age_ms);
+    ok = publish_samples(state_topic, payload, 1);
+  } else if (MQTT_PAYLOAD_BINARY == format) {
+    uint8_t payload[PAYLOAD_BINARY_LEN];
+    payload_encode_binary(payload, sizeof(payload), sample, age_ms);
+    ok = publish_samples(state_topic, payload, sizeof(payload), 1);
+  } else {
+    ok = publish_topics(sample);
+  }
+  if (!ok) {
+    return false;
+  }
+
+  if (!first_publish_done) {
+    first_publish_done = true;
+    boot_timing_finish("first publish");
+    char payload[sizeof("{\"boot_ms\":}") + PAYLOAD_INT_LEN];
+    payload_json_t json;
+    payload_json_begin(&json, payload, sizeof(payload));
+    payload_json_uint(&json, "boot_ms", boot_timing_total_ms());
+    publish(diag_topic, (const uint8_t *)payload, payload_json_end(&json));
+  }
+  return true;
+}
+
+/**
+ * @brief Publish the oldest unsent samples as one message on <host>/batch
+ *
+ * Each line is "<age ms>,<temperature>,<humidity>,<occupied>". There is no
+ * wall clock on the device, so samples carry their age at publish time.
+ */
+static bool publish_batch() {
+  sample_t batch[MQTT_BATCH_SIZE];
+  char topic[MQTT_TOPIC_LEN];
+  char payload[MQTT_BATCH_SIZE * MQTT_BATCH_LINE_LEN];
+  uint16_t n = sample_queue_peek_from(
+      &samples, samples_in_flight, batch, MQTT_BATCH_SIZE);
+  if (0 == n) {
+    return true;
+  }
+  uint32_t now_ms = millis();
+  size_t len = 0;
+  for (uint16_t i = 0; i < n; i++) {
+    len += snprintf(&payload[len], sizeof(payload) - len, "%u,%d,%d,%u\n",
+        (unsigned)(now_ms - batch[i].timestamp_ms), batch[i].temperature,
+        batch[i].humidity, batch[i].occupied ? 1u : 0u);
+  }
+  snprintf(topic, sizeof(topic), "%s/batch", device_config_get()->host_name);
+  return publish_samples(topic, payload, n);
+}
+
+// Returns true if every queued sample went out live
+static bool publish_pending() {
+  if (samples_unsent() >= MQTT_DRAIN_HIGH_WATERMARK) {
+    draining = true;
+  }
+  if (draining) {
+    return false;
+  }
+  sample_t sample;
+  while (sample_queue_peek_from(&samples, samples_in_flight, &sample, 1) &&
+         publish_live(&sample)) {
+  }
+  return 0 == samples_unsent();
+}
+
+static fsm_err_t drain_event_fn() {
+  // Publishes can be minutes apart now, so the keep-alive has to be serviced
+  if (MQTT_CLIENT_EVENT_NONE != poll_client()) {
+    return FSM_ERR_OK;
+  }
+  if (!draining) {
+    return FSM_ERR_OK;
+  }
+  // One batch per tick so a large backlog doesn't stall the loop
+  if (publish_batch() && samples_unsent() <= MQTT_DRAIN_LOW_WATERMARK) {
+    draining = false;
+  }
+  return FSM_ERR_OK;
+}
+
+// One "<name>=<value>" line per setting
+static void list_settings(char *reply, size_t len) {
+  char line[SETTINGS_TEXT_LEN];
+  size_t used = 0;
+  reply[0] = '\0';
+  for (uint8_t id = 0; id < SETTING_COUNT && used < len; id++) {
+    settings_format(line, sizeof(line), (setting_id_t)id);
+    used += snprintf(&reply[used], len - used, "%s\n", line);
+  }
+}
+
+static void notify_settings() {
+  if (FSM_ERR_OK != dht_fsm_notify_settings()) {
+    LOG_WARN("cmd: the DHT FSM wasn't told, its lane is full");
+  }
+}
+
+static void run_command(char *reply, size_t len) {
+  setting_id_t id;
+  char *value = strchr(command, '=');
+  if (0 == strcmp(command, "settings")) {
+    list_settings(reply, len);
+  } else if (0 == strcmp(command, "reset")) {
+    settings_reset();
+    notify_settings();
+    list_settings(reply, len);
+  } else if (0 == strcmp(command, "trace")) {
+#if FSM_TRACE
+    trace_request_mqtt_dump();
+    snprintf(reply, len, "trace: on %s/diag/trace",
+        device_config_get()->host_name);
+#else
+    snprintf(reply, len, "error: trace: not built in");
+#endif
+  } else if (value) {
+    *value++ = '\0';
+    settings_err_t err = settings_set(command, value, &id);
+    if (SETTINGS_OK != err) {
+      snprintf(reply, len, "error: %s: %s", command, settings_err_name(err));
+      return;
     }
+    notify_settings();
+    settings_format(reply, len, id);
+  } else if (settings_find(command, &id)) {
+    settings_format(reply, len, id);
+  } else {
+    snprintf(reply, len, "error: %s: unknown command", command);
   }
+}
 
-  // TODO: create a buffer for messages, trigger off watermark
-  client.publish(device_config._mqtt_topic_hum, String(get_hum()).c_str());
-  client.publish(device_config._mqtt_topic_temp, String(get_temp()).c_str());
-  client.publish(
-      device_config._mqtt_topic_prox, (get_prox()) ? "person" : "empty");
+/**
+ * @brief Run a command from <host>/cmd, the reply goes to <host>/cmd/result
+ *
+ * "<setting>=<value>" changes a setting and keeps it in NVS, "<setting>"
+ * reads it, "settings" lists them all and "reset" returns them to their
+ * defaults. "trace" publishes the FSM trace, like 'M' on the serial port.
+ */
+static fsm_err_t command_event_fn() {
+  if (!command_pending) {
+    return FSM_ERR_OK;
+  }
+  char topic[MQTT_TOPIC_LEN];
+  char reply[SETTING_COUNT * SETTINGS_TEXT_LEN];
+  run_command(reply, sizeof(reply));
+  command_pending = false;
+  snprintf(
+      topic, sizeof(topic), "%s/cmd/result", device_config_get()->host_name);
+  publish(topic, reply);
+  return FSM_ERR_OK;
+}
 
-  if (reactivate_prox) {
-    prox_fsm_send(PROX_EVENT_START);
-    fsm_err_t retVal = FSM_ERR_OK;
-    while (FSM_ERR_NO_EVENTS != retVal && FSM_ERR_OK == retVal) {
-      retVal = prox_fsm_handle_event();
+static fsm_err_t sample_event_fn() {
+  take_sample();
+  return FSM_ERR_OK;
+}
+
+// Publish occupancy changes right away instead of on the next 5 s tick
+static fsm_err_t occupancy_event_fn() {
+  if (!mqtt_client_connected(&client)) {
+    return FSM_ERR_OK;
+  }
+  if (take_sample() && publish_pending() && latest.occupied) {
+    occupancy_latency_us = micros() - latest.occupied_edge_us;
+    if (occupancy_latency_us > occupancy_latency_max_us) {
+      occupancy_latency_max_us = occupancy_latency_us;
     }
+    LOG_DEBUG("occupancy published %u us after the PIR edge",
+        occupancy_latency_us);
+  }
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t first_publish_event_fn() {
+  // Don't make the first reading wait for the 5 s tick after a reboot
+  take_readings();
+  if (!first_publish_done && latest.climate_valid &&
+      mqtt_client_connected(&client)) {
+    take_sample();
+    publish_pending();
+  }
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t active_entry_fn() {
+  failed_attempts = 0;
+  connect_ms = millis() - connect_start_ms;
+  boot_timing_mark("mqtt connected");
+  LOG_INFO("Connected to MQTT Broker!");
+  // A resumed session kept its subscriptions
+  if (!client.session_present) {
+    mqtt_client_subscribe(&client, reference_topic, MQTT_SUBSCRIBE_QOS);
+    mqtt_client_subscribe(&client, command_topic, MQTT_SUBSCRIBE_QOS);
+  }
+  // Flush whatever piled up while offline
+  draining = samples_unsent() > MQTT_DRAIN_LOW_WATERMARK;
+  return first_publish_event_fn();
+}
+
+static fsm_err_t periodic_active_event_fn() {
+  if (!mqtt_client_connected(&client)) {
+    mqtt_fsm_send(MQTT_EVENT_LOST);
+    return FSM_ERR_OK;
+  }
+
+  // Publish from a snapshot; the PIR interrupt stays armed and motion that
+  // arrives during a slow publish is queued for the prox FSM
+  take_sample();
+  publish_pending();
+
+  // A lost summary is covered by the next one, it repeats the whole day
+  char summary[OCCUPANCY_SUMMARY_LEN];
+  if (prox_take_occupancy_summary(summary, sizeof(summary))) {
+    publish(occupancy_topic, summary);
+  }
+
+  if (++diag_ticks >= MQTT_DIAG_INTERVAL_TICKS) {
+    diag_ticks = 0;
+    publish_diagnostics();
+  }
+#if FSM_TRACE
+  if (trace_take_mqtt_dump_request()) {
+    publish_trace();
   }
+#endif
 
   return FSM_ERR_OK;
 }
 
 /******** NO OP FUNCTIONS ********/
 static fsm_err_t unknown_exit_fn() { return FSM_ERR_OK; }
-static fsm_err_t active_entry_fn() { return FSM_ERR_OK; }
 static fsm_err_t active_exit_fn() { return FSM_ERR_OK; }
-static fsm_err_t inactive_entry_fn() { return FSM_ERR_OK; }
-static fsm_err_t inactive_exit_fn() { return FSM_ERR_OK; }
\ No newline at end of file
+static fsm_err_t inactive_exit_fn() { return FSM_ERR_OK; }
+static fsm_err_t connecting_exit_fn() { return FSM_ERR_OK; }
+static fsm_err_t connack_wait_exit_fn() { return FSM_ERR_OK; }
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include "mqtt_transport.h"
+
+#include <WiFi.h>
+#include <errno.h>
+#include <lwip/sockets.h>
+
+typedef struct tcp_socket {
+  int fd;
+  IPAddress address;  // 0 until the broker's name is resolved
+} tcp_socket_t;
+
+static tcp_socket_t tcp_socket = {.fd = -1};
+
+/************* Private Functions *************/
+static bool would_block(void) {
+  return EAGAIN == errno || EWOULDBLOCK == errno;
+}
+
+static void tcp_close(void *ctx) {
+  tcp_socket_t *sock = (tcp_socket_t *)ctx;
+  if (sock->fd >= 0) {
+    lwip_close(sock->fd);
+    sock->fd = -1;
+  }
+}
+
+static bool tcp_open(void *ctx, const char *host, uint16_t port) {
+  tcp_socket_t *sock = (tcp_socket_t *)ctx;
+  tcp_close(sock);
+  if (0 == (uint32_t)sock->address &&
+      1 != WiFi.hostByName(host, sock->address)) {
+    sock->address = IPAddress();
+    return false;
+  }
+  sock->fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock->fd < 0) {
+    return false;
+  }
+  // MQTT packets are small and latency matters more than segment count
+  int nodelay = 1;
+  lwip_setsockopt(
+      sock->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  lwip_fcntl(sock->fd, F_SETFL, O_NONBLOCK);
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = (uint32_t)sock->address;
+  if (0 != lwip_connect(sock->fd, (struct sockaddr *)&addr, sizeof(addr)) &&
+      EINPROGRESS != errno) {
+    tcp_close(sock);
+    return false;
+  }
+  return true;
+}
+
+static int tcp_poll_open(void *ctx) {
+  tcp_socket_t *sock = (tcp_socket_t *)ctx;
+  if (sock->fd < 0) {
+    return -1;
+  }
+  fd_set writable;
+  FD_ZERO(&writable);
+  FD_SET(sock->fd, &writable);
+  struct timeval no_wait = {};
+  int ready = lwip_select(sock->fd + 1, NULL, &writable, NULL, &no_wait);
+  if (0 == ready) {
+    return 0;
+  }
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (ready < 0 ||
+      0 != lwip_getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, &err, &len) ||
+      0 != err) {
+    return -1;
+  }
+  return 1;
+}
+
+static int tcp_write(void *ctx, const uint8_t *data, size_t len) {
+  tcp_socket_t *sock = (tcp_socket_t *)ctx;
+  int sent = lwip_send(sock->fd, data, len, MSG_DONTWAIT);
+  if (sent < 0) {
+    return would_block() ? 0 : -1;
+  }
+  return sent;
+}
+
+static int tcp_read(void *ctx, uint8_t *data, size_t len) {
+  tcp_socket_t *sock = (tcp_socket_t *)ctx;
+  int received = lwip_recv(sock->fd, data, len, MSG_DONTWAIT);
+  if (0 == received) {
+    return -1;  // closed by the broker
+  }
+  if (received < 0) {
+    return would_block() ? 0 : -1;
+  }
+  return received;
+}
+
+static const mqtt_transport_t transport = {.open = tcp_open,
+    .poll_open = tcp_poll_open,
+    .write = tcp_write,
+    .read = tcp_read,
+    .close = tcp_close,
+    .ctx = &tcp_socket};
+
+/************* Public Functions *************/
+const mqtt_transport_t *tcp_transport(void) { return &transport; }
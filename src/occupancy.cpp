@@ -0,0 +1,124 @@
+#include "occupancy.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static_assert(OCCUPANCY_HOURS * 65535UL <= 9999999UL,
+    "summed dwell bins fit the 7 digits of OCCUPANCY_SUMMARY_LEN");
+
+static const uint32_t dwell_limits_s[OCCUPANCY_DWELL_BINS - 1] = {
+    60, 5 * 60, 15 * 60, 30 * 60, 60 * 60, 2 * 60 * 60, 4 * 60 * 60};
+
+/************* Private Functions *************/
+static uint8_t dwell_bin(uint32_t dwell_ms) {
+  uint8_t bin = 0;
+  while (bin < OCCUPANCY_DWELL_BINS - 1 &&
+         dwell_ms / 1000 >= dwell_limits_s[bin]) {
+    bin++;
+  }
+  return bin;
+}
+
+static const occupancy_hour_t *nth_newest(
+    const occupancy_t *occupancy, uint8_t n) {
+  uint8_t index = (occupancy->newest + OCCUPANCY_HOURS - n) % OCCUPANCY_HOURS;
+  return &occupancy->hours[index];
+}
+
+static bool append(char *buf, size_t len, size_t *used, const char *format,
+    ...) {
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(buf + *used, len - *used, format, args);
+  va_end(args);
+  if (written < 0 || (size_t)written >= len - *used) {
+    return false;
+  }
+  *used += written;
+  return true;
+}
+
+static void saturating_inc(uint16_t *counter) {
+  if (UINT16_MAX != *counter) {
+    (*counter)++;
+  }
+}
+
+static void accumulate(occupancy_t *occupancy, uint32_t until_ms) {
+  if (occupancy->occupied) {
+    occupancy->open_occupied_ms += until_ms - occupancy->last_update_ms;
+  }
+  occupancy->last_update_ms = until_ms;
+}
+
+static void close_hour(occupancy_t *occupancy) {
+  occupancy->open.occupied_s =
+      (uint16_t)((occupancy->open_occupied_ms + 500) / 1000);
+  occupancy->newest = (occupancy->newest + 1) % OCCUPANCY_HOURS;
+  occupancy->hours[occupancy->newest] = occupancy->open;
+  if (occupancy->num_hours < OCCUPANCY_HOURS) {
+    occupancy->num_hours++;
+  }
+  memset(&occupancy->open, 0, sizeof(occupancy->open));
+  occupancy->open_occupied_ms = 0;
+  occupancy->open_start_ms += OCCUPANCY_HOUR_MS;
+  occupancy->report_pending = true;
+}
+
+/************* Public Functions *************/
+void occupancy_init(occupancy_t *occupancy, uint32_t now_ms) {
+  memset(occupancy, 0, sizeof(*occupancy));
+  occupancy->newest = OCCUPANCY_HOURS - 1;
+  occupancy->open_start_ms = now_ms;
+  occupancy->last_update_ms = now_ms;
+}
+
+void occupancy_update(occupancy_t *occupancy, bool occupied, uint32_t now_ms) {
+  while (now_ms - occupancy->open_start_ms >= OCCUPANCY_HOUR_MS) {
+    accumulate(occupancy, occupancy->open_start_ms + OCCUPANCY_HOUR_MS);
+    close_hour(occupancy);
+  }
+  accumulate(occupancy, now_ms);
+
+  if (occupied && !occupancy->occupied) {
+    occupancy->visit_start_ms = now_ms;
+    saturating_inc(&occupancy->open.visits);
+  } else if (!occupied && occupancy->occupied) {
+    saturating_inc(&occupancy->open.dwell[dwell_bin(
+        now_ms - occupancy->visit_start_ms)]);
+  }
+  occupancy->occupied = occupied;
+}
+
+bool occupancy_take_report(occupancy_t *occupancy) {
+  bool pending = occupancy->report_pending;
+  occupancy->report_pending = false;
+  return pending;
+}
+
+size_t occupancy_format_summary(
+    const occupancy_t *occupancy, char *buf, size_t len) {
+  uint32_t dwell[OCCUPANCY_DWELL_BINS] = {};
+  size_t used = 0;
+  bool ok = append(buf, len, &used, "{\"occ\":[");
+  for (uint8_t i = 0; ok && i < occupancy->num_hours; i++) {
+    const occupancy_hour_t *hour = nth_newest(occupancy, i);
+    ok = append(buf, len, &used, "%s%u", i ? "," : "", hour->occupied_s);
+    for (uint8_t bin = 0; bin < OCCUPANCY_DWELL_BINS; bin++) {
+      dwell[bin] += hour->dwell[bin];
+    }
+  }
+  ok = ok && append(buf, len, &used, "],\"visits\":[");
+  for (uint8_t i = 0; ok && i < occupancy->num_hours; i++) {
+    ok = append(buf, len, &used, "%s%u", i ? "," : "",
+        nth_newest(occupancy, i)->visits);
+  }
+  ok = ok && append(buf, len, &used, "],\"dwell\":[");
+  for (uint8_t bin = 0; ok && bin < OCCUPANCY_DWELL_BINS; bin++) {
+    ok = append(
+        buf, len, &used, "%s%u", bin ? "," : "", (unsigned)dwell[bin]);
+  }
+  ok = ok && append(buf, len, &used, "]}");
+  return ok ? used : 0;
+}
@@ -2,16 +2,30 @@
 
 #include <ArduinoOTA.h>
 
-#include "Config.h"
+#include "device_config.h"
+#include "log.h"
+#include "wifi_fsm.h"
 
-void ota_handler(void) { ArduinoOTA.handle(); }
+static bool ota_started = false;
+
+void ota_handler(void) {
+  // Wi-Fi connects in the background, so start OTA once it is up
+  if (!ota_started) {
+    if (!wifi_fsm_connected()) {
+      return;
+    }
+    ArduinoOTA.begin();
+    ota_started = true;
+  }
+  ArduinoOTA.handle();
+}
 
 void setup_ota() {
-  ArduinoOTA.setHostname(device_config._hostName);
-  ArduinoOTA.setPassword(device_config._otaPass);
+  ArduinoOTA.setHostname(device_config_get()->host_name);
+  ArduinoOTA.setPassword(device_config_get()->ota_password);
   ArduinoOTA
       .onStart([]() {
-        String type;
+        const char *type;
         if (ArduinoOTA.getCommand() == U_FLASH)
           type = "sketch";
         else  // U_SPIFFS
@@ -19,25 +33,28 @@ void setup_ota() {
 
         // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS
         // using SPIFFS.end()
-        Serial.println("Start updating " + type);
+        LOG_INFO("Start updating %s", type);
+      })
+      .onEnd([]() {
+        LOG_INFO("End");
+        // The update blocks the loop, so flush before the reboot
+        log_drain();
       })
-      .onEnd([]() { Serial.println("\nEnd"); })
       .onProgress([](unsigned int progress, unsigned int total) {
-        Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+        LOG_DEBUG("Progress: %u%%", progress / (total / 100));
       })
       .onError([](ota_error_t error) {
-        Serial.printf("Error[%u]: ", error);
+        const char *reason = "Unknown";
         if (error == OTA_AUTH_ERROR)
-          Serial.println("Auth Failed");
+          reason = "Auth Failed";
         else if (error == OTA_BEGIN_ERROR)
-          Serial.println("Begin Failed");
+          reason = "Begin Failed";
         else if (error == OTA_CONNECT_ERROR)
-          Serial.println("Connect Failed");
+          reason = "Connect Failed";
         else if (error == OTA_RECEIVE_ERROR)
-          Serial.println("Receive Failed");
+          reason = "Receive Failed";
         else if (error == OTA_END_ERROR)
-          Serial.println("End Failed");
+          reason = "End Failed";
+        LOG_ERROR("Error[%u]: %s", (unsigned)error, reason);
       });
-
-  ArduinoOTA.begin();
 }
\ No newline at end of file
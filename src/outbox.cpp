@@ -0,0 +1,286 @@
+#include "outbox.h"
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <string.h>
+
+#include "log.h"
+
+#define OUTBOX_PARTITION_LABEL "outbox"
+#define OUTBOX_SECTOR_LEN 4096
+#define OUTBOX_RECORDS_PER_SECTOR (OUTBOX_SECTOR_LEN / sizeof(outbox_record_t))
+#define OUTBOX_READ_RECORDS 16  // per flash read while scanning
+#define OUTBOX_BOOT_MASK 0x7F
+
+// Each state only clears bits of the one before, so no erase is needed
+#define OUTBOX_RECORD_ERASED 0xFF
+#define OUTBOX_RECORD_PENDING 0x7F
+#define OUTBOX_RECORD_CONSUMED 0x00
+
+#define OUTBOX_FLAG_OCCUPIED 0x01
+#define OUTBOX_FLAG_BOOT_SHIFT 1  // boot number in the upper seven bits
+
+typedef struct outbox_record {
+  uint8_t state;
+  uint8_t flags;
+  uint16_t crc;  // over the record with state erased and crc 0
+  int16_t temperature;
+  int16_t humidity;
+  uint32_t sequence;
+  uint32_t timestamp_ms;  // millis() of the boot that took it
+} outbox_record_t;
+
+static_assert(OUTBOX_SECTOR_LEN % sizeof(outbox_record_t) == 0,
+    "records must not straddle sectors");
+
+typedef void (*visit_fn)(
+    uint32_t slot, const outbox_record_t *record, void *ctx);
+
+// Walking the pending records while restoring them
+typedef struct restore_walk {
+  uint16_t skip;  // oldest records beyond the RAM queue's capacity
+  bool started;
+  outbox_record_t previous;
+  uint32_t offset_ms;  // of the current record from the oldest restored
+  uint32_t base_ms;
+  outbox_restore_fn restore;
+} restore_walk_t;
+
+static const esp_partition_t *partition = NULL;
+static uint32_t slot_count = 0;
+static uint32_t head = 0;  // next slot to write
+static uint32_t tail = 0;  // oldest pending record
+static uint16_t pending = 0;
+static uint16_t capacity_s = 0;
+static uint32_t next_sequence = 0;
+static uint8_t boot = 0;
+static outbox_stats_t stats = {};
+
+/******** PRIVATE FUNCTIONS ********/
+static uint16_t crc16(const uint8_t *data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  while (len--) {
+    crc ^= (uint16_t)*data++ << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static uint16_t record_crc(outbox_record_t record) {
+  record.state = OUTBOX_RECORD_ERASED;
+  record.crc = 0;
+  return crc16((const uint8_t *)&record, sizeof(record));
+}
+
+static bool is_pending(const outbox_record_t *record) {
+  return OUTBOX_RECORD_PENDING == record->state &&
+         record->crc == record_crc(*record);
+}
+
+static uint8_t boot_of(const outbox_record_t *record) {
+  return record->flags >> OUTBOX_FLAG_BOOT_SHIFT;
+}
+
+static bool mark(uint32_t slot, uint8_t state) {
+  return ESP_OK ==
+         esp_partition_write(partition, slot * sizeof(outbox_record_t), &state,
+             sizeof(state));
+}
+
+static uint8_t read_state(uint32_t slot) {
+  uint8_t state = OUTBOX_RECORD_ERASED;
+  esp_partition_read(
+      partition, slot * sizeof(outbox_record_t), &state, sizeof(state));
+  return state;
+}
+
+// Visits every slot once, starting at first and wrapping around
+static void scan(uint32_t first, visit_fn visit, void *ctx) {
+  outbox_record_t records[OUTBOX_READ_RECORDS];
+  uint32_t visited = 0;
+  while (visited < slot_count) {
+    uint32_t slot = (first + visited) % slot_count;
+    uint32_t n = OUTBOX_READ_RECORDS;
+    n = (slot_count - slot < n) ? slot_count - slot : n;
+    n = (slot_count - visited < n) ? slot_count - visited : n;
+    if (ESP_OK != esp_partition_read(partition,
+                      slot * sizeof(outbox_record_t), records,
+                      n * sizeof(outbox_record_t))) {
+      memset(records, OUTBOX_RECORD_ERASED, sizeof(records));
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      visit(slot + i, &records[i], ctx);
+    }
+    visited += n;
+  }
+}
+
+// Finds the newest record and retires torn ones, so they never count
+static void find_newest(
+    uint32_t slot, const outbox_record_t *record, void *ctx) {
+  outbox_record_t *newest = (outbox_record_t *)ctx;
+  if (OUTBOX_RECORD_ERASED == record->state) {
+    return;
+  }
+  if (record->crc != record_crc(*record)) {
+    if (OUTBOX_RECORD_CONSUMED != record->state) {
+      mark(slot, OUTBOX_RECORD_CONSUMED);
+    }
+    return;
+  }
+  if (OUTBOX_RECORD_ERASED == newest->state ||
+      (int32_t)(record->sequence - newest->sequence) > 0) {
+    *newest = *record;
+    head = (slot + 1) % slot_count;
+  }
+  pending += is_pending(record) ? 1 : 0;
+}
+
+// Samples taken in different boots are laid end to end, the gap unknown
+static uint32_t step_ms(restore_walk_t *walk, const outbox_record_t *record) {
+  uint32_t step = 0;
+  if (walk->started && boot_of(record) == boot_of(&walk->previous)) {
+    step = record->timestamp_ms - walk->previous.timestamp_ms;
+  }
+  walk->started = true;
+  walk->previous = *record;
+  return step;
+}
+
+static void measure_span(
+    uint32_t slot, const outbox_record_t *record, void *ctx) {
+  restore_walk_t *walk = (restore_walk_t *)ctx;
+  if (!is_pending(record)) {
+    return;
+  }
+  if (walk->skip) {
+    walk->skip--;
+    mark(slot, OUTBOX_RECORD_CONSUMED);
+    pending--;
+    return;
+  }
+  if (!walk->started) {
+    tail = slot;
+  }
+  walk->offset_ms += step_ms(walk, record);
+}
+
+static void restore_sample(
+    uint32_t slot, const outbox_record_t *record, void *ctx) {
+  (void)slot;
+  restore_walk_t *walk = (restore_walk_t *)ctx;
+  if (!is_pending(record)) {
+    return;
+  }
+  walk->offset_ms += step_ms(walk, record);
+  sample_t sample = {.timestamp_ms = walk->base_ms + walk->offset_ms,
+      .temperature = record->temperature,
+      .humidity = record->humidity,
+      .occupied = 0 != (record->flags & OUTBOX_FLAG_OCCUPIED)};
+  walk->restore(&sample);
+}
+
+// Advances tail to the next pending record after the one just consumed
+static void advance_tail(void) {
+  if (0 == pending) {
+    tail = head;
+    return;
+  }
+  do {
+    tail = (tail + 1) % slot_count;
+  } while (tail != head && OUTBOX_RECORD_PENDING != read_state(tail));
+}
+
+/******** PUBLIC FUNCTIONS ********/
+bool outbox_init(uint16_t capacity, outbox_restore_fn restore) {
+  partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+      ESP_PARTITION_SUBTYPE_ANY, OUTBOX_PARTITION_LABEL);
+  if (!partition) {
+    LOG_WARN("outbox: no partition, the backlog is kept in RAM only");
+    return false;
+  }
+  slot_count = (partition->size / OUTBOX_SECTOR_LEN) *
+               OUTBOX_RECORDS_PER_SECTOR;
+  // The sector being written can't also hold pending samples
+  if (slot_count < capacity + OUTBOX_RECORDS_PER_SECTOR) {
+    LOG_WARN("outbox: partition too small, the backlog is kept in RAM only");
+    partition = NULL;
+    return false;
+  }
+  capacity_s = capacity;
+  head = 0;
+  pending = 0;
+  outbox_record_t newest;
+  memset(&newest, OUTBOX_RECORD_ERASED, sizeof(newest));
+  scan(0, find_newest, &newest);
+  next_sequence = newest.sequence + 1;
+  boot = (boot_of(&newest) + 1) & OUTBOX_BOOT_MASK;
+
+  // Whatever follows the newest record in its sector was never finished
+  while (0 != head % OUTBOX_RECORDS_PER_SECTOR &&
+         OUTBOX_RECORD_ERASED != read_state(head)) {
+    head = (head + 1) % slot_count;
+  }
+  tail = head;
+  if (0 == pending) {
+    return true;
+  }
+
+  restore_walk_t walk = {};
+  walk.skip = (pending > capacity) ? pending - capacity : 0;
+  scan(head, measure_span, &walk);
+  // The newest restored sample is dated now
+  restore_walk_t replay = {};
+  replay.base_ms = millis() - walk.offset_ms;
+  replay.restore = restore;
+  scan(head, restore_sample, &replay);
+  stats.restored = pending;
+  LOG_INFO("outbox: restored %u samples", pending);
+  return true;
+}
+
+void outbox_append(const sample_t *sample) {
+  if (!partition) {
+    return;
+  }
+  // Mirror the RAM queue, which drops its oldest sample when full
+  if (pending == capacity_s) {
+    outbox_consume(1);
+  }
+  if (0 == head % OUTBOX_RECORDS_PER_SECTOR) {
+    esp_partition_erase_range(
+        partition, head * sizeof(outbox_record_t), OUTBOX_SECTOR_LEN);
+    stats.erases++;
+  }
+  outbox_record_t record = {.state = OUTBOX_RECORD_PENDING,
+      .flags = (uint8_t)((sample->occupied ? OUTBOX_FLAG_OCCUPIED : 0) |
+                         (boot << OUTBOX_FLAG_BOOT_SHIFT)),
+      .crc = 0,
+      .temperature = sample->temperature,
+      .humidity = sample->humidity,
+      .sequence = next_sequence++,
+      .timestamp_ms = sample->timestamp_ms};
+  record.crc = record_crc(record);
+  if (ESP_OK != esp_partition_write(partition,
+                    head * sizeof(outbox_record_t), &record,
+                    sizeof(record))) {
+    // The RAM queue still has it; a reboot loses this one sample
+    stats.write_errors++;
+    mark(head, OUTBOX_RECORD_CONSUMED);
+  } else if (0 == pending++) {
+    tail = head;
+  }
+  head = (head + 1) % slot_count;
+}
+
+void outbox_consume(uint16_t n) {
+  while (partition && n-- && pending) {
+    mark(tail, OUTBOX_RECORD_CONSUMED);
+    pending--;
+    advance_tail();
+  }
+}
+
+void outbox_get_stats(outbox_stats_t *stats_out) { *stats_out = stats; }
@@ -0,0 +1,250 @@
+#include "payload.h"
+
+#include <string.h>
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t pos;
+  bool overflow;
+} writer_t;
+
+/************* Private Functions *************/
+static void put_char(writer_t *writer, char c) {
+  if (writer->pos + 1 >= writer->len) {
+    writer->overflow = true;
+    return;
+  }
+  writer->buf[writer->pos++] = c;
+  writer->buf[writer->pos] = '\0';
+}
+
+static void put_str(writer_t *writer, const char *str) {
+  while (*str) {
+    put_char(writer, *str++);
+  }
+}
+
+static void put_uint(writer_t *writer, uint32_t value, uint8_t min_digits) {
+  char digits[10];
+  uint8_t n = 0;
+  do {
+    digits[n++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value > 0 || n < min_digits);
+  while (n > 0) {
+    put_char(writer, digits[--n]);
+  }
+}
+
+static void put_fixed(writer_t *writer, int32_t value, uint8_t decimals) {
+  static const uint32_t scale[] = {1, 10, 100, 1000, 10000};
+  uint32_t magnitude = (value < 0) ? 0u - (uint32_t)value : (uint32_t)value;
+  if (value < 0) {
+    put_char(writer, '-');
+  }
+  put_uint(writer, magnitude / scale[decimals], 1);
+  if (decimals > 0) {
+    put_char(writer, '.');
+    put_uint(writer, magnitude % scale[decimals], decimals);
+  }
+}
+
+static size_t finish(writer_t *writer) {
+  if (writer->overflow) {
+    if (writer->len > 0) {
+      writer->buf[0] = '\0';
+    }
+    return 0;
+  }
+  return writer->pos;
+}
+
+// Writes into the document with room left for the braces still to close
+static writer_t json_writer(const payload_json_t *json, uint8_t depth) {
+  writer_t writer = {.buf = json->buf,
+      .len = (json->len > depth) ? json->len - depth : 0,
+      .pos = json->pos,
+      .overflow = json->pos >= json->len};
+  return writer;
+}
+
+static void json_key(writer_t *writer, const payload_json_t *json,
+    const char *key) {
+  if (!json->first) {
+    put_char(writer, ',');
+  }
+  put_char(writer, '"');
+  put_str(writer, key);
+  put_str(writer, "\":");
+}
+
+// Keeps the field if it fit, otherwise cuts the document back to before it
+static bool json_commit(payload_json_t *json, const writer_t *writer) {
+  if (writer->overflow) {
+    if (json->pos < json->len) {
+      json->buf[json->pos] = '\0';
+    }
+    return false;
+  }
+  json->pos = writer->pos;
+  json->first = false;
+  return true;
+}
+
+/************* Public Functions *************/
+size_t payload_format_int(char *buf, size_t len, int32_t value) {
+  return payload_format_fixed(buf, len, value, 0);
+}
+
+size_t payload_format_uint(char *buf, size_t len, uint32_t value) {
+  if (!buf || 0 == len) {
+    return 0;
+  }
+  writer_t writer = {.buf = buf, .len = len, .pos = 0, .overflow = false};
+  buf[0] = '\0';
+  put_uint(&writer, value, 1);
+  return finish(&writer);
+}
+
+size_t payload_format_fixed(
+    char *buf, size_t len, int32_t value, uint8_t decimals) {
+  if (!buf || 0 == len || decimals > 4) {
+    return 0;
+  }
+  writer_t writer = {.buf = buf, .len = len, .pos = 0, .overflow = false};
+  buf[0] = '\0';
+  put_fixed(&writer, value, decimals);
+  return finish(&writer);
+}
+
+size_t payload_encode_json(
+    char *buf, size_t len, const sample_t *sample, uint32_t age_ms) {
+  if (!buf || 0 == len || !sample) {
+    return 0;
+  }
+  writer_t writer = {.buf = buf, .len = len, .pos = 0, .overflow = false};
+  buf[0] = '\0';
+  put_str(&writer, "{\"t\":");
+  put_fixed(&writer, sample->temperature, 0);
+  put_str(&writer, ",\"h\":");
+  put_fixed(&writer, sample->humidity, 0);
+  put_str(&writer, ",\"o\":");
+  put_char(&writer, sample->occupied ? '1' : '0');
+  put_str(&writer, ",\"age\":");
+  put_uint(&writer, age_ms, 1);
+  put_char(&writer, '}');
+  return finish(&writer);
+}
+
+size_t payload_encode_binary(
+    uint8_t *buf, size_t len, const sample_t *sample, uint32_t age_ms) {
+  if (!buf || PAYLOAD_BINARY_LEN > len || !sample) {
+    return 0;
+  }
+  uint16_t temperature = (uint16_t)sample->temperature;
+  uint16_t humidity = (uint16_t)sample->humidity;
+  buf[0] = PAYLOAD_BINARY_VERSION;
+  buf[1] = sample->occupied ? 1 : 0;
+  buf[2] = (uint8_t)temperature;
+  buf[3] = (uint8_t)(temperature >> 8);
+  buf[4] = (uint8_t)humidity;
+  buf[5] = (uint8_t)(humidity >> 8);
+  buf[6] = (uint8_t)age_ms;
+  buf[7] = (uint8_t)(age_ms >> 8);
+  buf[8] = (uint8_t)(age_ms >> 16);
+  buf[9] = (uint8_t)(age_ms >> 24);
+  return PAYLOAD_BINARY_LEN;
+}
+
+void payload_json_begin(payload_json_t *json, char *buf, size_t len) {
+  json->buf = buf;
+  json->len = len;
+  json->pos = 0;
+  json->depth = 0;
+  json->first = true;
+  if (!buf || 0 == len) {
+    return;
+  }
+  buf[0] = '\0';
+  writer_t writer = json_writer(json, 1);
+  put_char(&writer, '{');
+  if (json_commit(json, &writer)) {
+    json->depth = 1;
+    json->first = true;
+  } else {
+    json->pos = len;  // every field will be refused
+  }
+}
+
+bool payload_json_uint(payload_json_t *json, const char *key, uint32_t value) {
+  writer_t writer = json_writer(json, json->depth);
+  json_key(&writer, json, key);
+  put_uint(&writer, value, 1);
+  return json_commit(json, &writer);
+}
+
+bool payload_json_fixed(payload_json_t *json, const char *key, int32_t value,
+    uint8_t decimals) {
+  if (decimals > 4) {
+    return false;
+  }
+  writer_t writer = json_writer(json, json->depth);
+  json_key(&writer, json, key);
+  put_fixed(&writer, value, decimals);
+  return json_commit(json, &writer);
+}
+
+bool payload_json_uints(payload_json_t *json, const char *key,
+    const uint32_t *values, size_t count) {
+  writer_t writer = json_writer(json, json->depth);
+  json_key(&writer, json, key);
+  put_char(&writer, '[');
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) {
+      put_char(&writer, ',');
+    }
+    put_uint(&writer, values[i], 1);
+  }
+  put_char(&writer, ']');
+  return json_commit(json, &writer);
+}
+
+bool payload_json_open(payload_json_t *json, const char *key) {
+  if (UINT8_MAX == json->depth) {
+    return false;
+  }
+  writer_t writer = json_writer(json, json->depth + 1);
+  json_key(&writer, json, key);
+  put_char(&writer, '{');
+  if (!json_commit(json, &writer)) {
+    return false;
+  }
+  json->depth++;
+  json->first = true;
+  return true;
+}
+
+void payload_json_close(payload_json_t *json) {
+  if (json->depth <= 1) {
+    return;
+  }
+  writer_t writer = json_writer(json, json->depth - 1);
+  put_char(&writer, '}');
+  json_commit(json, &writer);
+  json->depth--;
+}
+
+size_t payload_json_end(payload_json_t *json) {
+  if (0 == json->depth) {
+    return 0;
+  }
+  while (json->depth > 1) {
+    payload_json_close(json);
+  }
+  writer_t writer = json_writer(json, 0);
+  put_char(&writer, '}');
+  json_commit(json, &writer);
+  json->depth = 0;
+  return json->pos;
+}
@@ -0,0 +1,163 @@
+#include "power.h"
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <driver/rtc_io.h>
+#include <esp_sleep.h>
+#include <string.h>
+
+#include "tasks.h"
+
+#if DUAL_CORE
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+// One FSM task per core, each with its own counters
+#define POWER_MAX_TASKS portNUM_PROCESSORS
+#else
+#define POWER_MAX_TASKS 1
+#endif
+
+// Waking up costs ~1 ms, so shorter waits just spin in delay()
+#define POWER_MIN_LIGHT_SLEEP_MS 20
+// How often an idle loop checks for power_wake()
+#define POWER_IDLE_SLICE_MS 10
+
+static uint8_t wake_pin_s = 0;
+static void (*on_wake_s)(void) = NULL;
+static uint32_t last_wake_ms[POWER_MAX_TASKS] = {};
+static power_stats_t stats[POWER_MAX_TASKS] = {};
+static power_stats_t last_duty_stats = {};
+#if DUAL_CORE
+// Set by each task as it starts idling, read by power_wake()
+static TaskHandle_t idle_tasks[POWER_MAX_TASKS] = {};
+#else
+static volatile bool wake_requested = false;
+#endif
+
+/******** PRIVATE FUNCTIONS ********/
+static uint8_t current_task(void) {
+#if DUAL_CORE
+  return xPortGetCoreID();
+#else
+  return 0;
+#endif
+}
+
+/******** PUBLIC FUNCTIONS ********/
+void power_init(uint8_t wake_pin, void (*on_wake)(void)) {
+  wake_pin_s = wake_pin;
+  on_wake_s = on_wake;
+  uint32_t now_ms = millis();
+  for (uint8_t task = 0; task < POWER_MAX_TASKS; task++) {
+    last_wake_ms[task] = now_ms;
+  }
+  // Modem sleep keeps the association alive between DTIM beacons
+  WiFi.setSleep(true);
+}
+
+void power_idle(uint32_t duration_ms) {
+  uint8_t task = current_task();
+  power_stats_t *task_stats = &stats[task];
+  uint32_t start_ms = millis();
+  task_stats->active_ms += start_ms - last_wake_ms[task];
+
+#if DUAL_CORE
+  // The other core keeps running, so there is no explicit light sleep
+  __atomic_store_n(
+      &idle_tasks[task], xTaskGetCurrentTaskHandle(), __ATOMIC_RELEASE);
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(duration_ms));
+#else
+#if POWER_LIGHT_SLEEP
+  if (duration_ms >= POWER_MIN_LIGHT_SLEEP_MS && !wake_requested) {
+    // A pin that is already high would wake us immediately
+    bool pin_wake_enabled = (LOW == digitalRead(wake_pin_s));
+    if (pin_wake_enabled) {
+      esp_sleep_enable_ext0_wakeup((gpio_num_t)wake_pin_s, HIGH);
+    }
+    esp_sleep_enable_timer_wakeup((uint64_t)duration_ms * 1000);
+    Serial.flush();
+    esp_light_sleep_start();
+
+    bool woken_by_pin = (ESP_SLEEP_WAKEUP_EXT0 == esp_sleep_get_wakeup_cause());
+    if (pin_wake_enabled) {
+      esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_EXT0);
+      rtc_gpio_deinit((gpio_num_t)wake_pin_s);
+    }
+    last_wake_ms[task] = millis();
+    task_stats->sleep_ms += last_wake_ms[task] - start_ms;
+    task_stats->sleep_count++;
+    if (woken_by_pin) {
+      // The GPIO edge interrupt doesn't run while the CPU is asleep
+      task_stats->pin_wakeups++;
+      if (on_wake_s) {
+        on_wake_s();
+      }
+    }
+    return;
+  }
+#endif
+
+  // Cleared only after waking, so a request that raced with the handlers
+  // ends this wait instead of being lost
+  uint32_t waited_ms = 0;
+  while (waited_ms < duration_ms && !wake_requested) {
+    uint32_t slice_ms = duration_ms - waited_ms;
+    if (slice_ms > POWER_IDLE_SLICE_MS) {
+      slice_ms = POWER_IDLE_SLICE_MS;
+    }
+    delay(slice_ms);
+    waited_ms += slice_ms;
+  }
+  wake_requested = false;
+#endif
+  last_wake_ms[task] = millis();
+  task_stats->idle_ms += last_wake_ms[task] - start_ms;
+}
+
+void IRAM_ATTR power_wake(void) {
+#if DUAL_CORE
+  BaseType_t higher_priority_woken = pdFALSE;
+  for (uint8_t task = 0; task < POWER_MAX_TASKS; task++) {
+    TaskHandle_t handle =
+        __atomic_load_n(&idle_tasks[task], __ATOMIC_ACQUIRE);
+    if (NULL == handle) {
+      continue;
+    }
+    if (xPortInIsrContext()) {
+      vTaskNotifyGiveFromISR(handle, &higher_priority_woken);
+    } else {
+      xTaskNotifyGive(handle);
+    }
+  }
+  if (higher_priority_woken) {
+    portYIELD_FROM_ISR();
+  }
+#else
+  wake_requested = true;
+#endif
+}
+
+void power_get_stats(power_stats_t *stats_out) {
+  memset(stats_out, 0, sizeof(*stats_out));
+  for (uint8_t task = 0; task < POWER_MAX_TASKS; task++) {
+    stats_out->active_ms += stats[task].active_ms;
+    stats_out->idle_ms += stats[task].idle_ms;
+    stats_out->sleep_ms += stats[task].sleep_ms;
+    stats_out->sleep_count += stats[task].sleep_count;
+    stats_out->pin_wakeups += stats[task].pin_wakeups;
+  }
+}
+
+uint8_t power_take_duty_cycle(void) {
+  power_stats_t stats_now;
+  power_get_stats(&stats_now);
+  uint32_t active_ms = stats_now.active_ms - last_duty_stats.active_ms;
+  uint32_t total_ms = active_ms +
+                      (stats_now.idle_ms - last_duty_stats.idle_ms) +
+                      (stats_now.sleep_ms - last_duty_stats.sleep_ms);
+  last_duty_stats = stats_now;
+  if (0 == total_ms) {
+    return 100;
+  }
+  return (uint8_t)((uint64_t)active_ms * 100 / total_ms);
+}
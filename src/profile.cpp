@@ -0,0 +1,116 @@
+#include "profile.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fsm.h"
+
+static profile_entry_t slots[PROFILE_MAX_SLOTS];
+static uint32_t overflows = 0;
+
+static const char *const loop_phase_names[] = {
+    "ota", "scheduler", "events", "busy"};
+
+/******** PRIVATE FUNCTIONS ********/
+static profile_entry_t *find_slot(uint32_t key) {
+  uint8_t index = key % PROFILE_MAX_SLOTS;
+  for (uint8_t i = 0; i < PROFILE_MAX_SLOTS; i++) {
+    profile_entry_t *entry = &slots[index];
+    if (key == entry->key) {
+      return entry;
+    }
+    if (0 == entry->key) {
+      entry->key = key;
+      entry->min_cycles = UINT32_MAX;
+      return entry;
+    }
+    index = (index + 1 == PROFILE_MAX_SLOTS) ? 0 : index + 1;
+  }
+  return NULL;
+}
+
+static uint8_t bucket_of(uint32_t cycles) {
+  uint32_t limit = 10 * PROFILE_CYCLES_PER_US;
+  uint8_t bucket = 0;
+  while (bucket < PROFILE_NUM_BUCKETS - 1 && cycles >= limit) {
+    limit *= 10;
+    bucket++;
+  }
+  return bucket;
+}
+
+/******** PUBLIC FUNCTIONS ********/
+void profile_record(uint32_t key, uint32_t cycles) {
+  profile_entry_t *entry = find_slot(key);
+  if (!entry) {
+    overflows++;
+    return;
+  }
+  entry->count++;
+  entry->total_cycles += cycles;
+  if (cycles < entry->min_cycles) {
+    entry->min_cycles = cycles;
+  }
+  if (cycles > entry->max_cycles) {
+    entry->max_cycles = cycles;
+  }
+  uint16_t *bucket = &entry->buckets[bucket_of(cycles)];
+  if (UINT16_MAX != *bucket) {
+    (*bucket)++;
+  }
+}
+
+bool profile_take(uint8_t slot, profile_entry_t *entry) {
+  if (PROFILE_MAX_SLOTS <= slot || 0 == slots[slot].count) {
+    return false;
+  }
+  *entry = slots[slot];
+  // Keep the key so the slot isn't handed to another handler
+  uint32_t key = slots[slot].key;
+  memset(&slots[slot], 0, sizeof(slots[slot]));
+  slots[slot].key = key;
+  slots[slot].min_cycles = UINT32_MAX;
+  return true;
+}
+
+uint32_t profile_overflows(void) { return overflows; }
+
+size_t profile_format_name(char *buf, size_t len, uint32_t key) {
+  uint8_t fsm_id = key >> 24;
+  uint8_t kind = (key >> 21) & 0x7;
+  uint8_t state = (key >> 13) & 0xFF;
+  uint16_t event = key & 0x1FFF;
+  int written = 0;
+
+  switch (kind) {
+    case PROFILE_KIND_ENTRY:
+      written = snprintf(buf, len, "%s/s%u/entry", fsm_get_name(fsm_id), state);
+      break;
+    case PROFILE_KIND_EXIT:
+      written = snprintf(buf, len, "%s/s%u/exit", fsm_get_name(fsm_id), state);
+      break;
+    case PROFILE_KIND_TRANSITION:
+      written = snprintf(
+          buf, len, "%s/s%u/e%u", fsm_get_name(fsm_id), state, event);
+      break;
+    default:
+      written = snprintf(buf, len, "loop/%s",
+          (state < sizeof(loop_phase_names) / sizeof(loop_phase_names[0]))
+              ? loop_phase_names[state]
+              : "unknown");
+      break;
+  }
+  return (written < 0 || (size_t)written >= len) ? 0 : (size_t)written;
+}
+
+void profile_entry_fields(uint32_t *fields, const profile_entry_t *entry) {
+  uint32_t avg_cycles =
+      entry->count ? (uint32_t)(entry->total_cycles / entry->count) : 0;
+  fields[0] = entry->count;
+  fields[1] = entry->min_cycles / PROFILE_CYCLES_PER_US;
+  fields[2] = avg_cycles / PROFILE_CYCLES_PER_US;
+  fields[3] = entry->max_cycles / PROFILE_CYCLES_PER_US;
+  for (uint8_t i = 0; i < PROFILE_NUM_BUCKETS; i++) {
+    fields[4 + i] = entry->buckets[i];
+  }
+}
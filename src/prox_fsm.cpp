@@ -1,38 +1,44 @@
 #include "prox_fsm.h"
 
 #include <Arduino.h>
+#include <string.h>
 
 #include "HardwareSerial.h"
+#include "fsm_table.h"
+#include "log.h"
+#include "occupancy.h"
+#include "power.h"
+#include "settings.h"
+
+#define PROX_QUEUE_SIZE 8
 
 static fsm_handle_t state_machine;
 
-enum { PROX_UNKNOWN, PROX_ACTIVE, PROX_INACTIVE };
+enum { PROX_UNKNOWN, PROX_ACTIVE, PROX_INACTIVE, PROX_STATE_COUNT };
 
-#define PROX_INPUT 35
 #define ENABLE true
 #define DISABLE false
 
-#define MOTION_INTERVAL_MS (120 * 1000)
-#define MOTION_COUNT_MAX 3
-
-typedef enum {
-  PROX_DETECTED,
-  PROX_NOT_DETECTED,
-} proximityState_t;
-
-typedef struct {
-  unsigned long timestamp_ms;
-  size_t motion_count;
-  proximityState_t prox_state;
-  proximityState_t previous_prox_state;
-} motionEvent_t;
-
-volatile motionEvent_t latestMotion = {.timestamp_ms = 0,
-    .motion_count = 0,
-    .prox_state = PROX_NOT_DETECTED,
-    .previous_prox_state = PROX_NOT_DETECTED};
+// Written by the ISR, read when the loop handles PROX_EVENT_MOTION
+static volatile uint32_t edge_us = 0;
 
 static bool person_detected = false;
+static uint32_t occupied_edge_us = 0;
+static bool seen_motion = false;
+static uint32_t last_motion_ms = 0;
+static uint32_t window_start_ms = 0;
+static uint8_t window_edges = 0;
+static bool vacancy_check_armed = false;
+static scheduler_t *scheduler_s = NULL;
+static void (*on_change_s)(void) = NULL;
+static occupancy_t occupancy;
+static prox_stats_t stats;
+
+// Single-slot handoff to the MQTT FSM: filled by the prox FSM while
+// summary_ready is clear, emptied by prox_take_occupancy_summary()
+static char summary[OCCUPANCY_SUMMARY_LEN];
+static size_t summary_len = 0;
+static bool summary_ready = false;
 
 /**
  * @brief ISR when motion is detected
@@ -40,9 +46,9 @@ static bool person_detected = false;
  * The trigger lasts for 1 second and can't be triggered again for 4-6 seconds
  */
 void IRAM_ATTR motion_detected() {
-  latestMotion.motion_count +=
-      (latestMotion.motion_count < MOTION_COUNT_MAX) ? 1 : 0;
-  latestMotion.timestamp_ms = millis();
+  edge_us = micros();
+  fsm_send_from_isr(&state_machine, PROX_EVENT_MOTION);
+  power_wake();
 }
 
 void prox_set_IRQ(bool enable) {
@@ -53,6 +59,12 @@ void prox_set_IRQ(bool enable) {
   }
 }
 
+// The wake-up takes about a millisecond, which the latency doesn't include
+void prox_notify_motion(void) {
+  edge_us = micros();
+  prox_fsm_send(PROX_EVENT_MOTION);
+}
+
 /******** PRIVATE FUNCTIONS ********/
 static fsm_err_t unknown_entry_fn();
 static fsm_err_t unknown_exit_fn();
@@ -62,66 +74,103 @@ static fsm_err_t inactive_entry_fn();
 static fsm_err_t inactive_exit_fn();
 
 static fsm_err_t periodic_active_event_fn();
+static fsm_err_t motion_event_fn();
+static fsm_err_t vacancy_check_event_fn();
 
 /******** TRANSITIONS ********/
-static fsm_transition_t unknown_transitions[] = {
-    {.destination_state_ID = PROX_ACTIVE, .event = PROX_EVENT_START},
-    {.destination_state_ID = PROX_INACTIVE, .event = PROX_EVENT_STOP},
-};
-
-static fsm_transition_t active_transitions[] = {
-    {.destination_state_ID = PROX_INACTIVE, .event = PROX_EVENT_STOP},
-    {.destination_state_ID = PROX_ACTIVE,
+static constexpr fsm_static_transition_t transitions[] = {
+    {.source_state_ID = PROX_UNKNOWN,
+        .event = PROX_EVENT_START,
+        .destination_state_ID = PROX_ACTIVE},
+    {.source_state_ID = PROX_UNKNOWN,
+        .event = PROX_EVENT_STOP,
+        .destination_state_ID = PROX_INACTIVE},
+    {.source_state_ID = PROX_ACTIVE,
+        .event = PROX_EVENT_STOP,
+        .destination_state_ID = PROX_INACTIVE},
+    {.source_state_ID = PROX_ACTIVE,
         .event = FSM_PERIODIC_EVENT_5S,
-        .transition_fn = periodic_active_event_fn}};
+        .destination_state_ID = PROX_ACTIVE,
+        .transition_fn = periodic_active_event_fn},
+    {.source_state_ID = PROX_ACTIVE,
+        .event = PROX_EVENT_MOTION,
+        .destination_state_ID = PROX_ACTIVE,
+        .transition_fn = motion_event_fn},
+    {.source_state_ID = PROX_ACTIVE,
+        .event = PROX_EVENT_VACANCY_CHECK,
+        .destination_state_ID = PROX_ACTIVE,
+        .transition_fn = vacancy_check_event_fn},
+    {.source_state_ID = PROX_INACTIVE,
+        .event = PROX_EVENT_START,
+        .destination_state_ID = PROX_ACTIVE},
+};
 
-static fsm_transition_t inactive_transitions[] = {
-    {.destination_state_ID = PROX_ACTIVE, .event = PROX_EVENT_START}};
+FSM_DEFINE_TABLE(
+    dispatch_table, PROX_STATE_COUNT, PROX_EVENT_COUNT, transitions);
 
 /******** STATES ********/
-static fsm_state_t unknown_state = {.ID = PROX_UNKNOWN,
-    .entry_fn = unknown_entry_fn,
-    .exit_fn = unknown_exit_fn,
-    .transition_array = unknown_transitions,
-    .num_transitions =
-        sizeof(unknown_transitions) / sizeof(unknown_transitions[0])};
-
-static fsm_state_t active_state = {.ID = PROX_ACTIVE,
-    .entry_fn = active_entry_fn,
-    .exit_fn = active_exit_fn,
-    .transition_array = active_transitions,
-    .num_transitions =
-        sizeof(active_transitions) / sizeof(active_transitions[0])};
-
-static fsm_state_t inactive_state = {.ID = PROX_INACTIVE,
-    .entry_fn = inactive_entry_fn,
-    .exit_fn = inactive_exit_fn,
-    .transition_array = inactive_transitions,
-    .num_transitions =
-        sizeof(inactive_transitions) / sizeof(inactive_transitions[0])};
-
-/******** STATE MACHINE ********/
 static fsm_state_t states[] = {
-    [PROX_UNKNOWN] = unknown_state,
-    [PROX_ACTIVE] = active_state,
-    [PROX_INACTIVE] = inactive_state,
+    [PROX_UNKNOWN] = {.ID = PROX_UNKNOWN,
+        .entry_fn = unknown_entry_fn,
+        .exit_fn = unknown_exit_fn},
+    [PROX_ACTIVE] = {.ID = PROX_ACTIVE,
+        .entry_fn = active_entry_fn,
+        .exit_fn = active_exit_fn},
+    [PROX_INACTIVE] = {.ID = PROX_INACTIVE,
+        .entry_fn = inactive_entry_fn,
+        .exit_fn = inactive_exit_fn},
 };
 
 /******** PUBLIC FUNCTIONS ********/
 fsm_err_t prox_fsm_init(void) {
-  return fsm_init(&state_machine, states, sizeof(states) / sizeof(states[0]));
+  occupancy_init(&occupancy, millis());
+  const fsm_queue_config_t queue = {.buffer = NULL,
+      .capacity = PROX_QUEUE_SIZE,
+      .overflow_policy = FSM_OVERFLOW_COALESCE};
+  fsm_err_t retVal =
+      fsm_init_table(&state_machine, states, dispatch_table, &queue);
+  fsm_set_name(&state_machine, "prox");
+  return retVal;
 }
 
 fsm_err_t prox_fsm_send(fsm_event event) {
   return fsm_send(&state_machine, event);
 }
 
+fsm_err_t prox_fsm_schedule(scheduler_t *scheduler) {
+  scheduler_s = scheduler;
+  return scheduler_add_periodic(scheduler, &state_machine, prox_fsm_send);
+}
+
 fsm_err_t prox_fsm_handle_event(void) {
   return fsm_handle_event(&state_machine);
 }
 
+fsm_err_t prox_fsm_get_queue_stats(fsm_queue_stats_t *stats) {
+  return fsm_get_queue_stats(&state_machine, stats);
+}
+
+void prox_fsm_get_stats(prox_stats_t *stats_out) { *stats_out = stats; }
+
 bool get_prox(void) { return person_detected; }
 
+void prox_fsm_on_change(void (*on_change)(void)) { on_change_s = on_change; }
+
+uint32_t prox_get_occupied_edge_us(void) { return occupied_edge_us; }
+
+size_t prox_take_occupancy_summary(char *buf, size_t len) {
+  if (!__atomic_load_n(&summary_ready, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  size_t taken = 0;
+  if (summary_len < len) {
+    memcpy(buf, summary, summary_len + 1);
+    taken = summary_len;
+  }
+  __atomic_store_n(&summary_ready, false, __ATOMIC_RELEASE);
+  return taken;
+}
+
 /******** PRIVATE FUNCTIONS ********/
 static fsm_err_t unknown_entry_fn() {
   pinMode(PROX_INPUT, INPUT);
@@ -139,21 +188,92 @@ static fsm_err_t inactive_entry_fn() {
   return FSM_ERR_OK;
 }
 
-static fsm_err_t periodic_active_event_fn() {
-  if (latestMotion.motion_count > 0) {
-    if (millis() - latestMotion.timestamp_ms > MOTION_INTERVAL_MS) {
-      latestMotion.motion_count--;
-      latestMotion.timestamp_ms = millis();
-    }
-    if (PROX_DETECTED != latestMotion.previous_prox_state) {
-      person_detected = true;
-    }
-    latestMotion.previous_prox_state = PROX_DETECTED;
+static void set_person_detected(bool detected) {
+  occupancy_update(&occupancy, detected, millis());
+  if (detected == person_detected) {
+    return;
+  }
+  person_detected = detected;
+  if (on_change_s) {
+    on_change_s();
+  }
+}
+
+static void arm_vacancy_check(uint32_t delay_ms) {
+  if (vacancy_check_armed || NULL == scheduler_s) {
+    return;
+  }
+  vacancy_check_armed =
+      (FSM_ERR_OK == scheduler_add_oneshot(scheduler_s,
+                         PROX_EVENT_VACANCY_CHECK, delay_ms, prox_fsm_send));
+}
+
+// Also runs on the 5 s tick, in case the one-shot couldn't be armed
+static void check_vacancy() {
+  if (!person_detected) {
+    return;
+  }
+  uint32_t vacant_ms = settings_get(SETTING_VACANT_MS);
+  uint32_t quiet_ms = millis() - last_motion_ms;
+  if (quiet_ms >= vacant_ms) {
+    set_person_detected(false);
   } else {
-    if (PROX_NOT_DETECTED != latestMotion.previous_prox_state) {
-      person_detected = false;
+    arm_vacancy_check(vacant_ms - quiet_ms);
+  }
+}
+
+// Edges closer than the debounce time are one edge; the room turns occupied
+// after enough edges within the window and empty after the vacant time
+// without motion, see settings.h
+static fsm_err_t motion_event_fn() {
+  uint32_t latency_us = micros() - edge_us;
+  stats.edges++;
+  if (latency_us > stats.latency_max_us) {
+    stats.latency_max_us = latency_us;
+  }
+  uint32_t now_ms = millis();
+  uint32_t debounce_ms = settings_get(SETTING_DEBOUNCE_MS);
+  if (seen_motion && now_ms - last_motion_ms < debounce_ms) {
+    return FSM_ERR_OK;
+  }
+  seen_motion = true;
+  last_motion_ms = now_ms;
+  if (person_detected) {
+    return FSM_ERR_OK;
+  }
+  uint32_t window_ms = settings_get(SETTING_OCCUPIED_WINDOW_MS);
+  if (0 == window_edges || now_ms - window_start_ms > window_ms) {
+    window_start_ms = now_ms;
+    window_edges = 0;
+  }
+  if (++window_edges >= settings_get(SETTING_OCCUPIED_EDGES)) {
+    window_edges = 0;
+    occupied_edge_us = edge_us;
+    set_person_detected(true);
+    arm_vacancy_check(settings_get(SETTING_VACANT_MS));
+  }
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t vacancy_check_event_fn() {
+  vacancy_check_armed = false;
+  check_vacancy();
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t periodic_active_event_fn() {
+  check_vacancy();
+  occupancy_update(&occupancy, person_detected, millis());
+  // A report stays pending until the previous summary was taken
+  if (!__atomic_load_n(&summary_ready, __ATOMIC_ACQUIRE) &&
+      occupancy_take_report(&occupancy)) {
+    summary_len =
+        occupancy_format_summary(&occupancy, summary, sizeof(summary));
+    if (0 == summary_len) {
+      LOG_WARN("prox: occupancy summary longer than %u bytes, not sent",
+          (unsigned)sizeof(summary));
     }
-    latestMotion.previous_prox_state = PROX_NOT_DETECTED;
+    __atomic_store_n(&summary_ready, 0 != summary_len, __ATOMIC_RELEASE);
   }
   return FSM_ERR_OK;
 }
@@ -0,0 +1,62 @@
+#include "sample_queue.h"
+
+#include <string.h>
+
+/************* Private Functions *************/
+static uint16_t wrap(const sample_queue_t *queue, uint32_t index) {
+  return (uint16_t)(index % queue->capacity);
+}
+
+/************* Public Functions *************/
+void sample_queue_init(
+    sample_queue_t *queue, sample_t *buffer, uint16_t capacity) {
+  memset(queue, 0, sizeof(*queue));
+  queue->buffer = buffer;
+  queue->capacity = capacity;
+}
+
+bool sample_queue_push(sample_queue_t *queue, const sample_t *sample) {
+  bool fit = true;
+  if (queue->count == queue->capacity) {
+    queue->head = wrap(queue, queue->head + 1);
+    queue->count--;
+    queue->stats.dropped++;
+    fit = false;
+  }
+  queue->buffer[wrap(queue, queue->head + queue->count)] = *sample;
+  queue->count++;
+  queue->stats.queued++;
+  if (queue->count > queue->stats.high_water_mark) {
+    queue->stats.high_water_mark = queue->count;
+  }
+  return fit;
+}
+
+uint16_t sample_queue_peek(
+    const sample_queue_t *queue, sample_t *samples, uint16_t max) {
+  return sample_queue_peek_from(queue, 0, samples, max);
+}
+
+uint16_t sample_queue_peek_from(const sample_queue_t *queue, uint16_t first,
+    sample_t *samples, uint16_t max) {
+  if (first >= queue->count) {
+    return 0;
+  }
+  uint16_t n = (queue->count - first < max) ? queue->count - first : max;
+  for (uint16_t i = 0; i < n; i++) {
+    samples[i] = queue->buffer[wrap(queue, queue->head + first + i)];
+  }
+  return n;
+}
+
+void sample_queue_pop(sample_queue_t *queue, uint16_t n) {
+  if (n > queue->count) {
+    n = queue->count;
+  }
+  queue->head = wrap(queue, queue->head + n);
+  queue->count -= n;
+}
+
+uint16_t sample_queue_count(const sample_queue_t *queue) {
+  return queue->count;
+}
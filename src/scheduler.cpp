@@ -0,0 +1,147 @@
+#include "scheduler.h"
+
+#include <string.h>
+
+static const uint32_t periodic_interval_ms[FSM_GLOBAL_EVENT_COUNT] = {
+    [FSM_PERIODIC_EVENT_500MS] = 500,
+    [FSM_PERIODIC_EVENT_1S] = 1000,
+    [FSM_PERIODIC_EVENT_5S] = 5000,
+};
+
+/************* Private Functions *************/
+static bool is_before(uint32_t a_ms, uint32_t b_ms) {
+  return (int32_t)(a_ms - b_ms) < 0;
+}
+
+static void swap_timers(scheduler_timer_t *a, scheduler_timer_t *b) {
+  scheduler_timer_t tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static void sift_up(scheduler_t *scheduler, uint8_t index) {
+  while (index > 0) {
+    uint8_t parent = (index - 1) / 2;
+    if (!is_before(scheduler->heap[index].deadline_ms,
+            scheduler->heap[parent].deadline_ms)) {
+      break;
+    }
+    swap_timers(&scheduler->heap[index], &scheduler->heap[parent]);
+    index = parent;
+  }
+}
+
+static void sift_down(scheduler_t *scheduler, uint8_t index) {
+  for (;;) {
+    uint8_t smallest = index;
+    uint8_t left = 2 * index + 1;
+    uint8_t right = left + 1;
+    if (left < scheduler->num_timers &&
+        is_before(scheduler->heap[left].deadline_ms,
+            scheduler->heap[smallest].deadline_ms)) {
+      smallest = left;
+    }
+    if (right < scheduler->num_timers &&
+        is_before(scheduler->heap[right].deadline_ms,
+            scheduler->heap[smallest].deadline_ms)) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      return;
+    }
+    swap_timers(&scheduler->heap[index], &scheduler->heap[smallest]);
+    index = smallest;
+  }
+}
+
+static fsm_err_t add_timer(scheduler_t *scheduler, fsm_event event,
+    uint32_t deadline_ms, uint32_t period_ms, scheduler_send_fn send) {
+  if (!send) {
+    return FSM_ERR_EINVAL;
+  }
+  if (SCHEDULER_MAX_TIMERS <= scheduler->num_timers) {
+    return FSM_ERR_FULL;
+  }
+  scheduler_timer_t *timer = &scheduler->heap[scheduler->num_timers];
+  timer->deadline_ms = deadline_ms;
+  timer->period_ms = period_ms;
+  timer->event = event;
+  timer->send = send;
+  sift_up(scheduler, scheduler->num_timers++);
+  return FSM_ERR_OK;
+}
+
+/************* Public Functions *************/
+void scheduler_init(scheduler_t *scheduler, uint32_t now_ms) {
+  memset(scheduler, 0, sizeof(*scheduler));
+  scheduler->epoch_ms = now_ms;
+  scheduler->last_dispatch_ms = now_ms;
+}
+
+fsm_err_t scheduler_add(scheduler_t *scheduler, fsm_event event,
+    uint32_t period_ms, scheduler_send_fn send) {
+  if (!scheduler || 0 == period_ms) {
+    return FSM_ERR_EINVAL;
+  }
+  return add_timer(scheduler, event, scheduler->epoch_ms, period_ms, send);
+}
+
+fsm_err_t scheduler_add_oneshot(scheduler_t *scheduler, fsm_event event,
+    uint32_t delay_ms, scheduler_send_fn send) {
+  if (!scheduler) {
+    return FSM_ERR_EINVAL;
+  }
+  return add_timer(
+      scheduler, event, scheduler->last_dispatch_ms + delay_ms, 0, send);
+}
+
+fsm_err_t scheduler_add_periodic(scheduler_t *scheduler,
+    const fsm_handle_t *state_machine, scheduler_send_fn send) {
+  for (fsm_event event = 0; event < FSM_GLOBAL_EVENT_COUNT; event++) {
+    if (!fsm_handles_event(state_machine, event)) {
+      continue;
+    }
+    fsm_err_t retVal =
+        scheduler_add(scheduler, event, periodic_interval_ms[event], send);
+    if (FSM_ERR_OK != retVal) {
+      return retVal;
+    }
+  }
+  return FSM_ERR_OK;
+}
+
+uint8_t scheduler_dispatch(scheduler_t *scheduler, uint32_t now_ms) {
+  uint8_t sent = 0;
+  scheduler->last_dispatch_ms = now_ms;
+  while (scheduler->num_timers > 0 &&
+         !is_before(now_ms, scheduler->heap[0].deadline_ms)) {
+    scheduler_timer_t *timer = &scheduler->heap[0];
+    timer->send(timer->event);
+    sent++;
+
+    if (0 == timer->period_ms) {
+      *timer = scheduler->heap[--scheduler->num_timers];
+      sift_down(scheduler, 0);
+      continue;
+    }
+    timer->deadline_ms += timer->period_ms;
+    if (!is_before(now_ms, timer->deadline_ms)) {
+      uint32_t missed = (now_ms - timer->deadline_ms) / timer->period_ms + 1;
+      timer->deadline_ms += missed * timer->period_ms;
+      scheduler->missed_periods += missed;
+    }
+    sift_down(scheduler, 0);
+  }
+  return sent;
+}
+
+uint32_t scheduler_time_until_next(
+    const scheduler_t *scheduler, uint32_t now_ms) {
+  if (0 == scheduler->num_timers) {
+    return UINT32_MAX;
+  }
+  if (!is_before(now_ms, scheduler->heap[0].deadline_ms)) {
+    return 0;
+  }
+  return scheduler->heap[0].deadline_ms - now_ms;
+}
@@ -0,0 +1,36 @@
+#include "sensor_link.h"
+
+#include <string.h>
+
+/************* Public Functions *************/
+void sensor_link_init(sensor_link_t *link) { memset(link, 0, sizeof(*link)); }
+
+bool sensor_link_push(sensor_link_t *link, const sensor_reading_t *reading) {
+  uint8_t tail = link->tail;
+  uint8_t head = __atomic_load_n(&link->head, __ATOMIC_ACQUIRE);
+  if (SENSOR_LINK_SIZE <= (uint8_t)(tail - head)) {
+    __atomic_fetch_add(&link->dropped, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  link->readings[tail & (SENSOR_LINK_SIZE - 1)] = *reading;
+  __atomic_store_n(&link->tail, (uint8_t)(tail + 1), __ATOMIC_RELEASE);
+  return true;
+}
+
+bool sensor_link_take(sensor_link_t *link, sensor_reading_t *reading) {
+  uint8_t head = link->head;
+  if (head == __atomic_load_n(&link->tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  *reading = link->readings[head & (SENSOR_LINK_SIZE - 1)];
+  __atomic_store_n(&link->head, (uint8_t)(head + 1), __ATOMIC_RELEASE);
+  return true;
+}
+
+uint32_t sensor_link_dropped(const sensor_link_t *link) {
+  return __atomic_load_n(&link->dropped, __ATOMIC_RELAXED);
+}
+
+int sensor_round_tenths(int32_t value_x10) {
+  return (value_x10 + ((value_x10 < 0) ? -5 : 5)) / 10;
+}
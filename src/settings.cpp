@@ -0,0 +1,250 @@
+#include "settings.h"
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "payload.h"
+
+#define SETTINGS_NVS_NAMESPACE "settings"
+#define SETTINGS_NVS_KEY "changed"
+#define SETTINGS_NVS_VERSION 1
+
+// Compile-time defaults, override per room in the env's build_flags
+#ifndef DHT_SAMPLE_PERIOD_MS
+#define DHT_SAMPLE_PERIOD_MS 5000
+#endif
+// Edges closer than the debounce time are one edge; the room turns occupied
+// after PROX_OCCUPIED_EDGES edges within PROX_OCCUPIED_WINDOW_MS and empty
+// after PROX_VACANT_MS without motion.
+#ifndef PROX_DEBOUNCE_MS
+#define PROX_DEBOUNCE_MS 500
+#endif
+#ifndef PROX_OCCUPIED_EDGES
+#define PROX_OCCUPIED_EDGES 1
+#endif
+#ifndef PROX_OCCUPIED_WINDOW_MS
+#define PROX_OCCUPIED_WINDOW_MS (30 * 1000)
+#endif
+#ifndef PROX_VACANT_MS
+#define PROX_VACANT_MS (120 * 1000)
+#endif
+// A sample is only published when a reading left the dead band around the
+// last published one, occupancy changed or the heartbeat expired
+#ifndef MQTT_REPORT_TEMP_DELTA_X10
+#define MQTT_REPORT_TEMP_DELTA_X10 5  // tenths of a degree Fahrenheit
+#endif
+#ifndef MQTT_REPORT_HUM_DELTA_X10
+#define MQTT_REPORT_HUM_DELTA_X10 10  // tenths of a percent
+#endif
+#ifndef MQTT_HEARTBEAT_MS
+#define MQTT_HEARTBEAT_MS 300000
+#endif
+#ifndef MQTT_PAYLOAD_FORMAT
+#define MQTT_PAYLOAD_FORMAT MQTT_PAYLOAD_TOPICS
+#endif
+// Degrees Fahrenheit, set temp_offset per room rather than per image
+#ifndef TEMPERATURE_OFFSET
+#define TEMPERATURE_OFFSET 0
+#endif
+
+typedef struct setting_def {
+  const char *name;
+  int32_t default_value;
+  int32_t min;
+  int32_t max;
+  uint8_t decimals;  // 1 for the tenths settings
+} setting_def_t;
+
+static const setting_def_t defs[SETTING_COUNT] = {
+    [SETTING_SAMPLE_PERIOD_MS] = {"sample_period_ms", DHT_SAMPLE_PERIOD_MS,
+        5000, 3600 * 1000, 0},
+    [SETTING_DEBOUNCE_MS] = {"debounce_ms", PROX_DEBOUNCE_MS, 0, 10 * 1000,
+        0},
+    [SETTING_OCCUPIED_EDGES] = {"occupied_edges", PROX_OCCUPIED_EDGES, 1, 20,
+        0},
+    [SETTING_OCCUPIED_WINDOW_MS] = {"occupied_window_ms",
+        PROX_OCCUPIED_WINDOW_MS, 1000, 600 * 1000, 0},
+    [SETTING_VACANT_MS] = {"vacant_ms", PROX_VACANT_MS, 5000, 3600 * 1000,
+        0},
+    [SETTING_TEMP_DELTA_X10] = {"temp_delta", MQTT_REPORT_TEMP_DELTA_X10, 0,
+        100, 1},
+    [SETTING_HUM_DELTA_X10] = {"hum_delta", MQTT_REPORT_HUM_DELTA_X10, 0,
+        200, 1},
+    [SETTING_HEARTBEAT_MS] = {"heartbeat_ms", MQTT_HEARTBEAT_MS, 5000,
+        24 * 3600 * 1000, 0},
+    [SETTING_PAYLOAD_FORMAT] = {"payload_format", MQTT_PAYLOAD_FORMAT,
+        MQTT_PAYLOAD_TOPICS, MQTT_PAYLOAD_BINARY, 0},
+    [SETTING_TEMP_OFFSET_X10] = {"temp_offset",
+        (int32_t)(TEMPERATURE_OFFSET * 10), -300, 300, 1},
+};
+
+// Persisted as a blob in NVS, bump SETTINGS_NVS_VERSION when changing the
+// meaning of a stored setting. Blobs from before a setting was added are
+// shorter and leave it at its default. Those from a newer image are longer,
+// and only the settings this image knows are read from them.
+typedef struct {
+  uint8_t version;
+  uint32_t changed;  // bit per setting_id_t changed at runtime
+  int32_t values[SETTING_COUNT];
+} settings_nvs_t;
+
+// One bit per setting in changed, so no image stores more than this
+#define SETTINGS_NVS_MAX_COUNT 32
+#define SETTINGS_NVS_MAX_LEN \
+  (offsetof(settings_nvs_t, values) + SETTINGS_NVS_MAX_COUNT * sizeof(int32_t))
+
+static_assert(SETTING_COUNT <= SETTINGS_NVS_MAX_COUNT,
+    "one bit per setting in changed");
+
+static int32_t values[SETTING_COUNT];
+static uint32_t changed = 0;
+
+/******** PRIVATE FUNCTIONS ********/
+static bool in_range(setting_id_t id, int32_t value) {
+  return value >= defs[id].min && value <= defs[id].max;
+}
+
+static void save(void) {
+  settings_nvs_t stored = {.version = SETTINGS_NVS_VERSION};
+  stored.changed = changed;
+  memcpy(stored.values, values, sizeof(stored.values));
+  Preferences prefs;
+  prefs.begin(SETTINGS_NVS_NAMESPACE, false);
+  prefs.putBytes(SETTINGS_NVS_KEY, &stored, sizeof(stored));
+  prefs.end();
+}
+
+// Whole numbers, or with one decimal for the tenths settings
+static bool parse(setting_id_t id, const char *text, int32_t *value) {
+  char *end = NULL;
+  if (0 == defs[id].decimals) {
+    long long parsed = strtoll(text, &end, 10);
+    if (parsed >= INT32_MIN && parsed <= INT32_MAX) {
+      *value = (int32_t)parsed;
+    } else {
+      end = (char *)text;
+    }
+  } else {
+    float parsed = strtof(text, &end);
+    if (isfinite(parsed) && fabsf(parsed) < 1e6f) {
+      *value = lroundf(parsed * 10.0f);
+    } else {
+      end = (char *)text;
+    }
+  }
+  return end != text && '\0' == *end;
+}
+
+/******** PUBLIC FUNCTIONS ********/
+void settings_init(void) {
+  for (uint8_t id = 0; id < SETTING_COUNT; id++) {
+    values[id] = defs[id].default_value;
+  }
+  changed = 0;
+
+  // getBytes() refuses a blob longer than the buffer, so size it for the
+  // longest any image writes and take the settings this one knows
+  uint8_t blob[SETTINGS_NVS_MAX_LEN];
+  Preferences prefs;
+  prefs.begin(SETTINGS_NVS_NAMESPACE, true);
+  size_t len = prefs.getBytesLength(SETTINGS_NVS_KEY);
+  if (len > sizeof(blob)) {
+    len = 0;
+  }
+  len = (len > 0) ? prefs.getBytes(SETTINGS_NVS_KEY, blob, len) : 0;
+  prefs.end();
+  settings_nvs_t stored = {};
+  memcpy(&stored, blob, (len < sizeof(stored)) ? len : sizeof(stored));
+  if (len < offsetof(settings_nvs_t, values) ||
+      SETTINGS_NVS_VERSION != stored.version) {
+    return;
+  }
+  size_t count = (len - offsetof(settings_nvs_t, values)) / sizeof(int32_t);
+  if (count > SETTING_COUNT) {
+    count = SETTING_COUNT;
+  }
+  for (uint8_t id = 0; id < count; id++) {
+    // The range may have narrowed since it was stored
+    if ((stored.changed & (1u << id)) &&
+        in_range((setting_id_t)id, stored.values[id])) {
+      values[id] = stored.values[id];
+      changed |= 1u << id;
+    }
+  }
+  if (changed) {
+    LOG_INFO("settings: %u changed at runtime",
+        (unsigned)__builtin_popcount(changed));
+  }
+}
+
+int32_t settings_get(setting_id_t id) {
+  return __atomic_load_n(&values[id], __ATOMIC_RELAXED);
+}
+
+settings_err_t settings_set(
+    const char *name, const char *value, setting_id_t *id) {
+  if (!settings_find(name, id)) {
+    return SETTINGS_ERR_UNKNOWN;
+  }
+  int32_t parsed = 0;
+  if (!parse(*id, value, &parsed)) {
+    return SETTINGS_ERR_VALUE;
+  }
+  if (!in_range(*id, parsed)) {
+    return SETTINGS_ERR_RANGE;
+  }
+  __atomic_store_n(&values[*id], parsed, __ATOMIC_RELAXED);
+  changed |= 1u << *id;
+  save();
+  LOG_INFO("settings: %s now %d", defs[*id].name, (int)parsed);
+  return SETTINGS_OK;
+}
+
+bool settings_find(const char *name, setting_id_t *id) {
+  for (uint8_t i = 0; i < SETTING_COUNT; i++) {
+    if (0 == strcmp(name, defs[i].name)) {
+      *id = (setting_id_t)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t settings_format(char *buf, size_t len, setting_id_t id) {
+  char value[PAYLOAD_INT_LEN];
+  payload_format_fixed(value, sizeof(value), settings_get(id),
+      defs[id].decimals);
+  int written = snprintf(buf, len, "%s=%s", defs[id].name, value);
+  return (written < 0 || (size_t)written >= len) ? 0 : written;
+}
+
+void settings_reset(void) {
+  for (uint8_t id = 0; id < SETTING_COUNT; id++) {
+    __atomic_store_n(&values[id], defs[id].default_value, __ATOMIC_RELAXED);
+  }
+  changed = 0;
+  Preferences prefs;
+  prefs.begin(SETTINGS_NVS_NAMESPACE, false);
+  prefs.remove(SETTINGS_NVS_KEY);
+  prefs.end();
+  LOG_INFO("settings: back to the defaults");
+}
+
+const char *settings_err_name(settings_err_t err) {
+  switch (err) {
+    case SETTINGS_OK:
+      return "ok";
+    case SETTINGS_ERR_UNKNOWN:
+      return "unknown setting";
+    case SETTINGS_ERR_VALUE:
+      return "not a number";
+    case SETTINGS_ERR_RANGE:
+      return "out of range";
+  }
+  return "?";
+}
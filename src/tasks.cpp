@@ -0,0 +1,37 @@
+#include "tasks.h"
+
+#if DUAL_CORE
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "log.h"
+#include "power.h"
+
+/******** PRIVATE FUNCTIONS ********/
+static void run(void *step) {
+  tasks_step_fn step_fn = (tasks_step_fn)step;
+  for (;;) {
+    power_idle(step_fn());
+  }
+}
+
+/******** PUBLIC FUNCTIONS ********/
+bool tasks_start(tasks_step_fn network_step, tasks_step_fn sensor_step) {
+  TaskHandle_t sensor_task = NULL;
+  if (pdPASS != xTaskCreatePinnedToCore(run, "sensors",
+                    TASKS_SENSOR_STACK_BYTES, (void *)sensor_step,
+                    TASKS_PRIORITY, &sensor_task, TASKS_SENSOR_CORE)) {
+    LOG_ERROR("tasks: no memory for the sensor task");
+    return false;
+  }
+  if (pdPASS != xTaskCreatePinnedToCore(run, "network",
+                    TASKS_NETWORK_STACK_BYTES, (void *)network_step,
+                    TASKS_PRIORITY, NULL, TASKS_NETWORK_CORE)) {
+    vTaskDelete(sensor_task);
+    LOG_ERROR("tasks: no memory for the network task");
+    return false;
+  }
+  return true;
+}
+#endif
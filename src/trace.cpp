@@ -0,0 +1,111 @@
+#include "trace.h"
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "fsm.h"
+
+#define TRACE_SERIAL_LINE_BYTES 32
+
+static trace_record_t ring[TRACE_SIZE];
+// Records ever claimed; with DUAL_CORE both tasks append
+static uint32_t write_pos = 0;
+static bool mqtt_dump_requested = false;
+
+typedef struct serial_writer {
+  uint8_t line[TRACE_SERIAL_LINE_BYTES];
+  size_t used;
+} serial_writer_t;
+
+/******** PRIVATE FUNCTIONS ********/
+static void serial_flush(serial_writer_t *writer) {
+  static const char hex[] = "0123456789abcdef";
+  char text[sizeof(TRACE_SERIAL_PREFIX) + 2 * TRACE_SERIAL_LINE_BYTES];
+  size_t len = strlen(TRACE_SERIAL_PREFIX);
+  memcpy(text, TRACE_SERIAL_PREFIX, len);
+  for (size_t i = 0; i < writer->used; i++) {
+    text[len++] = hex[writer->line[i] >> 4];
+    text[len++] = hex[writer->line[i] & 0xF];
+  }
+  text[len] = '\0';
+  Serial.println(text);
+  writer->used = 0;
+}
+
+static void serial_write(const uint8_t *data, size_t len, void *ctx) {
+  serial_writer_t *writer = (serial_writer_t *)ctx;
+  while (len--) {
+    writer->line[writer->used++] = *data++;
+    if (TRACE_SERIAL_LINE_BYTES == writer->used) {
+      serial_flush(writer);
+    }
+  }
+}
+
+/******** PUBLIC FUNCTIONS ********/
+void trace_record(
+    uint8_t fsm_id, uint8_t state, uint8_t event, int8_t result) {
+  uint32_t pos = __atomic_fetch_add(&write_pos, 1, __ATOMIC_RELAXED);
+  trace_record_t *record = &ring[pos & (TRACE_SIZE - 1)];
+  record->timestamp_ms = millis();
+  record->fsm_id = fsm_id;
+  record->state = state;
+  record->event = event;
+  record->result = result;
+}
+
+uint16_t trace_count(void) {
+  uint32_t pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+  return (pos < TRACE_SIZE) ? pos : TRACE_SIZE;
+}
+
+bool trace_get(uint16_t index, trace_record_t *record) {
+  uint32_t pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+  uint16_t count = (pos < TRACE_SIZE) ? pos : TRACE_SIZE;
+  if (index >= count) {
+    return false;
+  }
+  *record = ring[(pos - count + index) & (TRACE_SIZE - 1)];
+  return true;
+}
+
+void trace_clear(void) { __atomic_store_n(&write_pos, 0, __ATOMIC_RELAXED); }
+
+void trace_dump(trace_writer_t write, void *ctx) {
+  uint8_t num_machines = fsm_num_machines();
+  uint16_t count = trace_count();
+  uint8_t header[8];
+  memcpy(header, TRACE_MAGIC, 4);
+  header[4] = TRACE_VERSION;
+  header[5] = num_machines;
+  header[6] = count & 0xFF;
+  header[7] = count >> 8;
+  write(header, sizeof(header), ctx);
+  for (uint8_t id = 1; id <= num_machines; id++) {
+    const char *name = fsm_get_name(id);
+    uint8_t len = strlen(name);
+    write(&len, 1, ctx);
+    write((const uint8_t *)name, len, ctx);
+  }
+  trace_record_t record;
+  for (uint16_t i = 0; i < count; i++) {
+    trace_get(i, &record);
+    write((const uint8_t *)&record, sizeof(record), ctx);
+  }
+}
+
+void trace_dump_serial(void) {
+  serial_writer_t writer = {};
+  trace_dump(serial_write, &writer);
+  if (writer.used) {
+    serial_flush(&writer);
+  }
+}
+
+void trace_request_mqtt_dump(void) { mqtt_dump_requested = true; }
+
+bool trace_take_mqtt_dump_request(void) {
+  bool requested = mqtt_dump_requested;
+  mqtt_dump_requested = false;
+  return requested;
+}
@@ -1,16 +1,59 @@
 #include "wifi_fsm.h"
 
 #include <Arduino.h>
+#include <Preferences.h>
 
-#include "Config.h"
+#include "boot.h"
+#include "device_config.h"
+#include "fsm_table.h"
+#include "log.h"
+
+#define WIFI_QUEUE_SIZE 8
+
+#define WIFI_CONNECT_TIMEOUT_MS (15 * 1000)
+#define WIFI_BACKOFF_BASE_MS 1000
+#define WIFI_BACKOFF_MAX_MS (5 * 60 * 1000)
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_AP_KEY "ap"
+// A reused lease is never renewed, so it is only trusted for a few boots and
+// held for a limited time before the next association goes back to DHCP
+#define WIFI_LEASE_MAX_BOOTS 4
+#define WIFI_LEASE_MAX_AGE_MS (30 * 60 * 1000)
 
 static uint8_t led_pin_s = 0;
+static bool led_state = false;
 
 static fsm_handle_t state_machine;
 
-WiFiClient espClient;
+enum {
+  WIFI_UNKNOWN,
+  WIFI_ACTIVE,
+  WIFI_INACTIVE,
+  WIFI_CONNECTING,
+  WIFI_BACKOFF,
+  WIFI_STATE_COUNT
+};
+
+// Persisted as a blob in NVS, so only append fields
+typedef struct {
+  bool valid;
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint8_t lease_boots;  // boots since the lease came from DHCP
+} wifi_ap_cache_t;
 
-enum { WIFI_UNKNOWN, WIFI_ACTIVE, WIFI_INACTIVE };
+static wifi_ap_cache_t ap_cache = {};
+static bool fast_reconnect = false;
+static bool static_ip_applied = false;
+static bool first_association = true;
+static unsigned long connected_ms = 0;
+static uint8_t failed_attempts = 0;
+static unsigned long connect_start_ms = 0;
+static unsigned long retry_at_ms = 0;
 
 /******** PRIVATE FUNCTIONS ********/
 static fsm_err_t unknown_entry_fn();
@@ -19,118 +62,305 @@ static fsm_err_t active_entry_fn();
 static fsm_err_t active_exit_fn();
 static fsm_err_t inactive_entry_fn();
 static fsm_err_t inactive_exit_fn();
+static fsm_err_t connecting_entry_fn();
+static fsm_err_t connecting_exit_fn();
+static fsm_err_t backoff_entry_fn();
+static fsm_err_t backoff_exit_fn();
 
 static fsm_err_t periodic_active_event_fn();
-static fsm_err_t periodic_inactive_event_fn();
+static fsm_err_t periodic_connecting_event_fn();
+static fsm_err_t periodic_backoff_event_fn();
 
-/******** TRANSITIONS ********/
-static fsm_transition_t unknown_transitions[] = {
-    {.destination_state_ID = WIFI_ACTIVE, .event = WIFI_EVENT_START},
-    {.destination_state_ID = WIFI_INACTIVE, .event = WIFI_EVENT_STOP},
-};
+static void load_ap_cache();
 
-static fsm_transition_t active_transitions[] = {
-    {.destination_state_ID = WIFI_INACTIVE, .event = WIFI_EVENT_STOP},
-    {.destination_state_ID = WIFI_ACTIVE, .event = FSM_PERIODIC_EVENT_1S},
+/******** TRANSITIONS ********/
+static constexpr fsm_static_transition_t transitions[] = {
+    {.source_state_ID = WIFI_UNKNOWN,
+        .event = WIFI_EVENT_START,
+        .destination_state_ID = WIFI_CONNECTING},
+    {.source_state_ID = WIFI_UNKNOWN,
+        .event = WIFI_EVENT_STOP,
+        .destination_state_ID = WIFI_INACTIVE},
+    {.source_state_ID = WIFI_CONNECTING,
+        .event = WIFI_EVENT_CONNECTED,
+        .destination_state_ID = WIFI_ACTIVE},
+    {.source_state_ID = WIFI_CONNECTING,
+        .event = WIFI_EVENT_DISCONNECTED,
+        .destination_state_ID = WIFI_BACKOFF},
+    {.source_state_ID = WIFI_CONNECTING,
+        .event = WIFI_EVENT_STOP,
+        .destination_state_ID = WIFI_INACTIVE},
+    {.source_state_ID = WIFI_CONNECTING,
+        .event = FSM_PERIODIC_EVENT_500MS,
+        .destination_state_ID = WIFI_CONNECTING,
+        .transition_fn = periodic_connecting_event_fn},
+    {.source_state_ID = WIFI_BACKOFF,
+        .event = WIFI_EVENT_RETRY,
+        .destination_state_ID = WIFI_CONNECTING},
+    {.source_state_ID = WIFI_BACKOFF,
+        .event = WIFI_EVENT_STOP,
+        .destination_state_ID = WIFI_INACTIVE},
+    {.source_state_ID = WIFI_BACKOFF,
+        .event = FSM_PERIODIC_EVENT_500MS,
+        .destination_state_ID = WIFI_BACKOFF,
+        .transition_fn = periodic_backoff_event_fn},
+    {.source_state_ID = WIFI_ACTIVE,
+        .event = WIFI_EVENT_DISCONNECTED,
+        .destination_state_ID = WIFI_BACKOFF},
+    {.source_state_ID = WIFI_ACTIVE,
+        .event = WIFI_EVENT_STOP,
+        .destination_state_ID = WIFI_INACTIVE},
+    {.source_state_ID = WIFI_ACTIVE,
+        .event = FSM_PERIODIC_EVENT_1S,
+        .destination_state_ID = WIFI_ACTIVE,
+        .transition_fn = periodic_active_event_fn},
+    {.source_state_ID = WIFI_INACTIVE,
+        .event = WIFI_EVENT_START,
+        .destination_state_ID = WIFI_CONNECTING},
 };
 
-static fsm_transition_t inactive_transitions[] = {
-    {.destination_state_ID = WIFI_ACTIVE, .event = WIFI_EVENT_START},
-    {.destination_state_ID = WIFI_INACTIVE,
-        .event = FSM_PERIODIC_EVENT_5S,
-        .transition_fn = periodic_inactive_event_fn}};
+FSM_DEFINE_TABLE(
+    dispatch_table, WIFI_STATE_COUNT, WIFI_EVENT_COUNT, transitions);
 
 /******** STATES ********/
-static fsm_state_t unknown_state = {.ID = WIFI_UNKNOWN,
-    .entry_fn = unknown_entry_fn,
-    .exit_fn = unknown_exit_fn,
-    .transition_array = unknown_transitions,
-    .num_transitions =
-        sizeof(unknown_transitions) / sizeof(unknown_transitions[0])};
-
-static fsm_state_t active_state = {.ID = WIFI_ACTIVE,
-    .entry_fn = active_entry_fn,
-    .exit_fn = active_exit_fn,
-    .transition_array = active_transitions,
-    .num_transitions =
-        sizeof(active_transitions) / sizeof(active_transitions[0])};
-
-static fsm_state_t inactive_state = {.ID = WIFI_INACTIVE,
-    .entry_fn = inactive_entry_fn,
-    .exit_fn = inactive_exit_fn,
-    .transition_array = inactive_transitions,
-    .num_transitions =
-        sizeof(inactive_transitions) / sizeof(inactive_transitions[0])};
-
-/******** STATE MACHINE ********/
 static fsm_state_t states[] = {
-    [WIFI_UNKNOWN] = unknown_state,
-    [WIFI_ACTIVE] = active_state,
-    [WIFI_INACTIVE] = inactive_state,
+    [WIFI_UNKNOWN] = {.ID = WIFI_UNKNOWN,
+        .entry_fn = unknown_entry_fn,
+        .exit_fn = unknown_exit_fn},
+    [WIFI_ACTIVE] = {.ID = WIFI_ACTIVE,
+        .entry_fn = active_entry_fn,
+        .exit_fn = active_exit_fn},
+    [WIFI_INACTIVE] = {.ID = WIFI_INACTIVE,
+        .entry_fn = inactive_entry_fn,
+        .exit_fn = inactive_exit_fn},
+    [WIFI_CONNECTING] = {.ID = WIFI_CONNECTING,
+        .entry_fn = connecting_entry_fn,
+        .exit_fn = connecting_exit_fn},
+    [WIFI_BACKOFF] = {.ID = WIFI_BACKOFF,
+        .entry_fn = backoff_entry_fn,
+        .exit_fn = backoff_exit_fn},
 };
 
 /******** PUBLIC FUNCTIONS ********/
 fsm_err_t wifi_fsm_init(uint8_t led_pin) {
   led_pin_s = led_pin;
-  return fsm_init(&state_machine, states, sizeof(states) / sizeof(states[0]));
+  load_ap_cache();
+  const fsm_queue_config_t queue = {.buffer = NULL,
+      .capacity = WIFI_QUEUE_SIZE,
+      .overflow_policy = FSM_OVERFLOW_COALESCE};
+  fsm_err_t retVal =
+      fsm_init_table(&state_machine, states, dispatch_table, &queue);
+  fsm_set_name(&state_machine, "wifi");
+  return retVal;
 }
 
 fsm_err_t wifi_fsm_send(fsm_event event) {
   return fsm_send(&state_machine, event);
 }
 
+fsm_err_t wifi_fsm_schedule(scheduler_t *scheduler) {
+  return scheduler_add_periodic(scheduler, &state_machine, wifi_fsm_send);
+}
+
 fsm_err_t wifi_fsm_handle_event(void) {
   return fsm_handle_event(&state_machine);
 }
 
-WiFiClient *wifi_fsm_get_client(void) { return &espClient; }
+fsm_err_t wifi_fsm_get_queue_stats(fsm_queue_stats_t *stats) {
+  return fsm_get_queue_stats(&state_machine, stats);
+}
+
+bool wifi_fsm_connected(void) {
+  return WIFI_ACTIVE == state_machine.current_state_ID;
+}
 
 /******** PRIVATE FUNCTIONS ********/
-static void wifi_connect() {
-  Serial.print("Connecting to ");
-  Serial.println(device_config._ssid);
-
-  WiFi.begin(device_config._ssid, device_config._password);
-  bool ledState = true;
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-    digitalWrite(led_pin_s, ledState);
-    ledState = !ledState;
+/**
+ * @brief Runs in the WiFi driver's event task, the only producer posting
+ * into this machine's ISR lane
+ */
+static void wifi_event_handler(WiFiEvent_t event, WiFiEventInfo_t info) {
+  switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      fsm_send_from_isr(&state_machine, WIFI_EVENT_CONNECTED);
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      // WiFi.begin() drops the old association itself when the config changes
+      if (WIFI_REASON_ASSOC_LEAVE == info.wifi_sta_disconnected.reason) {
+        break;
+      }
+      fsm_send_from_isr(&state_machine, WIFI_EVENT_DISCONNECTED);
+      break;
+    case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+      fsm_send_from_isr(&state_machine, WIFI_EVENT_DISCONNECTED);
+      break;
+    default:
+      break;
   }
-  digitalWrite(led_pin_s, HIGH);
+}
 
-  Serial.println("");
-  Serial.println("WiFi connected");
-  Serial.println("IP address: ");
-  Serial.println(WiFi.localIP());
-  wifi_fsm_send(WIFI_EVENT_START);
+static void load_ap_cache() {
+  Preferences prefs;
+  prefs.begin(WIFI_NVS_NAMESPACE, true);
+  if (sizeof(ap_cache) !=
+      prefs.getBytes(WIFI_NVS_AP_KEY, &ap_cache, sizeof(ap_cache))) {
+    memset(&ap_cache, 0, sizeof(ap_cache));
+  }
+  prefs.end();
+  if (ap_cache.valid && ap_cache.lease_boots < UINT8_MAX) {
+    ap_cache.lease_boots++;
+  }
+}
+
+static void save_ap_cache() {
+  Preferences prefs;
+  wifi_ap_cache_t stored = {};
+  prefs.begin(WIFI_NVS_NAMESPACE, false);
+  prefs.getBytes(WIFI_NVS_AP_KEY, &stored, sizeof(stored));
+  // Skip the flash write when nothing changed, which is the common case
+  if (0 != memcmp(&stored, &ap_cache, sizeof(ap_cache))) {
+    prefs.putBytes(WIFI_NVS_AP_KEY, &ap_cache, sizeof(ap_cache));
+  }
+  prefs.end();
+}
+
+static void toggle_led() {
+  led_state = !led_state;
+  digitalWrite(led_pin_s, led_state);
 }
 
 static fsm_err_t unknown_entry_fn() {
-  wifi_connect();
+  WiFi.mode(WIFI_STA);
+  // Reconnects are paced by the BACKOFF state instead of the driver
+  WiFi.setAutoReconnect(false);
+  WiFi.onEvent(wifi_event_handler);
+  // Association runs in the background while the rest of setup() continues
+  wifi_fsm_send(WIFI_EVENT_START);
   return FSM_ERR_OK;
 }
 
-static fsm_err_t periodic_inactive_event_fn() {
-  wifi_connect();
+static fsm_err_t connecting_entry_fn() {
+  const device_config_t *config = device_config_get();
+  LOG_INFO("Connecting to %s", config->ssid);
+
+  // Skip the scan by going straight to the last known AP, once
+  fast_reconnect = ap_cache.valid;
+  bool reuse_lease = false;
+#if FAST_BOOT
+  // Reusing the last lease skips DHCP, the slowest part of a cold connect.
+  // Reconnects are not time critical and renew it instead
+  reuse_lease = fast_reconnect && first_association && 0 != ap_cache.ip &&
+                ap_cache.lease_boots <= WIFI_LEASE_MAX_BOOTS;
+#endif
+  first_association = false;
+  if (reuse_lease) {
+    WiFi.config(IPAddress(ap_cache.ip), IPAddress(ap_cache.gateway),
+        IPAddress(ap_cache.subnet), IPAddress(ap_cache.dns));
+    static_ip_applied = true;
+  } else if (static_ip_applied) {
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());
+    static_ip_applied = false;
+  }
+  if (fast_reconnect) {
+    WiFi.begin(
+        config->ssid, config->password, ap_cache.channel, ap_cache.bssid);
+  } else {
+    WiFi.begin(config->ssid, config->password);
+  }
+  connect_start_ms = millis();
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t periodic_connecting_event_fn() {
+  toggle_led();
+  if (millis() - connect_start_ms > WIFI_CONNECT_TIMEOUT_MS) {
+    LOG_WARN("WiFi connection timed out");
+    wifi_fsm_send(WIFI_EVENT_DISCONNECTED);
+  }
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t connecting_exit_fn() {
+  if (WL_CONNECTED != WiFi.status()) {
+    failed_attempts += (failed_attempts < UINT8_MAX) ? 1 : 0;
+    if (fast_reconnect) {
+      // The AP may have moved channel or been replaced, or the lease expired
+      ap_cache.valid = false;
+      save_ap_cache();
+    }
+  }
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t backoff_entry_fn() {
+  WiFi.disconnect();
+  uint32_t backoff_ms = WIFI_BACKOFF_MAX_MS;
+  if (failed_attempts < 16) {
+    backoff_ms = (uint32_t)WIFI_BACKOFF_BASE_MS << failed_attempts;
+  }
+  if (backoff_ms > WIFI_BACKOFF_MAX_MS) {
+    backoff_ms = WIFI_BACKOFF_MAX_MS;
+  }
+  // Full jitter keeps the rooms from retrying in lockstep after an AP reboot
+  backoff_ms = backoff_ms / 2 + random(backoff_ms / 2 + 1);
+  retry_at_ms = millis() + backoff_ms;
+  LOG_INFO("WiFi retry in %u ms", backoff_ms);
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t periodic_backoff_event_fn() {
+  toggle_led();
+  if ((long)(millis() - retry_at_ms) >= 0) {
+    wifi_fsm_send(WIFI_EVENT_RETRY);
+  }
+  return FSM_ERR_OK;
+}
+
+static fsm_err_t active_entry_fn() {
+  failed_attempts = 0;
+  memcpy(ap_cache.bssid, WiFi.BSSID(), sizeof(ap_cache.bssid));
+  ap_cache.channel = WiFi.channel();
+  // A reused lease reads back as itself, only DHCP makes it fresh again
+  if (!static_ip_applied) {
+    ap_cache.ip = WiFi.localIP();
+    ap_cache.gateway = WiFi.gatewayIP();
+    ap_cache.subnet = WiFi.subnetMask();
+    ap_cache.dns = WiFi.dnsIP();
+    ap_cache.lease_boots = 0;
+  }
+  ap_cache.valid = true;
+  save_ap_cache();
+  connected_ms = millis();
+  digitalWrite(led_pin_s, HIGH);
+  boot_timing_mark("wifi connected");
+
+  IPAddress ip = WiFi.localIP();
+  LOG_INFO("WiFi connected, IP address %u.%u.%u.%u", ip[0], ip[1], ip[2],
+      ip[3]);
   return FSM_ERR_OK;
 }
 
 static fsm_err_t periodic_active_event_fn() {
+  // Backstop in case a driver event was lost
   if (WiFi.status() != WL_CONNECTED) {
-    wifi_fsm_send(WIFI_EVENT_STOP);
+    wifi_fsm_send(WIFI_EVENT_DISCONNECTED);
+  } else if (static_ip_applied &&
+             millis() - connected_ms > WIFI_LEASE_MAX_AGE_MS) {
+    // The DHCP server may hand the address out again once the lease runs out
+    LOG_INFO("Reconnecting to renew the reused lease");
+    wifi_fsm_send(WIFI_EVENT_DISCONNECTED);
   }
   return FSM_ERR_OK;
 }
 
 static fsm_err_t inactive_entry_fn() {
-  wifi_connect();
+  WiFi.disconnect();
+  digitalWrite(led_pin_s, LOW);
   return FSM_ERR_OK;
 }
 
 /******** NO OP FUNCTIONS ********/
 static fsm_err_t unknown_exit_fn() { return FSM_ERR_OK; }
-static fsm_err_t active_entry_fn() { return FSM_ERR_OK; }
 static fsm_err_t active_exit_fn() { return FSM_ERR_OK; }
 static fsm_err_t inactive_exit_fn() { return FSM_ERR_OK; }
+static fsm_err_t backoff_exit_fn() { return FSM_ERR_OK; }
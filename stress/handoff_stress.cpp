@@ -0,0 +1,216 @@
+/*
+ * Stress test of the cross-core handoff used by DUAL_CORE builds
+ *
+ * Two host threads, pinned to different CPUs where the OS allows it, play
+ * the sensor and network tasks. The producer pushes numbered readings into
+ * a sensor_link and posts an event through fsm_send_from_isr() for each,
+ * retrying while either is full; both threads append trace records. The
+ * consumer handles the events and takes the readings, checking that every
+ * reading arrives once, in order and whole, and that every event is handled
+ * or counted as dropped. It stalls now and then so the lanes fill up.
+ *
+ *   pio run -e stress && .pio/build/stress/program [-n readings]
+ *
+ * Exits with 1 if any check failed.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "fsm.h"
+#include "sensor_link.h"
+#include "trace.h"
+
+#define STRESS_DEFAULT_READINGS 5000000UL
+#define STRESS_STALL_EVERY 4096  // takes between consumer stalls
+#define STRESS_STALL_SPINS 20000
+#define STRESS_PRODUCER_TRACE_ID 0xEE
+
+enum { STRESS_EVENT_READING = FSM_GLOBAL_EVENT_COUNT, STRESS_EVENT_COUNT };
+
+typedef struct stress_counts {
+  uint32_t link_full;  // pushes retried
+  uint32_t lane_full;  // posts retried
+} stress_counts_t;
+
+static fsm_handle_t state_machine;
+static sensor_link_t readings;
+static uint32_t handled = 0;
+static std::atomic<bool> producer_done(false);
+
+/******** PRIVATE FUNCTIONS ********/
+static fsm_err_t nop_fn(void) { return FSM_ERR_OK; }
+
+static fsm_err_t reading_fn(void) {
+  handled++;
+  return FSM_ERR_OK;
+}
+
+static fsm_transition_t transitions[] = {
+    {0, STRESS_EVENT_READING, reading_fn}};
+
+static fsm_state_t states[] = {{.ID = 0,
+    .entry_fn = nop_fn,
+    .exit_fn = nop_fn,
+    .transition_array = transitions,
+    .num_transitions = 1}};
+
+// Every field derives from the sequence number, so a torn copy shows
+static sensor_reading_t make_reading(uint32_t seq) {
+  sensor_reading_t reading = {.timestamp_ms = seq,
+      .occupied_edge_us = ~seq,
+      .temperature_x10 = (int32_t)(seq * 3),
+      .raw_temperature_x10 = (int32_t)(seq * 3 + 7),
+      .humidity_x10 = (int32_t)(seq ^ 0x5a5a5a5a),
+      .climate_valid = true,
+      .occupied = (0 != (seq & 1))};
+  return reading;
+}
+
+static bool reading_intact(const sensor_reading_t *reading) {
+  sensor_reading_t expected = make_reading(reading->timestamp_ms);
+  return expected.occupied_edge_us == reading->occupied_edge_us &&
+         expected.temperature_x10 == reading->temperature_x10 &&
+         expected.raw_temperature_x10 == reading->raw_temperature_x10 &&
+         expected.humidity_x10 == reading->humidity_x10 &&
+         expected.climate_valid == reading->climate_valid &&
+         expected.occupied == reading->occupied;
+}
+
+static void pin_to_cpu(std::thread &thread, unsigned cpu) {
+  unsigned num_cpus = std::thread::hardware_concurrency();
+  if (num_cpus < 2) {
+    return;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu % num_cpus, &cpus);
+  pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+}
+
+static void produce(uint32_t num_readings, stress_counts_t *counts) {
+  for (uint32_t seq = 1; seq <= num_readings; seq++) {
+    sensor_reading_t reading = make_reading(seq);
+    while (!sensor_link_push(&readings, &reading)) {
+      counts->link_full++;
+      std::this_thread::yield();
+    }
+    while (FSM_ERR_OK !=
+           fsm_send_from_isr(&state_machine, STRESS_EVENT_READING)) {
+      counts->lane_full++;
+      std::this_thread::yield();
+    }
+    if (0 == (seq & 0xFF)) {
+      trace_record(STRESS_PRODUCER_TRACE_ID, STRESS_PRODUCER_TRACE_ID,
+          STRESS_PRODUCER_TRACE_ID, 0);
+    }
+  }
+  producer_done.store(true, std::memory_order_release);
+}
+
+static uint32_t consume(uint32_t *failures) {
+  uint32_t taken = 0;
+  uint32_t last_seq = 0;
+  volatile uint32_t spin = 0;
+  for (;;) {
+    bool done = producer_done.load(std::memory_order_acquire);
+    while (FSM_ERR_OK == fsm_handle_event(&state_machine)) {
+    }
+    sensor_reading_t reading;
+    bool took = false;
+    while (sensor_link_take(&readings, &reading)) {
+      took = true;
+      if (reading.timestamp_ms <= last_seq || !reading_intact(&reading)) {
+        if ((*failures)++ < 10) {
+          fprintf(stderr, "bad reading %u after %u\n",
+              (unsigned)reading.timestamp_ms, (unsigned)last_seq);
+        }
+      }
+      last_seq = reading.timestamp_ms;
+      if (0 == (++taken % STRESS_STALL_EVERY)) {
+        for (spin = 0; spin < STRESS_STALL_SPINS; spin = spin + 1) {
+        }
+      }
+    }
+    // Everything the producer finished before setting done has been seen
+    if (done && !took && 0 == fsm_pending_events(&state_machine)) {
+      return taken;
+    }
+    if (!took) {
+      std::this_thread::yield();  // where the task would block in power_idle()
+    }
+  }
+}
+
+static bool trace_intact(void) {
+  trace_record_t record;
+  for (uint16_t i = 0; trace_get(i, &record); i++) {
+    bool from_producer = STRESS_PRODUCER_TRACE_ID == record.fsm_id &&
+                         STRESS_PRODUCER_TRACE_ID == record.state &&
+                         STRESS_PRODUCER_TRACE_ID == record.event;
+    bool from_consumer = state_machine.id == record.fsm_id &&
+                         0 == record.state &&
+                         STRESS_EVENT_READING == record.event;
+    if (!from_producer && !from_consumer) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/******** PUBLIC FUNCTIONS ********/
+int main(int argc, char **argv) {
+  uint32_t num_readings = STRESS_DEFAULT_READINGS;
+  if (3 == argc && 0 == strcmp(argv[1], "-n")) {
+    num_readings = strtoul(argv[2], NULL, 0);
+  }
+
+  sensor_link_init(&readings);
+  const fsm_queue_config_t queue = {.buffer = NULL,
+      .capacity = MAX_PENDING_EVENTS,
+      .overflow_policy = FSM_OVERFLOW_DROP_NEWEST};
+  fsm_init_with_queue(&state_machine, states, 1, &queue);
+  fsm_set_name(&state_machine, "sink");
+
+  stress_counts_t counts = {};
+  uint32_t failures = 0;
+  uint32_t taken = 0;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::thread consumer([&] { taken = consume(&failures); });
+  std::thread producer([&] { produce(num_readings, &counts); });
+  pin_to_cpu(consumer, 0);
+  pin_to_cpu(producer, 1);
+  producer.join();
+  consumer.join();
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start)
+                       .count();
+
+  fsm_queue_stats_t stats;
+  fsm_get_queue_stats(&state_machine, &stats);
+  // Retried posts count as dropped in the stats, the rest overflowed the queue
+  uint32_t queue_dropped = stats.dropped - counts.lane_full;
+  bool counted = num_readings == taken &&
+                 counts.link_full == sensor_link_dropped(&readings) &&
+                 num_readings == handled + queue_dropped;
+  bool traced = trace_intact();
+
+  printf("readings: %u taken, link full %u times (%.2f M/s)\n",
+      (unsigned)taken, (unsigned)counts.link_full,
+      num_readings / seconds / 1e6);
+  printf("events:   %u handled, %u dropped by the queue, lane full %u "
+         "times\n",
+      (unsigned)handled, (unsigned)queue_dropped, (unsigned)counts.lane_full);
+  printf("checks:   %u bad readings, counts %s, trace %s\n",
+      (unsigned)failures, counted ? "ok" : "MISMATCH",
+      traced ? "ok" : "TORN");
+  return (0 == failures && counted && traced) ? 0 : 1;
+}
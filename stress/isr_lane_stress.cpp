@@ -0,0 +1,198 @@
+/*
+ * Stress test of fsm_send_from_isr(), the lock-free lane an ISR posts to
+ *
+ * A host thread plays the ISR and posts a repeating sequence of events to
+ * a state machine whose loop runs on another thread, pinned to different
+ * CPUs where the OS allows it. Two rounds:
+ *
+ *   ordered  the poster retries while the lane is full; every event has to
+ *            be handled once and in the order it was posted
+ *   lossy    the poster gives up on a full lane like an ISR would; every
+ *            event has to be handled or counted as dropped, exactly once
+ *
+ * The poster never lets more events wait than the regular queue holds, so
+ * only the lane can overflow.
+ *
+ *   pio run -e isr_stress && .pio/build/isr_stress/program [-n events]
+ *
+ * Exits with 1 if any check failed.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+
+#include "fsm.h"
+
+#define STRESS_DEFAULT_EVENTS 5000000UL
+#define STRESS_NUM_IDS 8  // distinct events posted in turn
+#define STRESS_STALL_EVERY 4096  // events between consumer stalls
+#define STRESS_STALL_SPINS 20000
+#define STRESS_LOSSY_GAP_SPINS 64  // up to this between lossy posts
+
+enum {
+  STRESS_EVENT_FIRST = FSM_GLOBAL_EVENT_COUNT,
+  STRESS_EVENT_COUNT = STRESS_EVENT_FIRST + STRESS_NUM_IDS,
+};
+
+typedef struct round_result {
+  uint32_t posted;
+  uint32_t lane_full;  // posts refused, retried or given up
+} round_result_t;
+
+static fsm_handle_t state_machine;
+static std::atomic<uint32_t> handled(0);
+static std::atomic<bool> poster_done(false);
+static uint32_t next_id = 0;
+static uint32_t out_of_order = 0;
+static bool ordered = true;
+
+/******** PRIVATE FUNCTIONS ********/
+static fsm_err_t nop_fn(void) { return FSM_ERR_OK; }
+
+// One handler per event, so the consumer sees which one it got
+template <uint8_t id>
+static fsm_err_t event_fn(void) {
+  if (ordered && id != next_id && out_of_order++ < 10) {
+    fprintf(stderr, "event %u handled, expected %u\n", id, next_id);
+  }
+  next_id = (id + 1) % STRESS_NUM_IDS;
+  handled.store(handled.load(std::memory_order_relaxed) + 1,
+      std::memory_order_release);
+  return FSM_ERR_OK;
+}
+
+static fsm_transition_t transitions[] = {
+    {0, STRESS_EVENT_FIRST + 0, event_fn<0>},
+    {0, STRESS_EVENT_FIRST + 1, event_fn<1>},
+    {0, STRESS_EVENT_FIRST + 2, event_fn<2>},
+    {0, STRESS_EVENT_FIRST + 3, event_fn<3>},
+    {0, STRESS_EVENT_FIRST + 4, event_fn<4>},
+    {0, STRESS_EVENT_FIRST + 5, event_fn<5>},
+    {0, STRESS_EVENT_FIRST + 6, event_fn<6>},
+    {0, STRESS_EVENT_FIRST + 7, event_fn<7>},
+};
+
+static fsm_state_t states[] = {{.ID = 0,
+    .entry_fn = nop_fn,
+    .exit_fn = nop_fn,
+    .transition_array = transitions,
+    .num_transitions = STRESS_NUM_IDS}};
+
+static void pin_to_cpu(std::thread &thread, unsigned cpu) {
+  unsigned num_cpus = std::thread::hardware_concurrency();
+  if (num_cpus < 2) {
+    return;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu % num_cpus, &cpus);
+  pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+}
+
+static void post(uint32_t num_events, bool retry, round_result_t *result) {
+  uint32_t given_up = 0;
+  volatile uint32_t spin = 0;
+  for (uint32_t seq = 0; seq < num_events; seq++) {
+    // Interrupts come and go at their own pace, not back to back
+    if (!retry) {
+      for (spin = 0; spin < seq % STRESS_LOSSY_GAP_SPINS; spin = spin + 1) {
+      }
+    }
+    // Keep the regular queue from overflowing, see the top of the file
+    while (seq - given_up - handled.load(std::memory_order_acquire) >=
+           MAX_PENDING_EVENTS) {
+      std::this_thread::yield();
+    }
+    fsm_event event = STRESS_EVENT_FIRST + seq % STRESS_NUM_IDS;
+    while (FSM_ERR_OK != fsm_send_from_isr(&state_machine, event)) {
+      result->lane_full++;
+      if (!retry) {
+        given_up++;
+        break;
+      }
+      std::this_thread::yield();
+    }
+  }
+  result->posted = num_events;
+  poster_done.store(true, std::memory_order_release);
+}
+
+static void consume(void) {
+  volatile uint32_t spin = 0;
+  uint32_t taken = 0;
+  for (;;) {
+    bool done = poster_done.load(std::memory_order_acquire);
+    bool took = false;
+    while (FSM_ERR_OK == fsm_handle_event(&state_machine)) {
+      took = true;
+      if (0 == (++taken % STRESS_STALL_EVERY)) {
+        for (spin = 0; spin < STRESS_STALL_SPINS; spin = spin + 1) {
+        }
+      }
+    }
+    // Everything posted before done was set has been handled
+    if (done && !took && 0 == fsm_pending_events(&state_machine)) {
+      return;
+    }
+    if (!took) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+static bool run_round(const char *name, uint32_t num_events, bool retry) {
+  const fsm_queue_config_t queue = {.buffer = NULL,
+      .capacity = MAX_PENDING_EVENTS,
+      .overflow_policy = FSM_OVERFLOW_DROP_NEWEST};
+  fsm_init_with_queue(&state_machine, states, 1, &queue);
+  handled.store(0);
+  poster_done.store(false);
+  next_id = 0;
+  out_of_order = 0;
+  ordered = retry;
+
+  round_result_t result = {};
+  std::thread consumer(consume);
+  std::thread poster([&] { post(num_events, retry, &result); });
+  pin_to_cpu(consumer, 0);
+  pin_to_cpu(poster, 1);
+  poster.join();
+  consumer.join();
+
+  fsm_queue_stats_t stats;
+  fsm_get_queue_stats(&state_machine, &stats);
+  uint32_t count = handled.load();
+  bool counted = retry ? (num_events == count &&
+                             result.lane_full == stats.dropped)
+                       : (num_events == count + result.lane_full &&
+                             result.lane_full == stats.dropped);
+  printf("%-8s %u posted, %u handled, lane full %u times, %u counted "
+         "dropped, %u out of order: %s\n",
+      name, (unsigned)num_events, (unsigned)count,
+      (unsigned)result.lane_full, (unsigned)stats.dropped,
+      (unsigned)out_of_order,
+      (counted && 0 == out_of_order) ? "ok" : "FAILED");
+  return counted && 0 == out_of_order;
+}
+
+/******** PUBLIC FUNCTIONS ********/
+int main(int argc, char **argv) {
+  uint32_t num_events = STRESS_DEFAULT_EVENTS;
+  if (3 == argc && 0 == strcmp(argv[1], "-n")) {
+    num_events = strtoul(argv[2], NULL, 0);
+  }
+
+  bool ok = FSM_ERR_EINVAL == fsm_send_from_isr(NULL, STRESS_EVENT_FIRST);
+  if (!ok) {
+    fprintf(stderr, "fsm_send_from_isr() accepted a NULL machine\n");
+  }
+  ok = run_round("ordered", num_events, true) && ok;
+  ok = run_round("lossy", num_events, false) && ok;
+  return ok ? 0 : 1;
+}
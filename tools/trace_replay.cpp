@@ -0,0 +1,216 @@
+/*
+ * Decodes an FSM trace dump and replays it through the native build
+ *
+ *   pio run -e replay && .pio/build/replay/program [-q] dump
+ *
+ * The dump is either the binary format described in trace.h (e.g. the
+ * concatenated <host>/diag/trace messages) or a serial log containing the
+ * lines printed by trace_dump_serial(). Every record is printed, then the
+ * recorded events are fed to the real state machines in virtual time with
+ * all other event sources blocked. A record whose state or result differs
+ * from the replay is reported as a divergence; the first record of each
+ * machine just sets its starting state, since the ring may begin mid-run.
+ *
+ *   -q  only print divergences and the summary
+ */
+
+#include <getopt.h>
+
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "dht_fsm.h"
+#include "fsm.h"
+#include "mqtt_fsm.h"
+#include "native_hal.h"
+#include "prox_fsm.h"
+#include "settings.h"
+#include "trace.h"
+#include "wifi_fsm.h"
+
+#define ONBOARD_LED 2
+
+typedef struct trace_dump_data {
+  std::vector<std::string> machines;
+  std::vector<trace_record_t> records;
+} trace_dump_data_t;
+
+/******** PRIVATE FUNCTIONS ********/
+static bool read_file(const char *path, std::vector<uint8_t> *bytes) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  uint8_t buffer[4096];
+  size_t len;
+  while (0 < (len = fread(buffer, 1, sizeof(buffer), file))) {
+    bytes->insert(bytes->end(), buffer, buffer + len);
+  }
+  fclose(file);
+  return true;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// Pull the hex payload out of every trace line in a serial log
+static std::vector<uint8_t> decode_serial_log(const std::vector<uint8_t> &log) {
+  std::vector<uint8_t> bytes;
+  std::string text(log.begin(), log.end());
+  size_t pos = 0;
+  while (std::string::npos != (pos = text.find(TRACE_SERIAL_PREFIX, pos))) {
+    pos += strlen(TRACE_SERIAL_PREFIX);
+    while (pos + 1 < text.size() && hex_value(text[pos]) >= 0 &&
+           hex_value(text[pos + 1]) >= 0) {
+      bytes.push_back(hex_value(text[pos]) << 4 | hex_value(text[pos + 1]));
+      pos += 2;
+    }
+  }
+  return bytes;
+}
+
+static bool parse_dump(
+    const std::vector<uint8_t> &bytes, trace_dump_data_t *dump) {
+  if (bytes.size() < 8 || 0 != memcmp(bytes.data(), TRACE_MAGIC, 4)) {
+    fprintf(stderr, "no trace dump found\n");
+    return false;
+  }
+  if (TRACE_VERSION != bytes[4]) {
+    fprintf(stderr, "unsupported trace version %u\n", bytes[4]);
+    return false;
+  }
+  uint8_t num_machines = bytes[5];
+  uint16_t num_records = bytes[6] | (bytes[7] << 8);
+  size_t pos = 8;
+  for (uint8_t i = 0; i < num_machines; i++) {
+    if (pos >= bytes.size() || pos + 1 + bytes[pos] > bytes.size()) {
+      fprintf(stderr, "truncated machine table\n");
+      return false;
+    }
+    dump->machines.emplace_back((const char *)&bytes[pos + 1], bytes[pos]);
+    pos += 1 + bytes[pos];
+  }
+  if (pos + (size_t)num_records * sizeof(trace_record_t) > bytes.size()) {
+    fprintf(stderr, "truncated dump: expected %u records\n", num_records);
+    return false;
+  }
+  dump->records.resize(num_records);
+  memcpy(dump->records.data(), &bytes[pos],
+      num_records * sizeof(trace_record_t));
+  return true;
+}
+
+static const char *machine_name(const trace_dump_data_t &dump, uint8_t id) {
+  return (id >= 1 && id <= dump.machines.size())
+             ? dump.machines[id - 1].c_str()
+             : "?";
+}
+
+static void print_record(const trace_dump_data_t &dump,
+    const trace_record_t &record, const char *note) {
+  printf("%10u  %-6s s%-3u e%-3u %3d  %s\n", record.timestamp_ms,
+      machine_name(dump, record.fsm_id), record.state, record.event,
+      record.result, note);
+}
+
+// Same order as setup(), so the handlers see the same initial conditions
+static void init_machines(void) {
+  settings_init();
+  wifi_fsm_init(ONBOARD_LED);
+  dht_fsm_init();
+  prox_fsm_init();
+  mqtt_fsm_init();
+}
+
+static uint32_t replay(const trace_dump_data_t &dump, bool quiet) {
+  uint32_t divergences = 0;
+  std::vector<bool> synced(dump.machines.size() + 1, false);
+
+  for (const trace_record_t &record : dump.records) {
+    uint64_t at_us = (uint64_t)record.timestamp_ms * 1000;
+    if (at_us > native_hal_now_us()) {
+      native_hal_advance_us(at_us - native_hal_now_us());
+    }
+    fsm_handle_t *state_machine = fsm_find(machine_name(dump, record.fsm_id));
+    if (!state_machine) {
+      print_record(dump, record, "unknown machine");
+      divergences++;
+      continue;
+    }
+
+    const char *note = "";
+    if (state_machine->current_state_ID != record.state) {
+      if (synced[record.fsm_id]) {
+        printf("  diverged: replay was in s%u\n",
+            state_machine->current_state_ID);
+        divergences++;
+        note = "<- state";
+      }
+      // Jump without entry/exit functions, the trace only has the outcome
+      state_machine->current_state_ID = record.state;
+    }
+    synced[record.fsm_id] = true;
+
+    fsm_replay_allow_sends(true);
+    fsm_send(state_machine, record.event);
+    fsm_replay_allow_sends(false);
+    fsm_err_t retVal = fsm_handle_event(state_machine);
+    if (retVal != record.result) {
+      printf("  diverged: replay returned %d\n", retVal);
+      divergences++;
+      note = "<- result";
+    }
+    if (!quiet || note[0]) {
+      print_record(dump, record, note);
+    }
+  }
+  return divergences;
+}
+
+/******** PUBLIC FUNCTIONS ********/
+int main(int argc, char **argv) {
+  bool quiet = false;
+  int opt;
+  while (-1 != (opt = getopt(argc, argv, "q"))) {
+    if ('q' != opt) {
+      fprintf(stderr, "usage: %s [-q] dump\n", argv[0]);
+      return 2;
+    }
+    quiet = true;
+  }
+  if (optind + 1 != argc) {
+    fprintf(stderr, "usage: %s [-q] dump\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<uint8_t> bytes;
+  if (!read_file(argv[optind], &bytes)) {
+    fprintf(stderr, "can't read %s\n", argv[optind]);
+    return 2;
+  }
+  if (bytes.size() < 4 || 0 != memcmp(bytes.data(), TRACE_MAGIC, 4)) {
+    bytes = decode_serial_log(bytes);
+  }
+  trace_dump_data_t dump;
+  if (!parse_dump(bytes, &dump)) {
+    return 2;
+  }
+
+  native_hal_set_quiet(true);
+  fsm_replay_allow_sends(false);
+  init_machines();
+
+  printf("%10s  %-6s %-4s %-4s %3s\n", "ms", "fsm", "st", "ev", "ret");
+  uint32_t divergences = replay(dump, quiet);
+  printf("\n%zu records from %zu machines, %u divergences\n",
+      dump.records.size(), dump.machines.size(), divergences);
+  return divergences ? 1 : 0;
+}